@@ -0,0 +1,308 @@
+/*
+ * Request/response path microbenchmark
+ *
+ * Replays synthetic request mixes through modbus_slave_process_msg() and reports
+ * throughput and latency percentiles (CLOCK_MONOTONIC, per frame).
+ *
+ * usage: bench_slave [-n frames] [-o results.json]
+ *   -n  frames per scenario (default 200000)
+ *   -o  also write results as JSON (one object per scenario) for regression tracking
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "modbus.h"
+#include "modbus_cache.h"
+
+#define SLAVE_ADDRESS 0x11
+#define MAX_SCENARIOS 16
+#define MAX_SCENARIO_FRAMES 8
+#define WARMUP_FRAMES 1000
+
+typedef struct {
+	uint8_t data[MODBUS_MAX_RTU_FRAME_SIZE];
+	int len;
+} frame_t;
+
+typedef struct {
+	const char *name;
+	frame_t frames[MAX_SCENARIO_FRAMES];
+	int frame_count;
+	int cached; /* served through response cache */
+} scenario_t;
+
+static volatile uint32_t transmit_sink;
+
+static modbus_cache_entry_t cache_entries[16];
+static const modbus_cache_range_t cache_ranges[] = {
+	{ .table = MODBUS_TABLE_INPUT_REGISTERS, .start = 0, .count = 256, .ttl_ms = 1000 },
+};
+static modbus_cache_t cache;
+
+static modbus_device_id_t device_id = {
+	.object_name = {
+		.VendorName = "modbus-lib",
+		.ProductCode = "BENCH-1",
+		.MajorMinorRevision = "1.0",
+		.VendorUrl = "https://example.com",
+		.ProductName = "Benchmark slave",
+		.ModelName = "B1",
+		.UserApplicationName = "bench_slave",
+	},
+};
+
+/*
+ * Slave side
+ */
+
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	switch (transaction->function_code) {
+	case MODBUS_READ_HOLDING_REGISTERS:
+	case MODBUS_READ_INPUT_REGISTERS:
+		for (int i = 0; i < transaction->register_count; i++) {
+			transaction->buffer16b[i] = transaction->register_address + i;
+		}
+		return MODBUS_OK;
+	case MODBUS_WRITE_SINGLE_REGISTER:
+	case MODBUS_WRITE_MULTIPLE_REGISTERS:
+		return MODBUS_OK;
+	default:
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	transmit_sink += buffer[data_len - 1] + data_len;
+	return MODBUS_OK;
+}
+
+/*
+ * Request mixes
+ */
+
+static void frame_build(frame_t *frame, uint8_t address, const uint8_t *pdu, int pdu_len)
+{
+	uint16_t crc;
+
+	frame->data[0] = address;
+	memcpy(frame->data + 1, pdu, pdu_len);
+	crc = modbus_CRC16(frame->data, pdu_len + 1);
+	frame->data[pdu_len + 1] = crc & 0xff;
+	frame->data[pdu_len + 2] = crc >> 8;
+	frame->len = pdu_len + 3;
+}
+
+static void add_read(scenario_t *s, uint8_t function_code, uint16_t count)
+{
+	const uint8_t pdu[] = { function_code, 0x00, 0x10, count >> 8, count & 0xff };
+	frame_build(&s->frames[s->frame_count++], SLAVE_ADDRESS, pdu, sizeof(pdu));
+}
+
+static void add_write_single(scenario_t *s)
+{
+	const uint8_t pdu[] = { MODBUS_WRITE_SINGLE_REGISTER, 0x00, 0x20, 0x12, 0x34 };
+	frame_build(&s->frames[s->frame_count++], SLAVE_ADDRESS, pdu, sizeof(pdu));
+}
+
+static void add_write_multiple(scenario_t *s, uint8_t count)
+{
+	uint8_t pdu[6 + 2 * MODBUS_MAX_REGISTERS] = { MODBUS_WRITE_MULTIPLE_REGISTERS, 0x00, 0x20, 0x00, count, 2 * count };
+	for (int i = 0; i < 2 * count; i++) {
+		pdu[6 + i] = i;
+	}
+	frame_build(&s->frames[s->frame_count++], SLAVE_ADDRESS, pdu, 6 + 2 * count);
+}
+
+static void add_device_id(scenario_t *s)
+{
+	const uint8_t pdu[] = { MODBUS_READ_DEVICE_IDENTIFICATION, MODBUS_MEI, MODBUS_CONFORMITY_REGULAR, 0x00 };
+	frame_build(&s->frames[s->frame_count++], SLAVE_ADDRESS, pdu, sizeof(pdu));
+}
+
+static void add_crc_error(scenario_t *s)
+{
+	add_read(s, MODBUS_READ_HOLDING_REGISTERS, 16);
+	s->frames[s->frame_count - 1].data[3] ^= 0x01;
+}
+
+static void add_other_address(scenario_t *s)
+{
+	const uint8_t pdu[] = { MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x10, 0x00, 0x10 };
+	frame_build(&s->frames[s->frame_count++], SLAVE_ADDRESS + 1, pdu, sizeof(pdu));
+}
+
+/* s has room for MAX_SCENARIOS */
+static int scenarios_build(scenario_t *s)
+{
+	int n = 0;
+
+	memset(s, 0, sizeof(scenario_t) * MAX_SCENARIOS);
+	s[n].name = "fc03_1";       add_read(&s[n++], MODBUS_READ_HOLDING_REGISTERS, 1);
+	s[n].name = "fc03_16";      add_read(&s[n++], MODBUS_READ_HOLDING_REGISTERS, 16);
+	s[n].name = "fc03_125";     add_read(&s[n++], MODBUS_READ_HOLDING_REGISTERS, 125);
+	s[n].name = "fc04_1";       add_read(&s[n++], MODBUS_READ_INPUT_REGISTERS, 1);
+	s[n].name = "fc04_16";      add_read(&s[n++], MODBUS_READ_INPUT_REGISTERS, 16);
+	s[n].name = "fc04_125";     add_read(&s[n++], MODBUS_READ_INPUT_REGISTERS, 125);
+	s[n].name = "fc04_16_cached"; add_read(&s[n], MODBUS_READ_INPUT_REGISTERS, 16); s[n++].cached = 1;
+	s[n].name = "fc04_125_cached"; add_read(&s[n], MODBUS_READ_INPUT_REGISTERS, 125); s[n++].cached = 1;
+	s[n].name = "fc06";         add_write_single(&s[n++]);
+	s[n].name = "fc16_16";      add_write_multiple(&s[n++], 16);
+	s[n].name = "fc43_regular"; add_device_id(&s[n++]);
+	s[n].name = "crc_error";    add_crc_error(&s[n++]);
+	s[n].name = "other_address"; add_other_address(&s[n++]);
+	/* everything interleaved */
+	s[n].name = "mix";
+	add_read(&s[n], MODBUS_READ_HOLDING_REGISTERS, 16);
+	add_read(&s[n], MODBUS_READ_INPUT_REGISTERS, 125);
+	add_read(&s[n], MODBUS_READ_HOLDING_REGISTERS, 1);
+	add_write_single(&s[n]);
+	add_write_multiple(&s[n], 16);
+	add_device_id(&s[n]);
+	add_crc_error(&s[n]);
+	add_other_address(&s[n]);
+	n++;
+	return n;
+}
+
+/*
+ * Measurement
+ */
+
+typedef struct {
+	double frames_per_second;
+	double mean_ns;
+	uint32_t p50_ns;
+	uint32_t p99_ns;
+	uint32_t p999_ns;
+	uint32_t max_ns;
+} result_t;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint32_t cache_clock(void *clock_data)
+{
+	(void)clock_data;
+	return now_ns() / 1000000;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, uint32_t n, double p)
+{
+	uint32_t index = (uint32_t)(p * (n - 1) + 0.5);
+	return sorted[index];
+}
+
+static void scenario_run(const scenario_t *s, uint32_t frames, uint32_t *samples, result_t *result)
+{
+	uint64_t start, end, t0, t1;
+
+	modbus_slave_ctx_set_cache(&modbus_default_ctx, s->cached ? &cache : NULL);
+	for (uint32_t i = 0; i < WARMUP_FRAMES; i++) {
+		const frame_t *f = &s->frames[i % s->frame_count];
+		modbus_slave_process_msg(f->data, f->len);
+	}
+	/* throughput: back to back, no per-frame timing overhead */
+	start = now_ns();
+	for (uint32_t i = 0; i < frames; i++) {
+		const frame_t *f = &s->frames[i % s->frame_count];
+		modbus_slave_process_msg(f->data, f->len);
+	}
+	end = now_ns();
+	result->frames_per_second = frames * 1e9 / (double)(end - start);
+	result->mean_ns = (double)(end - start) / frames;
+	/* latency: every frame timed separately */
+	for (uint32_t i = 0; i < frames; i++) {
+		const frame_t *f = &s->frames[i % s->frame_count];
+		t0 = now_ns();
+		modbus_slave_process_msg(f->data, f->len);
+		t1 = now_ns();
+		samples[i] = (uint32_t)(t1 - t0);
+	}
+	qsort(samples, frames, sizeof(uint32_t), compare_u32);
+	result->p50_ns = percentile(samples, frames, 0.50);
+	result->p99_ns = percentile(samples, frames, 0.99);
+	result->p999_ns = percentile(samples, frames, 0.999);
+	result->max_ns = samples[frames - 1];
+}
+
+int main(int argc, char **argv)
+{
+	static scenario_t scenarios[MAX_SCENARIOS];
+	const char *json_path = NULL;
+	uint32_t frames = 200000;
+	uint32_t *samples;
+	FILE *json = NULL;
+	int scenario_count;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:o:")) != -1) {
+		switch (opt) {
+		case 'n':
+			frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			json_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n frames] [-o results.json]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (frames == 0) {
+		frames = 1;
+	}
+	samples = malloc(frames * sizeof(uint32_t));
+	if (samples == NULL) {
+		return 1;
+	}
+	if (json_path != NULL) {
+		json = fopen(json_path, "w");
+		if (json == NULL) {
+			perror(json_path);
+			return 1;
+		}
+		fprintf(json, "[\n");
+	}
+
+	modbus_slave_set_address(SLAVE_ADDRESS);
+	modbus_slave_init_device_id(&device_id);
+	modbus_cache_init(&cache, cache_entries, 16, cache_ranges, 1, cache_clock, NULL);
+	scenario_count = scenarios_build(scenarios);
+
+	printf("%-16s %12s %10s %8s %8s %8s %8s\n", "scenario", "frames/s", "mean ns", "p50", "p99", "p99.9", "max");
+	for (int i = 0; i < scenario_count; i++) {
+		result_t r;
+		scenario_run(&scenarios[i], frames, samples, &r);
+		printf("%-16s %12.0f %10.1f %8u %8u %8u %8u\n", scenarios[i].name, r.frames_per_second, r.mean_ns,
+				r.p50_ns, r.p99_ns, r.p999_ns, r.max_ns);
+		if (json != NULL) {
+			fprintf(json, "  {\"scenario\": \"%s\", \"frames\": %u, \"frames_per_second\": %.0f, \"mean_ns\": %.1f, "
+					"\"p50_ns\": %u, \"p99_ns\": %u, \"p999_ns\": %u, \"max_ns\": %u}%s\n",
+					scenarios[i].name, frames, r.frames_per_second, r.mean_ns, r.p50_ns, r.p99_ns, r.p999_ns,
+					r.max_ns, i + 1 < scenario_count ? "," : "");
+		}
+	}
+	if (json != NULL) {
+		fprintf(json, "]\n");
+		fclose(json);
+	}
+	free(samples);
+	return 0;
+}
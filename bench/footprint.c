@@ -0,0 +1,34 @@
+/*
+ * RAM footprint of the data structures for the configuration (profile) it is built with
+ *
+ * Sizes are those of the build host; on 32-bit MCUs pointers (and the padding around
+ * them) are smaller. Part of `make size`, which also reports code size and stack usage.
+ */
+
+#include <stdio.h>
+#include "modbus.h"
+#include "modbus_rtu_framer.h"
+#include "modbus_frame_ring.h"
+#include "modbus_fifo.h"
+
+static const char *profile_names[] = { "FULL", "SMALL", "TINY" };
+
+int main(void)
+{
+	printf("profile %s: frame %d B, registers %d, read bits %d, user functions %d, cache line %d\n",
+			profile_names[MODBUS_PROFILE], MODBUS_MAX_RTU_FRAME_SIZE, MODBUS_MAX_REGISTERS, MODBUS_MAX_READ_BITS,
+			MODBUS_MAX_USER_FUNCTIONS, MODBUS_CACHE_LINE_SIZE);
+	printf("    function codes:%s%s%s%s%s%s%s%s%s%s\n", MODBUS_ENABLE_COILS ? " 01 05 15" : "",
+			MODBUS_ENABLE_DISCRETE_INPUTS ? " 02" : "", MODBUS_ENABLE_HOLDING_REGISTERS ? " 03 06 16" : "",
+			MODBUS_ENABLE_INPUT_REGISTERS ? " 04" : "", MODBUS_ENABLE_FILE_RECORD ? " 20 21" : "",
+			MODBUS_ENABLE_MASK_WRITE_REGISTER ? " 22" : "", MODBUS_ENABLE_READ_WRITE_MULTIPLE ? " 23" : "",
+			MODBUS_ENABLE_FIFO_QUEUE ? " 24" : "", MODBUS_ENABLE_DEVICE_ID ? " 43" : "",
+			MODBUS_ENABLE_DIAGNOSTICS ? " 08 11 12" : "");
+	printf("    %-28s %5zu B (on stack per request)\n", "modbus_transaction_t", sizeof(modbus_transaction_t));
+	printf("    %-28s %5zu B\n", "modbus_slave_ctx_t", sizeof(modbus_slave_ctx_t));
+	printf("    %-28s %5zu B\n", "modbus_rtu_framer_t", sizeof(modbus_rtu_framer_t));
+	printf("    %-28s %5zu B\n", "modbus_frame_ring_t", sizeof(modbus_frame_ring_t));
+	printf("    %-28s %5zu B\n", "modbus_fifo_t", sizeof(modbus_fifo_t));
+	printf("    %-28s %5zu B\n", "modbus_pending_t", sizeof(modbus_pending_t));
+	return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Replays a capture (modbus_capture.h, log or pcap) through a slave context and
+ * compares its replies with the recorded ones
+ *
+ * The slave has no application behind it: read requests are answered with the data of
+ * the recorded reply, writes are accepted, recorded exceptions are reproduced. What is
+ * tested is the request/response path of the library (and its speed), byte for byte.
+ *
+ * usage: replay [-r] [-n loops] [-a address] capture
+ *   -r  keep recorded time between requests (default: as fast as possible)
+ *   -n  replay the capture loops times (default 1)
+ *   -a  slave address (default: address of the first request that got a reply)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "modbus.h"
+#include "modbus_capture.h"
+
+static modbus_replay_t replay;
+
+/* recorded exception as callback result */
+static int8_t recorded_exception(uint8_t exception)
+{
+	switch (exception) {
+	case MODBUS_EXCEPTION_ILLEGAL_FUNCTION:
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	case MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS:
+		return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+	default:
+		return MODBUS_ERROR;
+	}
+}
+
+static int8_t replay_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	const uint8_t *expected = replay.expected;
+	uint16_t data_len;
+	uint8_t registers = 0;
+
+	(void)ctx;
+	if (expected == NULL || replay.expected_len < 3) {
+		/* nothing recorded (broadcast, lost reply): accept */
+		return MODBUS_OK;
+	}
+	if (expected[1] & MODBUS_ERROR_FLAG) {
+		return recorded_exception(expected[2]);
+	}
+	switch (transaction->function_code) {
+	case MODBUS_READ_COILS:
+	case MODBUS_READ_DISCRETE_INPUTS:
+		data_len = MODBUS_BITS_TO_BYTES(transaction->register_count);
+		break;
+	case MODBUS_READ_HOLDING_REGISTERS:
+	case MODBUS_READ_INPUT_REGISTERS:
+		data_len = 2 * transaction->register_count;
+		registers = 1;
+		break;
+	default:
+		return MODBUS_OK;
+	}
+	if (expected[2] != data_len || replay.expected_len < 3 + data_len) {
+		return MODBUS_ERROR;
+	}
+	if (registers) {
+		for (uint16_t i = 0; i < transaction->register_count; i++) {
+			transaction->buffer16b[i] = (expected[3 + 2 * i] << 8) | expected[4 + 2 * i];
+		}
+	} else {
+		memcpy(transaction->buffer8b, expected + 3, data_len);
+	}
+	return MODBUS_OK;
+}
+
+static int8_t replay_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+/* global API is not used */
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+/* address of the first request that got a reply, 1 if there is none */
+static uint8_t find_address(void)
+{
+	modbus_capture_record_t record;
+	uint8_t address = 1;
+
+	while (modbus_replay_next(&replay, &record) == MODBUS_OK) {
+		if (record.direction == MODBUS_CAPTURE_REPLY && record.len > 0) {
+			address = record.data[0];
+			break;
+		}
+	}
+	modbus_replay_rewind(&replay);
+	return address;
+}
+
+int main(int argc, char **argv)
+{
+	modbus_slave_ctx_t ctx;
+	modbus_replay_stats_t stats;
+	modbus_replay_stats_t total = { 0 };
+	uint8_t flags = MODBUS_REPLAY_FLAG_NONE;
+	int address = -1;
+	int loops = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "rn:a:")) != -1) {
+		switch (opt) {
+		case 'r':
+			flags |= MODBUS_REPLAY_FLAG_REALTIME;
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		case 'a':
+			address = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r] [-n loops] [-a address] capture\n", argv[0]);
+			return 2;
+		}
+	}
+	if (optind >= argc || loops < 1) {
+		fprintf(stderr, "usage: %s [-r] [-n loops] [-a address] capture\n", argv[0]);
+		return 2;
+	}
+	if (modbus_replay_open(&replay, argv[optind]) != MODBUS_OK) {
+		fprintf(stderr, "%s: not a capture file\n", argv[optind]);
+		return 1;
+	}
+	if (address < 0) {
+		address = find_address();
+	}
+	modbus_slave_ctx_init(&ctx, address, replay_callback, replay_transmit, NULL);
+
+	for (int i = 0; i < loops; i++) {
+		modbus_replay_rewind(&replay);
+		if (modbus_replay_run(&replay, &ctx, flags, &stats) != MODBUS_OK) {
+			fprintf(stderr, "%s: truncated capture\n", argv[optind]);
+		}
+		total.requests += stats.requests;
+		total.matched += stats.matched;
+		total.mismatched += stats.mismatched;
+		total.skipped += stats.skipped;
+		total.elapsed_us += stats.elapsed_us;
+	}
+	modbus_replay_close(&replay);
+
+	printf("%s (%s, slave %d): %u requests in %.3f ms, %.0f requests/s\n", argv[optind],
+			replay.format == MODBUS_CAPTURE_FORMAT_LOG ? "log" : "pcap", address, total.requests,
+			total.elapsed_us / 1000.0, total.elapsed_us ? total.requests * 1e6 / total.elapsed_us : 0.0);
+	printf("    matched %u, mismatched %u, skipped %u\n", total.matched, total.mismatched, total.skipped);
+	return total.mismatched == 0 ? 0 : 1;
+}
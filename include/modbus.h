@@ -4,7 +4,7 @@
  *  Created on: Jul 18, 2021
  *      Author: user
  *
- *  Modbus slave RTU library (does NOT support ASCII and TCP)
+ *  Modbus slave RTU library (does NOT support ASCII; for TCP see modbus_tcp.h)
  *
  *  Useful links:
  *  https://www.picotech.com/library/oscilloscopes/modbus-serial-protocol-decoding
@@ -46,19 +46,80 @@
  * Defines & macros
  */
 
+/* footprint profiles: preset defaults of the configuration macros below (each of them can
+ * still be overridden); select with -DMODBUS_PROFILE=..., `make size` reports footprint */
+#define MODBUS_PROFILE_FULL 0 /* all function codes, 256 B frames, fastest CRC (default) */
+#define MODBUS_PROFILE_SMALL 1 /* all function codes, 256 B frames, CRC table, no cache line padding */
+#define MODBUS_PROFILE_TINY 2 /* registers only (03, 04, 06, 16), 64 B frames, bitwise CRC */
+#ifndef MODBUS_PROFILE
+#define MODBUS_PROFILE MODBUS_PROFILE_FULL
+#endif
+#if MODBUS_PROFILE == MODBUS_PROFILE_FULL
+#define MODBUS_PROFILE_FRAME_SIZE 256
+#define MODBUS_PROFILE_ALL_FUNCTIONS 1
+#define MODBUS_PROFILE_USER_FUNCTIONS 4
+#define MODBUS_PROFILE_CACHE_LINE_SIZE 64
+#define MODBUS_PROFILE_CRC_ENGINE MODBUS_CRC_ENGINE_AUTO
+#elif MODBUS_PROFILE == MODBUS_PROFILE_SMALL
+#define MODBUS_PROFILE_FRAME_SIZE 256
+#define MODBUS_PROFILE_ALL_FUNCTIONS 1
+#define MODBUS_PROFILE_USER_FUNCTIONS 1
+#define MODBUS_PROFILE_CACHE_LINE_SIZE 1
+#define MODBUS_PROFILE_CRC_ENGINE MODBUS_CRC_ENGINE_TABLE
+#elif MODBUS_PROFILE == MODBUS_PROFILE_TINY
+#define MODBUS_PROFILE_FRAME_SIZE 64
+#define MODBUS_PROFILE_ALL_FUNCTIONS 0
+#define MODBUS_PROFILE_USER_FUNCTIONS 0
+#define MODBUS_PROFILE_CACHE_LINE_SIZE 1
+#define MODBUS_PROFILE_CRC_ENGINE MODBUS_CRC_ENGINE_BITWISE
+#else
+#error "unknown MODBUS_PROFILE"
+#endif
+
 #define MODBUS_BROADCAST_ADDR 0
 #define MODBUS_DEFAULT_SLAVE_ADDRESS 247 /* 255 may be used for bridge device */
 /* minimal frame length is 4 bytes: 1 B slave address, 1 B function code, 2 B CRC */
 #define MODBUS_MINIMAL_FRAME_LEN 4
 #define MODBUS_MINIMAL_READWRITE_LEN 4
 #define MODBUS_MINIMAL_WRITE_MULTIPLE_LEN 5
+#define MODBUS_MASK_WRITE_REQUEST_LEN 6 /* address, AND mask, OR mask */
+#define MODBUS_MINIMAL_READ_WRITE_MULTIPLE_LEN 9 /* read address and quantity, write address, quantity and byte count */
 #define MODBUS_READ_DEVICE_ID_REQUEST_LEN 4
 #define MODBUS_READ_DEVICE_ID_RESPONSE_HEADER_LEN 4
 #define MODBUS_READ_DEVICE_ID_RESPONSE_OFFSET 3
-#define MODBUS_MAX_RTU_FRAME_SIZE 256
+/* largest frame (RTU ADU) sent or received; sizes all frame buffers and the per-request limits
+ * below. Smaller values save RAM, requests that don't fit are answered with exception 03 */
+#ifndef MODBUS_MAX_RTU_FRAME_SIZE
+#define MODBUS_MAX_RTU_FRAME_SIZE MODBUS_PROFILE_FRAME_SIZE
+#endif
+#if MODBUS_MAX_RTU_FRAME_SIZE < 32 || MODBUS_MAX_RTU_FRAME_SIZE > 256
+#error "MODBUS_MAX_RTU_FRAME_SIZE must be 32 ... 256"
+#endif
 #define MODBUS_BUFFER_SIZE MODBUS_MAX_RTU_FRAME_SIZE /* alias */
 #define MODBUS_ERROR_FLAG 0x80
-#define MODBUS_MAX_REGISTERS 125
+#define MODBUS_MIN(a, b) ((a) < (b) ? (a) : (b))
+/* read reply data: frame without address, function code, byte count and CRC */
+#define MODBUS_MAX_READ_DATA (MODBUS_MAX_RTU_FRAME_SIZE - 5)
+#define MODBUS_MAX_REGISTERS MODBUS_MIN(125, MODBUS_MAX_READ_DATA / 2)
+/* bit access limits, Modbus_Application_Protocol_V1_1b, sections 6.1, 6.2 and 6.11;
+ * write request carries address, quantity and byte count besides the data */
+#define MODBUS_MAX_READ_BITS MODBUS_MIN(2000, MODBUS_MAX_READ_DATA * 8)
+#define MODBUS_MAX_WRITE_COILS MODBUS_MIN(1968, (MODBUS_MAX_RTU_FRAME_SIZE - 9) * 8)
+#define MODBUS_BITS_TO_BYTES(n) (((n) + 7) / 8)
+/* register / bit data in modbus_transaction_t: largest of the limits above, or whole request
+ * data of write file record (bytes, even) */
+#define MODBUS_TRANSACTION_DATA_SIZE ((MODBUS_MAX_READ_DATA + 1) & ~1)
+/* register write limits, Modbus_Application_Protocol_V1_1b, sections 6.12 and 6.17; written
+ * registers are kept in transaction data */
+#define MODBUS_MAX_WRITE_REGISTERS MODBUS_MIN(123, MODBUS_TRANSACTION_DATA_SIZE / 2)
+#define MODBUS_MAX_READ_WRITE_MULTIPLE_WRITE MODBUS_MIN(121, MODBUS_TRANSACTION_DATA_SIZE / 2)
+/* write single coil values */
+#define MODBUS_COIL_ON 0xFF00
+#define MODBUS_COIL_OFF 0x0000
+/* read reply layout: address, function code, byte count, payload */
+#define MODBUS_REPLY_PAYLOAD_OFFSET 3
+/* vectored transmit segments: header, payload, CRC */
+#define MODBUS_REPLY_IOV_COUNT 3
 /* read device id constants */
 #define MODBUS_MEI 0x0E
 #define MODBUS_DEVICE_ID_INDIVIDUAL_ACCESS_FLAG 0x80
@@ -66,6 +127,71 @@
 #define MODBUS_NO_MORE_FOLLOWS 0x00
 #define MODBUS_BASIC_OBJECT_COUNT 3
 #define MODBUS_REGULAR_OBJECT_COUNT 7
+#define MODBUS_EXTENDED_OBJECT_FIRST_ID 0x80
+/* reply PDU: function code, MEI, read device id code, conformity level, more follows, next object id, object count */
+#define MODBUS_READ_DEVICE_ID_REPLY_HEADER_LEN 7
+/* room for objects in one reply (address and CRC included in MODBUS_MAX_RTU_FRAME_SIZE) */
+#define MODBUS_READ_DEVICE_ID_MAX_OBJECTS_LEN (MODBUS_MAX_RTU_FRAME_SIZE - 3 - MODBUS_READ_DEVICE_ID_REPLY_HEADER_LEN)
+/* storage for serialized device id objects, see modbus_device_id_t */
+#ifndef MODBUS_DEVICE_ID_MAX_EXTENDED
+#define MODBUS_DEVICE_ID_MAX_EXTENDED 8
+#endif
+#ifndef MODBUS_DEVICE_ID_BUFFER_SIZE
+#define MODBUS_DEVICE_ID_BUFFER_SIZE 512
+#endif
+/* CRC16 engines, see modbus_crc.c; select one with -DMODBUS_CRC_ENGINE=... */
+#define MODBUS_CRC_ENGINE_BITWISE 0 /* bit by bit, no tables (smallest) */
+#define MODBUS_CRC_ENGINE_TABLE 1 /* 256-entry table (512 B) */
+#define MODBUS_CRC_ENGINE_SLICE8 2 /* slice-by-8 (4 kB of tables) */
+#define MODBUS_CRC_ENGINE_PCLMUL 3 /* x86 carry-less multiply folding (GCC/Clang only) */
+#define MODBUS_CRC_ENGINE_AUTO 4 /* best engine supported by CPU, picked on first use */
+#ifndef MODBUS_CRC_ENGINE
+#define MODBUS_CRC_ENGINE MODBUS_PROFILE_CRC_ENGINE
+#endif
+#define MODBUS_CRC16_INIT 0xFFFF
+/* slave contexts are aligned to this so that contexts served by different threads
+ * never share a cache line; define as 1 on MCUs to save RAM */
+#ifndef MODBUS_CACHE_LINE_SIZE
+#define MODBUS_CACHE_LINE_SIZE MODBUS_PROFILE_CACHE_LINE_SIZE
+#endif
+/* function codes compiled into the handler table (see modbus.c); define as 0 to leave out */
+#ifndef MODBUS_ENABLE_COILS
+#define MODBUS_ENABLE_COILS MODBUS_PROFILE_ALL_FUNCTIONS /* 01, 05, 15 */
+#endif
+#ifndef MODBUS_ENABLE_DISCRETE_INPUTS
+#define MODBUS_ENABLE_DISCRETE_INPUTS MODBUS_PROFILE_ALL_FUNCTIONS /* 02 */
+#endif
+#ifndef MODBUS_ENABLE_INPUT_REGISTERS
+#define MODBUS_ENABLE_INPUT_REGISTERS 1 /* 04 */
+#endif
+#ifndef MODBUS_ENABLE_HOLDING_REGISTERS
+#define MODBUS_ENABLE_HOLDING_REGISTERS 1 /* 03, 06, 16 */
+#endif
+#ifndef MODBUS_ENABLE_MASK_WRITE_REGISTER
+#define MODBUS_ENABLE_MASK_WRITE_REGISTER MODBUS_PROFILE_ALL_FUNCTIONS /* 22 */
+#endif
+#ifndef MODBUS_ENABLE_READ_WRITE_MULTIPLE
+#define MODBUS_ENABLE_READ_WRITE_MULTIPLE MODBUS_PROFILE_ALL_FUNCTIONS /* 23 */
+#endif
+#ifndef MODBUS_ENABLE_FILE_RECORD
+#define MODBUS_ENABLE_FILE_RECORD MODBUS_PROFILE_ALL_FUNCTIONS /* 20, 21 */
+#endif
+#ifndef MODBUS_ENABLE_FIFO_QUEUE
+#define MODBUS_ENABLE_FIFO_QUEUE MODBUS_PROFILE_ALL_FUNCTIONS /* 24 */
+#endif
+#ifndef MODBUS_ENABLE_RESPONSE_CACHE
+#define MODBUS_ENABLE_RESPONSE_CACHE MODBUS_PROFILE_ALL_FUNCTIONS /* modbus_cache.h */
+#endif
+#ifndef MODBUS_ENABLE_DEVICE_ID
+#define MODBUS_ENABLE_DEVICE_ID MODBUS_PROFILE_ALL_FUNCTIONS /* 43 / 14 */
+#endif
+#ifndef MODBUS_ENABLE_DIAGNOSTICS
+#define MODBUS_ENABLE_DIAGNOSTICS MODBUS_PROFILE_ALL_FUNCTIONS /* 08, 11, 12 and bus counters */
+#endif
+/* function code handlers that can be registered per context at runtime */
+#ifndef MODBUS_MAX_USER_FUNCTIONS
+#define MODBUS_MAX_USER_FUNCTIONS MODBUS_PROFILE_USER_FUNCTIONS
+#endif
 
 /*
  * Return values
@@ -79,6 +205,58 @@
 #define MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED -5 // function not implemented in callback
 #define MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED -6 // register not implemented in callback
 #define MODBUS_ERROR_DEVICE_ID_NOT_IMPLEMENTED -7
+#define MODBUS_ERROR_ACCESS_DENIED -8 // register exists, but can't be read/written
+#define MODBUS_ERROR_TIMEOUT -9 // master: no reply from slave
+#define MODBUS_ERROR_EXCEPTION -10 // master: slave replied with exception (see modbus_master_t exception)
+#define MODBUS_ERROR_ADDRESS_MISMATCH -11 // master: reply from other slave / unit id
+#define MODBUS_ERROR_FUNCTION_MISMATCH -12 // master: reply to other function code
+#define MODBUS_ERROR_LENGTH_MISMATCH -13 // master: byte count / length does not fit the request
+#define MODBUS_ERROR_ECHO_MISMATCH -14 // master: write reply does not echo the request
+#define MODBUS_ERROR_TRANSACTION_MISMATCH -15 // master: TCP transaction / protocol id differ from request
+#define MODBUS_FRAME_INCOMPLETE 1 // no complete frame received yet (not an error)
+#define MODBUS_PENDING 2 // returned by callback: request is completed later (modbus_slave_ctx_complete())
+
+/*
+ * Request processing flags (modbus_slave_ctx_process_request())
+ */
+
+#define MODBUS_REQUEST_FLAG_NONE 0x00
+#define MODBUS_REQUEST_FLAG_ANY_ADDRESS 0x01 // serve any address, no broadcast (Modbus TCP unit id)
+#define MODBUS_REQUEST_FLAG_NO_DEFER 0x02 // transport can't send completed replies: MODBUS_PENDING gets exception 06
+
+/*
+ * Captured frame direction (modbus_capture_function_t)
+ */
+
+#define MODBUS_CAPTURE_REQUEST 0 // received by modbus_slave_ctx_process_msg() / _process_frame()
+#define MODBUS_CAPTURE_REPLY 1 // passed to transmit / transmitv
+
+/*
+ * Deferred completion flags (modbus_slave_ctx_set_pending_pool())
+ */
+
+#define MODBUS_PENDING_FLAG_NONE 0x00 // reply is sent when request is completed
+#define MODBUS_PENDING_FLAG_ACKNOWLEDGE 0x01 // reply exception 05 right away, completion sends nothing
+#define MODBUS_PENDING_FLAG_BUSY 0x02 // reply exception 06 to other requests while any is pending
+
+/*
+ * Communication event log (get comm event log (12), Modbus_Application_Protocol_V1_1b section 6.9)
+ */
+
+#define MODBUS_EVENT_LOG_SIZE 64 // events kept per context (maximum of the reply)
+#define MODBUS_EVENT_RESTART 0x00 // communication restart (diagnostics sub-function 01)
+#define MODBUS_EVENT_LISTEN_ONLY 0x04 // entered listen only mode (diagnostics sub-function 04)
+#define MODBUS_EVENT_RECEIVE 0x80 // request received, flags below
+#define MODBUS_EVENT_RECEIVE_COMM_ERROR 0x02 // CRC error / invalid frame
+#define MODBUS_EVENT_RECEIVE_OVERRUN 0x10 // character overrun
+#define MODBUS_EVENT_RECEIVE_LISTEN_ONLY 0x20 // received in listen only mode
+#define MODBUS_EVENT_RECEIVE_BROADCAST 0x40
+#define MODBUS_EVENT_SEND 0x40 // request completed (reply sent or not), flags below
+#define MODBUS_EVENT_SEND_READ_EXCEPTION 0x01 // exception 01 - 03
+#define MODBUS_EVENT_SEND_ABORT_EXCEPTION 0x02 // exception 04
+#define MODBUS_EVENT_SEND_BUSY_EXCEPTION 0x04 // exception 05 - 06
+#define MODBUS_EVENT_SEND_NAK_EXCEPTION 0x08 // exception 07
+#define MODBUS_EVENT_SEND_LISTEN_ONLY 0x20 // no reply, listen only mode
 
 /*
  * Data types
@@ -119,6 +297,24 @@ typedef enum {
 	MODBUS_READ_DEVICE_IDENTIFICATION = 43, /* sub codes: 14 */
 } modbus_function_code_t;
 
+/* diagnostics (08) sub-functions (Modbus_Application_Protocol_V1_1b, section 6.8) */
+typedef enum {
+	MODBUS_DIAG_RETURN_QUERY_DATA = 0x00,
+	MODBUS_DIAG_RESTART_COMMUNICATIONS = 0x01, /* data 0000, or FF00 to clear event log as well */
+	MODBUS_DIAG_RETURN_DIAGNOSTIC_REGISTER = 0x02,
+	MODBUS_DIAG_FORCE_LISTEN_ONLY = 0x04,
+	MODBUS_DIAG_CLEAR_COUNTERS = 0x0A,
+	MODBUS_DIAG_BUS_MESSAGE_COUNT = 0x0B,
+	MODBUS_DIAG_BUS_COMM_ERROR_COUNT = 0x0C,
+	MODBUS_DIAG_BUS_EXCEPTION_COUNT = 0x0D,
+	MODBUS_DIAG_SLAVE_MESSAGE_COUNT = 0x0E,
+	MODBUS_DIAG_SLAVE_NO_RESPONSE_COUNT = 0x0F,
+	MODBUS_DIAG_SLAVE_NAK_COUNT = 0x10,
+	MODBUS_DIAG_SLAVE_BUSY_COUNT = 0x11,
+	MODBUS_DIAG_BUS_OVERRUN_COUNT = 0x12,
+	MODBUS_DIAG_CLEAR_OVERRUN = 0x14,
+} modbus_diag_sub_function_t;
+
 typedef enum {
 	MODBUS_EXCEPTION_ILLEGAL_FUNCTION = 1,
 	MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS = 2,
@@ -127,34 +323,54 @@ typedef enum {
 	MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE = 4,
 	MODBUS_EXCEPTION_ACKNOWLEDGE = 5,
 	MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY = 6,
+	MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE = 7,
 	MODBUS_EXCEPTION_MEMORY_PARITY_ERROR = 8,
 	MODBUS_EXCEPTION_GATEWAY_PATH_UNAVAILABLE = 10,
 	MODBUS_EXCEPTION_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND = 11,
 	MODBUS_EXCEPTION_ILLEGAL_DEVICE_ID_CODE = 3
 } modbus_exception_code_t;
 
+/* laid out to avoid padding: pointer, 16-bit fields, 8-bit fields, then register / bit data
+ * (first 32 bytes hold everything but the data, so parsing a request touches one cache line) */
 typedef struct {
-	modbus_function_code_t function_code : 8;
+	/* zero-copy read reply (functions 01-04): payload points to the final position of
+	 * register values / packed bits in the reply buffer. Fill it in wire format (registers
+	 * big-endian) and set payload_ready instead of using the union below; payload may also
+	 * be re-pointed to memory that already holds wire-format data and stays valid until
+	 * the next request is processed */
+	uint8_t *payload;
+
 	uint16_t register_address; // e.g. first register of A0: 0
 	uint16_t register_number;  // e.g. first register of A0: 40001
-	uint8_t  register_count; // number of registers to be read/written
+	uint16_t register_count; // number of registers (or coils/discrete inputs) to be read/written
 
-	modbus_exception_code_t exception;
+	/* read/write multiple registers (23): register_address/register_count is the range to be read,
+	 * this is the range to be written (written first, values in holding_registers[]) */
+	uint16_t write_address;
+	uint16_t write_count;
 
+	uint8_t address; // slave address (unit identifier) the request was sent to
+	modbus_function_code_t function_code : 8;
+	modbus_exception_code_t exception : 8;
 	uint8_t broadcast; // 1 if broadcast, 0 otherwise
+	uint8_t payload_ready;
+
+	/* process device id */
+	uint8_t read_device_id_code;
+	uint8_t object_id;
 
 	union {
-		uint8_t buffer8b[MODBUS_MAX_RTU_FRAME_SIZE];
-		uint16_t buffer16b[MODBUS_MAX_RTU_FRAME_SIZE/2];
+		uint8_t buffer8b[MODBUS_TRANSACTION_DATA_SIZE];
+		uint16_t buffer16b[MODBUS_TRANSACTION_DATA_SIZE/2];
 		uint16_t input_registers[MODBUS_MAX_REGISTERS];
 		uint16_t holding_registers[MODBUS_MAX_REGISTERS];
 		int16_t  input_registers_signed[MODBUS_MAX_REGISTERS];
 		int16_t  holding_registers_signed[MODBUS_MAX_REGISTERS];
+		/* bits are packed LSB first, as on the wire: coil N is bit (N % 8) of byte N / 8;
+		 * use modbus_bit_get() / modbus_bit_set() / modbus_bits_copy() */
+		uint8_t  coils[MODBUS_BITS_TO_BYTES(MODBUS_MAX_READ_BITS)];
+		uint8_t  discrete_inputs[MODBUS_BITS_TO_BYTES(MODBUS_MAX_READ_BITS)];
 	};
-
-	/* process device id */
-	uint8_t read_device_id_code;
-	uint8_t object_id;
 } modbus_transaction_t;
 
 typedef enum {
@@ -177,6 +393,15 @@ typedef enum {
 
 /* Device ID datatypes */
 #define MODBUS_DEVICE_ID_OBJECT_NUM 7
+#define MODBUS_DEVICE_ID_MAX_OBJECTS (MODBUS_DEVICE_ID_OBJECT_NUM + MODBUS_DEVICE_ID_MAX_EXTENDED)
+
+/* extended category object (private, any data) */
+typedef struct {
+	uint8_t id; /* MODBUS_EXTENDED_OBJECT_FIRST_ID ... 0xFF */
+	uint8_t len;
+	const uint8_t *value;
+} modbus_device_id_object_t;
+
 typedef struct {
 	union {
 		struct {
@@ -189,31 +414,275 @@ typedef struct {
 			char *ProductName;
 			char *ModelName;
 			char *UserApplicationName;
-			/* Extended category (optional part) */
-			// Nothing here yet!
 		} object_name;
 		char *object_id[MODBUS_DEVICE_ID_OBJECT_NUM];
 	};
+	/* Extended category (optional part): sorted by id, at most MODBUS_DEVICE_ID_MAX_EXTENDED */
+	const modbus_device_id_object_t *extended_objects;
+	uint8_t extended_count;
 	uint8_t conformity_level;
+
+	/* filled by modbus_slave_ctx_init_device_id(): all objects serialized (id, length, value)
+	 * in id order; each reply is one slice of them. Call it again after changing objects */
+	uint8_t object_count;
+	uint8_t category_end[MODBUS_CONFORMITY_EXTENDED]; /* index past last object of basic/regular/extended stream */
+	uint8_t ids[MODBUS_DEVICE_ID_MAX_OBJECTS];
+	uint8_t page_end[MODBUS_DEVICE_ID_MAX_OBJECTS]; /* stream reply starting at object i ends before this one */
+	uint16_t offset[MODBUS_DEVICE_ID_MAX_OBJECTS + 1]; /* object i is objects[offset[i]] ... objects[offset[i + 1] - 1] */
+	uint8_t objects[MODBUS_DEVICE_ID_BUFFER_SIZE];
 } modbus_device_id_t;
 
+/* bus diagnostics: counters (as served by diagnostics (08) sub-functions 0B - 12, which return
+ * their low 16 bits) and communication event log. Frame counters are kept by the context frames
+ * are passed to (the port, if there's a slave table), request counters by the one serving them */
+typedef struct {
+	uint32_t bus_messages; /* frames seen on the bus, any address (0B) */
+	uint32_t bus_comm_errors; /* frames with CRC error or invalid length / timing (0C) */
+	uint32_t bus_exceptions; /* exception replies sent (0D) */
+	uint32_t slave_messages; /* requests for this slave, broadcasts included (0E) */
+	uint32_t slave_no_response; /* requests for this slave not answered: broadcasts, malformed, listen only (0F) */
+	uint32_t slave_nak; /* exception 07 replies (10) */
+	uint32_t slave_busy; /* exception 06 replies (11) */
+	uint32_t bus_overruns; /* frames lost to character overrun, see modbus_slave_ctx_count_error() (12) */
+	uint16_t event_counter; /* requests completed without exception, except get comm event counter (11) */
+	uint16_t diagnostic_register; /* returned by sub-function 02, set by application */
+	uint8_t listen_only; /* entered by sub-function 04, left by 01 */
+	/* set by application: CRC of frames for other addresses is checked, so their CRC errors are
+	 * counted as well (costs a CRC per frame); otherwise they count as bus messages unchecked */
+	uint8_t check_other_crc;
+	uint8_t event_count; /* events in log */
+	uint8_t event_head; /* where next event goes */
+	uint8_t events[MODBUS_EVENT_LOG_SIZE]; /* MODBUS_EVENT_*, ring */
+} modbus_diagnostics_t;
+
+/* Slave context: everything needed to serve one port, no shared state between contexts */
+typedef struct modbus_slave_ctx modbus_slave_ctx_t;
+/* does the real work: read sensors, set outputs... */
+typedef int8_t (*modbus_slave_callback_t)(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction);
+/* sends reply, e.g. via UART */
+typedef int8_t (*modbus_transmit_function_t)(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len);
+/* reply segment for vectored transmit */
+typedef struct {
+	const uint8_t *data;
+	uint16_t len;
+} modbus_iovec_t;
+/* sends reply given as MODBUS_REPLY_IOV_COUNT segments (header, payload, CRC), e.g. as DMA
+ * scatter-gather list; payload may be empty. iov array is valid only during the call,
+ * segment data stay valid until the next request is processed */
+typedef int8_t (*modbus_transmitv_function_t)(modbus_slave_ctx_t *ctx, const modbus_iovec_t *iov, uint8_t iov_count);
+/* observes frames going through the context (MODBUS_CAPTURE_REQUEST / _REPLY, CRC included),
+ * e.g. modbus_capture_hook() (modbus_capture.h); called on the hot path, must not block */
+typedef void (*modbus_capture_function_t)(modbus_slave_ctx_t *ctx, uint8_t direction, const modbus_iovec_t *iov,
+		uint8_t iov_count);
+
+/* virtual slaves hosted behind one port: contexts indexed by address, so dispatch is one lookup */
+typedef struct {
+	modbus_slave_ctx_t *slaves[256];
+	uint16_t count;
+} modbus_slave_table_t;
+
+struct modbus_register_map; /* see modbus_register_map.h */
+struct modbus_file_map; /* see modbus_file_record.h */
+struct modbus_fifo; /* see modbus_fifo.h */
+struct modbus_cache; /* see modbus_cache.h */
+
+/* Function code handler. Built-in handlers live in a table indexed by function code, built at
+ * compile time (see MODBUS_ENABLE_*); more can be registered per context at runtime. */
+typedef struct {
+	uint8_t min_len; /* minimal request length after function code; shorter requests are ignored */
+	uint8_t flags; /* MODBUS_FUNCTION_FLAG_* */
+	/* decodes request data (after function code) into transaction; set transaction->exception
+	 * for exception reply, return non-OK value if no reply should be sent */
+	int8_t (*parse)(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction);
+	/* does the work, e.g. modbus_slave_ctx_serve(); NULL if there's nothing to do.
+	 * Non-OK return value is turned into exception reply */
+	int8_t (*execute)(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction);
+	/* writes reply data (after function code) to buffer, returns their length */
+	uint8_t (*serialize)(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction);
+} modbus_function_handler_t;
+
+/* reply is byte count followed by transaction->payload (see zero-copy replies) */
+#define MODBUS_FUNCTION_FLAG_PAYLOAD 0x01
+/* execute may return MODBUS_PENDING; other handlers get exception 06 instead */
+#define MODBUS_FUNCTION_FLAG_DEFER 0x02
+
+/* pending pool entry; transaction is the first member, so the pointer passed to the callback
+ * identifies the entry when completing it */
+typedef struct {
+	modbus_transaction_t transaction;
+	const modbus_function_handler_t *handler;
+	uint8_t in_use;
+} modbus_pending_t;
+
+struct modbus_slave_ctx {
+	modbus_device_id_t *device_id;
+	struct modbus_register_map *register_map; /* optional, served before callback is called */
+	struct modbus_file_map *file_map; /* optional, serves read / write file record */
+	struct modbus_fifo *fifos; /* optional list of queues served by read FIFO queue */
+	struct modbus_cache *cache; /* optional response cache, see modbus_slave_ctx_set_cache() */
+	modbus_slave_callback_t callback;
+	modbus_transmit_function_t transmit;
+	modbus_transmitv_function_t transmitv; /* optional, used instead of transmit when set */
+	uint8_t *reply_buffer; /* optional caller-supplied buffer replies are built in, NULL = buffer */
+	void *user_data; /* not used by library */
+	modbus_capture_function_t capture; /* optional, see modbus_slave_ctx_set_capture() */
+	modbus_slave_table_t *slave_table; /* optional virtual slaves, see modbus_slave_ctx_set_slave_table() */
+	void *capture_data; /* passed to capture function through context */
+#if MODBUS_MAX_USER_FUNCTIONS > 0
+	/* handlers registered with modbus_slave_ctx_register_function(), checked before built-in ones */
+	const modbus_function_handler_t *user_functions[MODBUS_MAX_USER_FUNCTIONS];
+#endif
+	/* optional caller-supplied pool of deferred transactions, see modbus_slave_ctx_set_pending_pool() */
+	modbus_pending_t *pending;
+	uint8_t address;
+	uint8_t pending_size;
+	uint8_t pending_count;
+	uint8_t pending_flags; /* MODBUS_PENDING_FLAG_* */
+	uint8_t user_function_count;
+#if MODBUS_MAX_USER_FUNCTIONS > 0
+	uint8_t user_function_codes[MODBUS_MAX_USER_FUNCTIONS];
+#endif
+#if MODBUS_ENABLE_DIAGNOSTICS
+	/* updated by the thread serving the context; see modbus_slave_ctx_diagnostics() */
+	modbus_diagnostics_t diagnostics;
+#endif
+	/* TX buffer; can be also used for RX in memory constrained systems;
+	 * NOTE if shared buffer is used for TX/RX, care must be taken to prevent writing into buffer
+	 * during execution of modbus_slave_ctx_process_msg() */
+	uint8_t buffer[MODBUS_MAX_RTU_FRAME_SIZE];
+} __attribute__((aligned(MODBUS_CACHE_LINE_SIZE)));
+
+/* CRC16 engine: takes running CRC (MODBUS_CRC16_INIT at start of frame), returns updated CRC */
+typedef uint16_t (*modbus_crc16_engine_t)(uint16_t crc, const uint8_t *buf, int len);
+
 /*
  * Global variables
  */
 
-/* device address: declared in modbus.c */
-extern uint8_t modbus_slave_address;
+/* context used by global API below (modbus_slave_process_msg() etc.); defined in modbus_default.c */
+extern modbus_slave_ctx_t modbus_default_ctx;
+
+/* NOTE former globals below are macros over modbus_default_ctx, not linker symbols: don't declare them
+ * extern yourself, and don't use these names for other identifiers (see README) */
 
-/* shared modbus buffer; defined in modbus.c; may be used elsewhere in code */
-extern uint8_t modbus_buffer[];
+/* device address */
+#define modbus_slave_address (modbus_default_ctx.address)
+
+/* shared modbus buffer; may be used elsewhere in code */
+#define modbus_buffer (modbus_default_ctx.buffer)
 
 /* modbus device id struct */
-extern modbus_device_id_t *modbus_device_id;
+#define modbus_device_id (modbus_default_ctx.device_id)
 
 /*
  * Function prototypes
  */
 
+/* CRC16 of buf; low byte is transmitted first */
+uint16_t modbus_CRC16(const uint8_t *buf, int len);
+/* incremental CRC16: feed frame in chunks starting with MODBUS_CRC16_INIT;
+ * CRC over a complete frame including its two CRC bytes is 0 */
+uint16_t modbus_crc16_update(uint16_t crc, const uint8_t *buf, int len);
+/* returns given engine or NULL if it's not compiled in / not supported by CPU */
+modbus_crc16_engine_t modbus_crc16_get_engine(uint8_t engine);
+/* override engine picked by MODBUS_CRC_ENGINE_AUTO; call before starting other threads */
+int8_t modbus_crc16_select(uint8_t engine);
+/* check that all available engines match the bit-by-bit reference implementation */
+int8_t modbus_crc16_selftest(void);
+
+/* packed bit helpers (LSB first, Modbus wire format) */
+uint8_t modbus_bit_get(const uint8_t *bits, uint16_t index);
+void modbus_bit_set(uint8_t *bits, uint16_t index, uint8_t value);
+/* copies count bits from src (starting at bit src_offset) to dst (starting at bit dst_offset),
+ * in 64-bit word steps; other bits of dst are left untouched */
+void modbus_bits_copy(uint8_t *dst, uint32_t dst_offset, const uint8_t *src, uint32_t src_offset, uint16_t count);
+
+/*
+ * Reentrant API: each context can be served from a different thread
+ */
+
+int8_t modbus_slave_ctx_init(modbus_slave_ctx_t *ctx, uint8_t address,
+		modbus_slave_callback_t callback, modbus_transmit_function_t transmit, void *user_data);
+int8_t modbus_slave_ctx_set_address(modbus_slave_ctx_t *ctx, uint8_t address);
+int8_t modbus_slave_ctx_init_device_id(modbus_slave_ctx_t *ctx, modbus_device_id_t *device_id);
+/* requests to mapped addresses are served from the map, callback is called only for the rest */
+int8_t modbus_slave_ctx_set_register_map(modbus_slave_ctx_t *ctx, struct modbus_register_map *map);
+/* files served by read / write file record (20, 21); without file map these are answered with exception 01 */
+int8_t modbus_slave_ctx_set_file_map(modbus_slave_ctx_t *ctx, struct modbus_file_map *map);
+/* adds queue served by read FIFO queue (24); without queues it is answered with exception 01 */
+int8_t modbus_slave_ctx_add_fifo(modbus_slave_ctx_t *ctx, struct modbus_fifo *fifo);
+/* read register replies are served from / stored in cache (modbus_cache.h);
+ * NULL disables caching */
+int8_t modbus_slave_ctx_set_cache(modbus_slave_ctx_t *ctx, struct modbus_cache *cache);
+/* replies are built in buffer (at least MODBUS_MAX_RTU_FRAME_SIZE bytes, e.g. DMA TX buffer)
+ * instead of ctx->buffer; NULL switches back to ctx->buffer */
+int8_t modbus_slave_ctx_set_reply_buffer(modbus_slave_ctx_t *ctx, uint8_t *buffer);
+/* replies are passed to transmitv as segments instead of being joined for ctx->transmit;
+ * NULL switches back to ctx->transmit */
+int8_t modbus_slave_ctx_set_transmitv(modbus_slave_ctx_t *ctx, modbus_transmitv_function_t transmitv);
+/* capture is called with every request frame received by modbus_slave_ctx_process_msg() (before CRC
+ * check) / _process_frame() / _process_request() and every reply sent or built by _process_request() /
+ * _complete_request(); frames of the latter two (TCP, serial backend) are given CRC to look like RTU
+ * frames. capture_data is stored in ctx->capture_data. NULL disables capturing */
+int8_t modbus_slave_ctx_set_capture(modbus_slave_ctx_t *ctx, modbus_capture_function_t capture, void *capture_data);
+/* serves virtual slaves of table through ctx (the port): each request goes to the context with its
+ * address, broadcasts go to all of them; ctx itself serves only if it's in the table. Replies are
+ * sent through ctx; deferred requests are completed through the virtual slave, so it should have the
+ * same transmit function. NULL switches back to ctx->address */
+int8_t modbus_slave_ctx_set_slave_table(modbus_slave_ctx_t *ctx, modbus_slave_table_t *table);
+int8_t modbus_slave_table_init(modbus_slave_table_t *table);
+/* adds slave under slave->address (1-255); address must not change while slave is in table */
+int8_t modbus_slave_table_add(modbus_slave_table_t *table, modbus_slave_ctx_t *slave);
+int8_t modbus_slave_table_remove(modbus_slave_table_t *table, uint8_t address);
+/* frames for addresses that are not served are dropped before CRC is computed (unless
+ * ctx->diagnostics.check_other_crc is set) */
+int8_t modbus_slave_ctx_process_msg(modbus_slave_ctx_t *ctx, const uint8_t *buffer, int len);
+int8_t modbus_slave_ctx_process_frame(modbus_slave_ctx_t *ctx, const uint8_t *buffer, int len);
+/* transport-independent part: processes request (address + PDU, no CRC) and builds reply
+ * (address + PDU, no CRC) into reply buffer of at least MODBUS_MAX_RTU_FRAME_SIZE bytes;
+ * reply_len is 0 when no reply should be sent; ctx->transmit is not called */
+int8_t modbus_slave_ctx_process_request(modbus_slave_ctx_t *ctx, const uint8_t *buffer, int len,
+		uint8_t *reply, uint16_t *reply_len, uint8_t flags);
+/* handles function_code with given handler (overrides built-in one); NULL handler disables function code */
+int8_t modbus_slave_ctx_register_function(modbus_slave_ctx_t *ctx, uint8_t function_code,
+		const modbus_function_handler_t *handler);
+/* serves transaction from register map or callback; to be used as modbus_function_handler_t execute */
+int8_t modbus_slave_ctx_serve(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction);
+/* enables deferred completion: callback may return MODBUS_PENDING for reads and writes (01-06, 15, 16),
+ * the transaction is then kept in pool (size entries) until modbus_slave_ctx_complete() is called.
+ * Requests are processed in a free pool entry, so the transaction pointer given to the callback
+ * stays valid; when pool is full, MODBUS_PENDING is answered with exception 06. NULL pool disables it.
+ * Supported by RTU frames (_process_msg() / _process_frame() + _complete()) and the serial backend
+ * (modbus_serial_port_complete()); the TCP server answers MODBUS_PENDING with exception 06 unless
+ * MODBUS_PENDING_FLAG_ACKNOWLEDGE is set (MODBUS_REQUEST_FLAG_NO_DEFER) */
+int8_t modbus_slave_ctx_set_pending_pool(modbus_slave_ctx_t *ctx, modbus_pending_t *pool, uint8_t size, uint8_t flags);
+/* completes pending transaction: result is what the callback would have returned; data are taken
+ * from transaction (fill it right before calling this, payload in reply buffer is not kept while
+ * pending). Reply is built and sent as by modbus_slave_ctx_process_frame(), unless broadcast or
+ * MODBUS_PENDING_FLAG_ACKNOWLEDGE. Returns MODBUS_ERROR if transaction is not pending */
+int8_t modbus_slave_ctx_complete(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction, int8_t result);
+/* transport-independent variant: reply (address + PDU, no CRC) is built into reply buffer,
+ * reply_len is 0 when no reply should be sent; ctx->transmit is not called */
+int8_t modbus_slave_ctx_complete_request(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction, int8_t result,
+		uint8_t *reply, uint16_t *reply_len);
+/* modbus_frame_handler_t for modbus_rtu_framer_t; user_data is the context */
+int8_t modbus_slave_ctx_frame_handler(const uint8_t *frame, int len, void *user_data);
+/* bus counters and event log for export (e.g. to metrics system); plain reads, so values may be
+ * torn when read from other thread than the one serving ctx. NULL if diagnostics are not compiled in */
+const modbus_diagnostics_t *modbus_slave_ctx_diagnostics(const modbus_slave_ctx_t *ctx);
+/* clears counters, diagnostic register and event log; listen only mode is left as is */
+int8_t modbus_slave_ctx_clear_diagnostics(modbus_slave_ctx_t *ctx);
+/* counts frame dropped by transport before it reached ctx (e.g. framer result): MODBUS_ERROR_CRC or
+ * MODBUS_ERROR_FRAME_INVALID (communication error), MODBUS_ERROR_OUT_OF_BOUNDS (character overrun) */
+int8_t modbus_slave_ctx_count_error(modbus_slave_ctx_t *ctx, int8_t error);
+/* copies at most max events of the log to events, newest first; returns their count */
+uint8_t modbus_slave_ctx_event_log(const modbus_slave_ctx_t *ctx, uint8_t *events, uint8_t max);
+
+/*
+ * Global API: thin wrapper over modbus_default_ctx, which calls
+ * modbus_slave_callback() and modbus_transmit_function() below
+ */
+
 /* process message: should be called in when modbus message was received (e.g. in main.c)
  * modbus_process_msg() may call following functions:
  *     - modbus_callback_function() if data readout is requested
@@ -221,8 +690,15 @@ extern modbus_device_id_t *modbus_device_id;
  * Both functions have to be implemented by user.
  */
 int8_t modbus_slave_process_msg(const uint8_t *buffer, int len);
+/* same as modbus_slave_process_msg(), but CRC of the frame has already been checked by caller
+ * (e.g. by modbus_rtu_framer_t, which computes it while the frame is being received) */
+int8_t modbus_slave_process_frame(const uint8_t *buffer, int len);
 int8_t modbus_slave_init_device_id(modbus_device_id_t *device_id);
 int8_t modbus_slave_set_address(uint8_t address);
+int8_t modbus_slave_set_slave_table(modbus_slave_table_t *table);
+/* deferred completion, see modbus_slave_ctx_set_pending_pool() / modbus_slave_ctx_complete() */
+int8_t modbus_slave_set_pending_pool(modbus_pending_t *pool, uint8_t size, uint8_t flags);
+int8_t modbus_slave_complete(modbus_transaction_t *transaction, int8_t result);
 /* modbus callback function type - should be implemented by user (e.g. in main.c) */
 int8_t modbus_slave_callback(modbus_transaction_t *transaction);
 /* UART transmit function type - should be implemented by user (e.g. in main.c) */
@@ -0,0 +1,103 @@
+/*
+ * modbus_cache.h
+ *
+ *  Read-through response cache: complete reply frames (CRC included) to read input /
+ *  holding registers (04 / 03), keyed by (address, function code, start, count).
+ *
+ *  Requests are cached only when they fall entirely into one of the cache ranges; each range
+ *  has its own time to live. A request that hits a valid entry is answered by copying the
+ *  stored frame into the reply buffer: no callback, register map or reply CRC. Misses are
+ *  served as usual and their (non-exception) reply is stored. Entries are direct-mapped, a new
+ *  reply replaces whatever was in its slot.
+ *
+ *  RTU frames and requests (modbus_slave_ctx_process_request(), e.g. TCP) share the cache.
+ *  The cache is consulted after the slave is known to serve the request itself: busy replies
+ *  (MODBUS_PENDING_FLAG_BUSY) still come first, and a function handler registered for 03 / 04
+ *  bypasses the cache.
+ *
+ *  Holding register writes received by the context (06, 16, 22, 23) invalidate overlapping
+ *  entries; values changed by the application are invalidated with modbus_cache_invalidate()
+ *  (from the thread serving the context, the cache has no locks).
+ *
+ * USAGE:
+ *
+ *  static const modbus_cache_range_t ranges[] = {
+ *      { .table = MODBUS_TABLE_INPUT_REGISTERS, .start = 0, .count = 100, .ttl_ms = 200 },
+ *  };
+ *  static modbus_cache_entry_t entries[16];
+ *  static modbus_cache_t cache;
+ *
+ *  modbus_cache_init(&cache, entries, 16, ranges, 1, my_clock_ms, NULL);
+ *  modbus_slave_ctx_set_cache(&ctx, &cache);
+ *  ...
+ *  measurements_update(); modbus_cache_invalidate(&cache, MODBUS_TABLE_INPUT_REGISTERS, 0, 100);
+ */
+
+#ifndef SRC_MODBUS_CACHE_H_
+#define SRC_MODBUS_CACHE_H_
+
+#include "modbus.h"
+#include "modbus_register_map.h"
+
+/*
+ * Data types
+ */
+
+/* milliseconds of a free-running clock */
+typedef uint32_t (*modbus_cache_clock_t)(void *clock_data);
+
+typedef struct {
+	uint8_t table; /* MODBUS_TABLE_INPUT_REGISTERS or MODBUS_TABLE_HOLDING_REGISTERS */
+	uint16_t start;
+	uint16_t count;
+	uint32_t ttl_ms;
+} modbus_cache_range_t;
+
+typedef struct {
+	uint64_t key; /* 0 = empty */
+	uint32_t expires_ms;
+	uint16_t len; /* reply frame length, CRC included */
+	uint8_t frame[MODBUS_MAX_RTU_FRAME_SIZE];
+} modbus_cache_entry_t;
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses; /* cacheable requests not found (expired ones included) */
+	uint64_t expired;
+	uint64_t invalidations; /* entries dropped by writes / modbus_cache_invalidate() */
+} modbus_cache_stats_t;
+
+typedef struct modbus_cache {
+	modbus_cache_entry_t *entries;
+	const modbus_cache_range_t *ranges;
+	modbus_cache_clock_t clock;
+	void *clock_data;
+	/* entry to be filled by reply to the request being served (set on miss) */
+	modbus_cache_entry_t *store;
+	/* entry that answered the request being served (set on hit) */
+	const modbus_cache_entry_t *hit;
+	uint64_t store_key;
+	uint32_t store_expires_ms;
+	uint16_t mask; /* entry count - 1 */
+	uint16_t range_count;
+	modbus_cache_stats_t stats;
+} modbus_cache_t;
+
+/*
+ * Function prototypes
+ */
+
+/* count (power of 2) entries; ranges are not copied, must stay valid */
+int8_t modbus_cache_init(modbus_cache_t *cache, modbus_cache_entry_t *entries, uint16_t count,
+		const modbus_cache_range_t *ranges, uint16_t range_count, modbus_cache_clock_t clock, void *clock_data);
+/* request (address + PDU, no CRC): stored reply frame or NULL; on miss of a cacheable request
+ * the reply is stored by modbus_cache_store() */
+const modbus_cache_entry_t *modbus_cache_lookup(modbus_cache_t *cache, const uint8_t *request, int len);
+/* stores reply frame given as segments (see modbus_transmitv_function_t) if lookup missed */
+void modbus_cache_store(modbus_cache_t *cache, const modbus_iovec_t *iov, uint8_t iov_count);
+/* drops entries of table overlapping [start, start + count) */
+void modbus_cache_invalidate(modbus_cache_t *cache, uint8_t table, uint16_t start, uint16_t count);
+/* drops everything */
+void modbus_cache_clear(modbus_cache_t *cache);
+
+#endif /* SRC_MODBUS_CACHE_H_ */
@@ -0,0 +1,161 @@
+/*
+ * modbus_capture.h
+ *
+ *  Wire traffic capture and replay (POSIX).
+ *
+ *  Capture: modbus_capture_hook() (set with modbus_slave_ctx_set_capture()) timestamps
+ *  request and reply frames of every transport (RTU frames, serial backend, TCP server;
+ *  TCP requests are recorded as RTU frames with the unit id as address) and appends
+ *  them, already encoded as records of the output file, to a single-producer /
+ *  single-consumer byte ring; a writer thread empties the ring into the file every
+ *  MODBUS_CAPTURE_FLUSH_MS. The hot path does no system calls besides reading the clock
+ *  and never waits: when the ring is full, the frame is dropped and counted in
+ *  capture.dropped.
+ *
+ *  Formats (all numbers little-endian):
+ *  - MODBUS_CAPTURE_FORMAT_LOG: 16-byte header ("MBCP", version 1, reserved, start time
+ *    in us since epoch as uint64), then per frame: delta time since previous record in us
+ *    (uint32, saturated), frame length (uint16), direction (MODBUS_CAPTURE_REQUEST /
+ *    _REPLY), reserved byte, frame with CRC
+ *  - MODBUS_CAPTURE_FORMAT_PCAP: classic pcap with link type MODBUS_CAPTURE_LINKTYPE
+ *    (LINKTYPE_USER0); in Wireshark map it to "mbrtu" (Preferences > Protocols > DLT_USER).
+ *    pcap has no direction, replay tells replies by position: a frame right after a request
+ *    with the same address and function code is its reply
+ *
+ *  Replay: the log is memory-mapped and its requests are run through a slave context
+ *  (modbus_slave_ctx_process_request(), so ctx->transmit is not used), as fast as possible
+ *  or at recorded speed; replies are compared with recorded ones (CRC excluded).
+ *
+ * USAGE:
+ *
+ *  static uint8_t ring[1 << 16];
+ *  static modbus_capture_t capture;
+ *
+ *  modbus_capture_open(&capture, "/tmp/bus.mbcp", MODBUS_CAPTURE_FORMAT_LOG, ring, sizeof(ring));
+ *  modbus_slave_ctx_set_capture(&ctx, modbus_capture_hook, &capture);
+ *  ... serve requests ...
+ *  modbus_slave_ctx_set_capture(&ctx, NULL, NULL);
+ *  modbus_capture_close(&capture); (writes what is left)
+ *
+ *  modbus_replay_t replay;
+ *  modbus_replay_stats_t stats;
+ *  modbus_replay_open(&replay, "/tmp/bus.mbcp");
+ *  modbus_replay_run(&replay, &ctx, MODBUS_REPLAY_FLAG_NONE, &stats);
+ *  modbus_replay_close(&replay);
+ *
+ *  One capture has one producer: contexts served from different threads need one each.
+ *  bench/replay.c is a command line replay tool.
+ */
+
+#ifndef SRC_MODBUS_CAPTURE_H_
+#define SRC_MODBUS_CAPTURE_H_
+
+#include <stddef.h>
+#include <pthread.h>
+#include "modbus.h"
+
+/*
+ * Defines & macros
+ */
+
+#define MODBUS_CAPTURE_FORMAT_LOG 0
+#define MODBUS_CAPTURE_FORMAT_PCAP 1
+
+#define MODBUS_CAPTURE_LOG_MAGIC "MBCP"
+#define MODBUS_CAPTURE_LOG_VERSION 1
+#define MODBUS_CAPTURE_LOG_HEADER_LEN 16
+#define MODBUS_CAPTURE_LOG_RECORD_LEN 8 /* record header, frame follows */
+#define MODBUS_CAPTURE_PCAP_HEADER_LEN 24
+#define MODBUS_CAPTURE_PCAP_RECORD_LEN 16
+#define MODBUS_CAPTURE_LINKTYPE 147 /* LINKTYPE_USER0 */
+
+/* writer thread period */
+#ifndef MODBUS_CAPTURE_FLUSH_MS
+#define MODBUS_CAPTURE_FLUSH_MS 10
+#endif
+
+/* replay flags */
+#define MODBUS_REPLAY_FLAG_NONE 0x00
+#define MODBUS_REPLAY_FLAG_REALTIME 0x01 /* keep recorded time between requests */
+
+/*
+ * Data types
+ */
+
+typedef struct {
+	/* set by modbus_capture_open(), read-only afterwards */
+	uint8_t *buffer;
+	uint32_t mask; /* size - 1 */
+	int fd;
+	uint8_t format; /* MODBUS_CAPTURE_FORMAT_* */
+	pthread_t thread;
+
+	/* written by producer (the thread serving the context) only */
+	uint32_t head __attribute__((aligned(MODBUS_CACHE_LINE_SIZE)));
+	uint64_t last_us; /* time of previous record (log format) */
+	uint32_t records; /* frames captured */
+	uint32_t dropped; /* frames dropped because ring was full */
+
+	/* written by writer thread only */
+	uint32_t tail __attribute__((aligned(MODBUS_CACHE_LINE_SIZE)));
+	uint32_t write_errors; /* failed write() calls, their data are lost */
+	int running;
+} modbus_capture_t;
+
+typedef struct {
+	uint64_t time_us; /* since epoch */
+	const uint8_t *data; /* frame with CRC, points into the mapped log */
+	uint16_t len;
+	uint8_t direction; /* MODBUS_CAPTURE_REQUEST / _REPLY */
+} modbus_capture_record_t;
+
+typedef struct {
+	const uint8_t *map;
+	size_t size;
+	size_t pos; /* next record */
+	uint8_t format;
+	uint64_t time_us; /* of previous record */
+	/* previous frame, if it was a request (pcap direction) */
+	uint8_t request_address;
+	uint8_t request_function;
+	uint8_t after_request;
+	/* recorded reply to the request being replayed (CRC excluded), for callbacks; NULL if none */
+	const uint8_t *expected;
+	uint16_t expected_len;
+} modbus_replay_t;
+
+typedef struct {
+	uint32_t requests; /* requests run through the context */
+	uint32_t matched; /* reply (or no reply) same as recorded */
+	uint32_t mismatched;
+	uint32_t skipped; /* records not replayed: replies without request, requests with bad CRC */
+	uint64_t elapsed_us;
+} modbus_replay_stats_t;
+
+/*
+ * Function prototypes
+ */
+
+/* creates (truncates) file at path, writes file header and starts writer thread;
+ * buffer is the ring (size bytes, power of 2, at least one maximal record) */
+int8_t modbus_capture_open(modbus_capture_t *capture, const char *path, uint8_t format, uint8_t *buffer,
+		uint32_t size);
+/* appends frame given as segments; never blocks */
+void modbus_capture_frame(modbus_capture_t *capture, uint8_t direction, const modbus_iovec_t *iov, uint8_t iov_count);
+/* modbus_capture_function_t; ctx->capture_data is the capture */
+void modbus_capture_hook(modbus_slave_ctx_t *ctx, uint8_t direction, const modbus_iovec_t *iov, uint8_t iov_count);
+/* stops writer thread, writes remaining records and closes file */
+int8_t modbus_capture_close(modbus_capture_t *capture);
+
+/* maps capture file (either format) */
+int8_t modbus_replay_open(modbus_replay_t *replay, const char *path);
+/* next record; MODBUS_ERROR at end of log, MODBUS_ERROR_FRAME_INVALID if the log is truncated */
+int8_t modbus_replay_next(modbus_replay_t *replay, modbus_capture_record_t *record);
+void modbus_replay_rewind(modbus_replay_t *replay);
+/* runs all requests of the log through ctx from current position (MODBUS_REPLAY_FLAG_*);
+ * replay->expected is set while each request is processed */
+int8_t modbus_replay_run(modbus_replay_t *replay, modbus_slave_ctx_t *ctx, uint8_t flags,
+		modbus_replay_stats_t *stats);
+void modbus_replay_close(modbus_replay_t *replay);
+
+#endif /* SRC_MODBUS_CAPTURE_H_ */
@@ -0,0 +1,63 @@
+/*
+ * modbus_endian.h
+ *
+ *  Register byte order: Modbus sends registers big-endian, the library keeps them in
+ *  host byte order (transaction->holding_registers[], register map data).
+ *
+ *  modbus_registers_pack() / _unpack() convert register blocks between the two with
+ *  byte shuffles: AVX2 (when compiled with -mavx2 / -march=...), SSE2 (any x86-64),
+ *  NEON (ARM with __ARM_NEON), __builtin_bswap16() elsewhere, plain copy on big-endian
+ *  hosts. The kernel is chosen at compile time: blocks are at most 250 bytes, a runtime
+ *  CPU check would cost about as much as it saves.
+ *
+ *  Typed values spanning several registers are stored in one of four word orders, named
+ *  after the position of the value's bytes (A = most significant) in the registers:
+ *  - MODBUS_ORDER_ABCD: big-endian, most significant register first (Modbus convention)
+ *  - MODBUS_ORDER_CDAB: registers swapped, least significant register first
+ *  - MODBUS_ORDER_BADC: bytes swapped within each register
+ *  - MODBUS_ORDER_DCBA: little-endian
+ *  For 64-bit values, "registers swapped" reverses all four registers.
+ *
+ * USAGE (in callback):
+ *
+ *  float setpoint = modbus_get_float(&transaction->holding_registers[0], MODBUS_ORDER_CDAB);
+ *  modbus_set_uint32(&transaction->input_registers[2], counter, MODBUS_ORDER_ABCD);
+ */
+
+#ifndef SRC_MODBUS_ENDIAN_H_
+#define SRC_MODBUS_ENDIAN_H_
+
+#include "modbus.h"
+
+/*
+ * Defines & macros
+ */
+
+/* word orders; bit 0 = registers swapped, bit 1 = bytes swapped within registers */
+#define MODBUS_ORDER_ABCD 0x00
+#define MODBUS_ORDER_CDAB 0x01
+#define MODBUS_ORDER_BADC 0x02
+#define MODBUS_ORDER_DCBA 0x03
+
+/*
+ * Function prototypes
+ */
+
+/* count host-order registers to big-endian bytes (2 * count); dst may be unaligned */
+void modbus_registers_pack(uint8_t *dst, const uint16_t *src, uint16_t count);
+/* 2 * count big-endian bytes to host-order registers; src may be unaligned */
+void modbus_registers_unpack(uint16_t *dst, const uint8_t *src, uint16_t count);
+/* name of the kernel compiled in ("avx2", "sse2", "neon", "bswap", "copy") */
+const char *modbus_registers_kernel(void);
+
+/* typed values in 2 (32-bit) or 4 (64-bit) consecutive registers */
+uint32_t modbus_get_uint32(const uint16_t *registers, uint8_t order);
+void modbus_set_uint32(uint16_t *registers, uint32_t value, uint8_t order);
+int32_t modbus_get_int32(const uint16_t *registers, uint8_t order);
+void modbus_set_int32(uint16_t *registers, int32_t value, uint8_t order);
+float modbus_get_float(const uint16_t *registers, uint8_t order);
+void modbus_set_float(uint16_t *registers, float value, uint8_t order);
+uint64_t modbus_get_uint64(const uint16_t *registers, uint8_t order);
+void modbus_set_uint64(uint16_t *registers, uint64_t value, uint8_t order);
+
+#endif /* SRC_MODBUS_ENDIAN_H_ */
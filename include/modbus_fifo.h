@@ -0,0 +1,102 @@
+/*
+ * modbus_fifo.h
+ *
+ *  FIFO queues served by Read FIFO Queue (24): a producer (sampling thread, ADC ISR)
+ *  appends registers to a single-producer / single-consumer lock-free ring, each request
+ *  drains up to MODBUS_FIFO_MAX_REPLY_COUNT of them into the reply. A queue is identified
+ *  by its FIFO pointer address (the address sent in the request).
+ *
+ *  Like the frame ring (modbus_frame_ring.h), producer and consumer each own one index;
+ *  registers are published with release stores and observed with acquire loads, no locks
+ *  and no read-modify-write operations are used.
+ *
+ *  Samples of more than one register (e.g. 32-bit values, or a timestamp with channels)
+ *  are pushed as a whole and never split between two replies: a reply carries as many
+ *  whole samples as fit, so its FIFO count is a multiple of sample_size.
+ *
+ *  FIFO count semantics (Modbus_Application_Protocol_V1_1b, section 6.18): the FIFO count
+ *  of a reply is the number of registers in that reply (0-31). By default a queue holding
+ *  more than fits is drained in chunks, registers returned are removed from the queue. With
+ *  MODBUS_FIFO_FLAG_STRICT the request is answered with exception 03 instead (as the
+ *  specification describes) and nothing is removed. Either way, registers of a reply lost
+ *  on the line are lost, the master should poll faster than the queue fills.
+ *
+ * USAGE:
+ *
+ *  static uint16_t samples[1024];
+ *  static modbus_fifo_t fifo;
+ *
+ *  modbus_fifo_init(&fifo, 0x04DE, samples, 1024, 1);
+ *  modbus_slave_ctx_add_fifo(&ctx, &fifo);
+ *  ...
+ *  producer: modbus_fifo_push(&fifo, &value); or modbus_fifo_write(&fifo, block, n);
+ *  samples that don't fit are dropped and counted in fifo.overruns
+ *
+ *  Each queue has one consumer: do not add it to contexts served from different threads.
+ */
+
+#ifndef SRC_MODBUS_FIFO_H_
+#define SRC_MODBUS_FIFO_H_
+
+#include "modbus.h"
+
+/*
+ * Defines & macros
+ */
+
+/* largest FIFO count of a reply, section 6.18 */
+#define MODBUS_FIFO_MAX_COUNT 31
+/* reply: address, function code, byte count (2), FIFO count (2), registers, CRC */
+#define MODBUS_FIFO_MAX_REPLY_COUNT MODBUS_MIN(MODBUS_FIFO_MAX_COUNT, (MODBUS_MAX_RTU_FRAME_SIZE - 8) / 2)
+
+/* more queued registers than fit into a reply are answered with exception 03 */
+#define MODBUS_FIFO_FLAG_STRICT 0x01
+
+/*
+ * Data types
+ */
+
+typedef struct modbus_fifo {
+	/* set by modbus_fifo_init(), read-only afterwards */
+	uint16_t *registers;
+	uint32_t mask; /* size - 1 */
+	struct modbus_fifo *next; /* next queue of the context */
+	uint16_t address; /* FIFO pointer address */
+	uint8_t sample_size; /* registers pushed and drained together */
+	uint8_t flags; /* MODBUS_FIFO_FLAG_* */
+
+	/* written by producer only: registers pushed so far (free-running, masked on use) */
+	uint32_t head __attribute__((aligned(MODBUS_CACHE_LINE_SIZE)));
+	/* producer statistics */
+	uint32_t overruns; /* samples dropped because queue was full */
+	uint32_t high_water; /* highest number of registers waiting */
+
+	/* written by consumer only: registers drained so far */
+	uint32_t tail __attribute__((aligned(MODBUS_CACHE_LINE_SIZE)));
+} modbus_fifo_t;
+
+/*
+ * Function prototypes
+ */
+
+/* registers is storage for size registers, size must be power of 2; sample_size is
+ * 1 ... MODBUS_FIFO_MAX_REPLY_COUNT registers */
+int8_t modbus_fifo_init(modbus_fifo_t *fifo, uint16_t address, uint16_t *registers, uint32_t size,
+		uint8_t sample_size);
+
+/* producer side */
+/* appends one sample (sample_size registers); MODBUS_ERROR_OUT_OF_BOUNDS (overrun counted) when full */
+int8_t modbus_fifo_push(modbus_fifo_t *fifo, const uint16_t *sample);
+/* appends up to count samples with one publish, returns number of samples appended;
+ * the rest is dropped and counted as overruns */
+uint32_t modbus_fifo_write(modbus_fifo_t *fifo, const uint16_t *samples, uint32_t count);
+
+/* consumer side */
+/* number of registers queued */
+uint32_t modbus_fifo_count(const modbus_fifo_t *fifo);
+/* removes whole samples, at most max_count registers, into values; returns number of registers */
+uint16_t modbus_fifo_read(modbus_fifo_t *fifo, uint16_t *values, uint16_t max_count);
+/* queue with given FIFO pointer address in list starting with first, or NULL */
+modbus_fifo_t *modbus_fifo_find(modbus_fifo_t *first, uint16_t address);
+
+#endif /* SRC_MODBUS_FIFO_H_ */
@@ -0,0 +1,112 @@
+/*
+ * modbus_file_record.h
+ *
+ *  File records (Read File Record 20, Write File Record 21): each Modbus file number
+ *  is backed by user memory or by a memory-mapped file. Record N of a file is the 16-bit
+ *  big-endian word at byte offset 2 * N, so replies are copied straight from the mapping
+ *  (and writes straight into it), one bounds check per sub-request.
+ *
+ *  A file number holds at most MODBUS_FILE_MAX_RECORDS records (record numbers 0-9999,
+ *  Modbus_Application_Protocol_V1_1b, section 6.14); larger files are mapped to several
+ *  consecutive file numbers.
+ *
+ *  Writes into mapped files are flushed with msync() according to sync policy: not at all
+ *  (kernel writes pages back), asynchronously or synchronously (before the reply is sent),
+ *  after every request or every N write requests; modbus_file_map_sync() flushes on demand.
+ *
+ * USAGE:
+ *
+ *  static modbus_file_t files[16];
+ *  static modbus_file_map_t file_map;
+ *
+ *  modbus_file_map_init(&file_map, files, 16);
+ *  modbus_file_map_add(&file_map, 1, log_buffer, 500, MODBUS_ACCESS_READ);
+ *  modbus_file_map_add_file(&file_map, 10, "/var/lib/dev/waveform.bin", MODBUS_ACCESS_READ_WRITE);
+ *  modbus_file_map_set_sync(&file_map, MODBUS_FILE_SYNC_ASYNC, 1);
+ *  modbus_slave_ctx_set_file_map(&ctx, &file_map);
+ *  ...
+ *  modbus_file_map_close(&file_map); (flushes and unmaps files)
+ */
+
+#ifndef SRC_MODBUS_FILE_RECORD_H_
+#define SRC_MODBUS_FILE_RECORD_H_
+
+#include "modbus.h"
+#include "modbus_register_map.h" /* MODBUS_ACCESS_* */
+
+/*
+ * Defines & macros
+ */
+
+#define MODBUS_FILE_MAX_RECORDS 10000
+#define MODBUS_FILE_REFERENCE_TYPE 6
+/* sub-request: reference type, file number, record number, record length */
+#define MODBUS_FILE_SUB_REQUEST_LEN 7
+/* request byte count limits, sections 6.14 and 6.15 */
+#define MODBUS_FILE_READ_MIN_BYTE_COUNT 0x07
+#define MODBUS_FILE_READ_MAX_BYTE_COUNT 0xF5
+#define MODBUS_FILE_WRITE_MIN_BYTE_COUNT 0x09
+#define MODBUS_FILE_WRITE_MAX_BYTE_COUNT 0xFB
+
+/* msync() policy for mapped files */
+#define MODBUS_FILE_SYNC_NONE 0 /* left to the kernel (and modbus_file_map_sync()) */
+#define MODBUS_FILE_SYNC_ASYNC 1 /* msync(MS_ASYNC): write-back started, reply not delayed */
+#define MODBUS_FILE_SYNC_SYNC 2 /* msync(MS_SYNC): data on storage before reply is sent */
+
+/*
+ * Data types
+ */
+
+typedef struct {
+	uint16_t file_number;
+	uint8_t access; /* MODBUS_ACCESS_* */
+	uint8_t owner; /* unmapped by modbus_file_map_close() (first file number of a mapping) */
+	uint16_t record_count;
+	uint8_t *data; /* records, big-endian: record N at data + 2 * N */
+	/* memory-mapped files only (NULL otherwise): whole mapping */
+	uint8_t *map_base;
+	size_t map_size;
+	/* records written since last sync: [dirty_start, dirty_end) */
+	uint16_t dirty_start;
+	uint16_t dirty_end;
+} modbus_file_t;
+
+typedef struct modbus_file_map {
+	modbus_file_t *files; /* sorted by file number */
+	uint16_t file_count;
+	uint16_t capacity;
+	uint8_t sync_policy; /* MODBUS_FILE_SYNC_* */
+	uint16_t sync_every; /* write requests between syncs */
+	uint16_t writes_since_sync;
+	uint32_t syncs; /* statistics: msync() calls */
+} modbus_file_map_t;
+
+/*
+ * Function prototypes
+ */
+
+/* files is storage for up to capacity files (not copied, must stay valid) */
+int8_t modbus_file_map_init(modbus_file_map_t *map, modbus_file_t *files, uint16_t capacity);
+/* user memory of record_count records (2 * record_count bytes, big-endian) as file_number */
+int8_t modbus_file_map_add(modbus_file_map_t *map, uint16_t file_number, void *data, uint16_t record_count,
+		uint8_t access);
+/* maps file at path (shared, read-only unless access includes MODBUS_ACCESS_WRITE) to file_number,
+ * file_number + 1, ... (MODBUS_FILE_MAX_RECORDS records each); file size is not changed */
+int8_t modbus_file_map_add_file(modbus_file_map_t *map, uint16_t file_number, const char *path, uint8_t access);
+/* policy applied after every `every` write requests (0 or 1 = after each one) */
+void modbus_file_map_set_sync(modbus_file_map_t *map, uint8_t policy, uint16_t every);
+/* flushes records written since last sync (policy MODBUS_FILE_SYNC_ASYNC or _SYNC) */
+int8_t modbus_file_map_sync(modbus_file_map_t *map, uint8_t policy);
+/* flushes and unmaps mapped files */
+void modbus_file_map_close(modbus_file_map_t *map);
+
+/* used by function handlers */
+/* file holding records [record_number, record_number + count), or NULL */
+modbus_file_t *modbus_file_map_find(const modbus_file_map_t *map, uint16_t file_number, uint16_t record_number,
+		uint16_t count);
+/* records written into file (marks them for next sync) */
+void modbus_file_map_written(modbus_file_t *file, uint16_t record_number, uint16_t count);
+/* end of write request: applies sync policy */
+int8_t modbus_file_map_write_done(modbus_file_map_t *map);
+
+#endif /* SRC_MODBUS_FILE_RECORD_H_ */
@@ -0,0 +1,92 @@
+/*
+ * modbus_frame_ring.h
+ *
+ *  Single-producer / single-consumer lock-free ring of frame slots: hands received
+ *  frames over from the receive context (UART ISR, reader thread) to the processing
+ *  thread, so reception never waits for modbus_slave_process_frame() to finish.
+ *
+ *  Producer and consumer each own one index; slots are published with release stores
+ *  and observed with acquire loads, no locks and no read-modify-write operations are
+ *  used (works on single-core MCUs with ISR producer as well as between threads).
+ *
+ * USAGE:
+ *
+ * 1) modbus_frame_ring_init(&ring);
+ * 2) producer: hand complete frames over, e.g. directly from the RTU framer:
+ *        modbus_rtu_framer_init(&framer, 19200, modbus_frame_ring_frame_handler, &ring);
+ *    or reserve a slot, receive into it (e.g. by DMA) and commit it:
+ *        uint8_t *slot = modbus_frame_ring_reserve(&ring);
+ *        ... modbus_frame_ring_commit(&ring, len);
+ *    when ring is full, frame is dropped and counted in ring.overruns
+ * 3) consumer (main loop / processing thread):
+ *        modbus_frame_ring_drain(&ring, NULL, NULL, 0);
+ *    NULL handler passes frames to modbus_slave_process_frame(); use
+ *    modbus_slave_ctx_frame_handler with context as user_data for modbus_slave_ctx_t
+ *
+ *  Frames are stored as received, CRC included; they are expected to be checked already
+ *  (the RTU framer does that while receiving).
+ */
+
+#ifndef SRC_MODBUS_FRAME_RING_H_
+#define SRC_MODBUS_FRAME_RING_H_
+
+#include "modbus.h"
+#include "modbus_rtu_framer.h"
+
+/*
+ * Defines & macros
+ */
+
+/* number of frame slots, must be power of 2 */
+#ifndef MODBUS_FRAME_RING_SIZE
+#define MODBUS_FRAME_RING_SIZE 8
+#endif
+
+/*
+ * Data types
+ */
+
+typedef struct {
+	uint16_t len;
+	uint8_t data[MODBUS_MAX_RTU_FRAME_SIZE];
+} modbus_frame_slot_t;
+
+typedef struct {
+	/* written by producer only: next slot to be filled (free-running, masked on use) */
+	uint32_t head __attribute__((aligned(MODBUS_CACHE_LINE_SIZE)));
+	/* producer statistics */
+	uint32_t overruns; /* frames dropped because ring was full */
+	uint32_t high_water; /* highest number of frames waiting for processing */
+
+	/* written by consumer only: next slot to be processed */
+	uint32_t tail __attribute__((aligned(MODBUS_CACHE_LINE_SIZE)));
+
+	modbus_frame_slot_t slots[MODBUS_FRAME_RING_SIZE] __attribute__((aligned(MODBUS_CACHE_LINE_SIZE)));
+} modbus_frame_ring_t;
+
+/*
+ * Function prototypes
+ */
+
+void modbus_frame_ring_init(modbus_frame_ring_t *ring);
+
+/* producer side */
+/* copies frame into ring; returns MODBUS_ERROR_OUT_OF_BOUNDS (and counts overrun) when full */
+int8_t modbus_frame_ring_push(modbus_frame_ring_t *ring, const uint8_t *frame, int len);
+/* modbus_frame_handler_t for modbus_rtu_framer_t; user_data is the ring */
+int8_t modbus_frame_ring_frame_handler(const uint8_t *frame, int len, void *user_data);
+/* zero-copy variant: returns free slot buffer (MODBUS_MAX_RTU_FRAME_SIZE bytes) or NULL
+ * (overrun counted) when full; frame becomes visible to consumer after commit */
+uint8_t *modbus_frame_ring_reserve(modbus_frame_ring_t *ring);
+void modbus_frame_ring_commit(modbus_frame_ring_t *ring, int len);
+
+/* consumer side */
+/* number of frames waiting for processing */
+uint32_t modbus_frame_ring_count(const modbus_frame_ring_t *ring);
+/* passes up to max_frames (0 = all) waiting frames to handler (NULL = modbus_slave_process_frame())
+ * in one batch (producer index is read once per batch); each slot is handed back to producer as soon
+ * as its frame has been processed. Returns number of frames processed */
+int modbus_frame_ring_drain(modbus_frame_ring_t *ring, modbus_frame_handler_t handler, void *user_data,
+		int max_frames);
+
+#endif /* SRC_MODBUS_FRAME_RING_H_ */
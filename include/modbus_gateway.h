@@ -0,0 +1,198 @@
+/*
+ * modbus_gateway.h
+ *
+ *  Modbus TCP to RTU gateway (Linux, epoll): TCP masters on one side, RS-485 buses on the other
+ *
+ *  Requests received over TCP (MBAP header + PDU) are routed by unit identifier to a serial
+ *  bus, where they wait in the bus queue; each bus carries one RTU transaction at a time.
+ *  Read requests (01 - 04) identical to one already queued or on the wire (same unit id and
+ *  PDU) are not queued again: they wait for the same RTU reply, which is sent to every
+ *  waiting client with its own transaction id. Several masters polling the same registers
+ *  thus cost one bus transaction instead of one each. A read is never merged with one queued
+ *  before a write (or any other non-read request) to the same unit.
+ *
+ *  RTU timing: a request is sent only after t3.5 of silence on the bus; replies are framed
+ *  by the RTU framer (modbus_rtu_framer.h, CRC computed on the fly) and checked against the
+ *  request (modbus_reply_decode()); the response timeout counts from the end of request
+ *  transmission. After a broadcast (unit id 0) the bus stays quiet for the turnaround delay.
+ *  Requests that can't be served are answered with exceptions: 0A (no bus for unit id),
+ *  0B (no reply within timeout), 06 (bus queue full), 03 (longer than MODBUS_MAX_RTU_FRAME_SIZE).
+ *
+ *  Each bus keeps queue depth and waiting time statistics (see modbus_gateway_bus_stats_t).
+ *
+ * USAGE:
+ *
+ * 1) modbus_gateway_init(&gateway, "0.0.0.0", MODBUS_TCP_DEFAULT_PORT, 64);
+ * 2) for each bus:
+ *        modbus_gateway_bus_config_t config = MODBUS_GATEWAY_BUS_CONFIG_DEFAULT;
+ *        modbus_gateway_bus_open(&gateway, &bus, "/dev/ttyUSB0", &config);
+ *        modbus_gateway_route(&gateway, &bus, 1, 31); (unit ids 1..31 are on this bus)
+ * 3) modbus_gateway_run(&gateway); (returns after modbus_gateway_stop())
+ *    or call modbus_gateway_poll() from your own loop
+ * 4) modbus_gateway_close(&gateway);
+ */
+
+#ifndef SRC_MODBUS_GATEWAY_H_
+#define SRC_MODBUS_GATEWAY_H_
+
+#include "modbus.h"
+#include "modbus_tcp.h"
+#include "modbus_serial.h"
+#include "modbus_rtu_framer.h"
+
+/*
+ * Defines & macros
+ */
+
+#ifndef MODBUS_GATEWAY_MAX_BUSES
+#define MODBUS_GATEWAY_MAX_BUSES 8
+#endif
+/* requests queued per bus (the one on the wire included) */
+#ifndef MODBUS_GATEWAY_QUEUE_SIZE
+#define MODBUS_GATEWAY_QUEUE_SIZE 32
+#endif
+/* clients served by one RTU transaction */
+#ifndef MODBUS_GATEWAY_MAX_WAITERS
+#define MODBUS_GATEWAY_MAX_WAITERS 8
+#endif
+/* requests of one connection waiting for reply; reading pauses when reached */
+#ifndef MODBUS_GATEWAY_MAX_PENDING
+#define MODBUS_GATEWAY_MAX_PENDING 8
+#endif
+#define MODBUS_GATEWAY_RX_BUFFER_SIZE 1024
+/* room for a reply to every pending request */
+#define MODBUS_GATEWAY_TX_BUFFER_SIZE (MODBUS_GATEWAY_MAX_PENDING * MODBUS_TCP_MAX_ADU_SIZE)
+#define MODBUS_GATEWAY_MAX_EVENTS 64 /* epoll events handled per poll */
+
+/* 19200 8E1, 1 s response timeout, 100 ms turnaround delay after broadcast */
+#define MODBUS_GATEWAY_BUS_CONFIG_DEFAULT { .serial = MODBUS_SERIAL_CONFIG_DEFAULT, \
+		.response_timeout_ms = 1000, .turnaround_ms = 100, .merge_reads = 1 }
+
+/*
+ * Data types
+ */
+
+typedef struct {
+	modbus_serial_config_t serial;
+	uint32_t response_timeout_ms; /* from end of request transmission to first byte of reply */
+	uint32_t turnaround_ms; /* silence after broadcast, so slaves can process it */
+	uint8_t merge_reads; /* identical read requests share one RTU transaction */
+} modbus_gateway_bus_config_t;
+
+/* client waiting for reply */
+typedef struct {
+	uint32_t connection; /* index in gateway->connections */
+	uint32_t generation; /* of the connection, stale when it was closed meanwhile */
+	uint8_t transaction_id[2];
+} modbus_gateway_waiter_t;
+
+typedef struct {
+	uint64_t enqueued_us;
+	uint16_t len; /* RTU frame, CRC included */
+	uint8_t waiter_count;
+	modbus_gateway_waiter_t waiters[MODBUS_GATEWAY_MAX_WAITERS];
+	uint8_t frame[MODBUS_MAX_RTU_FRAME_SIZE];
+} modbus_gateway_request_t;
+
+typedef struct {
+	uint64_t transactions; /* requests sent on the bus */
+	uint64_t merged; /* client requests that joined a queued or running transaction */
+	uint64_t replies; /* valid replies, exceptions included */
+	uint64_t exceptions;
+	uint64_t timeouts;
+	uint64_t tx_errors; /* request could not be written (counted as timeout as well) */
+	uint64_t invalid_replies; /* not matching the request (CRC errors are in framer statistics) */
+	uint64_t queue_full; /* requests rejected with exception 06 */
+	uint64_t dropped; /* requests not sent, all their clients disconnected */
+	uint16_t queue_depth_max;
+	/* waiting time: from arrival of the request to start of its transmission */
+	uint64_t wait_total_us; /* divide by transactions for mean */
+	uint32_t wait_max_us;
+	/* response time: from end of transmission to the reply frame */
+	uint64_t response_total_us; /* divide by replies for mean */
+	uint32_t response_max_us;
+} modbus_gateway_bus_stats_t;
+
+struct modbus_gateway;
+
+typedef struct {
+	struct modbus_gateway *gateway;
+	modbus_gateway_bus_config_t config;
+	int fd;
+	int timer_fd;
+	uint8_t index; /* in gateway->buses */
+	uint8_t state; /* idle, waiting for reply, turnaround */
+	uint8_t framing; /* inside framer feed / poll, next request is sent after it returns */
+	uint64_t deadline_us; /* of reply / turnaround */
+	uint64_t quiet_us; /* bus is silent long enough for next request */
+	uint64_t sent_us; /* end of transmission of the request on the wire */
+	/* queue (ring); head is the request on the wire */
+	uint16_t head;
+	uint16_t count; /* current queue depth */
+	modbus_gateway_request_t queue[MODBUS_GATEWAY_QUEUE_SIZE];
+	/* reply frames; frame statistics are in framer (frames_ok, frames_crc_error, ...) */
+	modbus_rtu_framer_t framer;
+	modbus_gateway_bus_stats_t stats;
+} modbus_gateway_bus_t;
+
+typedef struct {
+	int fd;
+	uint32_t generation;
+	uint32_t events; /* epoll events currently requested */
+	uint16_t rx_len;
+	uint16_t tx_len; /* bytes waiting to be sent */
+	uint16_t tx_pos; /* bytes of tx_buffer already sent */
+	uint8_t pending; /* requests waiting for reply */
+	uint8_t rx_buffer[MODBUS_GATEWAY_RX_BUFFER_SIZE];
+	uint8_t tx_buffer[MODBUS_GATEWAY_TX_BUFFER_SIZE];
+} modbus_gateway_connection_t;
+
+typedef struct {
+	uint64_t connections_accepted;
+	uint64_t connections_rejected; /* connection limit reached */
+	uint64_t connections_closed;
+	uint64_t requests;
+	uint64_t replies; /* exceptions made by the gateway included */
+	uint64_t no_route; /* requests answered with exception 0A */
+	uint64_t too_long; /* requests longer than an RTU frame, answered with exception 03 */
+	uint64_t protocol_errors; /* invalid MBAP header, connection closed */
+} modbus_gateway_stats_t;
+
+typedef struct modbus_gateway {
+	int listen_fd;
+	int epoll_fd;
+	int wake_fd; /* eventfd used by modbus_gateway_stop() */
+	int running;
+	uint32_t max_connections;
+	uint32_t active_connections;
+	modbus_gateway_connection_t *connections;
+	uint8_t bus_count;
+	modbus_gateway_bus_t *buses[MODBUS_GATEWAY_MAX_BUSES];
+	uint8_t routes[256]; /* unit id -> bus index + 1, 0 = no route */
+	modbus_gateway_stats_t stats;
+} modbus_gateway_t;
+
+/*
+ * Function prototypes
+ */
+
+/* bind_address is IPv4 address in dotted notation (NULL means any); port 0 picks free port */
+int8_t modbus_gateway_init(modbus_gateway_t *gateway, const char *bind_address, uint16_t port,
+		uint32_t max_connections);
+/* port the gateway listens on */
+uint16_t modbus_gateway_port(const modbus_gateway_t *gateway);
+/* opens and configures tty device; bus must stay valid until modbus_gateway_close() */
+int8_t modbus_gateway_bus_open(modbus_gateway_t *gateway, modbus_gateway_bus_t *bus, const char *path,
+		const modbus_gateway_bus_config_t *config);
+/* requests for unit ids first..last go to bus (0 = broadcast on that bus) */
+int8_t modbus_gateway_route(modbus_gateway_t *gateway, modbus_gateway_bus_t *bus, uint8_t first, uint8_t last);
+/* handles events that are ready, waiting at most timeout_ms (-1 = forever) */
+int8_t modbus_gateway_poll(modbus_gateway_t *gateway, int timeout_ms);
+/* serves connections and buses until modbus_gateway_stop() is called */
+int8_t modbus_gateway_run(modbus_gateway_t *gateway);
+/* may be called from any thread or signal handler */
+void modbus_gateway_stop(modbus_gateway_t *gateway);
+/* closes all connections and buses and releases resources */
+void modbus_gateway_close(modbus_gateway_t *gateway);
+
+#endif /* SRC_MODBUS_GATEWAY_H_ */
@@ -0,0 +1,194 @@
+/*
+ * modbus_master.h
+ *
+ *  Modbus master (client) over RTU or TCP framing, and a poll scheduler
+ *
+ *  The master builds request ADUs (RTU: address + PDU + CRC, TCP: MBAP header + PDU),
+ *  hands them to a user-supplied transfer function and checks the reply: framing (CRC or
+ *  MBAP header), address / unit id, function code, exception, length. The transport is
+ *  not part of the library: the transfer function writes the request and reads one reply
+ *  (RTU: until t3.5 silence or timeout, TCP: MBAP length), like the slave's transmit function.
+ *
+ *  Replies are checked by modbus_reply_decode() (also usable without modbus_master_t), which
+ *  returns a view over the reply frame: no data are copied, registers are byte-swapped only
+ *  when read through the modbus_reply_*() accessors. Each kind of mismatch has its own error
+ *  code (MODBUS_ERROR_CRC, _ADDRESS_MISMATCH, _FUNCTION_MISMATCH, _LENGTH_MISMATCH, ...).
+ *
+ *  The poll scheduler reads tags (slave, table, address, width, period) with as few read
+ *  requests (01 - 04) as possible: tags of one slave, table and period are merged into one
+ *  request when the gap between them is at most `gap` unused registers / bits and the
+ *  request stays within the read limits (MODBUS_MAX_REGISTERS, MODBUS_MAX_READ_BITS).
+ *  Requests of one period are spread evenly over it, so the bus carries a steady load
+ *  instead of bursts; requests that are due are sent back to back, earliest deadline
+ *  first, and the caller sleeps only until the next one is due.
+ *
+ * USAGE:
+ *
+ *  modbus_master_init(&master, MODBUS_MASTER_RTU, my_transfer, &port);
+ *  modbus_master_read(&master, 1, MODBUS_READ_HOLDING_REGISTERS, 0, 10, registers);
+ *
+ *  modbus_reply_t reply; (valid until the next request)
+ *  if (modbus_master_read_reply(&master, 1, MODBUS_READ_INPUT_REGISTERS, 0, 10, &reply) == MODBUS_OK) {
+ *      float flow = modbus_reply_float(&reply, 4, MODBUS_ORDER_ABCD);
+ *  }
+ *
+ *  static uint16_t voltage[2], power[2];
+ *  static modbus_poll_tag_t tags[] = {
+ *      { .slave = 1, .table = MODBUS_TABLE_INPUT_REGISTERS, .address = 0, .width = 2, .period_ms = 100, .value = voltage },
+ *      { .slave = 1, .table = MODBUS_TABLE_INPUT_REGISTERS, .address = 6, .width = 2, .period_ms = 100, .value = power },
+ *  };
+ *  static modbus_poll_request_t requests[8];
+ *
+ *  modbus_poll_init(&poll, tags, 2, requests, 8, 8);
+ *  modbus_poll_plan(&poll, now_ms()); (one request: registers 0-7)
+ *  for (;;) {
+ *      sleep_ms(modbus_poll_run(&poll, &master, now_ms()));
+ *  }
+ */
+
+#ifndef SRC_MODBUS_MASTER_H_
+#define SRC_MODBUS_MASTER_H_
+
+#include "modbus.h"
+#include "modbus_register_map.h"
+#include "modbus_endian.h"
+
+/*
+ * Defines & macros
+ */
+
+#define MODBUS_MASTER_RTU 0
+#define MODBUS_MASTER_TCP 1
+/* largest ADU: MBAP header (7 B) + PDU (253 B); RTU frames are at most MODBUS_MAX_RTU_FRAME_SIZE */
+#define MODBUS_MASTER_ADU_SIZE 260
+#define MODBUS_MASTER_MBAP_HEADER_LEN 7
+/* write multiple registers request: address, function code, address, quantity, byte count, data, CRC */
+#define MODBUS_MASTER_MAX_WRITE_REGISTERS MODBUS_MIN(123, (MODBUS_MAX_RTU_FRAME_SIZE - 9) / 2)
+
+/*
+ * Data types
+ */
+
+typedef struct modbus_master modbus_master_t;
+
+/* sends request (len bytes) and receives one reply into reply (MODBUS_MASTER_ADU_SIZE bytes);
+ * returns MODBUS_OK with reply_len set, or MODBUS_ERROR_TIMEOUT when no reply came.
+ * For broadcasts (RTU address 0) no reply is expected, reply_len may be left 0 */
+typedef int8_t (*modbus_master_transfer_t)(modbus_master_t *master, const uint8_t *request, uint16_t len,
+		uint8_t *reply, uint16_t *reply_len);
+
+typedef struct {
+	uint64_t requests;
+	uint64_t replies; /* valid replies, exceptions included */
+	uint64_t exceptions;
+	uint64_t timeouts;
+	uint64_t errors; /* invalid replies, see modbus_reply_decode() */
+} modbus_master_stats_t;
+
+struct modbus_master {
+	modbus_master_transfer_t transfer;
+	void *user_data; /* not used by library */
+	uint8_t mode; /* MODBUS_MASTER_RTU / _TCP */
+	uint8_t exception; /* exception code of last reply returning MODBUS_ERROR_EXCEPTION */
+	uint16_t transaction_id; /* TCP: id of last request */
+	modbus_master_stats_t stats;
+	uint8_t request[MODBUS_MASTER_ADU_SIZE];
+	uint8_t reply[MODBUS_MASTER_ADU_SIZE];
+};
+
+/* view over a valid reply (modbus_reply_decode()); points into the reply frame */
+typedef struct {
+	const uint8_t *pdu; /* reply PDU: function code + data */
+	const uint8_t *data; /* read: registers (big-endian) / packed bits; write single register: value */
+	uint16_t pdu_len;
+	uint16_t address; /* first register / bit, from request */
+	uint16_t count; /* registers / bits read or written; other functions: bytes of data */
+	uint8_t slave;
+	uint8_t function_code;
+	uint8_t exception; /* set when MODBUS_ERROR_EXCEPTION is returned */
+} modbus_reply_t;
+
+/* value polled by the scheduler */
+typedef struct {
+	uint8_t slave;
+	uint8_t table; /* modbus_table_t */
+	uint16_t address; /* first register / bit (0-based, as on the wire) */
+	uint16_t width; /* number of registers / bits */
+	uint32_t period_ms; /* > 0 */
+	void *value; /* uint16_t[width] in host order, or uint8_t[(width + 7) / 8] packed bits */
+	/* updated by the scheduler */
+	int8_t result; /* of last poll: MODBUS_OK, MODBUS_ERROR_EXCEPTION (see exception), ... */
+	uint8_t exception;
+	uint32_t updated_ms; /* time value was last read successfully */
+} modbus_poll_tag_t;
+
+/* read request planned by modbus_poll_plan() */
+typedef struct {
+	uint8_t slave;
+	uint8_t function_code;
+	uint16_t address;
+	uint16_t count;
+	uint16_t first_tag; /* tags of this request: tags[first_tag] ... tags[first_tag + tag_count - 1] */
+	uint16_t tag_count;
+	uint32_t period_ms;
+	uint32_t due_ms;
+} modbus_poll_request_t;
+
+typedef struct {
+	modbus_poll_tag_t *tags;
+	modbus_poll_request_t *requests;
+	uint16_t tag_count;
+	uint16_t request_capacity;
+	uint16_t request_count;
+	uint16_t gap; /* largest number of unused registers / bits read to merge two tags */
+} modbus_poll_t;
+
+/*
+ * Function prototypes
+ */
+
+int8_t modbus_master_init(modbus_master_t *master, uint8_t mode, modbus_master_transfer_t transfer, void *user_data);
+/* sends request PDU (function code + data) to slave and checks the reply; on MODBUS_OK,
+ * reply_pdu points to the reply PDU (function code + data) in master->reply, valid until the
+ * next request. Exception replies return MODBUS_ERROR_EXCEPTION, code in master->exception */
+int8_t modbus_master_transaction(modbus_master_t *master, uint8_t slave, const uint8_t *pdu, uint16_t pdu_len,
+		const uint8_t **reply_pdu, uint16_t *reply_pdu_len);
+/* read request, reply is left in master->reply and decoded into reply (valid until the next request) */
+int8_t modbus_master_read_reply(modbus_master_t *master, uint8_t slave, uint8_t function_code, uint16_t address,
+		uint16_t count, modbus_reply_t *reply);
+/* read coils, discrete inputs (dst: packed bits), holding or input registers (dst: host order) */
+int8_t modbus_master_read(modbus_master_t *master, uint8_t slave, uint8_t function_code, uint16_t address,
+		uint16_t count, void *dst);
+int8_t modbus_master_write_register(modbus_master_t *master, uint8_t slave, uint16_t address, uint16_t value);
+int8_t modbus_master_write_registers(modbus_master_t *master, uint8_t slave, uint16_t address, uint16_t count,
+		const uint16_t *values);
+int8_t modbus_master_write_coil(modbus_master_t *master, uint8_t slave, uint16_t address, uint8_t value);
+
+/* checks reply ADU against the request ADU it answers (mode MODBUS_MASTER_RTU / _TCP); MODBUS_OK
+ * or MODBUS_ERROR_EXCEPTION (code in view->exception) fill view. MODBUS_ERROR means an invalid request */
+int8_t modbus_reply_decode(uint8_t mode, const uint8_t *request, uint16_t request_len, const uint8_t *reply,
+		uint16_t reply_len, modbus_reply_t *view);
+/* data of a read reply; index counts from the first register / bit read, order is MODBUS_ORDER_* */
+uint8_t modbus_reply_bit(const modbus_reply_t *reply, uint16_t index);
+uint16_t modbus_reply_register(const modbus_reply_t *reply, uint16_t index);
+void modbus_reply_registers(const modbus_reply_t *reply, uint16_t index, uint16_t count, uint16_t *dst);
+uint32_t modbus_reply_uint32(const modbus_reply_t *reply, uint16_t index, uint8_t order);
+int32_t modbus_reply_int32(const modbus_reply_t *reply, uint16_t index, uint8_t order);
+float modbus_reply_float(const modbus_reply_t *reply, uint16_t index, uint8_t order);
+
+/* tags are sorted in place by modbus_poll_plan(); requests is storage for up to capacity requests */
+int8_t modbus_poll_init(modbus_poll_t *poll, modbus_poll_tag_t *tags, uint16_t tag_count,
+		modbus_poll_request_t *requests, uint16_t capacity, uint16_t gap);
+/* merges tags into requests, first ones are due at now_ms; MODBUS_ERROR if a tag is invalid
+ * or requests don't fit into capacity. Call again after changing tags */
+int8_t modbus_poll_plan(modbus_poll_t *poll, uint32_t now_ms);
+/* request due at now_ms with the earliest deadline, or NULL; wait_ms (optional) is then time
+ * until the next request is due */
+modbus_poll_request_t *modbus_poll_next(modbus_poll_t *poll, uint32_t now_ms, uint32_t *wait_ms);
+/* reads request through master, updates its tags and schedules it for the next period */
+int8_t modbus_poll_execute(modbus_poll_t *poll, modbus_master_t *master, modbus_poll_request_t *request,
+		uint32_t now_ms);
+/* executes all requests due at now_ms, returns time until the next one is due */
+uint32_t modbus_poll_run(modbus_poll_t *poll, modbus_master_t *master, uint32_t now_ms);
+
+#endif /* SRC_MODBUS_MASTER_H_ */
@@ -0,0 +1,106 @@
+/*
+ * modbus_register_map.h
+ *
+ *  Declarative register map: contiguous ranges of coils, discrete inputs, input
+ *  registers and holding registers backed by user memory. Requests that fall
+ *  entirely into one mapped range are served directly from/to that memory
+ *  (block copy, O(log n) lookup); everything else goes to the slave callback.
+ *
+ *  Register data are kept in host byte order (uint16_t[]), bits are packed
+ *  LSB first (bit 0 of byte 0 is the first coil of the range).
+ *
+ * USAGE:
+ *
+ *  static uint16_t setpoints[100];
+ *  static modbus_register_range_t ranges[8];
+ *  static modbus_register_map_t map;
+ *
+ *  modbus_register_map_init(&map, ranges, 8);
+ *  modbus_register_range_t range = {
+ *      .table = MODBUS_TABLE_HOLDING_REGISTERS, .start = 0, .count = 100,
+ *      .data = setpoints, .access = MODBUS_ACCESS_READ_WRITE,
+ *  };
+ *  modbus_register_map_add(&map, &range);
+ *  modbus_slave_ctx_set_register_map(&ctx, &map);
+ *
+ *  Register ranges may be backed by a shadow register bank (modbus_shadow.h) instead of
+ *  plain memory: set range.shadow (data is not used), range register start + i is bank
+ *  register i. Reads then always return a consistent snapshot while other threads update
+ *  the bank.
+ *
+ *  Hooks are optional: read_hook is called before data are read from the range
+ *  (e.g. to refresh them), write_hook after data were written into the range.
+ *  Non-OK return value is handled the same way as slave callback return value.
+ */
+
+#ifndef SRC_MODBUS_REGISTER_MAP_H_
+#define SRC_MODBUS_REGISTER_MAP_H_
+
+#include "modbus.h"
+#include "modbus_shadow.h"
+
+/*
+ * Defines & macros
+ */
+
+#define MODBUS_ACCESS_READ 0x01
+#define MODBUS_ACCESS_WRITE 0x02
+#define MODBUS_ACCESS_READ_WRITE (MODBUS_ACCESS_READ | MODBUS_ACCESS_WRITE)
+
+/*
+ * Data types
+ */
+
+typedef enum {
+	MODBUS_TABLE_COILS = 0,
+	MODBUS_TABLE_DISCRETE_INPUTS,
+	MODBUS_TABLE_INPUT_REGISTERS,
+	MODBUS_TABLE_HOLDING_REGISTERS,
+	MODBUS_TABLE_COUNT
+} modbus_table_t;
+
+typedef struct modbus_register_range modbus_register_range_t;
+
+typedef int8_t (*modbus_range_hook_t)(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction,
+		const modbus_register_range_t *range);
+
+struct modbus_register_range {
+	uint8_t table; /* modbus_table_t */
+	uint8_t access; /* MODBUS_ACCESS_*; input registers and discrete inputs are never writable */
+	uint16_t start; /* first address (0-based, as on the wire) */
+	uint16_t count; /* number of registers / bits */
+	void *data; /* uint16_t[count] for registers, uint8_t[(count + 7) / 8] for bits */
+	modbus_range_hook_t read_hook;
+	modbus_range_hook_t write_hook;
+	void *user_data;
+	modbus_shadow_bank_t *shadow; /* registers only: served from shadow bank instead of data */
+};
+
+typedef struct modbus_register_map {
+	modbus_register_range_t *ranges; /* sorted by table and start address */
+	uint16_t range_count;
+	uint16_t capacity;
+	/* ranges of each table: ranges[table_first[t]] ... ranges[table_first[t] + table_count[t] - 1] */
+	uint16_t table_first[MODBUS_TABLE_COUNT];
+	uint16_t table_count[MODBUS_TABLE_COUNT];
+} modbus_register_map_t;
+
+/*
+ * Function prototypes
+ */
+
+/* ranges is storage for up to capacity ranges (not copied, must stay valid) */
+int8_t modbus_register_map_init(modbus_register_map_t *map, modbus_register_range_t *ranges, uint16_t capacity);
+/* range is copied into the map; overlapping ranges are rejected */
+int8_t modbus_register_map_add(modbus_register_map_t *map, const modbus_register_range_t *range);
+/* range containing [address, address + count), or NULL */
+const modbus_register_range_t *modbus_register_map_find(const modbus_register_map_t *map, uint8_t table,
+		uint16_t address, uint16_t count);
+/* table accessed by given function code, or MODBUS_TABLE_COUNT if none */
+uint8_t modbus_register_map_table(uint8_t function_code);
+/* serves transaction from the map; MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED if not mapped
+ * (caller should fall back to the callback) */
+int8_t modbus_register_map_serve(modbus_slave_ctx_t *ctx, const modbus_register_map_t *map,
+		modbus_transaction_t *transaction);
+
+#endif /* SRC_MODBUS_REGISTER_MAP_H_ */
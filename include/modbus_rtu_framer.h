@@ -0,0 +1,95 @@
+/*
+ * modbus_rtu_framer.h
+ *
+ *  Byte-stream RTU framer: splits received bytes into frames according to
+ *  RTU timing and computes CRC while the frame is being received.
+ *
+ *  See section 2.5.1.1 (MODBUS Message RTU Framing) in
+ *  "MODBUS over Serial Line: Specification and Implementation Guide":
+ *      - pause longer than t1.5 inside frame makes the frame invalid
+ *      - pause of at least t3.5 ends the frame
+ *  For baud rates above 19200 fixed values t1.5 = 750 us and t3.5 = 1750 us are used.
+ *
+ * USAGE:
+ *
+ * 1) modbus_rtu_framer_init(&framer, 19200, NULL, NULL);
+ *    (NULL handler passes frames to modbus_slave_process_frame())
+ * 2) on every received byte or chunk of bytes (e.g. in UART ISR / DMA callback):
+ *        modbus_rtu_framer_feed(&framer, data, len, timestamp_us);
+ *    timestamp is the time when the last byte of the chunk was received
+ * 3) periodically or when timer set to modbus_rtu_framer_deadline() fires:
+ *        modbus_rtu_framer_poll(&framer, now_us);
+ *    this closes the frame after t3.5 of silence and hands it to the handler
+ *
+ *  Timestamps are free-running 32-bit microsecond counters (wrap-around is handled).
+ */
+
+#ifndef SRC_MODBUS_RTU_FRAMER_H_
+#define SRC_MODBUS_RTU_FRAMER_H_
+
+#include "modbus.h"
+
+/*
+ * Defines & macros
+ */
+
+#define MODBUS_RTU_BITS_PER_CHAR 11 /* start + 8 data + parity/stop + stop */
+#define MODBUS_RTU_FIXED_TIMING_BAUDRATE 19200 /* above this, fixed t1.5/t3.5 are used */
+#define MODBUS_RTU_FIXED_T15_US 750
+#define MODBUS_RTU_FIXED_T35_US 1750
+
+/*
+ * Data types
+ */
+
+/* called with complete frame whose CRC has been validated (CRC bytes are included in len) */
+typedef int8_t (*modbus_frame_handler_t)(const uint8_t *frame, int len, void *user_data);
+
+typedef enum {
+	MODBUS_RTU_STATE_IDLE = 0, /* waiting for first byte of frame */
+	MODBUS_RTU_STATE_RECEPTION, /* receiving frame */
+	MODBUS_RTU_STATE_CONTROL_AND_WAITING /* t1.5 expired, waiting for t3.5 */
+} modbus_rtu_state_t;
+
+typedef struct {
+	/* configuration */
+	uint32_t char_us; /* duration of one character */
+	uint32_t t15_us;
+	uint32_t t35_us;
+	modbus_frame_handler_t handler;
+	void *user_data;
+
+	/* reception state */
+	uint32_t last_byte_us; /* timestamp of last received byte */
+	uint16_t crc; /* running CRC16 of received bytes */
+	uint16_t len;
+	uint8_t state; /* modbus_rtu_state_t */
+	uint8_t frame_nok; /* frame has to be discarded (t1.5 violation, overflow) */
+
+	/* statistics */
+	uint32_t frames_ok;
+	uint32_t frames_crc_error;
+	uint32_t frames_invalid;
+
+	uint8_t buffer[MODBUS_MAX_RTU_FRAME_SIZE];
+} modbus_rtu_framer_t;
+
+/*
+ * Function prototypes
+ */
+
+int8_t modbus_rtu_framer_init(modbus_rtu_framer_t *framer, uint32_t baudrate,
+		modbus_frame_handler_t handler, void *user_data);
+/* discard partially received frame */
+void modbus_rtu_framer_reset(modbus_rtu_framer_t *framer);
+/* feed received bytes; may close previous frame if enough silence preceded the chunk;
+ * returns MODBUS_FRAME_INCOMPLETE or the result of closing the previous frame */
+int8_t modbus_rtu_framer_feed(modbus_rtu_framer_t *framer, const uint8_t *data, int len, uint32_t timestamp_us);
+/* closes frame if t3.5 passed since last byte; returns MODBUS_FRAME_INCOMPLETE if there
+ * was nothing to close, MODBUS_ERROR_CRC / MODBUS_ERROR_FRAME_INVALID for discarded frames
+ * and handler return value otherwise */
+int8_t modbus_rtu_framer_poll(modbus_rtu_framer_t *framer, uint32_t now_us);
+/* time at which modbus_rtu_framer_poll() should be called next (valid only when not idle) */
+uint32_t modbus_rtu_framer_deadline(const modbus_rtu_framer_t *framer);
+
+#endif /* SRC_MODBUS_RTU_FRAMER_H_ */
@@ -0,0 +1,133 @@
+/*
+ * modbus_serial.h
+ *
+ *  Modbus RTU over Linux serial ports (ttyS, ttyUSB, ttyAMA...): termios setup,
+ *  RS-485 driver-enable control, frame detection and replies, for any number of
+ *  ports served from one thread (epoll).
+ *
+ *  Received bytes are timestamped and fed to the RTU framer (modbus_rtu_framer.h),
+ *  which computes CRC on the fly; t3.5 silence after the last byte is detected with
+ *  a timerfd armed at modbus_rtu_framer_deadline(). Requests are processed by
+ *  modbus_slave_ctx_process_request() and replies are written by the backend, so the
+ *  transmit function of the slave context is not used. Deferred requests (callback
+ *  returned MODBUS_PENDING) are answered with modbus_serial_port_complete(), not
+ *  modbus_slave_ctx_complete().
+ *
+ *  Bytes are read in chunks as the kernel delivers them, so gaps inside a frame are not
+ *  visible to user space; the t1.5 check is therefore not done (only t3.5 ends a frame).
+ *
+ *  RS-485: with config.rs485 set, the kernel driver toggles RTS (driver enable) around
+ *  transmission (TIOCSRS485), so turnaround does not depend on scheduling of this thread.
+ *
+ * USAGE:
+ *
+ * 1) initialize slave context(s) (modbus_slave_ctx_init()); transmit function is not used
+ * 2) modbus_serial_init(&serial);
+ * 3) for each port:
+ *        modbus_serial_config_t config = MODBUS_SERIAL_CONFIG_DEFAULT;
+ *        modbus_serial_port_open(&serial, &port, &ctx, "/dev/ttyUSB0", &config);
+ * 4) modbus_serial_run(&serial); (returns after modbus_serial_stop())
+ *    or call modbus_serial_poll() from your own loop
+ * 5) modbus_serial_close(&serial);
+ */
+
+#ifndef SRC_MODBUS_SERIAL_H_
+#define SRC_MODBUS_SERIAL_H_
+
+#include "modbus.h"
+#include "modbus_rtu_framer.h"
+
+/*
+ * Defines & macros
+ */
+
+#ifndef MODBUS_SERIAL_MAX_PORTS
+#define MODBUS_SERIAL_MAX_PORTS 32
+#endif
+#define MODBUS_SERIAL_MAX_EVENTS 64 /* epoll events handled per poll */
+#define MODBUS_SERIAL_READ_SIZE 512 /* bytes read from port at once */
+
+/* 19200 8E1, as recommended by "MODBUS over Serial Line", section 2.5.1 */
+#define MODBUS_SERIAL_CONFIG_DEFAULT { .baudrate = 19200, .parity = 'E', .stop_bits = 1 }
+
+/*
+ * Data types
+ */
+
+typedef struct {
+	uint32_t baudrate; /* standard rates 1200 ... 4000000 */
+	char parity; /* 'N', 'E' or 'O' */
+	uint8_t stop_bits; /* 1 or 2 (2 is required by the standard with no parity) */
+	uint8_t rs485; /* let the driver control RS-485 transceiver (TIOCSRS485) */
+	uint8_t rs485_rts_active_low; /* driver enable is active low */
+	uint32_t rs485_delay_before_ms; /* delay between driver enable and first TX byte */
+	uint32_t rs485_delay_after_ms; /* delay between last TX byte and driver disable */
+	/* end-of-frame silence; 0 = t3.5 for baudrate. USB adapters deliver bytes in bursts
+	 * (e.g. every 1-16 ms, see latency_timer), use a value above their latency */
+	uint32_t silence_us;
+} modbus_serial_config_t;
+
+typedef struct {
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t replies;
+	uint64_t tx_errors; /* reply could not be written completely */
+	/* turnaround: from the last byte of request being read to the first byte of reply
+	 * being handed to the driver; includes t3.5 silence the slave has to wait anyway */
+	uint32_t turnaround_last_us;
+	uint32_t turnaround_min_us;
+	uint32_t turnaround_max_us;
+	uint64_t turnaround_total_us; /* divide by replies for mean */
+} modbus_serial_stats_t;
+
+struct modbus_serial;
+
+typedef struct {
+	struct modbus_serial *serial;
+	modbus_slave_ctx_t *ctx;
+	int fd;
+	int timer_fd;
+	uint8_t index; /* in serial->ports */
+	/* request frames; frame statistics are in framer (frames_ok, frames_crc_error, ...) */
+	modbus_rtu_framer_t framer;
+	uint16_t tx_len; /* bytes waiting to be written */
+	uint16_t tx_pos;
+	modbus_serial_stats_t stats;
+	uint8_t tx_buffer[MODBUS_MAX_RTU_FRAME_SIZE];
+} modbus_serial_port_t;
+
+typedef struct modbus_serial {
+	int epoll_fd;
+	int wake_fd; /* eventfd used by modbus_serial_stop() */
+	int running;
+	uint8_t port_count;
+	modbus_serial_port_t *ports[MODBUS_SERIAL_MAX_PORTS];
+} modbus_serial_t;
+
+/*
+ * Function prototypes
+ */
+
+/* raw 8-bit mode, no flow control, non-blocking reads; also used by modbus_gateway.h */
+int8_t modbus_serial_configure(int fd, const modbus_serial_config_t *config);
+int8_t modbus_serial_init(modbus_serial_t *serial);
+/* opens and configures tty device and serves ctx on it; port must stay valid until
+ * modbus_serial_close() */
+int8_t modbus_serial_port_open(modbus_serial_t *serial, modbus_serial_port_t *port, modbus_slave_ctx_t *ctx,
+		const char *path, const modbus_serial_config_t *config);
+/* completes transaction deferred by callback of ctx (port's context or its virtual slave) and
+ * writes the reply, see modbus_slave_ctx_complete(); call from the thread serving the port.
+ * Returns MODBUS_ERROR if transaction is not pending or previous reply is still being written
+ * (transaction stays pending then, try again later) */
+int8_t modbus_serial_port_complete(modbus_serial_port_t *port, modbus_slave_ctx_t *ctx,
+		modbus_transaction_t *transaction, int8_t result);
+/* handles events that are ready, waiting at most timeout_ms (-1 = forever) */
+int8_t modbus_serial_poll(modbus_serial_t *serial, int timeout_ms);
+/* serves ports until modbus_serial_stop() is called */
+int8_t modbus_serial_run(modbus_serial_t *serial);
+/* may be called from any thread or signal handler */
+void modbus_serial_stop(modbus_serial_t *serial);
+/* closes all ports and releases resources */
+void modbus_serial_close(modbus_serial_t *serial);
+
+#endif /* SRC_MODBUS_SERIAL_H_ */
@@ -0,0 +1,79 @@
+/*
+ * modbus_shadow.h
+ *
+ *  Shadow register bank: registers shared between an application thread (e.g. sensor
+ *  acquisition) and the thread serving Modbus, protected by a sequence lock. Readers
+ *  never block and always get a consistent snapshot of any range (e.g. 32/64-bit values
+ *  spanning several registers are never torn); a reader that overlapped with a write
+ *  simply copies again. Writers are serialized by the sequence counter itself (short
+ *  spin while another writer is inside), so the bank may be written from both sides.
+ *
+ *  Registers are kept in host byte order, as in the register map.
+ *
+ *  Readers wait while a write is in progress, so they must not preempt the writer on the
+ *  same core (e.g. Modbus served from UART ISR, bank written from main loop): write with
+ *  that interrupt disabled there, the write is only a few register stores.
+ *
+ * USAGE:
+ *
+ *  static uint16_t measurements[64];
+ *  static modbus_shadow_bank_t bank;
+ *  modbus_shadow_init(&bank, measurements, 64);
+ *
+ *  acquisition thread:
+ *      modbus_shadow_write(&bank, 10, words, 4);
+ *  or, for several values at once:
+ *      modbus_shadow_write_begin(&bank);
+ *      modbus_shadow_set(&bank, 10, hi); modbus_shadow_set(&bank, 11, lo); ...
+ *      modbus_shadow_write_end(&bank);
+ *  (modbus_shadow_get() reads a register inside such a block, e.g. to increment a counter)
+ *
+ *  Modbus side: map the bank into the register map (range.shadow = &bank, data unused;
+ *  range register start + i is bank register i), or read it from the slave callback:
+ *      modbus_shadow_read(&bank, transaction->register_address - 1000,
+ *              transaction->input_registers, transaction->register_count);
+ */
+
+#ifndef SRC_MODBUS_SHADOW_H_
+#define SRC_MODBUS_SHADOW_H_
+
+#include "modbus.h"
+
+/*
+ * Data types
+ */
+
+typedef struct modbus_shadow_bank {
+	/* odd while a writer is updating registers; incremented by 2 per write */
+	uint32_t sequence;
+	uint16_t count;
+	uint16_t *registers; /* count registers, host byte order */
+	/* statistics: reads that overlapped with a write and were repeated */
+	uint32_t read_retries;
+} modbus_shadow_bank_t;
+
+/*
+ * Function prototypes
+ */
+
+/* registers is storage for count registers (initial values are kept) */
+int8_t modbus_shadow_init(modbus_shadow_bank_t *bank, uint16_t *registers, uint16_t count);
+
+/* writer side */
+/* registers set between begin and end are published together */
+void modbus_shadow_write_begin(modbus_shadow_bank_t *bank);
+void modbus_shadow_write_end(modbus_shadow_bank_t *bank);
+/* only between modbus_shadow_write_begin() and modbus_shadow_write_end(); index is not checked */
+void modbus_shadow_set(modbus_shadow_bank_t *bank, uint16_t index, uint16_t value);
+/* current value for read-modify-write between begin and end; index is not checked */
+uint16_t modbus_shadow_get(modbus_shadow_bank_t *bank, uint16_t index);
+/* copies count registers to bank registers index ... index + count - 1 in one update */
+int8_t modbus_shadow_write(modbus_shadow_bank_t *bank, uint16_t index, const uint16_t *values, uint16_t count);
+
+/* reader side (any thread, never blocks writers) */
+/* consistent copy of bank registers index ... index + count - 1, host byte order */
+int8_t modbus_shadow_read(modbus_shadow_bank_t *bank, uint16_t index, uint16_t *values, uint16_t count);
+/* the same in wire format (big-endian), e.g. straight into reply payload */
+int8_t modbus_shadow_read_be(modbus_shadow_bank_t *bank, uint16_t index, uint8_t *data, uint16_t count);
+
+#endif /* SRC_MODBUS_SHADOW_H_ */
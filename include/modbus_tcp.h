@@ -0,0 +1,110 @@
+/*
+ * modbus_tcp.h
+ *
+ *  Modbus TCP server (Linux, epoll)
+ *  see https://modbus.org/docs/Modbus_Messaging_Implementation_Guide_V1_0b.pdf
+ *
+ *  Requests are MBAP header + PDU; the PDU is processed by the same code as RTU
+ *  frames (modbus_slave_ctx_process_request()), CRC is not used. Unit identifier
+ *  is not checked and is echoed back in the reply.
+ *
+ *  Deferred completion is not supported: the connection and transaction id of a parked
+ *  request are not kept, so callbacks returning MODBUS_PENDING get exception 06 (slave
+ *  device busy), or 05 (acknowledge) with MODBUS_PENDING_FLAG_ACKNOWLEDGE.
+ *
+ *  One server instance is served by one thread; all connections are non-blocking
+ *  and multiplexed with epoll. Pipelined requests are processed in order and
+ *  replies produced from one read are sent with a single system call.
+ *
+ * USAGE:
+ *
+ * 1) initialize slave context (modbus_slave_ctx_init()); its transmit function is not used
+ * 2) modbus_tcp_server_init(&server, &ctx, "0.0.0.0", MODBUS_TCP_DEFAULT_PORT, 1024);
+ * 3) modbus_tcp_server_run(&server); (returns after modbus_tcp_server_stop())
+ *    or call modbus_tcp_server_poll() from your own loop
+ * 4) modbus_tcp_server_close(&server);
+ */
+
+#ifndef SRC_MODBUS_TCP_H_
+#define SRC_MODBUS_TCP_H_
+
+#include "modbus.h"
+
+/*
+ * Defines & macros
+ */
+
+#define MODBUS_TCP_DEFAULT_PORT 502
+#define MODBUS_TCP_PROTOCOL_ID 0
+/* MBAP header: transaction id (2 B), protocol id (2 B), length (2 B), unit id (1 B) */
+#define MODBUS_TCP_MBAP_HEADER_LEN 7
+/* unit id is counted both in MBAP header and in length field */
+#define MODBUS_TCP_MBAP_LENGTH_OFFSET 6
+#define MODBUS_TCP_MAX_PDU_SIZE 253
+#define MODBUS_TCP_MAX_ADU_SIZE (MODBUS_TCP_MBAP_HEADER_LEN + MODBUS_TCP_MAX_PDU_SIZE)
+/* per-connection buffers; RX must hold at least one ADU, TX at least one reply */
+#ifndef MODBUS_TCP_RX_BUFFER_SIZE
+#define MODBUS_TCP_RX_BUFFER_SIZE 1024
+#endif
+#ifndef MODBUS_TCP_TX_BUFFER_SIZE
+#define MODBUS_TCP_TX_BUFFER_SIZE 2048
+#endif
+#define MODBUS_TCP_MAX_EVENTS 64 /* epoll events handled per poll */
+
+/*
+ * Data types
+ */
+
+typedef struct modbus_tcp_connection {
+	int fd;
+	uint16_t rx_len;
+	uint16_t tx_len; /* bytes waiting to be sent */
+	uint16_t tx_pos; /* bytes of tx_buffer already sent */
+	uint8_t tx_blocked; /* waiting for EPOLLOUT, reading is paused */
+	struct modbus_tcp_connection *next_free;
+	uint8_t rx_buffer[MODBUS_TCP_RX_BUFFER_SIZE];
+	uint8_t tx_buffer[MODBUS_TCP_TX_BUFFER_SIZE];
+} modbus_tcp_connection_t;
+
+typedef struct {
+	uint64_t connections_accepted;
+	uint64_t connections_rejected; /* connection limit reached */
+	uint64_t connections_closed;
+	uint64_t requests;
+	uint64_t replies;
+	uint64_t protocol_errors; /* invalid MBAP header, connection closed */
+} modbus_tcp_stats_t;
+
+typedef struct {
+	modbus_slave_ctx_t *ctx;
+	int listen_fd;
+	int epoll_fd;
+	int wake_fd; /* eventfd used by modbus_tcp_server_stop() */
+	int running;
+	uint32_t max_connections;
+	uint32_t active_connections;
+	modbus_tcp_connection_t *connections;
+	modbus_tcp_connection_t *free_connections;
+	modbus_tcp_connection_t *closed_connections; /* closed during current poll */
+	modbus_tcp_stats_t stats;
+} modbus_tcp_server_t;
+
+/*
+ * Function prototypes
+ */
+
+/* bind_address is IPv4 address in dotted notation (NULL means any); port 0 picks free port */
+int8_t modbus_tcp_server_init(modbus_tcp_server_t *server, modbus_slave_ctx_t *ctx,
+		const char *bind_address, uint16_t port, uint32_t max_connections);
+/* port the server listens on */
+uint16_t modbus_tcp_server_port(const modbus_tcp_server_t *server);
+/* handles events that are ready, waiting at most timeout_ms (-1 = forever) */
+int8_t modbus_tcp_server_poll(modbus_tcp_server_t *server, int timeout_ms);
+/* serves connections until modbus_tcp_server_stop() is called */
+int8_t modbus_tcp_server_run(modbus_tcp_server_t *server);
+/* may be called from any thread or signal handler */
+void modbus_tcp_server_stop(modbus_tcp_server_t *server);
+/* closes all connections and releases resources */
+void modbus_tcp_server_close(modbus_tcp_server_t *server);
+
+#endif /* SRC_MODBUS_TCP_H_ */
@@ -6,187 +6,603 @@
  */
 
 #include "modbus.h"
+#include "modbus_register_map.h"
+#include "modbus_file_record.h"
+#include "modbus_fifo.h"
+#include "modbus_endian.h"
+#include "modbus_cache.h"
+
+/* get comm event log (12) reply: address, function code, byte count, status, event count,
+ * message count, events, CRC */
+#define MODBUS_COM_EVENT_LOG_MAX_EVENTS MODBUS_MIN(MODBUS_EVENT_LOG_SIZE, MODBUS_MAX_RTU_FRAME_SIZE - 11)
+/* diagnostics (08) query data, kept in transaction data and echoed: address, function code,
+ * sub-function, data, CRC */
+#define MODBUS_DIAG_MAX_QUERY_DATA MODBUS_MIN(MODBUS_TRANSACTION_DATA_SIZE, MODBUS_MAX_RTU_FRAME_SIZE - 6)
+/* file record (20, 21) request data is kept in transaction data, write request is echoed:
+ * address, function code, byte count, data, CRC */
+#define MODBUS_FILE_READ_BYTE_COUNT_LIMIT MODBUS_MIN(MODBUS_FILE_READ_MAX_BYTE_COUNT, MODBUS_MAX_READ_DATA)
+#define MODBUS_FILE_WRITE_BYTE_COUNT_LIMIT MODBUS_MIN(MODBUS_FILE_WRITE_MAX_BYTE_COUNT, MODBUS_MAX_READ_DATA)
+
+/* every request that fits into a frame must fit into transaction data */
+_Static_assert(2 * MODBUS_MAX_REGISTERS <= MODBUS_TRANSACTION_DATA_SIZE &&
+		2 * MODBUS_MAX_WRITE_REGISTERS <= MODBUS_TRANSACTION_DATA_SIZE &&
+		2 * MODBUS_MAX_READ_WRITE_MULTIPLE_WRITE <= MODBUS_TRANSACTION_DATA_SIZE &&
+		MODBUS_BITS_TO_BYTES(MODBUS_MAX_WRITE_COILS) <= MODBUS_TRANSACTION_DATA_SIZE,
+		"MODBUS_TRANSACTION_DATA_SIZE too small");
 
 /*
- * Global variables
+ * Private functions
  */
 
-/* Modbus TX buffer; can be also used for RX in memory constrained systems (e.g. in main.c);
- * NOTE if shared buffer is used for TX/RX, care must be taken to prevent writing into buffer
- * during execution of modbus_process_message() */
-uint8_t modbus_buffer[MODBUS_MAX_RTU_FRAME_SIZE];
+/* little-endian load/store of n <= 8 bytes */
+static uint64_t modbus_load_le(const uint8_t *p, uint8_t n)
+{
+	uint64_t value = 0;
+
+	memcpy(&value, p, n);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap64(value);
+#endif
+	return value;
+}
+
+static void modbus_store_le(uint8_t *p, uint64_t value, uint8_t n)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap64(value);
+#endif
+	memcpy(p, &value, n);
+}
+
+static int8_t modbus_device_id_add_object(modbus_device_id_t *device_id, uint8_t object_id, const uint8_t *value, size_t len)
+{
+	uint8_t n = device_id->object_count;
+	uint16_t pos = device_id->offset[n];
+
+	/* each object must fit into a reply on its own (individual access) */
+	if (len + 2 > MODBUS_READ_DEVICE_ID_MAX_OBJECTS_LEN) {
+		return MODBUS_ERROR;
+	}
+	if (n >= MODBUS_DEVICE_ID_MAX_OBJECTS || pos + 2 + len > MODBUS_DEVICE_ID_BUFFER_SIZE) {
+		return MODBUS_ERROR_OUT_OF_BOUNDS;
+	}
+	device_id->objects[pos++] = object_id;
+	device_id->objects[pos++] = len;
+	memcpy(device_id->objects + pos, value, len);
+	device_id->ids[n] = object_id;
+	device_id->offset[n + 1] = pos + len;
+	device_id->object_count++;
+	return MODBUS_OK;
+}
+
+/* starting register number of each table (see modbus_register_map_table()) */
+static const uint16_t modbus_register_number_base[MODBUS_TABLE_COUNT + 1] = {
+	[MODBUS_TABLE_COILS] = MODBUS_DO_START_NUMBER,
+	[MODBUS_TABLE_DISCRETE_INPUTS] = MODBUS_DI_START_NUMBER,
+	[MODBUS_TABLE_INPUT_REGISTERS] = MODBUS_AI_START_NUMBER,
+	[MODBUS_TABLE_HOLDING_REGISTERS] = MODBUS_AO_START_NUMBER,
+};
+
+/* register address and quantity: first 4 bytes of most requests */
+static void modbus_parse_range(const uint8_t *data, modbus_transaction_t *transaction)
+{
+	transaction->register_address = (data[0] << 8) | data[1];
+	transaction->register_count = (data[2] << 8) | data[3];
+	transaction->register_number = modbus_register_number_base[modbus_register_map_table(transaction->function_code)] +
+			transaction->register_address;
+}
 
-/* MODBUS device address */
-uint8_t modbus_slave_address = MODBUS_DEFAULT_SLAVE_ADDRESS;
+/* echo of address and value / quantity, used by write replies */
+static uint8_t modbus_serialize_echo(uint8_t *buffer, uint16_t address, uint16_t value)
+{
+	buffer[0] = (uint8_t) (address >> 8);
+	buffer[1] = (uint8_t) address;
+	buffer[2] = (uint8_t) (value >> 8);
+	buffer[3] = (uint8_t) value;
+	return 4;
+}
 
-/* Device ID struct */
-modbus_device_id_t *modbus_device_id = NULL;
+static uint8_t modbus_result_to_exception(int8_t result)
+{
+	switch (result) {
+	case MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED:
+		return MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+	case MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED:
+	case MODBUS_ERROR_ACCESS_DENIED:
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+	default:
+		return MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE;
+	}
+}
 
 /*
- * CRC16 functions
- * see https://modbus.org/docs/Modbus_over_serial_line_V1_02.pdf
- * section 6.2.2
+ * Bus diagnostics: counters and event log (see modbus_diagnostics_t); helpers compile to nothing
+ * without MODBUS_ENABLE_DIAGNOSTICS
  */
 
-/* CRC16 (without memory mapped values)
- * taken from https://ctlsys.com/support/how_to_compute_the_modbus_rtu_message_crc/ */
-uint16_t modbus_CRC16(const uint8_t *buf, int len)
-{
-	uint16_t crc = 0xFFFF;
-
-	for (int pos = 0; pos < len; pos++) {
-		crc ^= (uint16_t)buf[pos];          // XOR byte into least sig. byte of crc
-       
-		for (int i = 8; i != 0; i--) {    // Loop over each bit
-			if ((crc & 0x0001) != 0) {      // If the LSB is set
-				crc >>= 1;                    // Shift right and XOR 0xA001
-				crc ^= 0xA001;
-			} else {                            // Else LSB is not set
-				crc >>= 1;                    // Just shift right
-			}
+#if MODBUS_ENABLE_DIAGNOSTICS
+static void modbus_diag_log(modbus_diagnostics_t *diag, uint8_t event)
+{
+	diag->events[diag->event_head] = event;
+	diag->event_head = (diag->event_head + 1) % MODBUS_EVENT_LOG_SIZE;
+	if (diag->event_count < MODBUS_EVENT_LOG_SIZE) {
+		diag->event_count++;
+	}
+}
+
+/* counters and diagnostic register, optionally event log as well */
+static void modbus_diag_clear(modbus_diagnostics_t *diag, uint8_t clear_log)
+{
+	uint8_t listen_only = diag->listen_only;
+	uint8_t check_other_crc = diag->check_other_crc;
+
+	if (clear_log) {
+		memset(diag, 0, sizeof(*diag));
+	} else {
+		memset(diag, 0, offsetof(modbus_diagnostics_t, listen_only));
+	}
+	diag->listen_only = listen_only;
+	diag->check_other_crc = check_other_crc;
+}
+#endif
+
+/* frame seen on the bus: error is MODBUS_OK or why the frame was dropped */
+static void modbus_diag_frame(modbus_slave_ctx_t *ctx, int8_t error)
+{
+#if MODBUS_ENABLE_DIAGNOSTICS
+	modbus_diagnostics_t *diag = &ctx->diagnostics;
+
+	diag->bus_messages++;
+	if (error == MODBUS_ERROR_CRC || error == MODBUS_ERROR_FRAME_INVALID) {
+		diag->bus_comm_errors++;
+		modbus_diag_log(diag, MODBUS_EVENT_RECEIVE | MODBUS_EVENT_RECEIVE_COMM_ERROR);
+	} else if (error == MODBUS_ERROR_OUT_OF_BOUNDS) {
+		diag->bus_overruns++;
+		modbus_diag_log(diag, MODBUS_EVENT_RECEIVE | MODBUS_EVENT_RECEIVE_OVERRUN);
+	}
+#else
+	(void)ctx;
+	(void)error;
+#endif
+}
+
+/* request (address + PDU, no CRC) for ctx received; returns 0 if it is not going to be served
+ * (listen only mode) */
+static uint8_t modbus_diag_request(modbus_slave_ctx_t *ctx, const uint8_t *buffer, int len, uint8_t broadcast)
+{
+#if MODBUS_ENABLE_DIAGNOSTICS
+	modbus_diagnostics_t *diag = &ctx->diagnostics;
+	uint8_t event = MODBUS_EVENT_RECEIVE | (broadcast ? MODBUS_EVENT_RECEIVE_BROADCAST : 0);
+
+	diag->slave_messages++;
+	if (!diag->listen_only) {
+		modbus_diag_log(diag, event);
+		return 1;
+	}
+	modbus_diag_log(diag, event | MODBUS_EVENT_RECEIVE_LISTEN_ONLY);
+	if (len >= 4 && buffer[1] == MODBUS_DIAGNOSTIC && buffer[2] == 0 &&
+			buffer[3] == MODBUS_DIAG_RESTART_COMMUNICATIONS) {
+		/* the only request served in listen only mode */
+		return 1;
+	}
+	diag->slave_no_response++;
+	modbus_diag_log(diag, MODBUS_EVENT_SEND | MODBUS_EVENT_SEND_LISTEN_ONLY);
+	return 0;
+#else
+	(void)ctx;
+	(void)buffer;
+	(void)len;
+	(void)broadcast;
+	return 1;
+#endif
+}
+
+/* request for ctx completed with exception (0 = none); replied is 0 if no reply is sent */
+static void modbus_diag_reply(modbus_slave_ctx_t *ctx, uint8_t function_code, uint8_t exception, uint8_t replied)
+{
+#if MODBUS_ENABLE_DIAGNOSTICS
+	modbus_diagnostics_t *diag = &ctx->diagnostics;
+	uint8_t event = MODBUS_EVENT_SEND;
+
+	switch (exception) {
+	case 0:
+		if ((function_code & ~MODBUS_ERROR_FLAG) != MODBUS_GET_COM_EVENT_COUNTER) {
+			diag->event_counter++;
+		}
+		break;
+	case MODBUS_EXCEPTION_ILLEGAL_FUNCTION:
+	case MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS:
+	case MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE:
+		event |= MODBUS_EVENT_SEND_READ_EXCEPTION;
+		break;
+	case MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE:
+		event |= MODBUS_EVENT_SEND_ABORT_EXCEPTION;
+		break;
+	case MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY:
+		if (replied) {
+			diag->slave_busy++;
+		}
+		event |= MODBUS_EVENT_SEND_BUSY_EXCEPTION;
+		break;
+	case MODBUS_EXCEPTION_ACKNOWLEDGE:
+		event |= MODBUS_EVENT_SEND_BUSY_EXCEPTION;
+		break;
+	case MODBUS_EXCEPTION_NEGATIVE_ACKNOWLEDGE:
+		if (replied) {
+			diag->slave_nak++;
 		}
+		event |= MODBUS_EVENT_SEND_NAK_EXCEPTION;
+		break;
+	default:
+		break;
+	}
+	if (!replied) {
+		diag->slave_no_response++;
+	} else if (exception != 0) {
+		diag->bus_exceptions++;
 	}
-	// Note, this number has low and high bytes swapped, so use it accordingly (or swap bytes)
-	return crc;  
+	modbus_diag_log(diag, event);
+#else
+	(void)ctx;
+	(void)function_code;
+	(void)exception;
+	(void)replied;
+#endif
+}
+
+/* request for ctx dropped without reply (malformed) */
+static void modbus_diag_no_reply(modbus_slave_ctx_t *ctx)
+{
+#if MODBUS_ENABLE_DIAGNOSTICS
+	ctx->diagnostics.slave_no_response++;
+#else
+	(void)ctx;
+#endif
 }
 
 /*
- * Private functions
+ * Function code handlers: parse request, execute, serialize reply
  */
 
-static uint8_t modbus_fill_device_id_objects(uint8_t *buffer, modbus_transaction_t *transaction)
-{
-	/* we assume buffer is 256 - MODBUS_READ_DEVICE_ID_RESPONSE_HEADER_LEN = 252 bytes long */
-	/* find out how many objects we copy to buffer */
-	int len;
-	uint8_t object_index = transaction->object_id;
-	uint8_t object_count;
-	uint8_t more_follows = MODBUS_NO_MORE_FOLLOWS;
-	uint8_t next_object_id;
-	uint8_t last_object;
-	const uint8_t max_len = 256 - MODBUS_READ_DEVICE_ID_RESPONSE_HEADER_LEN;
-
-	/* last object index */
-	if (transaction->read_device_id_code == MODBUS_CONFORMITY_BASIC) {
-		last_object = MODBUS_BASIC_OBJECT_COUNT;
-	} else if (transaction->read_device_id_code == MODBUS_CONFORMITY_REGULAR) {
-		last_object = MODBUS_REGULAR_OBJECT_COUNT;
-	/* extended not implemented */
-//	} else if (transaction->read_device_id_code == MODBUS_CONFORMITY_EXTENDED){
-//		last_object = MODBUS_EXTENDED_OBJECT_COUNT;
+#if MODBUS_ENABLE_COILS || MODBUS_ENABLE_DISCRETE_INPUTS
+/* read coils (01), read discrete inputs (02) */
+static int8_t modbus_parse_read_bits(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	(void)len;
+	modbus_parse_range(data, transaction);
+	if (transaction->register_count < 1 || transaction->register_count > MODBUS_MAX_READ_BITS) {
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
 	} else {
-		/* fallback: regular */
-		last_object = MODBUS_REGULAR_OBJECT_COUNT;
-	}
-	last_object--; // we need index
-	/* copy as many objects as possible */
-	do {
-		/* copy object */
-		int object_len = strlen(modbus_device_id->object_id[object_index]);
-		if (len + object_len + 2 > max_len) {
-			more_follows = MODBUS_MORE_FOLLOWS;
-			next_object_id = object_index;
-			break;
-		}
-		/* offset is for "more follows", "next object id", "object count" */
-		buffer[MODBUS_READ_DEVICE_ID_RESPONSE_OFFSET + len++] = object_index;
-		buffer[MODBUS_READ_DEVICE_ID_RESPONSE_OFFSET + len++] = object_len;
-		/* note that string copied to buffer is not null-terminated */
-		strncpy((char*)(buffer + len), (char*)modbus_device_id->object_id[object_index++], object_len);
-		len += object_len;
-		object_count++;
-	} while (object_index < last_object);
-	buffer[0] = more_follows;
-	buffer[1] = next_object_id;
-	buffer[2] = object_count;
-	return MODBUS_READ_DEVICE_ID_RESPONSE_OFFSET + len;
-}
-
-/* here we assume buffer has minimal size of MODBUS_MAX_RTU_FRAME_SIZE;
- * this function is private, so hopefully it's going to be ok */
-static int8_t modbus_transaction_to_buffer(uint8_t *buffer, uint8_t *msg_len, modbus_transaction_t *transaction)
+		/* callback only needs to set bits which are 1 */
+		memset(transaction->coils, 0, MODBUS_BITS_TO_BYTES(transaction->register_count));
+	}
+	return MODBUS_OK;
+}
+
+static uint8_t modbus_serialize_read_bits(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
 {
-	uint16_t crc16;
-	uint8_t byte_count;
-	uint8_t buffer_pos = 0;
+	uint8_t byte_count = MODBUS_BITS_TO_BYTES(transaction->register_count);
 
-	// TODO use relative indices (increments) instead of absolute
-	buffer[buffer_pos++] = modbus_slave_address;
-	buffer[buffer_pos++] = transaction->function_code;
-	*msg_len = 5;
+	(void)ctx;
+	buffer[0] = byte_count;
+	if (!transaction->payload_ready) {
+		/* bits are already packed in wire format */
+		memcpy(buffer + 1, transaction->coils, byte_count);
+		transaction->payload = buffer + 1;
+		transaction->payload_ready = 1;
+	}
+	if ((transaction->register_count % 8) && transaction->payload == buffer + 1) {
+		/* unused bits of the last byte are zero (caller-owned payload must have them cleared) */
+		buffer[byte_count] &= (1 << (transaction->register_count % 8)) - 1;
+	}
+	return 1 + byte_count;
+}
+#endif
 
-	if (transaction->function_code & MODBUS_ERROR_FLAG) {
-		/* sending error reply */
-		buffer[buffer_pos++] = transaction->exception;
+#if MODBUS_ENABLE_HOLDING_REGISTERS || MODBUS_ENABLE_INPUT_REGISTERS || MODBUS_ENABLE_READ_WRITE_MULTIPLE
+/* read holding registers (03), read input registers (04), read/write multiple registers (23) */
+static uint8_t modbus_serialize_read_registers(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	uint8_t byte_count = transaction->register_count * 2;
+
+	(void)ctx;
+	buffer[0] = byte_count;
+	if (!transaction->payload_ready) {
+		/* buffer16b is alias for both holding and input register buffers */
+		modbus_registers_pack(buffer + 1, transaction->buffer16b, transaction->register_count);
+		transaction->payload = buffer + 1;
+		transaction->payload_ready = 1;
+	}
+	return 1 + byte_count;
+}
+#endif
+
+#if MODBUS_ENABLE_HOLDING_REGISTERS || MODBUS_ENABLE_INPUT_REGISTERS
+static int8_t modbus_parse_read_registers(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	(void)len;
+	modbus_parse_range(data, transaction);
+	if (transaction->register_count < 1 || transaction->register_count > MODBUS_MAX_REGISTERS) {
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	}
+	return MODBUS_OK;
+}
+#endif
+
+#if MODBUS_ENABLE_COILS
+/* write single coil (05) */
+static int8_t modbus_parse_write_single_coil(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	uint16_t value = (data[2] << 8) | data[3];
+
+	(void)ctx;
+	(void)len;
+	modbus_parse_range(data, transaction);
+	transaction->register_count = 1;
+	if (value == MODBUS_COIL_ON || value == MODBUS_COIL_OFF) {
+		transaction->coils[0] = (value == MODBUS_COIL_ON);
 	} else {
-		switch (transaction->function_code) {
-			case MODBUS_READ_HOLDING_REGISTERS:
-			case MODBUS_READ_INPUT_REGISTERS:
-				byte_count = transaction->register_count * 2;
-				buffer[buffer_pos++] = byte_count;
-				*msg_len = byte_count + 5;
-				for (int i = 0; i < transaction->register_count; i++) {
-					// TODO endianness handling
-					/* buffer16b is alias for both holding and input register buffers */
-					buffer[buffer_pos++] = transaction->buffer16b[i] >> 8;
-					buffer[buffer_pos++] = transaction->buffer16b[i] & 0xff;
-				}
-				break;
-			case MODBUS_WRITE_SINGLE_REGISTER:
-				buffer[buffer_pos++] = (uint8_t) (transaction->register_address >> 8);
-				buffer[buffer_pos++] = (uint8_t) transaction->register_address;
-				buffer[buffer_pos++] = (uint8_t) (transaction->holding_registers[0] >> 8);
-				buffer[buffer_pos++] = (uint8_t) transaction->holding_registers[0];
-				*msg_len = 8; /* includes 2 bytes for CRC */
-				break;
-			case MODBUS_WRITE_MULTIPLE_REGISTERS:
-				buffer[buffer_pos++] = (uint8_t) (transaction->register_address >> 8);
-				buffer[buffer_pos++] = (uint8_t) transaction->register_address;
-				buffer[buffer_pos++] = (uint8_t) (transaction->register_count >> 8);
-				buffer[buffer_pos++] = (uint8_t) transaction->register_count;
-				*msg_len = 8; /* includes 2 bytes for CRC */
-				break;
-			case MODBUS_READ_DEVICE_IDENTIFICATION:
-				/* MEI type */
-				buffer[buffer_pos++] = MODBUS_MEI;
-				/* read device id */
-				buffer[buffer_pos++] = transaction->read_device_id_code;
-				/* conformity level */
-				buffer[buffer_pos++] = modbus_device_id->conformity_level;
-				/* fill buffer with as many objects as possible  */
-				*msg_len = modbus_fill_device_id_objects(buffer+buffer_pos, transaction);
-				*msg_len += 7; /* includes 2 bytes for CRC */
-				break;
-			default:
-				break;
-		}
-	}
-	crc16 = modbus_CRC16(buffer, buffer_pos); /* last two bytes is the checksum itself */
-	buffer[buffer_pos++] = crc16 & 0xff;
-	buffer[buffer_pos++] = crc16 >> 8;
-	return MODBUS_OK;
-}
-
-static int8_t modbus_process_device_id_request(const uint8_t *buffer, int len, modbus_transaction_t *transaction)
+		/* Modbus_Application_Protocol_V1_1b, section 6.5 */
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	}
+	return MODBUS_OK;
+}
+
+static uint8_t modbus_serialize_write_single_coil(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	return modbus_serialize_echo(buffer, transaction->register_address,
+			(transaction->coils[0] & 0x01) ? MODBUS_COIL_ON : MODBUS_COIL_OFF);
+}
+
+/* write multiple coils (15) */
+static int8_t modbus_parse_write_multiple_coils(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	uint8_t byte_count = data[4];
+
+	(void)ctx;
+	modbus_parse_range(data, transaction);
+	/* Modbus_Application_Protocol_V1_1b, section 6.11 */
+	if (transaction->register_count < 1 || transaction->register_count > MODBUS_MAX_WRITE_COILS ||
+			MODBUS_BITS_TO_BYTES(transaction->register_count) != byte_count) {
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+		return MODBUS_OK;
+	}
+	if (len < MODBUS_MINIMAL_WRITE_MULTIPLE_LEN + byte_count) {
+		return MODBUS_ERROR;
+	}
+	/* bits are kept packed, as on the wire */
+	memcpy(transaction->coils, data + MODBUS_MINIMAL_WRITE_MULTIPLE_LEN, byte_count);
+	return MODBUS_OK;
+}
+#endif
+
+#if MODBUS_ENABLE_COILS || MODBUS_ENABLE_HOLDING_REGISTERS
+/* write multiple coils (15), write multiple registers (16) */
+static uint8_t modbus_serialize_write_multiple(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	return modbus_serialize_echo(buffer, transaction->register_address, transaction->register_count);
+}
+#endif
+
+#if MODBUS_ENABLE_HOLDING_REGISTERS
+/* write single register (06) */
+static int8_t modbus_parse_write_single_register(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	(void)len;
+	modbus_parse_range(data, transaction);
+	transaction->register_count = 1;
+	transaction->holding_registers[0] = (data[2] << 8) | data[3];
+	return MODBUS_OK;
+}
+
+static uint8_t modbus_serialize_write_single_register(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	return modbus_serialize_echo(buffer, transaction->register_address, transaction->holding_registers[0]);
+}
+
+/* write multiple registers (16) */
+static int8_t modbus_parse_write_multiple_registers(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	uint8_t byte_count = data[4];
+
+	(void)ctx;
+	modbus_parse_range(data, transaction);
+	if (transaction->register_count < 1 || transaction->register_count > MODBUS_MAX_WRITE_REGISTERS ||
+			2*transaction->register_count != byte_count) {
+		/* Max number of register is defined by Modbus_Application_Protocol_V1_1b, section 6.12 */
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_REGISTER_QUANTITY;
+		return MODBUS_OK;
+	}
+	if (len < MODBUS_MINIMAL_WRITE_MULTIPLE_LEN + byte_count) {
+		return MODBUS_ERROR;
+	}
+	data += MODBUS_MINIMAL_WRITE_MULTIPLE_LEN;
+	modbus_registers_unpack(transaction->holding_registers, data, transaction->register_count);
+	return MODBUS_OK;
+}
+#endif
+
+#if MODBUS_ENABLE_MASK_WRITE_REGISTER
+/* mask write register (22): AND mask in holding_registers[0], OR mask in holding_registers[1] */
+static int8_t modbus_parse_mask_write(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	(void)len;
+	modbus_parse_range(data, transaction);
+	transaction->register_count = 1;
+	transaction->holding_registers[0] = (data[2] << 8) | data[3];
+	transaction->holding_registers[1] = (data[4] << 8) | data[5];
+	return MODBUS_OK;
+}
+
+/* read-modify-write through the usual paths: register map / callback see
+ * read holding registers (03) followed by write single register (06) */
+static int8_t modbus_execute_mask_write(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	uint16_t and_mask = transaction->holding_registers[0];
+	uint16_t or_mask = transaction->holding_registers[1];
+	uint16_t value;
+	int8_t result;
+
+	transaction->function_code = MODBUS_READ_HOLDING_REGISTERS;
+	transaction->payload_ready = 0;
+	result = modbus_slave_ctx_serve(ctx, transaction);
+	if (result == MODBUS_OK) {
+		if (transaction->payload_ready) {
+			value = (transaction->payload[0] << 8) | transaction->payload[1];
+		} else {
+			value = transaction->holding_registers[0];
+		}
+		/* Modbus_Application_Protocol_V1_1b, section 6.16 */
+		transaction->holding_registers[0] = (value & and_mask) | (or_mask & ~and_mask);
+		transaction->function_code = MODBUS_WRITE_SINGLE_REGISTER;
+		result = modbus_slave_ctx_serve(ctx, transaction);
+	}
+	transaction->function_code = MODBUS_MASK_WRITE_REGISTER;
+	transaction->payload_ready = 0;
+	transaction->holding_registers[0] = and_mask;
+	transaction->holding_registers[1] = or_mask;
+	return result;
+}
+
+static uint8_t modbus_serialize_mask_write(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	modbus_serialize_echo(buffer, transaction->register_address, transaction->holding_registers[0]);
+	buffer[4] = (uint8_t) (transaction->holding_registers[1] >> 8);
+	buffer[5] = (uint8_t) transaction->holding_registers[1];
+	return 6;
+}
+#endif
+
+#if MODBUS_ENABLE_READ_WRITE_MULTIPLE
+/* read/write multiple registers (23) */
+static int8_t modbus_parse_read_write_multiple(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	uint8_t byte_count = data[8];
+
+	(void)ctx;
+	modbus_parse_range(data, transaction);
+	transaction->write_address = (data[4] << 8) | data[5];
+	transaction->write_count = (data[6] << 8) | data[7];
+	/* Modbus_Application_Protocol_V1_1b, section 6.17 */
+	if (transaction->register_count < 1 || transaction->register_count > MODBUS_MAX_REGISTERS ||
+			transaction->write_count < 1 || transaction->write_count > MODBUS_MAX_READ_WRITE_MULTIPLE_WRITE ||
+			byte_count != 2 * transaction->write_count) {
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+		return MODBUS_OK;
+	}
+	if (len < MODBUS_MINIMAL_READ_WRITE_MULTIPLE_LEN + byte_count) {
+		return MODBUS_ERROR;
+	}
+	data += MODBUS_MINIMAL_READ_WRITE_MULTIPLE_LEN;
+	modbus_registers_unpack(transaction->holding_registers, data, transaction->write_count);
+	return MODBUS_OK;
+}
+
+/* write is performed before read; register map / callback see write multiple registers (16)
+ * followed by read holding registers (03) */
+static int8_t modbus_execute_read_write_multiple(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	uint16_t read_address = transaction->register_address;
+	uint16_t read_count = transaction->register_count;
+	int8_t result;
+
+	transaction->function_code = MODBUS_WRITE_MULTIPLE_REGISTERS;
+	transaction->register_address = transaction->write_address;
+	transaction->register_count = transaction->write_count;
+	transaction->register_number = MODBUS_AO_START_NUMBER + transaction->write_address;
+	result = modbus_slave_ctx_serve(ctx, transaction);
+	transaction->function_code = MODBUS_READ_HOLDING_REGISTERS;
+	transaction->register_address = read_address;
+	transaction->register_count = read_count;
+	transaction->register_number = MODBUS_AO_START_NUMBER + read_address;
+	if (result == MODBUS_OK) {
+		result = modbus_slave_ctx_serve(ctx, transaction);
+	}
+	transaction->function_code = MODBUS_READ_WRITE_MULTIPLE_REGISTERS;
+	return result;
+}
+#endif
+
+#if MODBUS_ENABLE_DEVICE_ID
+/* index of object with given id, or object_count if there is no such object */
+static uint8_t modbus_device_id_find(const modbus_device_id_t *device_id, uint8_t object_id)
+{
+	uint8_t low = 0;
+	uint8_t high = device_id->object_count;
+
+	while (low < high) {
+		uint8_t mid = (low + high) / 2;
+		if (device_id->ids[mid] < object_id) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low < device_id->object_count && device_id->ids[low] == object_id) {
+		return low;
+	}
+	return device_id->object_count;
+}
+
+/* fills more follows, next object id, object count and objects; returns number of bytes written.
+ * Objects were serialized by modbus_slave_ctx_init_device_id(), so this is a single copy */
+static uint8_t modbus_fill_device_id_objects(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	const modbus_device_id_t *device_id = ctx->device_id;
+	uint8_t first = modbus_device_id_find(device_id, transaction->object_id);
+	uint8_t last = first + 1;
+	uint8_t category_end = last;
+	uint16_t len;
+
+	if (transaction->read_device_id_code != MODBUS_INDIVIDUAL_ACCESS) {
+		/* stream access: as many objects of the category as fit, split points are precomputed */
+		category_end = device_id->category_end[transaction->read_device_id_code - 1];
+		last = device_id->page_end[first];
+		if (last > category_end) {
+			last = category_end;
+		}
+	}
+	len = device_id->offset[last] - device_id->offset[first];
+	if (last < category_end) {
+		buffer[0] = MODBUS_MORE_FOLLOWS;
+		buffer[1] = device_id->ids[last];
+	} else {
+		buffer[0] = MODBUS_NO_MORE_FOLLOWS;
+		buffer[1] = 0;
+	}
+	buffer[2] = last - first;
+	memcpy(buffer + 3, device_id->objects + device_id->offset[first], len);
+	return 3 + len;
+}
+
+/* read device identification (43 / 14) */
+static int8_t modbus_parse_device_id(modbus_slave_ctx_t *ctx, const uint8_t *buffer, int len, modbus_transaction_t *transaction)
 {
 	uint8_t MEI_type;
 	uint8_t read_device_id_code;
 	uint8_t object_id;
+	uint8_t object_index;
 	uint8_t buffer_pos = 0;
 
+	(void)len; /* checked by dispatcher (min_len) */
+
 	if (transaction->broadcast == 1) {
 		/* Read device ID broadcast - invalid; ignore (master will get timeout) */
 		return MODBUS_ERROR;
 	}
-	if (modbus_device_id == NULL) {
-		/* modbus_device_id not initialized; user should use modbus_slave_init_device_id() first */
+	if (ctx->device_id == NULL) {
+		/* device id not initialized; user should use modbus_slave_ctx_init_device_id() first */
 		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DEVICE_ID_CODE;
 		return MODBUS_OK;
 	}
-	if (len < MODBUS_READ_DEVICE_ID_REQUEST_LEN) {
-		/* frame too short, ignore */
-		return MODBUS_ERROR;
-	}
 	/* next byte should be MEI = 0x0E */
 	MEI_type = buffer[buffer_pos++];
 	if (MEI_type != MODBUS_MEI) {
@@ -204,209 +620,1404 @@ static int8_t modbus_process_device_id_request(const uint8_t *buffer, int len, m
 	/* next byte is object id */
 	object_id = buffer[buffer_pos++];
 	transaction->object_id = object_id;
-	if (object_id > MODBUS_DEVICE_ID_OBJECT_NUM) {
-		/* illegal object ID */
-		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
-		return MODBUS_OK;
+	object_index = modbus_device_id_find(ctx->device_id, object_id);
+	if (read_device_id_code == MODBUS_INDIVIDUAL_ACCESS) {
+		if (object_index == ctx->device_id->object_count) {
+			/* illegal object ID */
+			transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+			return MODBUS_OK;
+		}
+	} else if (object_index >= ctx->device_id->category_end[read_device_id_code - 1]) {
+		/* unknown object in stream access: restart at the beginning (object 0) */
+		transaction->object_id = 0;
 	}
 	/* Message processed */
 	return MODBUS_OK;
 }
 
-/* returns ERROR only when no response to master is needed */
-static int8_t modbus_process_read_write_request(const uint8_t *buffer, int len, modbus_transaction_t *transaction)
+static uint8_t modbus_serialize_device_id(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
 {
-	uint8_t byte_count;
-	int8_t callback_result;
-	uint8_t buffer_pos = 0;
+	/* MEI type */
+	buffer[0] = MODBUS_MEI;
+	/* read device id */
+	buffer[1] = transaction->read_device_id_code;
+	/* conformity level */
+	buffer[2] = ctx->device_id->conformity_level;
+	/* fill buffer with as many objects as possible  */
+	return 3 + modbus_fill_device_id_objects(ctx, buffer + 3, transaction);
+}
+#endif
 
-	/* set starting register number */
-	switch (transaction->function_code) {
-	/* coils */
-	case MODBUS_READ_DO:
-	case MODBUS_WRITE_SINGLE_DO:
-	case MODBUS_WRITE_MULTIPLE_DO:
-		transaction->register_number = MODBUS_DO_START_NUMBER;
-		break;
-	/* discrete inputs */
-	case MODBUS_READ_DI:
-		transaction->register_number = MODBUS_DI_START_NUMBER;
-		break;
-	/* input registers */
-	case MODBUS_READ_AI:
-		transaction->register_number = MODBUS_AI_START_NUMBER;
-		break;
-	/* holding registers */
-	case MODBUS_READ_AO:
-	case MODBUS_WRITE_SINGLE_AO:
-	case MODBUS_WRITE_MULTIPLE_AO:
-	case MODBUS_READ_WRITE_MULTIPLE_REGISTERS:
-		transaction->register_number = MODBUS_AO_START_NUMBER;
-		break;
-	default:
-		break;
+#if MODBUS_ENABLE_FILE_RECORD
+/* sub-request header: reference type, file number, record number, record length */
+static void modbus_parse_file_sub_request(const uint8_t *data, uint16_t *file_number, uint16_t *record_number,
+		uint16_t *record_length)
+{
+	*file_number = (data[1] << 8) | data[2];
+	*record_number = (data[3] << 8) | data[4];
+	*record_length = (data[5] << 8) | data[6];
+}
+
+/* file holding records of sub-request with given access, or NULL */
+static modbus_file_t *modbus_file_sub_request_target(modbus_slave_ctx_t *ctx, const uint8_t *data, uint8_t access,
+		int8_t *result)
+{
+	uint16_t file_number, record_number, record_length;
+	modbus_file_t *file;
+
+	modbus_parse_file_sub_request(data, &file_number, &record_number, &record_length);
+	file = modbus_file_map_find(ctx->file_map, file_number, record_number, record_length);
+	if (file == NULL) {
+		*result = MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+	} else if (!(file->access & access)) {
+		*result = MODBUS_ERROR_ACCESS_DENIED;
+		file = NULL;
 	}
+	return file;
+}
 
-	#define MODBUS_FLAG_WRITE  0x01
-	#define MODBUS_FLAG_SINGLE 0x02
-	uint8_t flags = 0x00;
+/* read file record (20): sub-requests are kept in transaction data, register_count is their byte count */
+static int8_t modbus_parse_read_file_record(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	uint8_t byte_count = data[0];
+	uint16_t file_number, record_number, record_length;
+	/* wide enough for any record_length, so the sum cannot wrap below the limit */
+	uint32_t reply_len = 0;
 
-	/* process message */
-	switch (transaction->function_code) {
-	case MODBUS_WRITE_SINGLE_COIL:
-	case MODBUS_WRITE_SINGLE_REGISTER: /* holding register */
-		flags |= MODBUS_FLAG_SINGLE;
-	case MODBUS_WRITE_MULTIPLE_COILS:
-	case MODBUS_WRITE_MULTIPLE_REGISTERS:
-		flags |= MODBUS_FLAG_WRITE;
-	case MODBUS_READ_DISCRETE_INPUTS:
-	case MODBUS_READ_COILS:
-	case MODBUS_READ_INPUT_REGISTERS:
-	case MODBUS_READ_HOLDING_REGISTERS:
-		if (len < MODBUS_MINIMAL_READWRITE_LEN) {
-			/* buffer too short to contain everything we need */
-			return MODBUS_ERROR;
-		}
-		transaction->register_address = (buffer[buffer_pos] << 8) | buffer[buffer_pos + 1];
-		buffer += 2;
-		// TODO check length!
-		if (flags & MODBUS_FLAG_WRITE) {
-			if (flags & MODBUS_FLAG_SINGLE) {
-				transaction->holding_registers[0] = (buffer[buffer_pos] << 8) | buffer[buffer_pos + 1];
-				buffer_pos += 2;
-			} else {
-				/* Write multiple registers */
-				transaction->register_count = (buffer[buffer_pos] << 8) | buffer[buffer_pos + 1];
-				buffer_pos += 2;
-				if (len < MODBUS_MINIMAL_WRITE_MULTIPLE_LEN) {
-					return MODBUS_ERROR;
-				}
-				byte_count = buffer[buffer_pos++];
-				if (transaction->register_count > 123 || 2*transaction->register_count != byte_count) {
-					/* Max number of register is defined by Modbus_Application_Protocol_V1_1b, section 6.12 */
-					transaction->exception = MODBUS_EXCEPTION_ILLEGAL_REGISTER_QUANTITY;
-				} else {
-					if (len < MODBUS_MINIMAL_WRITE_MULTIPLE_LEN + byte_count) {
-						return MODBUS_ERROR;
-					}
-					for (uint8_t i = 0; i < transaction->register_count; i++) {
-						transaction->holding_registers[i] = (buffer[buffer_pos] << 8) | buffer[buffer_pos + 1];
-						buffer_pos += 2;
-					}
-				}
-			}
-		} else {
-			transaction->register_count = (buffer[buffer_pos] << 8) | buffer[buffer_pos + 1];
-			buffer_pos += 2;
-			if (
-					transaction->register_count < 1 ||
-					transaction->register_count > MODBUS_MAX_REGISTERS
-			   ) {
-				transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
-			}
-		}
-		// add offset to register number
-		transaction->register_number += transaction->register_address;
-		break;
-	default:
-		/* function code not known / not implemented, reply with
-		 * ExceptionCode 1 */
+	if (ctx->file_map == NULL) {
 		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
-		break;
+		return MODBUS_OK;
 	}
-	/* data in modbus_buffer have been processed and buffer can be re-used for TX */
-	/* handle reply */
-	if (transaction->exception != 0) {
-		/* indicate error */
-		transaction->function_code |= MODBUS_ERROR_FLAG;
-	} else {
-		callback_result = modbus_slave_callback(transaction);
-		/* error handling */
-		if (callback_result != MODBUS_OK) {
-			transaction->function_code |= MODBUS_ERROR_FLAG;
-			if (callback_result == MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED) {
-				transaction->exception = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
-			} else if (callback_result == MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED) {
-				transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
-			}
+	/* Modbus_Application_Protocol_V1_1b, section 6.14 */
+	if (byte_count < MODBUS_FILE_READ_MIN_BYTE_COUNT || byte_count > MODBUS_FILE_READ_BYTE_COUNT_LIMIT ||
+			byte_count % MODBUS_FILE_SUB_REQUEST_LEN != 0) {
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+		return MODBUS_OK;
+	}
+	if (len < 1 + byte_count) {
+		return MODBUS_ERROR;
+	}
+	data++;
+	for (uint8_t pos = 0; pos < byte_count; pos += MODBUS_FILE_SUB_REQUEST_LEN) {
+		modbus_parse_file_sub_request(data + pos, &file_number, &record_number, &record_length);
+		if (data[pos] != MODBUS_FILE_REFERENCE_TYPE) {
+			transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+			return MODBUS_OK;
+		}
+		/* each sub-response: length, reference type, records */
+		reply_len += 2 + 2 * record_length;
+		if (record_length == 0 || reply_len > MODBUS_MAX_READ_DATA) {
+			transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+			return MODBUS_OK;
 		}
 	}
+	memcpy(transaction->buffer8b, data, byte_count);
+	transaction->register_address = 0;
+	transaction->register_count = byte_count;
 	return MODBUS_OK;
 }
 
-/*
- * Public function definitions
- */
-
-int8_t modbus_slave_set_address(uint8_t address)
+/* sub-responses are copied from files straight to their place in reply */
+static int8_t modbus_execute_read_file_record(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
 {
-	if (address == 0) {
-		/* address 0 is broadcast address */
-		return MODBUS_ERROR;
+	const uint8_t *sub_request = transaction->buffer8b;
+	uint16_t file_number, record_number, record_length;
+	uint8_t *reply = transaction->payload;
+	uint16_t reply_len = 0;
+	modbus_file_t *file;
+	int8_t result;
+
+	for (uint8_t pos = 0; pos < transaction->register_count; pos += MODBUS_FILE_SUB_REQUEST_LEN) {
+		file = modbus_file_sub_request_target(ctx, sub_request + pos, MODBUS_ACCESS_READ, &result);
+		if (file == NULL) {
+			return result;
+		}
+		modbus_parse_file_sub_request(sub_request + pos, &file_number, &record_number, &record_length);
+		reply[reply_len] = 1 + 2 * record_length;
+		reply[reply_len + 1] = MODBUS_FILE_REFERENCE_TYPE;
+		memcpy(reply + reply_len + 2, file->data + 2 * record_number, 2 * record_length);
+		reply_len += 2 + 2 * record_length;
 	}
-	modbus_slave_address = address;
+	transaction->write_count = reply_len;
+	transaction->payload_ready = 1;
 	return MODBUS_OK;
 }
 
-
-int8_t modbus_slave_process_msg(const uint8_t *buffer, int len)
+static uint8_t modbus_serialize_read_file_record(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
 {
+	(void)ctx;
+	/* response data length, sub-responses are in payload already */
+	buffer[0] = transaction->write_count;
+	return 1 + transaction->write_count;
+}
 
+/* write file record (21): request data are kept in transaction data (the reply echoes them) */
+static int8_t modbus_parse_write_file_record(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	uint8_t byte_count = data[0];
+	uint16_t file_number, record_number, record_length;
+	/* wide enough for any record_length, so the sum cannot wrap below byte_count */
+	uint32_t pos = 0;
 
-	/*
-	 * TODO list:
-	 *
-	 * 1) check that errors and exceptions are handled according to Modbus_Application_Protocol_V1_1b.pdf
-	 * 2) buffer overflow prevention: for each function code, check that buffer is long enough
-	 */
-
-
-	/* transaction holds message context and content:
-	 * it wraps all necessary buffers and variables */
-	modbus_transaction_t transaction;
-	uint8_t buffer_pos = 0;
-
-	if (len < MODBUS_MINIMAL_FRAME_LEN) {
-		/* frame too short; return error (no reply needed) */
-		return MODBUS_ERROR_FRAME_INVALID;
-	}
-	/* check CRC first */
-	uint16_t crc_received = (buffer[len - 1] << 8) | buffer[len - 2];
-	uint16_t crc_calculated = modbus_CRC16(buffer, len - 2);
-	if (crc_received != crc_calculated) {
-		/* CRC mismatch, return error (no reply needed) */
-		return MODBUS_ERROR_CRC;
+	if (ctx->file_map == NULL) {
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+		return MODBUS_OK;
 	}
-	/* check if address matches ours */
-	uint8_t address = buffer[buffer_pos++];
-	transaction.broadcast = (address == MODBUS_BROADCAST_ADDR);
-	if (address != modbus_slave_address && transaction.broadcast != 1) {
-		/* Message is not for us (no reply needed) */
+	/* Modbus_Application_Protocol_V1_1b, section 6.15 */
+	if (byte_count < MODBUS_FILE_WRITE_MIN_BYTE_COUNT || byte_count > MODBUS_FILE_WRITE_BYTE_COUNT_LIMIT) {
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
 		return MODBUS_OK;
 	}
-	/* get function code */
-	transaction.function_code = buffer[buffer_pos++];
-	transaction.exception = 0;
-	uint8_t request_processing_result;
-	if (transaction.function_code == MODBUS_READ_DEVICE_IDENTIFICATION) {
-		/* Read device ID request is quite complicated, therefore it has its own processing function */
-		request_processing_result = modbus_process_device_id_request(buffer + buffer_pos, len - buffer_pos, &transaction);
-	} else {
-		/* process other requests: input register read, holding register read/write */
-		request_processing_result = modbus_process_read_write_request(buffer + buffer_pos, len - buffer_pos, &transaction);
+	if (len < 1 + byte_count) {
+		return MODBUS_ERROR;
 	}
-	uint8_t msg_len;
-	/* reply only if request was processed successfully and message was not broadcast */
-	if (request_processing_result == MODBUS_OK && transaction.broadcast == 0) {
-		modbus_transaction_to_buffer(modbus_buffer, &msg_len, &transaction);
-		/* send reply */
-		modbus_transmit_function(modbus_buffer, msg_len);
+	data++;
+	/* sub-requests must fill the byte count exactly */
+	while (pos < byte_count) {
+		if (byte_count - pos < MODBUS_FILE_SUB_REQUEST_LEN) {
+			transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+			return MODBUS_OK;
+		}
+		modbus_parse_file_sub_request(data + pos, &file_number, &record_number, &record_length);
+		if (data[pos] != MODBUS_FILE_REFERENCE_TYPE) {
+			transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+			return MODBUS_OK;
+		}
+		pos += MODBUS_FILE_SUB_REQUEST_LEN + 2 * record_length;
+		if (record_length == 0 || pos > byte_count) {
+			transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+			return MODBUS_OK;
+		}
 	}
+	memcpy(transaction->buffer8b, data, byte_count);
+	transaction->register_address = 0;
+	transaction->register_count = byte_count;
 	return MODBUS_OK;
 }
 
-int8_t modbus_slave_init_device_id(modbus_device_id_t *device_id)
+/* all sub-requests are checked before anything is written, so a request is written whole or not at all */
+static int8_t modbus_execute_write_file_record(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
 {
+	/* sub-request is at least header and one record */
+	modbus_file_t *files[MODBUS_FILE_WRITE_MAX_BYTE_COUNT / (MODBUS_FILE_SUB_REQUEST_LEN + 2)];
+	const uint8_t *data = transaction->buffer8b;
+	uint16_t file_number, record_number, record_length;
+	uint8_t count = 0;
+	uint16_t pos;
+	int8_t result;
+
+	for (pos = 0; pos < transaction->register_count; pos += MODBUS_FILE_SUB_REQUEST_LEN + 2 * record_length) {
+		modbus_parse_file_sub_request(data + pos, &file_number, &record_number, &record_length);
+		files[count] = modbus_file_sub_request_target(ctx, data + pos, MODBUS_ACCESS_WRITE, &result);
+		if (files[count++] == NULL) {
+			return result;
+		}
+	}
+	count = 0;
+	for (pos = 0; pos < transaction->register_count; pos += MODBUS_FILE_SUB_REQUEST_LEN + 2 * record_length) {
+		modbus_parse_file_sub_request(data + pos, &file_number, &record_number, &record_length);
+		memcpy(files[count]->data + 2 * record_number, data + pos + MODBUS_FILE_SUB_REQUEST_LEN, 2 * record_length);
+		modbus_file_map_written(files[count++], record_number, record_length);
+	}
+	/* failed flush is reported as slave device failure */
+	return modbus_file_map_write_done(ctx->file_map);
+}
+
+static uint8_t modbus_serialize_write_file_record(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	buffer[0] = transaction->register_count;
+	memcpy(buffer + 1, transaction->buffer8b, transaction->register_count);
+	return 1 + transaction->register_count;
+}
+#endif
+
+#if MODBUS_ENABLE_FIFO_QUEUE
+/* read FIFO queue (24): register_address is the FIFO pointer address */
+static int8_t modbus_parse_read_fifo_queue(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	(void)len;
+	if (ctx->fifos == NULL) {
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+		return MODBUS_OK;
+	}
+	transaction->register_address = (data[0] << 8) | data[1];
+	transaction->register_count = 0;
+	return MODBUS_OK;
+}
+
+/* drains queue into transaction data; register_count is the FIFO count of the reply */
+static int8_t modbus_execute_read_fifo_queue(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	modbus_fifo_t *fifo = modbus_fifo_find(ctx->fifos, transaction->register_address);
+
+	if (fifo == NULL) {
+		return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+	}
+	if ((fifo->flags & MODBUS_FIFO_FLAG_STRICT) && modbus_fifo_count(fifo) > MODBUS_FIFO_MAX_REPLY_COUNT) {
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+		return MODBUS_OK;
+	}
+	transaction->register_count = modbus_fifo_read(fifo, transaction->holding_registers, MODBUS_FIFO_MAX_REPLY_COUNT);
+	return MODBUS_OK;
+}
+
+static uint8_t modbus_serialize_read_fifo_queue(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	uint16_t byte_count = 2 + 2 * transaction->register_count;
+
+	(void)ctx;
+	buffer[0] = byte_count >> 8;
+	buffer[1] = byte_count & 0xff;
+	buffer[2] = transaction->register_count >> 8;
+	buffer[3] = transaction->register_count & 0xff;
+	modbus_registers_pack(buffer + 4, transaction->holding_registers, transaction->register_count);
+	return 2 + byte_count;
+}
+#endif
+
+#if MODBUS_ENABLE_DIAGNOSTICS
+/* diagnostics (08) sub-functions served, bit per sub-function */
+#define MODBUS_DIAG_SUB_FUNCTIONS ((1UL << MODBUS_DIAG_RETURN_QUERY_DATA) | \
+		(1UL << MODBUS_DIAG_RESTART_COMMUNICATIONS) | (1UL << MODBUS_DIAG_RETURN_DIAGNOSTIC_REGISTER) | \
+		(1UL << MODBUS_DIAG_FORCE_LISTEN_ONLY) | (1UL << MODBUS_DIAG_CLEAR_OVERRUN) | \
+		(((1UL << (MODBUS_DIAG_BUS_OVERRUN_COUNT + 1)) - 1) & ~((1UL << MODBUS_DIAG_CLEAR_COUNTERS) - 1)))
+
+/* diagnostics (08): register_address is the sub-function, its data (register_count bytes, usually
+ * one register) are echoed from buffer8b, where counters replace them; everything is done here */
+static int8_t modbus_parse_diagnostic(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	modbus_diagnostics_t *diag = &ctx->diagnostics;
+	uint16_t value = (data[2] << 8) | data[3];
+	uint8_t listen_only = diag->listen_only;
+	uint32_t counter;
+
+	transaction->register_address = (data[0] << 8) | data[1];
+	if (len - 2 > MODBUS_DIAG_MAX_QUERY_DATA) {
+		/* echo wouldn't fit (request from a transport with larger frames) */
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+		return MODBUS_OK;
+	}
+	transaction->register_count = len - 2;
+	memcpy(transaction->buffer8b, data + 2, len - 2);
+	if (transaction->register_address == MODBUS_DIAG_RETURN_QUERY_DATA) {
+		/* loopback, any data */
+		return MODBUS_OK;
+	}
+	if (transaction->register_address >= 32 || !(MODBUS_DIAG_SUB_FUNCTIONS & (1UL << transaction->register_address))) {
+		/* not supported (ASCII delimiter, ...) */
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+		return MODBUS_OK;
+	}
+	if (len != 4 || (value != 0 && transaction->register_address != MODBUS_DIAG_RESTART_COMMUNICATIONS)) {
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+		return MODBUS_OK;
+	}
+	switch (transaction->register_address) {
+	case MODBUS_DIAG_RESTART_COMMUNICATIONS:
+		if (value != 0x0000 && value != 0xFF00) {
+			transaction->exception = MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+			return MODBUS_OK;
+		}
+		modbus_diag_clear(diag, value == 0xFF00);
+		diag->listen_only = 0;
+		modbus_diag_log(diag, MODBUS_EVENT_RESTART);
+		/* no reply to the request that ends listen only mode */
+		return listen_only ? MODBUS_ERROR : MODBUS_OK;
+	case MODBUS_DIAG_FORCE_LISTEN_ONLY:
+		diag->listen_only = 1;
+		modbus_diag_log(diag, MODBUS_EVENT_LISTEN_ONLY);
+		/* no reply */
+		return MODBUS_ERROR;
+	case MODBUS_DIAG_CLEAR_COUNTERS:
+		modbus_diag_clear(diag, 0);
+		return MODBUS_OK;
+	case MODBUS_DIAG_CLEAR_OVERRUN:
+		diag->bus_overruns = 0;
+		return MODBUS_OK;
+	case MODBUS_DIAG_RETURN_DIAGNOSTIC_REGISTER:
+		counter = diag->diagnostic_register;
+		break;
+	case MODBUS_DIAG_BUS_MESSAGE_COUNT:
+		counter = diag->bus_messages;
+		break;
+	case MODBUS_DIAG_BUS_COMM_ERROR_COUNT:
+		counter = diag->bus_comm_errors;
+		break;
+	case MODBUS_DIAG_BUS_EXCEPTION_COUNT:
+		counter = diag->bus_exceptions;
+		break;
+	case MODBUS_DIAG_SLAVE_MESSAGE_COUNT:
+		counter = diag->slave_messages;
+		break;
+	case MODBUS_DIAG_SLAVE_NO_RESPONSE_COUNT:
+		counter = diag->slave_no_response;
+		break;
+	case MODBUS_DIAG_SLAVE_NAK_COUNT:
+		counter = diag->slave_nak;
+		break;
+	case MODBUS_DIAG_SLAVE_BUSY_COUNT:
+		counter = diag->slave_busy;
+		break;
+	case MODBUS_DIAG_BUS_OVERRUN_COUNT:
+		counter = diag->bus_overruns;
+		break;
+	default:
+		counter = 0;
+		break;
+	}
+	transaction->buffer8b[0] = (uint8_t) (counter >> 8);
+	transaction->buffer8b[1] = (uint8_t) counter;
+	return MODBUS_OK;
+}
+
+static uint8_t modbus_serialize_diagnostic(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	buffer[0] = (uint8_t) (transaction->register_address >> 8);
+	buffer[1] = (uint8_t) transaction->register_address;
+	memcpy(buffer + 2, transaction->buffer8b, transaction->register_count);
+	return 2 + transaction->register_count;
+}
+
+/* get comm event counter (11): status (FFFF while a deferred request is pending), event count */
+static uint8_t modbus_serialize_com_event_counter(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	return modbus_serialize_echo(buffer, ctx->pending_count > 0 ? 0xFFFF : 0x0000, ctx->diagnostics.event_counter);
+}
+
+/* get comm event log (12): byte count, status and event count as above, bus message count,
+ * events newest first */
+static uint8_t modbus_serialize_com_event_log(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	uint8_t count = modbus_slave_ctx_event_log(ctx, buffer + 7, MODBUS_COM_EVENT_LOG_MAX_EVENTS);
+
+	buffer[0] = 6 + count;
+	modbus_serialize_com_event_counter(ctx, buffer + 1, transaction);
+	buffer[5] = (uint8_t) (ctx->diagnostics.bus_messages >> 8);
+	buffer[6] = (uint8_t) ctx->diagnostics.bus_messages;
+	return 7 + count;
+}
+#endif
+
+/* handler table: handlers are listed once, function codes point to them through
+ * a 256-byte index, so dispatch is one table lookup and an indirect call */
+enum {
+	MODBUS_HANDLER_NONE = 0,
+#if MODBUS_ENABLE_COILS || MODBUS_ENABLE_DISCRETE_INPUTS
+	MODBUS_HANDLER_READ_BITS,
+#endif
+#if MODBUS_ENABLE_HOLDING_REGISTERS || MODBUS_ENABLE_INPUT_REGISTERS
+	MODBUS_HANDLER_READ_REGISTERS,
+#endif
+#if MODBUS_ENABLE_COILS
+	MODBUS_HANDLER_WRITE_SINGLE_COIL,
+	MODBUS_HANDLER_WRITE_MULTIPLE_COILS,
+#endif
+#if MODBUS_ENABLE_HOLDING_REGISTERS
+	MODBUS_HANDLER_WRITE_SINGLE_REGISTER,
+	MODBUS_HANDLER_WRITE_MULTIPLE_REGISTERS,
+#endif
+#if MODBUS_ENABLE_MASK_WRITE_REGISTER
+	MODBUS_HANDLER_MASK_WRITE_REGISTER,
+#endif
+#if MODBUS_ENABLE_READ_WRITE_MULTIPLE
+	MODBUS_HANDLER_READ_WRITE_MULTIPLE,
+#endif
+#if MODBUS_ENABLE_FILE_RECORD
+	MODBUS_HANDLER_READ_FILE_RECORD,
+	MODBUS_HANDLER_WRITE_FILE_RECORD,
+#endif
+#if MODBUS_ENABLE_FIFO_QUEUE
+	MODBUS_HANDLER_READ_FIFO_QUEUE,
+#endif
+#if MODBUS_ENABLE_DEVICE_ID
+	MODBUS_HANDLER_DEVICE_ID,
+#endif
+#if MODBUS_ENABLE_DIAGNOSTICS
+	MODBUS_HANDLER_DIAGNOSTIC,
+	MODBUS_HANDLER_COM_EVENT_COUNTER,
+	MODBUS_HANDLER_COM_EVENT_LOG,
+#endif
+	MODBUS_HANDLER_COUNT
+};
+
+static const modbus_function_handler_t modbus_function_handlers[MODBUS_HANDLER_COUNT] = {
+#if MODBUS_ENABLE_COILS || MODBUS_ENABLE_DISCRETE_INPUTS
+	[MODBUS_HANDLER_READ_BITS] = {
+		MODBUS_MINIMAL_READWRITE_LEN, MODBUS_FUNCTION_FLAG_PAYLOAD | MODBUS_FUNCTION_FLAG_DEFER,
+		modbus_parse_read_bits, modbus_slave_ctx_serve, modbus_serialize_read_bits
+	},
+#endif
+#if MODBUS_ENABLE_HOLDING_REGISTERS || MODBUS_ENABLE_INPUT_REGISTERS
+	[MODBUS_HANDLER_READ_REGISTERS] = {
+		MODBUS_MINIMAL_READWRITE_LEN, MODBUS_FUNCTION_FLAG_PAYLOAD | MODBUS_FUNCTION_FLAG_DEFER,
+		modbus_parse_read_registers, modbus_slave_ctx_serve, modbus_serialize_read_registers
+	},
+#endif
+#if MODBUS_ENABLE_COILS
+	[MODBUS_HANDLER_WRITE_SINGLE_COIL] = {
+		MODBUS_MINIMAL_READWRITE_LEN, MODBUS_FUNCTION_FLAG_DEFER,
+		modbus_parse_write_single_coil, modbus_slave_ctx_serve, modbus_serialize_write_single_coil
+	},
+	[MODBUS_HANDLER_WRITE_MULTIPLE_COILS] = {
+		MODBUS_MINIMAL_WRITE_MULTIPLE_LEN, MODBUS_FUNCTION_FLAG_DEFER,
+		modbus_parse_write_multiple_coils, modbus_slave_ctx_serve, modbus_serialize_write_multiple
+	},
+#endif
+#if MODBUS_ENABLE_HOLDING_REGISTERS
+	[MODBUS_HANDLER_WRITE_SINGLE_REGISTER] = {
+		MODBUS_MINIMAL_READWRITE_LEN, MODBUS_FUNCTION_FLAG_DEFER,
+		modbus_parse_write_single_register, modbus_slave_ctx_serve, modbus_serialize_write_single_register
+	},
+	[MODBUS_HANDLER_WRITE_MULTIPLE_REGISTERS] = {
+		MODBUS_MINIMAL_WRITE_MULTIPLE_LEN, MODBUS_FUNCTION_FLAG_DEFER,
+		modbus_parse_write_multiple_registers, modbus_slave_ctx_serve, modbus_serialize_write_multiple
+	},
+#endif
+#if MODBUS_ENABLE_MASK_WRITE_REGISTER
+	[MODBUS_HANDLER_MASK_WRITE_REGISTER] = {
+		MODBUS_MASK_WRITE_REQUEST_LEN, 0,
+		modbus_parse_mask_write, modbus_execute_mask_write, modbus_serialize_mask_write
+	},
+#endif
+#if MODBUS_ENABLE_READ_WRITE_MULTIPLE
+	[MODBUS_HANDLER_READ_WRITE_MULTIPLE] = {
+		MODBUS_MINIMAL_READ_WRITE_MULTIPLE_LEN, MODBUS_FUNCTION_FLAG_PAYLOAD,
+		modbus_parse_read_write_multiple, modbus_execute_read_write_multiple, modbus_serialize_read_registers
+	},
+#endif
+#if MODBUS_ENABLE_FILE_RECORD
+	[MODBUS_HANDLER_READ_FILE_RECORD] = {
+		1, MODBUS_FUNCTION_FLAG_PAYLOAD,
+		modbus_parse_read_file_record, modbus_execute_read_file_record, modbus_serialize_read_file_record
+	},
+	[MODBUS_HANDLER_WRITE_FILE_RECORD] = {
+		1, 0,
+		modbus_parse_write_file_record, modbus_execute_write_file_record, modbus_serialize_write_file_record
+	},
+#endif
+#if MODBUS_ENABLE_FIFO_QUEUE
+	[MODBUS_HANDLER_READ_FIFO_QUEUE] = {
+		2, 0,
+		modbus_parse_read_fifo_queue, modbus_execute_read_fifo_queue, modbus_serialize_read_fifo_queue
+	},
+#endif
+#if MODBUS_ENABLE_DEVICE_ID
+	[MODBUS_HANDLER_DEVICE_ID] = {
+		MODBUS_READ_DEVICE_ID_REQUEST_LEN - 1, 0,
+		modbus_parse_device_id, NULL, modbus_serialize_device_id
+	},
+#endif
+#if MODBUS_ENABLE_DIAGNOSTICS
+	[MODBUS_HANDLER_DIAGNOSTIC] = {
+		4, 0,
+		modbus_parse_diagnostic, NULL, modbus_serialize_diagnostic
+	},
+	[MODBUS_HANDLER_COM_EVENT_COUNTER] = {
+		0, 0,
+		NULL, NULL, modbus_serialize_com_event_counter
+	},
+	[MODBUS_HANDLER_COM_EVENT_LOG] = {
+		0, 0,
+		NULL, NULL, modbus_serialize_com_event_log
+	},
+#endif
+};
+
+static const uint8_t modbus_function_index[256] = {
+#if MODBUS_ENABLE_COILS
+	[MODBUS_READ_COILS] = MODBUS_HANDLER_READ_BITS,
+	[MODBUS_WRITE_SINGLE_COIL] = MODBUS_HANDLER_WRITE_SINGLE_COIL,
+	[MODBUS_WRITE_MULTIPLE_COILS] = MODBUS_HANDLER_WRITE_MULTIPLE_COILS,
+#endif
+#if MODBUS_ENABLE_DISCRETE_INPUTS
+	[MODBUS_READ_DISCRETE_INPUTS] = MODBUS_HANDLER_READ_BITS,
+#endif
+#if MODBUS_ENABLE_HOLDING_REGISTERS
+	[MODBUS_READ_HOLDING_REGISTERS] = MODBUS_HANDLER_READ_REGISTERS,
+	[MODBUS_WRITE_SINGLE_REGISTER] = MODBUS_HANDLER_WRITE_SINGLE_REGISTER,
+	[MODBUS_WRITE_MULTIPLE_REGISTERS] = MODBUS_HANDLER_WRITE_MULTIPLE_REGISTERS,
+#endif
+#if MODBUS_ENABLE_INPUT_REGISTERS
+	[MODBUS_READ_INPUT_REGISTERS] = MODBUS_HANDLER_READ_REGISTERS,
+#endif
+#if MODBUS_ENABLE_MASK_WRITE_REGISTER
+	[MODBUS_MASK_WRITE_REGISTER] = MODBUS_HANDLER_MASK_WRITE_REGISTER,
+#endif
+#if MODBUS_ENABLE_READ_WRITE_MULTIPLE
+	[MODBUS_READ_WRITE_MULTIPLE_REGISTERS] = MODBUS_HANDLER_READ_WRITE_MULTIPLE,
+#endif
+#if MODBUS_ENABLE_FILE_RECORD
+	[MODBUS_READ_FILE_RECORD] = MODBUS_HANDLER_READ_FILE_RECORD,
+	[MODBUS_WRITE_FILE_RECORD] = MODBUS_HANDLER_WRITE_FILE_RECORD,
+#endif
+#if MODBUS_ENABLE_FIFO_QUEUE
+	[MODBUS_READ_FIFO_QUEUE] = MODBUS_HANDLER_READ_FIFO_QUEUE,
+#endif
+#if MODBUS_ENABLE_DEVICE_ID
+	[MODBUS_READ_DEVICE_IDENTIFICATION] = MODBUS_HANDLER_DEVICE_ID,
+#endif
+#if MODBUS_ENABLE_DIAGNOSTICS
+	[MODBUS_DIAGNOSTIC] = MODBUS_HANDLER_DIAGNOSTIC,
+	[MODBUS_GET_COM_EVENT_COUNTER] = MODBUS_HANDLER_COM_EVENT_COUNTER,
+	[MODBUS_GET_COM_EVENT_LOG] = MODBUS_HANDLER_COM_EVENT_LOG,
+#endif
+};
+
+/* handler for function code: registered ones first, then built-in table; NULL if none */
+static const modbus_function_handler_t *modbus_function_lookup(const modbus_slave_ctx_t *ctx, uint8_t function_code)
+{
+	uint8_t index;
+
+#if MODBUS_MAX_USER_FUNCTIONS > 0
+	for (uint8_t i = 0; i < ctx->user_function_count; i++) {
+		if (ctx->user_function_codes[i] == function_code) {
+			return ctx->user_functions[i];
+		}
+	}
+#else
+	(void)ctx;
+#endif
+	index = modbus_function_index[function_code];
+	return index != MODBUS_HANDLER_NONE ? &modbus_function_handlers[index] : NULL;
+}
+
+/* serializes reply ADU (address + PDU) without CRC into buffer of MODBUS_MAX_RTU_FRAME_SIZE bytes
+ * (parsers limit counts so that every reply fits); msg_len is set to ADU length
+ * (including payload which is not in buffer, if gather is set);
+ * on return, payload_ready tells whether the reply has payload at transaction->payload */
+static void modbus_transaction_to_buffer(const modbus_function_handler_t *handler, modbus_slave_ctx_t *ctx,
+		uint8_t *buffer, uint16_t *msg_len, modbus_transaction_t *transaction, uint8_t gather)
+{
+	uint16_t buffer_pos = 0;
+
+	buffer[buffer_pos++] = transaction->address;
+	buffer[buffer_pos++] = transaction->function_code;
+
+	if (transaction->function_code & MODBUS_ERROR_FLAG) {
+		/* sending error reply */
+		buffer[buffer_pos++] = transaction->exception;
+		transaction->payload_ready = 0;
+	} else {
+		if (!(handler->flags & MODBUS_FUNCTION_FLAG_PAYLOAD)) {
+			transaction->payload_ready = 0;
+		}
+		if (handler->serialize != NULL) {
+			buffer_pos += handler->serialize(ctx, buffer + buffer_pos, transaction);
+		}
+		if (transaction->payload_ready && transaction->payload != buffer + MODBUS_REPLY_PAYLOAD_OFFSET && !gather) {
+			/* payload provided by callback is joined, unless reply is going to be sent as segments */
+			memcpy(buffer + MODBUS_REPLY_PAYLOAD_OFFSET, transaction->payload, buffer_pos - MODBUS_REPLY_PAYLOAD_OFFSET);
+			transaction->payload = buffer + MODBUS_REPLY_PAYLOAD_OFFSET;
+		}
+	}
+	*msg_len = buffer_pos;
+}
+
+/* free pending pool entry or NULL */
+static modbus_pending_t *modbus_pending_reserve(modbus_slave_ctx_t *ctx)
+{
+	for (uint8_t i = 0; i < ctx->pending_size; i++) {
+		if (!ctx->pending[i].in_use) {
+			return &ctx->pending[i];
+		}
+	}
+	return NULL;
+}
+
+/* pending pool entry holding transaction or NULL if transaction is not pending */
+static modbus_pending_t *modbus_pending_find(modbus_slave_ctx_t *ctx, const modbus_transaction_t *transaction)
+{
+	for (uint8_t i = 0; i < ctx->pending_size; i++) {
+		if (&ctx->pending[i].transaction == transaction) {
+			return ctx->pending[i].in_use ? &ctx->pending[i] : NULL;
+		}
+	}
+	return NULL;
+}
+
+static void modbus_capture_request(modbus_slave_ctx_t *ctx, const uint8_t *buffer, int len)
+{
+	modbus_iovec_t iov = { buffer, len > 0 ? len : 0 };
+
+	ctx->capture(ctx, MODBUS_CAPTURE_REQUEST, &iov, 1);
+}
+
+/* captures request / reply of modbus_slave_ctx_process_request() (address + PDU, no CRC) as RTU frame */
+static void modbus_capture_without_crc(modbus_slave_ctx_t *ctx, uint8_t direction, const uint8_t *buffer, int len)
+{
+	uint16_t crc16;
+	uint8_t crc[2];
+	modbus_iovec_t iov[2];
+
+	len = len > 0 ? len : 0;
+	crc16 = modbus_CRC16(buffer, len);
+	crc[0] = crc16 & 0xff;
+	crc[1] = crc16 >> 8;
+	iov[0].data = buffer;
+	iov[0].len = len;
+	iov[1].data = crc;
+	iov[1].len = 2;
+	ctx->capture(ctx, direction, iov, 2);
+}
+
+/* sends reply built by modbus_transaction_to_buffer() (msg_len bytes, no CRC) */
+static int8_t modbus_send_reply(modbus_slave_ctx_t *ctx, uint8_t *reply, uint16_t msg_len,
+		const modbus_transaction_t *transaction)
+{
+	modbus_iovec_t iov[MODBUS_REPLY_IOV_COUNT];
+	uint16_t header_len;
+	uint16_t crc16;
+
+	if (ctx->transmitv == NULL) {
+		crc16 = modbus_CRC16(reply, msg_len);
+		reply[msg_len++] = crc16 & 0xff;
+		reply[msg_len++] = crc16 >> 8;
+		iov[0].data = reply;
+		iov[0].len = msg_len;
+		if (ctx->capture != NULL) {
+			ctx->capture(ctx, MODBUS_CAPTURE_REPLY, iov, 1);
+		}
+#if MODBUS_ENABLE_RESPONSE_CACHE
+		if (ctx->cache != NULL) {
+			modbus_cache_store(ctx->cache, iov, 1);
+		}
+#endif
+		/* send reply */
+		return ctx->transmit(ctx, reply, msg_len);
+	}
+	/* scatter-gather: header, payload (possibly outside of reply buffer), CRC */
+	header_len = transaction->payload_ready ? MODBUS_REPLY_PAYLOAD_OFFSET : msg_len;
+	iov[0].data = reply;
+	iov[0].len = header_len;
+	iov[1].data = transaction->payload;
+	iov[1].len = msg_len - header_len;
+	crc16 = modbus_crc16_update(MODBUS_CRC16_INIT, iov[0].data, iov[0].len);
+	crc16 = modbus_crc16_update(crc16, iov[1].data, iov[1].len);
+	/* CRC goes to its usual place in reply buffer, so it outlives this call */
+	reply[msg_len] = crc16 & 0xff;
+	reply[msg_len + 1] = crc16 >> 8;
+	iov[2].data = reply + msg_len;
+	iov[2].len = 2;
+	if (ctx->capture != NULL) {
+		ctx->capture(ctx, MODBUS_CAPTURE_REPLY, iov, MODBUS_REPLY_IOV_COUNT);
+	}
+#if MODBUS_ENABLE_RESPONSE_CACHE
+	if (ctx->cache != NULL) {
+		modbus_cache_store(ctx->cache, iov, MODBUS_REPLY_IOV_COUNT);
+	}
+#endif
+	return ctx->transmitv(ctx, iov, MODBUS_REPLY_IOV_COUNT);
+}
+
+#if MODBUS_ENABLE_RESPONSE_CACHE
+/* sends reply frame (CRC included) copied from cache into reply by modbus_process_slave_request() */
+static int8_t modbus_send_cached_reply(modbus_slave_ctx_t *ctx, uint8_t *reply, const modbus_cache_entry_t *entry)
+{
+	modbus_iovec_t iov[MODBUS_REPLY_IOV_COUNT];
+	uint16_t msg_len = entry->len - 2;
+
+	/* same segments as modbus_send_reply(): header, (empty) payload, CRC */
+	iov[0].data = reply;
+	iov[0].len = msg_len;
+	iov[1].data = reply + msg_len;
+	iov[1].len = 0;
+	iov[2].data = reply + msg_len;
+	iov[2].len = 2;
+	if (ctx->transmitv == NULL) {
+		if (ctx->capture != NULL) {
+			iov[0].len = entry->len;
+			ctx->capture(ctx, MODBUS_CAPTURE_REPLY, iov, 1);
+		}
+		return ctx->transmit(ctx, reply, entry->len);
+	}
+	if (ctx->capture != NULL) {
+		ctx->capture(ctx, MODBUS_CAPTURE_REPLY, iov, MODBUS_REPLY_IOV_COUNT);
+	}
+	return ctx->transmitv(ctx, iov, MODBUS_REPLY_IOV_COUNT);
+}
+
+/* drops cached holding registers written by request (address + PDU, no CRC), whether the write
+ * succeeded or not */
+static void modbus_cache_invalidate_written(modbus_cache_t *cache, const uint8_t *buffer, int len)
+{
+	const uint8_t *pdu = buffer + 1;
+
+	switch (pdu[0]) {
+	case MODBUS_WRITE_SINGLE_REGISTER:
+	case MODBUS_MASK_WRITE_REGISTER:
+		if (len >= 4) {
+			modbus_cache_invalidate(cache, MODBUS_TABLE_HOLDING_REGISTERS, (pdu[1] << 8) | pdu[2], 1);
+		}
+		break;
+	case MODBUS_WRITE_MULTIPLE_REGISTERS:
+		if (len >= 6) {
+			modbus_cache_invalidate(cache, MODBUS_TABLE_HOLDING_REGISTERS, (pdu[1] << 8) | pdu[2],
+					(pdu[3] << 8) | pdu[4]);
+		}
+		break;
+	case MODBUS_READ_WRITE_MULTIPLE_REGISTERS:
+		if (len >= 10) {
+			modbus_cache_invalidate(cache, MODBUS_TABLE_HOLDING_REGISTERS, (pdu[5] << 8) | pdu[6],
+					(pdu[7] << 8) | pdu[8]);
+		}
+		break;
+	default:
+		break;
+	}
+}
+#endif
+
+/* builds reply of pending transaction and releases its pool entry */
+static void modbus_pending_complete(modbus_slave_ctx_t *ctx, modbus_pending_t *pending, int8_t result,
+		uint8_t *reply, uint16_t *reply_len, uint8_t gather)
+{
+	modbus_transaction_t *transaction = &pending->transaction;
+
+	*reply_len = 0;
+	/* exception 05 may have been sent when request was parked */
+	transaction->function_code &= ~MODBUS_ERROR_FLAG;
+	transaction->exception = 0;
+	if (result != MODBUS_OK) {
+		transaction->exception = modbus_result_to_exception(result);
+		transaction->function_code |= MODBUS_ERROR_FLAG;
+	}
+	if (!transaction->payload_ready) {
+		transaction->payload = reply + MODBUS_REPLY_PAYLOAD_OFFSET;
+	}
+	if (!(ctx->pending_flags & MODBUS_PENDING_FLAG_ACKNOWLEDGE)) {
+		if (transaction->broadcast == 0) {
+			modbus_transaction_to_buffer(pending->handler, ctx, reply, reply_len, transaction, gather);
+		}
+		/* with acknowledge, completion was counted when the request was parked */
+		modbus_diag_reply(ctx, transaction->function_code, transaction->exception, transaction->broadcast == 0);
+	}
+	pending->in_use = 0;
+	ctx->pending_count--;
+}
+
+/* processes request (address + PDU, no CRC) and builds reply in reply buffer; read replies are
+ * built in place: payload points to its final position in reply before request is served.
+ * Request is processed in *transaction, or in a free pending pool entry if there is one; on
+ * return *transaction points to the one that was used. Built-in reads may be answered from cache
+ * (NULL if none): the stored frame is copied to reply, CRC included, and cache->hit is set */
+static int8_t modbus_process_slave_request(modbus_slave_ctx_t *ctx, const uint8_t *buffer, int len,
+		uint8_t *reply, uint16_t *reply_len, uint8_t flags, modbus_transaction_t **transaction_ptr, uint8_t gather,
+		struct modbus_cache *cache)
+{
+	const modbus_function_handler_t *handler;
+	/* without a way to send the reply later, requests can only be acknowledged */
+	modbus_pending_t *pending = (flags & MODBUS_REQUEST_FLAG_NO_DEFER) &&
+			!(ctx->pending_flags & MODBUS_PENDING_FLAG_ACKNOWLEDGE) ? NULL : modbus_pending_reserve(ctx);
+	modbus_transaction_t *transaction = *transaction_ptr;
+	uint8_t buffer_pos = 0;
+	int8_t result;
+
+#if !MODBUS_ENABLE_RESPONSE_CACHE
+	(void)cache;
+#endif
+	if (pending != NULL) {
+		transaction = &pending->transaction;
+		*transaction_ptr = transaction;
+	}
+
+	*reply_len = 0;
+	if (len < MODBUS_MINIMAL_FRAME_LEN - 2) {
+		/* request too short; return error (no reply needed) */
+		return MODBUS_ERROR_FRAME_INVALID;
+	}
+	/* check if address matches ours */
+	uint8_t address = buffer[buffer_pos++];
+	transaction->address = address;
+	transaction->broadcast = (address == MODBUS_BROADCAST_ADDR) && !(flags & MODBUS_REQUEST_FLAG_ANY_ADDRESS);
+	if (address != ctx->address && transaction->broadcast != 1 && !(flags & MODBUS_REQUEST_FLAG_ANY_ADDRESS)) {
+		/* Message is not for us (no reply needed) */
+		return MODBUS_OK;
+	}
+	if (!modbus_diag_request(ctx, buffer, len, transaction->broadcast)) {
+		/* listen only mode (no reply) */
+		return MODBUS_OK;
+	}
+	/* get function code */
+	transaction->function_code = buffer[buffer_pos++];
+	transaction->exception = 0;
+	transaction->payload = reply + MODBUS_REPLY_PAYLOAD_OFFSET;
+	transaction->payload_ready = 0;
+	handler = modbus_function_lookup(ctx, transaction->function_code);
+	if ((ctx->pending_flags & MODBUS_PENDING_FLAG_BUSY) && ctx->pending_count > 0) {
+		/* still working on previous request */
+		transaction->exception = MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY;
+	} else if (handler == NULL) {
+		/* function code not known / not implemented, reply with
+		 * ExceptionCode 1 */
+		transaction->exception = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+#if MODBUS_ENABLE_RESPONSE_CACHE
+	} else if (cache != NULL && handler == &modbus_function_handlers[modbus_function_index[transaction->function_code]] &&
+			modbus_cache_lookup(cache, buffer, len) != NULL) {
+		/* stored reply of built-in read handler */
+		memcpy(reply, cache->hit->frame, cache->hit->len);
+		*reply_len = cache->hit->len - 2;
+		modbus_diag_reply(ctx, transaction->function_code, 0, 1);
+		return MODBUS_OK;
+#endif
+	} else {
+		if (len - buffer_pos < handler->min_len) {
+			/* buffer too short to contain everything we need (no reply) */
+			modbus_diag_no_reply(ctx);
+			return MODBUS_OK;
+		}
+		if (handler->parse != NULL) {
+			result = handler->parse(ctx, buffer + buffer_pos, len - buffer_pos, transaction);
+			if (result != MODBUS_OK) {
+				/* no response to master is needed */
+				modbus_diag_no_reply(ctx);
+				return MODBUS_OK;
+			}
+		}
+		/* data in RX buffer have been processed and buffer can be re-used for TX */
+		if (transaction->exception == 0 && handler->execute != NULL) {
+			result = handler->execute(ctx, transaction);
+			if (result == MODBUS_PENDING) {
+				if (pending == NULL || !(handler->flags & MODBUS_FUNCTION_FLAG_DEFER)) {
+					/* can't be parked: pool full or function doesn't support it */
+					transaction->exception = MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY;
+				} else {
+					/* payload in reply buffer would be overwritten by next request */
+					transaction->payload_ready = 0;
+					pending->handler = handler;
+					pending->in_use = 1;
+					ctx->pending_count++;
+					if (!(ctx->pending_flags & MODBUS_PENDING_FLAG_ACKNOWLEDGE)) {
+						/* reply is sent by modbus_slave_ctx_complete() */
+						return MODBUS_OK;
+					}
+					transaction->exception = MODBUS_EXCEPTION_ACKNOWLEDGE;
+				}
+			} else if (result != MODBUS_OK && transaction->exception == 0) {
+				transaction->exception = modbus_result_to_exception(result);
+			}
+		}
+	}
+	if (transaction->exception != 0) {
+		/* indicate error */
+		transaction->function_code |= MODBUS_ERROR_FLAG;
+	}
+	/* reply only if message was not broadcast */
+	if (transaction->broadcast == 0) {
+		modbus_transaction_to_buffer(handler, ctx, reply, reply_len, transaction, gather);
+	}
+	modbus_diag_reply(ctx, transaction->function_code, transaction->exception, transaction->broadcast == 0);
+	return MODBUS_OK;
+}
+
+/* CRC at the end of RTU frame matches */
+static uint8_t modbus_frame_crc_ok(const uint8_t *buffer, int len)
+{
+	uint16_t crc_received = (buffer[len - 1] << 8) | buffer[len - 2];
+
+	return crc_received == modbus_CRC16(buffer, len - 2);
+}
+
+/* whether frame for address is going to be processed by ctx (or one of its virtual slaves) */
+static uint8_t modbus_address_served(const modbus_slave_ctx_t *ctx, uint8_t address)
+{
+	if (address == MODBUS_BROADCAST_ADDR) {
+		return 1;
+	}
+	if (ctx->slave_table != NULL) {
+		return ctx->slave_table->slaves[address] != NULL;
+	}
+	return address == ctx->address;
+}
+
+/* routes request to virtual slave of its address if ctx has slave table, see modbus_process_slave_request() */
+static int8_t modbus_process_request(modbus_slave_ctx_t *ctx, const uint8_t *buffer, int len,
+		uint8_t *reply, uint16_t *reply_len, uint8_t flags, modbus_transaction_t **transaction_ptr, uint8_t gather)
+{
+	modbus_slave_table_t *table = ctx->slave_table;
+	modbus_transaction_t *local_transaction = *transaction_ptr;
+	modbus_slave_ctx_t *slave;
+
+#if MODBUS_ENABLE_RESPONSE_CACHE
+	/* every entry point (RTU frame, TCP / serial request) passes here */
+	if (ctx->cache != NULL) {
+		ctx->cache->store = NULL;
+		ctx->cache->hit = NULL;
+		if (len >= MODBUS_MINIMAL_FRAME_LEN - 2) {
+			modbus_cache_invalidate_written(ctx->cache, buffer, len);
+		}
+	}
+#endif
+	if (table == NULL || len < MODBUS_MINIMAL_FRAME_LEN - 2) {
+		return modbus_process_slave_request(ctx, buffer, len, reply, reply_len, flags, transaction_ptr, gather,
+				ctx->cache);
+	}
+	if (buffer[0] == MODBUS_BROADCAST_ADDR && !(flags & MODBUS_REQUEST_FLAG_ANY_ADDRESS)) {
+		/* every virtual slave executes broadcast, none replies */
+		for (uint16_t address = 1; address < 256; address++) {
+			if (table->slaves[address] != NULL) {
+				*transaction_ptr = local_transaction;
+				modbus_process_slave_request(table->slaves[address], buffer, len, reply, reply_len, flags,
+						transaction_ptr, gather, ctx->cache);
+			}
+		}
+		*reply_len = 0;
+		return MODBUS_OK;
+	}
+	slave = table->slaves[buffer[0]];
+	if (slave == NULL) {
+		/* Message is not for us (no reply needed) */
+		*reply_len = 0;
+		return MODBUS_OK;
+	}
+	return modbus_process_slave_request(slave, buffer, len, reply, reply_len, flags, transaction_ptr, gather,
+			ctx->cache);
+}
+
+/* serves frame with CRC already checked (or not needed) and sends reply */
+static int8_t modbus_process_checked_frame(modbus_slave_ctx_t *ctx, const uint8_t *buffer, int len)
+{
+	modbus_transaction_t local_transaction;
+	modbus_transaction_t *transaction = &local_transaction;
+	uint8_t *reply = (ctx->reply_buffer != NULL) ? ctx->reply_buffer : ctx->buffer;
+	uint16_t msg_len;
+	int8_t result;
+
+	if (len < MODBUS_MINIMAL_FRAME_LEN || len > MODBUS_MAX_RTU_FRAME_SIZE) {
+		/* frame too short or longer than any request this build serves; return error (no reply needed) */
+		modbus_diag_frame(ctx, MODBUS_ERROR_FRAME_INVALID);
+		return MODBUS_ERROR_FRAME_INVALID;
+	}
+	modbus_diag_frame(ctx, MODBUS_OK);
+	/* CRC is not part of the request */
+	result = modbus_process_request(ctx, buffer, len - 2, reply, &msg_len, MODBUS_REQUEST_FLAG_NONE,
+			&transaction, ctx->transmitv != NULL);
+	if (result == MODBUS_OK && msg_len != 0) {
+#if MODBUS_ENABLE_RESPONSE_CACHE
+		if (ctx->cache != NULL && ctx->cache->hit != NULL) {
+			modbus_send_cached_reply(ctx, reply, ctx->cache->hit);
+			return result;
+		}
+#endif
+		modbus_send_reply(ctx, reply, msg_len, transaction);
+	}
+#if MODBUS_ENABLE_RESPONSE_CACHE
+	if (ctx->cache != NULL) {
+		/* reply of a parked (pending) request is not stored */
+		ctx->cache->store = NULL;
+	}
+#endif
+	return result;
+}
+
+/*
+ * Public function definitions
+ */
+
+uint8_t modbus_bit_get(const uint8_t *bits, uint16_t index)
+{
+	return (bits[index >> 3] >> (index & 7)) & 0x01;
+}
+
+void modbus_bit_set(uint8_t *bits, uint16_t index, uint8_t value)
+{
+	if (value) {
+		bits[index >> 3] |= 1 << (index & 7);
+	} else {
+		bits[index >> 3] &= ~(1 << (index & 7));
+	}
+}
+
+void modbus_bits_copy(uint8_t *dst, uint32_t dst_offset, const uint8_t *src, uint32_t src_offset, uint16_t count)
+{
+	/* 56 bits per step: with shift of up to 7 bits, the chunk still fits one 64-bit word */
+	const uint8_t step = 56;
+
+	dst += dst_offset >> 3;
+	src += src_offset >> 3;
+	dst_offset &= 7;
+	src_offset &= 7;
+	if (dst_offset == 0 && src_offset == 0) {
+		/* byte aligned: plain copy, merge last partial byte */
+		memcpy(dst, src, count >> 3);
+		if (count & 7) {
+			uint8_t mask = (1 << (count & 7)) - 1;
+			dst[count >> 3] = (dst[count >> 3] & ~mask) | (src[count >> 3] & mask);
+		}
+		return;
+	}
+	while (count > 0) {
+		uint8_t n = count < step ? count : step;
+		uint8_t src_bytes = (src_offset + n + 7) >> 3;
+		uint8_t dst_bytes = (dst_offset + n + 7) >> 3;
+		uint64_t mask = ((1ULL << n) - 1) << dst_offset;
+		uint64_t chunk = (modbus_load_le(src, src_bytes) >> src_offset) << dst_offset;
+		uint64_t word = modbus_load_le(dst, dst_bytes);
+
+		modbus_store_le(dst, (word & ~mask) | (chunk & mask), dst_bytes);
+		/* 56 bits = 7 whole bytes, offsets within byte don't change */
+		src += 7;
+		dst += 7;
+		count -= n;
+	}
+}
+
+int8_t modbus_slave_ctx_init(modbus_slave_ctx_t *ctx, uint8_t address,
+		modbus_slave_callback_t callback, modbus_transmit_function_t transmit, void *user_data)
+{
+	if (ctx == NULL || callback == NULL || transmit == NULL) {
+		return MODBUS_ERROR;
+	}
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->callback = callback;
+	ctx->transmit = transmit;
+	ctx->user_data = user_data;
+	ctx->address = MODBUS_DEFAULT_SLAVE_ADDRESS;
+	if (address != MODBUS_BROADCAST_ADDR) {
+		ctx->address = address;
+	}
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_set_address(modbus_slave_ctx_t *ctx, uint8_t address)
+{
+	if (address == 0) {
+		/* address 0 is broadcast address */
+		return MODBUS_ERROR;
+	}
+	ctx->address = address;
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_process_msg(modbus_slave_ctx_t *ctx, const uint8_t *buffer, int len)
+{
+	/* TODO check that errors and exceptions are handled according to Modbus_Application_Protocol_V1_1b.pdf
+	 * (request length is checked against handler min_len by dispatcher) */
+	if (ctx->capture != NULL) {
+		modbus_capture_request(ctx, buffer, len);
+	}
+	if (len < MODBUS_MINIMAL_FRAME_LEN || len > MODBUS_MAX_RTU_FRAME_SIZE) {
+		/* frame too short or longer than any request this build serves; return error (no reply needed) */
+		modbus_diag_frame(ctx, MODBUS_ERROR_FRAME_INVALID);
+		return MODBUS_ERROR_FRAME_INVALID;
+	}
+	if (!modbus_address_served(ctx, buffer[0])) {
+		/* Message is not for us (no reply needed), don't spend time on its CRC unless asked to */
+#if MODBUS_ENABLE_DIAGNOSTICS
+		modbus_diag_frame(ctx, ctx->diagnostics.check_other_crc && !modbus_frame_crc_ok(buffer, len) ?
+				MODBUS_ERROR_CRC : MODBUS_OK);
+#endif
+		return MODBUS_OK;
+	}
+	if (!modbus_frame_crc_ok(buffer, len)) {
+		/* CRC mismatch, return error (no reply needed) */
+		modbus_diag_frame(ctx, MODBUS_ERROR_CRC);
+		return MODBUS_ERROR_CRC;
+	}
+	return modbus_process_checked_frame(ctx, buffer, len);
+}
+
+int8_t modbus_slave_ctx_process_frame(modbus_slave_ctx_t *ctx, const uint8_t *buffer, int len)
+{
+	if (ctx->capture != NULL) {
+		modbus_capture_request(ctx, buffer, len);
+	}
+	return modbus_process_checked_frame(ctx, buffer, len);
+}
+
+int8_t modbus_slave_ctx_process_request(modbus_slave_ctx_t *ctx, const uint8_t *buffer, int len,
+		uint8_t *reply, uint16_t *reply_len, uint8_t flags)
+{
+	/* transaction holds message context and content:
+	 * it wraps all necessary buffers and variables */
+	modbus_transaction_t local_transaction;
+	modbus_transaction_t *transaction = &local_transaction;
+
+	int8_t result;
+
+	if (ctx->capture != NULL) {
+		modbus_capture_without_crc(ctx, MODBUS_CAPTURE_REQUEST, buffer, len);
+	}
+	modbus_diag_frame(ctx, len < MODBUS_MINIMAL_FRAME_LEN - 2 ? MODBUS_ERROR_FRAME_INVALID : MODBUS_OK);
+	result = modbus_process_request(ctx, buffer, len, reply, reply_len, flags, &transaction, 0);
+	if (ctx->capture != NULL && *reply_len != 0) {
+		modbus_capture_without_crc(ctx, MODBUS_CAPTURE_REPLY, reply, *reply_len);
+	}
+#if MODBUS_ENABLE_RESPONSE_CACHE
+	if (ctx->cache != NULL && ctx->cache->store != NULL && result == MODBUS_OK && *reply_len != 0) {
+		/* entries are RTU frames: CRC is computed for replies being stored only */
+		uint16_t crc16 = modbus_CRC16(reply, *reply_len);
+		const uint8_t crc[2] = { crc16 & 0xff, crc16 >> 8 };
+		const modbus_iovec_t iov[2] = { { reply, *reply_len }, { crc, 2 } };
+
+		modbus_cache_store(ctx->cache, iov, 2);
+	}
+	if (ctx->cache != NULL) {
+		/* reply of a parked (pending) request is not stored */
+		ctx->cache->store = NULL;
+	}
+#endif
+	return result;
+}
+
+int8_t modbus_slave_ctx_set_pending_pool(modbus_slave_ctx_t *ctx, modbus_pending_t *pool, uint8_t size, uint8_t flags)
+{
+	if (ctx->pending_count > 0) {
+		/* pool can't be swapped while there are pending transactions */
+		return MODBUS_ERROR;
+	}
+	if (pool == NULL) {
+		size = 0;
+	}
+	for (uint8_t i = 0; i < size; i++) {
+		pool[i].in_use = 0;
+	}
+	ctx->pending = pool;
+	ctx->pending_size = size;
+	ctx->pending_flags = flags;
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_complete(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction, int8_t result)
+{
+	modbus_pending_t *pending = modbus_pending_find(ctx, transaction);
+	uint8_t *reply = (ctx->reply_buffer != NULL) ? ctx->reply_buffer : ctx->buffer;
+	uint16_t msg_len;
+
+	if (pending == NULL) {
+		return MODBUS_ERROR;
+	}
+	modbus_pending_complete(ctx, pending, result, reply, &msg_len, ctx->transmitv != NULL);
+	if (msg_len == 0) {
+		return MODBUS_OK;
+	}
+	return modbus_send_reply(ctx, reply, msg_len, transaction);
+}
+
+int8_t modbus_slave_ctx_complete_request(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction, int8_t result,
+		uint8_t *reply, uint16_t *reply_len)
+{
+	modbus_pending_t *pending = modbus_pending_find(ctx, transaction);
+
+	if (pending == NULL) {
+		*reply_len = 0;
+		return MODBUS_ERROR;
+	}
+	modbus_pending_complete(ctx, pending, result, reply, reply_len, 0);
+	if (ctx->capture != NULL && *reply_len != 0) {
+		modbus_capture_without_crc(ctx, MODBUS_CAPTURE_REPLY, reply, *reply_len);
+	}
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_register_function(modbus_slave_ctx_t *ctx, uint8_t function_code,
+		const modbus_function_handler_t *handler)
+{
+	if (ctx == NULL) {
+		return MODBUS_ERROR;
+	}
+#if MODBUS_MAX_USER_FUNCTIONS > 0
+	for (uint8_t i = 0; i < ctx->user_function_count; i++) {
+		if (ctx->user_function_codes[i] == function_code) {
+			ctx->user_functions[i] = handler;
+			return MODBUS_OK;
+		}
+	}
+	if (ctx->user_function_count >= MODBUS_MAX_USER_FUNCTIONS) {
+		return MODBUS_ERROR_OUT_OF_BOUNDS;
+	}
+	ctx->user_function_codes[ctx->user_function_count] = function_code;
+	ctx->user_functions[ctx->user_function_count] = handler;
+	ctx->user_function_count++;
+	return MODBUS_OK;
+#else
+	(void)function_code;
+	(void)handler;
+	return MODBUS_ERROR_OUT_OF_BOUNDS;
+#endif
+}
+
+int8_t modbus_slave_ctx_serve(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	int8_t result = MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+
+	if (ctx->register_map != NULL) {
+		/* memory-backed registers first */
+		result = modbus_register_map_serve(ctx, ctx->register_map, transaction);
+	}
+	if (result == MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED) {
+		/* not mapped */
+		result = ctx->callback(ctx, transaction);
+	}
+	return result;
+}
+
+int8_t modbus_slave_ctx_set_reply_buffer(modbus_slave_ctx_t *ctx, uint8_t *buffer)
+{
+	if (ctx == NULL) {
+		return MODBUS_ERROR;
+	}
+	ctx->reply_buffer = buffer;
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_set_transmitv(modbus_slave_ctx_t *ctx, modbus_transmitv_function_t transmitv)
+{
+	if (ctx == NULL) {
+		return MODBUS_ERROR;
+	}
+	ctx->transmitv = transmitv;
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_set_slave_table(modbus_slave_ctx_t *ctx, modbus_slave_table_t *table)
+{
+	if (ctx == NULL) {
+		return MODBUS_ERROR;
+	}
+	ctx->slave_table = table;
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_table_init(modbus_slave_table_t *table)
+{
+	if (table == NULL) {
+		return MODBUS_ERROR;
+	}
+	memset(table, 0, sizeof(*table));
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_table_add(modbus_slave_table_t *table, modbus_slave_ctx_t *slave)
+{
+	if (table == NULL || slave == NULL || slave->address == MODBUS_BROADCAST_ADDR ||
+			table->slaves[slave->address] != NULL) {
+		return MODBUS_ERROR;
+	}
+	table->slaves[slave->address] = slave;
+	table->count++;
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_table_remove(modbus_slave_table_t *table, uint8_t address)
+{
+	if (table == NULL || table->slaves[address] == NULL) {
+		return MODBUS_ERROR;
+	}
+	table->slaves[address] = NULL;
+	table->count--;
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_set_capture(modbus_slave_ctx_t *ctx, modbus_capture_function_t capture, void *capture_data)
+{
+	if (ctx == NULL) {
+		return MODBUS_ERROR;
+	}
+	ctx->capture = capture;
+	ctx->capture_data = capture_data;
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_set_register_map(modbus_slave_ctx_t *ctx, struct modbus_register_map *map)
+{
+	if (ctx == NULL) {
+		return MODBUS_ERROR;
+	}
+	ctx->register_map = map;
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_set_file_map(modbus_slave_ctx_t *ctx, struct modbus_file_map *map)
+{
+	if (ctx == NULL) {
+		return MODBUS_ERROR;
+	}
+	ctx->file_map = map;
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_set_cache(modbus_slave_ctx_t *ctx, struct modbus_cache *cache)
+{
+	if (ctx == NULL) {
+		return MODBUS_ERROR;
+	}
+	ctx->cache = cache;
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_add_fifo(modbus_slave_ctx_t *ctx, struct modbus_fifo *fifo)
+{
+	if (ctx == NULL || fifo == NULL || modbus_fifo_find(ctx->fifos, fifo->address) != NULL) {
+		return MODBUS_ERROR;
+	}
+	fifo->next = ctx->fifos;
+	ctx->fifos = fifo;
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_frame_handler(const uint8_t *frame, int len, void *user_data)
+{
+	return modbus_slave_ctx_process_frame((modbus_slave_ctx_t *)user_data, frame, len);
+}
+
+const modbus_diagnostics_t *modbus_slave_ctx_diagnostics(const modbus_slave_ctx_t *ctx)
+{
+#if MODBUS_ENABLE_DIAGNOSTICS
+	return ctx != NULL ? &ctx->diagnostics : NULL;
+#else
+	(void)ctx;
+	return NULL;
+#endif
+}
+
+int8_t modbus_slave_ctx_clear_diagnostics(modbus_slave_ctx_t *ctx)
+{
+	if (ctx == NULL) {
+		return MODBUS_ERROR;
+	}
+#if MODBUS_ENABLE_DIAGNOSTICS
+	modbus_diag_clear(&ctx->diagnostics, 1);
+#endif
+	return MODBUS_OK;
+}
+
+int8_t modbus_slave_ctx_count_error(modbus_slave_ctx_t *ctx, int8_t error)
+{
+	if (ctx == NULL || (error != MODBUS_ERROR_CRC && error != MODBUS_ERROR_FRAME_INVALID &&
+			error != MODBUS_ERROR_OUT_OF_BOUNDS)) {
+		return MODBUS_ERROR;
+	}
+	modbus_diag_frame(ctx, error);
+	return MODBUS_OK;
+}
+
+uint8_t modbus_slave_ctx_event_log(const modbus_slave_ctx_t *ctx, uint8_t *events, uint8_t max)
+{
+#if MODBUS_ENABLE_DIAGNOSTICS
+	const modbus_diagnostics_t *diag = &ctx->diagnostics;
+	uint8_t count = MODBUS_MIN(diag->event_count, max);
+	uint8_t pos = diag->event_head;
+
+	for (uint8_t i = 0; i < count; i++) {
+		pos = (pos + MODBUS_EVENT_LOG_SIZE - 1) % MODBUS_EVENT_LOG_SIZE;
+		events[i] = diag->events[pos];
+	}
+	return count;
+#else
+	(void)ctx;
+	(void)events;
+	(void)max;
+	return 0;
+#endif
+}
+
+int8_t modbus_slave_ctx_init_device_id(modbus_slave_ctx_t *ctx, modbus_device_id_t *device_id)
+{
+	int8_t result;
+
 	if (device_id == NULL) {
 		return MODBUS_ERROR;
 	}
@@ -417,8 +2028,50 @@ int8_t modbus_slave_init_device_id(modbus_device_id_t *device_id)
 	) {
 		return MODBUS_ERROR;
 	}
-	/* set conformity level: currently only "basic" and "regular" is implemented */
-	if ( 	device_id->object_id[3] != NULL &&
+	if (device_id->extended_count > MODBUS_DEVICE_ID_MAX_EXTENDED ||
+			(device_id->extended_count > 0 && device_id->extended_objects == NULL)) {
+		return MODBUS_ERROR;
+	}
+	/* serialize all objects once; replies are served by copying slices of them */
+	device_id->object_count = 0;
+	device_id->offset[0] = 0;
+	for (uint8_t id = 0; id < MODBUS_DEVICE_ID_OBJECT_NUM; id++) {
+		if (device_id->object_id[id] == NULL) {
+			continue;
+		}
+		result = modbus_device_id_add_object(device_id, id, (const uint8_t *)device_id->object_id[id],
+				strlen(device_id->object_id[id]));
+		if (result != MODBUS_OK) {
+			return result;
+		}
+	}
+	device_id->category_end[MODBUS_CONFORMITY_BASIC - 1] = MODBUS_BASIC_OBJECT_COUNT;
+	device_id->category_end[MODBUS_CONFORMITY_REGULAR - 1] = device_id->object_count;
+	for (uint8_t i = 0; i < device_id->extended_count; i++) {
+		const modbus_device_id_object_t *object = &device_id->extended_objects[i];
+		if (object->id < MODBUS_EXTENDED_OBJECT_FIRST_ID || (i > 0 && object->id <= device_id->extended_objects[i - 1].id)) {
+			/* ids have to be sorted, lookup is a binary search */
+			return MODBUS_ERROR;
+		}
+		result = modbus_device_id_add_object(device_id, object->id, object->value, object->len);
+		if (result != MODBUS_OK) {
+			return result;
+		}
+	}
+	device_id->category_end[MODBUS_CONFORMITY_EXTENDED - 1] = device_id->object_count;
+	/* split points for stream access: last object that fits into reply starting at object i */
+	for (uint8_t i = 0; i < device_id->object_count; i++) {
+		uint8_t last = i + 1;
+		while (last < device_id->object_count &&
+				device_id->offset[last + 1] - device_id->offset[i] <= MODBUS_READ_DEVICE_ID_MAX_OBJECTS_LEN) {
+			last++;
+		}
+		device_id->page_end[i] = last;
+	}
+	/* set conformity level */
+	if (device_id->extended_count > 0) {
+		device_id->conformity_level = MODBUS_CONFORMITY_EXTENDED;
+	} else if ( 	device_id->object_id[3] != NULL &&
 			device_id->object_id[4] != NULL &&
 			device_id->object_id[5] != NULL
 
@@ -430,6 +2083,6 @@ int8_t modbus_slave_init_device_id(modbus_device_id_t *device_id)
 	}
 	/* we support both stream and individual access to objects */
 	device_id->conformity_level |= MODBUS_DEVICE_ID_INDIVIDUAL_ACCESS_FLAG;
-	modbus_device_id = device_id;
+	ctx->device_id = device_id;
 	return MODBUS_OK;
 }
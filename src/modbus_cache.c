@@ -0,0 +1,156 @@
+/*
+ * modbus_cache.c
+ *
+ *  Read-through response cache, see modbus_cache.h
+ */
+
+#include "modbus_cache.h"
+
+/*
+ * Private functions
+ */
+
+/* request is address, function code, start and count (big-endian) */
+static uint64_t modbus_cache_key(const uint8_t *request)
+{
+	return ((uint64_t)request[0] << 40) | ((uint64_t)request[1] << 32) | ((uint32_t)request[2] << 24) |
+			(request[3] << 16) | (request[4] << 8) | request[5];
+}
+
+static modbus_cache_entry_t *modbus_cache_slot(modbus_cache_t *cache, uint64_t key)
+{
+	return &cache->entries[((key * 0x9E3779B97F4A7C15ULL) >> 40) & cache->mask];
+}
+
+static uint8_t modbus_cache_key_table(uint64_t key)
+{
+	return ((key >> 32) & 0xff) == MODBUS_READ_INPUT_REGISTERS ? MODBUS_TABLE_INPUT_REGISTERS :
+			MODBUS_TABLE_HOLDING_REGISTERS;
+}
+
+/* range containing the whole request, or NULL */
+static const modbus_cache_range_t *modbus_cache_range(const modbus_cache_t *cache, uint8_t table, uint16_t start,
+		uint16_t count)
+{
+	for (uint16_t i = 0; i < cache->range_count; i++) {
+		const modbus_cache_range_t *range = &cache->ranges[i];
+
+		if (range->table == table && start >= range->start &&
+				(uint32_t)start + count <= (uint32_t)range->start + range->count) {
+			return range;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Public function definitions
+ */
+
+int8_t modbus_cache_init(modbus_cache_t *cache, modbus_cache_entry_t *entries, uint16_t count,
+		const modbus_cache_range_t *ranges, uint16_t range_count, modbus_cache_clock_t clock, void *clock_data)
+{
+	if (cache == NULL || entries == NULL || count == 0 || (count & (count - 1)) != 0 ||
+			(ranges == NULL && range_count > 0) || clock == NULL) {
+		return MODBUS_ERROR;
+	}
+	memset(cache, 0, sizeof(*cache));
+	cache->entries = entries;
+	cache->mask = count - 1;
+	cache->ranges = ranges;
+	cache->range_count = range_count;
+	cache->clock = clock;
+	cache->clock_data = clock_data;
+	modbus_cache_clear(cache);
+	return MODBUS_OK;
+}
+
+const modbus_cache_entry_t *modbus_cache_lookup(modbus_cache_t *cache, const uint8_t *request, int len)
+{
+	const modbus_cache_range_t *range;
+	modbus_cache_entry_t *entry;
+	uint64_t key;
+	uint32_t now;
+	uint16_t start;
+	uint16_t count;
+
+	cache->store = NULL;
+	cache->hit = NULL;
+	/* read input / holding registers: address, function code, start, count */
+	if (len != 6 || (request[1] != MODBUS_READ_INPUT_REGISTERS && request[1] != MODBUS_READ_HOLDING_REGISTERS) ||
+			request[0] == MODBUS_BROADCAST_ADDR) {
+		return NULL;
+	}
+	key = modbus_cache_key(request);
+	entry = modbus_cache_slot(cache, key);
+	now = cache->clock(cache->clock_data);
+	if (entry->key == key) {
+		if ((int32_t)(now - entry->expires_ms) < 0) {
+			cache->stats.hits++;
+			cache->hit = entry;
+			return entry;
+		}
+		cache->stats.expired++;
+	}
+	start = (request[2] << 8) | request[3];
+	count = (request[4] << 8) | request[5];
+	range = modbus_cache_range(cache, modbus_cache_key_table(key), start, count);
+	if (range == NULL) {
+		return NULL;
+	}
+	cache->stats.misses++;
+	cache->store = entry;
+	cache->store_key = key;
+	cache->store_expires_ms = now + range->ttl_ms;
+	return NULL;
+}
+
+void modbus_cache_store(modbus_cache_t *cache, const modbus_iovec_t *iov, uint8_t iov_count)
+{
+	modbus_cache_entry_t *entry = cache->store;
+	uint16_t len = 0;
+
+	cache->store = NULL;
+	if (entry == NULL || iov_count == 0 || iov[0].len < 2 || (iov[0].data[1] & MODBUS_ERROR_FLAG)) {
+		/* nothing to store, or exception (not cached) */
+		return;
+	}
+	/* slot may hold another reply, which is being overwritten */
+	entry->key = 0;
+	for (uint8_t i = 0; i < iov_count; i++) {
+		if (len + iov[i].len > MODBUS_MAX_RTU_FRAME_SIZE) {
+			return;
+		}
+		memcpy(entry->frame + len, iov[i].data, iov[i].len);
+		len += iov[i].len;
+	}
+	entry->key = cache->store_key;
+	entry->expires_ms = cache->store_expires_ms;
+	entry->len = len;
+}
+
+void modbus_cache_invalidate(modbus_cache_t *cache, uint8_t table, uint16_t start, uint16_t count)
+{
+	uint32_t end = (uint32_t)start + count;
+
+	for (uint32_t i = 0; i <= cache->mask; i++) {
+		modbus_cache_entry_t *entry = &cache->entries[i];
+		uint16_t entry_start = (entry->key >> 16) & 0xffff;
+		uint16_t entry_count = entry->key & 0xffff;
+
+		if (entry->key != 0 && modbus_cache_key_table(entry->key) == table && entry_start < end &&
+				start < (uint32_t)entry_start + entry_count) {
+			entry->key = 0;
+			cache->stats.invalidations++;
+		}
+	}
+}
+
+void modbus_cache_clear(modbus_cache_t *cache)
+{
+	for (uint32_t i = 0; i <= cache->mask; i++) {
+		cache->entries[i].key = 0;
+	}
+	cache->store = NULL;
+	cache->hit = NULL;
+}
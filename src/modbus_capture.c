@@ -0,0 +1,398 @@
+/*
+ * modbus_capture.c
+ *
+ *  Wire traffic capture and replay, see modbus_capture.h
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "modbus_capture.h"
+
+/*
+ * Private functions
+ */
+
+static void modbus_capture_put16(uint8_t *buffer, uint16_t value)
+{
+	buffer[0] = value & 0xff;
+	buffer[1] = value >> 8;
+}
+
+static void modbus_capture_put32(uint8_t *buffer, uint32_t value)
+{
+	modbus_capture_put16(buffer, value & 0xffff);
+	modbus_capture_put16(buffer + 2, value >> 16);
+}
+
+static uint16_t modbus_capture_get16(const uint8_t *buffer)
+{
+	return buffer[0] | (buffer[1] << 8);
+}
+
+static uint32_t modbus_capture_get32(const uint8_t *buffer)
+{
+	return modbus_capture_get16(buffer) | ((uint32_t)modbus_capture_get16(buffer + 2) << 16);
+}
+
+static uint64_t modbus_capture_now_us(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int8_t modbus_capture_write_all(int fd, const uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t written = write(fd, data, len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return MODBUS_ERROR;
+		}
+		data += written;
+		len -= written;
+	}
+	return MODBUS_OK;
+}
+
+/* copies len bytes to ring at free-running position pos */
+static void modbus_capture_ring_copy(modbus_capture_t *capture, uint32_t pos, const uint8_t *data, uint32_t len)
+{
+	uint32_t offset = pos & capture->mask;
+	uint32_t first = MODBUS_MIN(len, capture->mask + 1 - offset);
+
+	memcpy(capture->buffer + offset, data, first);
+	memcpy(capture->buffer, data + first, len - first);
+}
+
+/* writes published records to file (consumer side) */
+static void modbus_capture_flush(modbus_capture_t *capture)
+{
+	uint32_t tail = capture->tail; /* own index */
+	/* acquire: records of published head are visible */
+	uint32_t head = __atomic_load_n(&capture->head, __ATOMIC_ACQUIRE);
+
+	while (tail != head) {
+		uint32_t offset = tail & capture->mask;
+		uint32_t len = MODBUS_MIN(head - tail, capture->mask + 1 - offset);
+
+		if (modbus_capture_write_all(capture->fd, capture->buffer + offset, len) != MODBUS_OK) {
+			capture->write_errors++;
+		}
+		tail += len;
+		/* release: we're done with the bytes before producer may reuse them */
+		__atomic_store_n(&capture->tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+static void *modbus_capture_thread(void *arg)
+{
+	modbus_capture_t *capture = (modbus_capture_t *)arg;
+	struct timespec period = { 0, MODBUS_CAPTURE_FLUSH_MS * 1000000L };
+
+	while (__atomic_load_n(&capture->running, __ATOMIC_ACQUIRE)) {
+		modbus_capture_flush(capture);
+		nanosleep(&period, NULL);
+	}
+	return NULL;
+}
+
+/* pcap has no direction: a frame right after a request, with its address and function code, is the reply */
+static uint8_t modbus_replay_pcap_direction(modbus_replay_t *replay, const uint8_t *data, uint16_t len)
+{
+	if (replay->after_request && len >= 2 && data[0] == replay->request_address &&
+			(data[1] & ~MODBUS_ERROR_FLAG) == replay->request_function) {
+		return MODBUS_CAPTURE_REPLY;
+	}
+	return MODBUS_CAPTURE_REQUEST;
+}
+
+/*
+ * Public function definitions
+ */
+
+int8_t modbus_capture_open(modbus_capture_t *capture, const char *path, uint8_t format, uint8_t *buffer,
+		uint32_t size)
+{
+	uint8_t header[MODBUS_CAPTURE_PCAP_HEADER_LEN] = { 0 };
+	uint16_t header_len;
+	uint64_t now_us = modbus_capture_now_us(CLOCK_REALTIME);
+
+	if (capture == NULL || buffer == NULL || (size & (size - 1)) != 0 ||
+			size < MODBUS_CAPTURE_PCAP_RECORD_LEN + MODBUS_MAX_RTU_FRAME_SIZE) {
+		return MODBUS_ERROR;
+	}
+	if (format == MODBUS_CAPTURE_FORMAT_LOG) {
+		memcpy(header, MODBUS_CAPTURE_LOG_MAGIC, 4);
+		modbus_capture_put16(header + 4, MODBUS_CAPTURE_LOG_VERSION);
+		modbus_capture_put32(header + 8, now_us & 0xffffffff);
+		modbus_capture_put32(header + 12, now_us >> 32);
+		header_len = MODBUS_CAPTURE_LOG_HEADER_LEN;
+	} else if (format == MODBUS_CAPTURE_FORMAT_PCAP) {
+		modbus_capture_put32(header, 0xa1b2c3d4); /* microsecond timestamps */
+		modbus_capture_put16(header + 4, 2);
+		modbus_capture_put16(header + 6, 4);
+		modbus_capture_put32(header + 16, MODBUS_MAX_RTU_FRAME_SIZE); /* snap length */
+		modbus_capture_put32(header + 20, MODBUS_CAPTURE_LINKTYPE);
+		header_len = MODBUS_CAPTURE_PCAP_HEADER_LEN;
+	} else {
+		return MODBUS_ERROR;
+	}
+	capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (capture->fd < 0) {
+		return MODBUS_ERROR;
+	}
+	if (modbus_capture_write_all(capture->fd, header, header_len) != MODBUS_OK) {
+		close(capture->fd);
+		return MODBUS_ERROR;
+	}
+	capture->buffer = buffer;
+	capture->mask = size - 1;
+	capture->format = format;
+	capture->head = 0;
+	capture->last_us = now_us;
+	capture->records = 0;
+	capture->dropped = 0;
+	capture->tail = 0;
+	capture->write_errors = 0;
+	capture->running = 1;
+	if (pthread_create(&capture->thread, NULL, modbus_capture_thread, capture) != 0) {
+		close(capture->fd);
+		return MODBUS_ERROR;
+	}
+	return MODBUS_OK;
+}
+
+void modbus_capture_frame(modbus_capture_t *capture, uint8_t direction, const modbus_iovec_t *iov, uint8_t iov_count)
+{
+	uint8_t header[MODBUS_CAPTURE_PCAP_RECORD_LEN];
+	uint32_t head = capture->head; /* own index, no ordering needed */
+	/* acquire: writer is done with the bytes before we overwrite them */
+	uint32_t tail = __atomic_load_n(&capture->tail, __ATOMIC_ACQUIRE);
+	uint64_t now_us = modbus_capture_now_us(CLOCK_REALTIME);
+	uint32_t header_len;
+	uint32_t len = 0;
+
+	for (uint8_t i = 0; i < iov_count; i++) {
+		len += iov[i].len;
+	}
+	if (capture->format == MODBUS_CAPTURE_FORMAT_LOG) {
+		uint64_t delta_us = now_us - capture->last_us;
+
+		header_len = MODBUS_CAPTURE_LOG_RECORD_LEN;
+		modbus_capture_put32(header, delta_us > UINT32_MAX ? UINT32_MAX : (uint32_t)delta_us);
+		modbus_capture_put16(header + 4, len);
+		header[6] = direction;
+		header[7] = 0;
+	} else {
+		header_len = MODBUS_CAPTURE_PCAP_RECORD_LEN;
+		modbus_capture_put32(header, now_us / 1000000);
+		modbus_capture_put32(header + 4, now_us % 1000000);
+		modbus_capture_put32(header + 8, len);
+		modbus_capture_put32(header + 12, len);
+	}
+	if (capture->mask + 1 - (head - tail) < header_len + len) {
+		capture->dropped++;
+		return;
+	}
+	capture->last_us = now_us;
+	modbus_capture_ring_copy(capture, head, header, header_len);
+	head += header_len;
+	for (uint8_t i = 0; i < iov_count; i++) {
+		modbus_capture_ring_copy(capture, head, iov[i].data, iov[i].len);
+		head += iov[i].len;
+	}
+	capture->records++;
+	/* release: record is visible before the new head */
+	__atomic_store_n(&capture->head, head, __ATOMIC_RELEASE);
+}
+
+void modbus_capture_hook(modbus_slave_ctx_t *ctx, uint8_t direction, const modbus_iovec_t *iov, uint8_t iov_count)
+{
+	modbus_capture_frame((modbus_capture_t *)ctx->capture_data, direction, iov, iov_count);
+}
+
+int8_t modbus_capture_close(modbus_capture_t *capture)
+{
+	__atomic_store_n(&capture->running, 0, __ATOMIC_RELEASE);
+	pthread_join(capture->thread, NULL);
+	modbus_capture_flush(capture);
+	if (close(capture->fd) != 0) {
+		capture->write_errors++;
+	}
+	capture->fd = -1;
+	return capture->write_errors == 0 ? MODBUS_OK : MODBUS_ERROR;
+}
+
+int8_t modbus_replay_open(modbus_replay_t *replay, const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	memset(replay, 0, sizeof(*replay));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return MODBUS_ERROR;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < MODBUS_CAPTURE_LOG_HEADER_LEN) {
+		close(fd);
+		return MODBUS_ERROR;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* mapping stays valid after the descriptor is closed */
+	close(fd);
+	if (map == MAP_FAILED) {
+		return MODBUS_ERROR;
+	}
+	replay->map = map;
+	replay->size = st.st_size;
+	if (memcmp(replay->map, MODBUS_CAPTURE_LOG_MAGIC, 4) == 0 &&
+			modbus_capture_get16(replay->map + 4) == MODBUS_CAPTURE_LOG_VERSION) {
+		replay->format = MODBUS_CAPTURE_FORMAT_LOG;
+	} else if (replay->size >= MODBUS_CAPTURE_PCAP_HEADER_LEN && modbus_capture_get32(replay->map) == 0xa1b2c3d4 &&
+			modbus_capture_get32(replay->map + 20) == MODBUS_CAPTURE_LINKTYPE) {
+		replay->format = MODBUS_CAPTURE_FORMAT_PCAP;
+	} else {
+		modbus_replay_close(replay);
+		return MODBUS_ERROR;
+	}
+	modbus_replay_rewind(replay);
+	return MODBUS_OK;
+}
+
+void modbus_replay_rewind(modbus_replay_t *replay)
+{
+	if (replay->format == MODBUS_CAPTURE_FORMAT_LOG) {
+		replay->pos = MODBUS_CAPTURE_LOG_HEADER_LEN;
+		replay->time_us = modbus_capture_get32(replay->map + 8) |
+				((uint64_t)modbus_capture_get32(replay->map + 12) << 32);
+	} else {
+		replay->pos = MODBUS_CAPTURE_PCAP_HEADER_LEN;
+		replay->time_us = 0;
+	}
+	replay->after_request = 0;
+	replay->expected = NULL;
+	replay->expected_len = 0;
+}
+
+int8_t modbus_replay_next(modbus_replay_t *replay, modbus_capture_record_t *record)
+{
+	const uint8_t *header = replay->map + replay->pos;
+	size_t left = replay->size - replay->pos;
+
+	if (left == 0) {
+		return MODBUS_ERROR;
+	}
+	if (replay->format == MODBUS_CAPTURE_FORMAT_LOG) {
+		if (left < MODBUS_CAPTURE_LOG_RECORD_LEN) {
+			return MODBUS_ERROR_FRAME_INVALID;
+		}
+		record->len = modbus_capture_get16(header + 4);
+		record->direction = header[6];
+		replay->time_us += modbus_capture_get32(header);
+		left -= MODBUS_CAPTURE_LOG_RECORD_LEN;
+		replay->pos += MODBUS_CAPTURE_LOG_RECORD_LEN;
+	} else {
+		if (left < MODBUS_CAPTURE_PCAP_RECORD_LEN) {
+			return MODBUS_ERROR_FRAME_INVALID;
+		}
+		record->len = modbus_capture_get32(header + 8);
+		replay->time_us = (uint64_t)modbus_capture_get32(header) * 1000000 + modbus_capture_get32(header + 4);
+		left -= MODBUS_CAPTURE_PCAP_RECORD_LEN;
+		replay->pos += MODBUS_CAPTURE_PCAP_RECORD_LEN;
+	}
+	if (left < record->len) {
+		return MODBUS_ERROR_FRAME_INVALID;
+	}
+	record->data = replay->map + replay->pos;
+	record->time_us = replay->time_us;
+	replay->pos += record->len;
+	if (replay->format == MODBUS_CAPTURE_FORMAT_PCAP) {
+		record->direction = modbus_replay_pcap_direction(replay, record->data, record->len);
+	}
+	replay->after_request = record->direction == MODBUS_CAPTURE_REQUEST;
+	if (replay->after_request && record->len >= 2) {
+		replay->request_address = record->data[0];
+		replay->request_function = record->data[1];
+	}
+	return MODBUS_OK;
+}
+
+int8_t modbus_replay_run(modbus_replay_t *replay, modbus_slave_ctx_t *ctx, uint8_t flags,
+		modbus_replay_stats_t *stats)
+{
+	uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+	modbus_capture_record_t request, record;
+	uint64_t start_us = modbus_capture_now_us(CLOCK_MONOTONIC);
+	uint64_t first_us = 0;
+	uint16_t reply_len;
+	int8_t result;
+
+	memset(stats, 0, sizeof(*stats));
+	result = modbus_replay_next(replay, &record);
+	while (result == MODBUS_OK) {
+		if (record.direction != MODBUS_CAPTURE_REQUEST) {
+			/* reply without request, e.g. of a deferred request */
+			stats->skipped++;
+			result = modbus_replay_next(replay, &record);
+			continue;
+		}
+		request = record;
+		replay->expected = NULL;
+		replay->expected_len = 0;
+		result = modbus_replay_next(replay, &record);
+		if (result == MODBUS_OK && record.direction == MODBUS_CAPTURE_REPLY) {
+			replay->expected = record.data;
+			replay->expected_len = record.len >= 2 ? record.len - 2 : 0;
+			result = modbus_replay_next(replay, &record);
+		}
+		if (request.len < MODBUS_MINIMAL_FRAME_LEN ||
+				modbus_CRC16(request.data, request.len - 2) != modbus_capture_get16(request.data + request.len - 2)) {
+			stats->skipped++;
+			continue;
+		}
+		if (flags & MODBUS_REPLAY_FLAG_REALTIME) {
+			uint64_t due_us;
+			struct timespec due;
+
+			if (stats->requests == 0) {
+				first_us = request.time_us;
+			}
+			due_us = start_us + (request.time_us - first_us);
+			due.tv_sec = due_us / 1000000;
+			due.tv_nsec = (due_us % 1000000) * 1000;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+			}
+		}
+		modbus_slave_ctx_process_request(ctx, request.data, request.len - 2, reply, &reply_len,
+				MODBUS_REQUEST_FLAG_NONE);
+		stats->requests++;
+		if (reply_len == replay->expected_len && (reply_len == 0 || memcmp(reply, replay->expected, reply_len) == 0)) {
+			stats->matched++;
+		} else {
+			stats->mismatched++;
+		}
+	}
+	stats->elapsed_us = modbus_capture_now_us(CLOCK_MONOTONIC) - start_us;
+	replay->expected = NULL;
+	replay->expected_len = 0;
+	/* end of log is not an error, truncated log is */
+	return result == MODBUS_ERROR ? MODBUS_OK : result;
+}
+
+void modbus_replay_close(modbus_replay_t *replay)
+{
+	if (replay->map != NULL) {
+		munmap((void *)replay->map, replay->size);
+		replay->map = NULL;
+	}
+}
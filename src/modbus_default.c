@@ -0,0 +1,75 @@
+/*
+ * modbus_default.c
+ *
+ *  Global (non-reentrant) API: thin wrapper over modbus_default_ctx.
+ *  Kept in separate file so that applications using only modbus_slave_ctx_t
+ *  don't have to implement modbus_slave_callback() and modbus_transmit_function().
+ */
+
+#include "modbus.h"
+
+/*
+ * Private functions
+ */
+
+static int8_t modbus_default_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	return modbus_slave_callback(transaction);
+}
+
+static int8_t modbus_default_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	return modbus_transmit_function(buffer, data_len);
+}
+
+/*
+ * Global variables
+ */
+
+modbus_slave_ctx_t modbus_default_ctx = {
+	.address = MODBUS_DEFAULT_SLAVE_ADDRESS,
+	.device_id = NULL,
+	.callback = modbus_default_callback,
+	.transmit = modbus_default_transmit,
+};
+
+/*
+ * Public function definitions
+ */
+
+int8_t modbus_slave_set_address(uint8_t address)
+{
+	return modbus_slave_ctx_set_address(&modbus_default_ctx, address);
+}
+
+int8_t modbus_slave_set_slave_table(modbus_slave_table_t *table)
+{
+	return modbus_slave_ctx_set_slave_table(&modbus_default_ctx, table);
+}
+
+int8_t modbus_slave_process_msg(const uint8_t *buffer, int len)
+{
+	return modbus_slave_ctx_process_msg(&modbus_default_ctx, buffer, len);
+}
+
+int8_t modbus_slave_process_frame(const uint8_t *buffer, int len)
+{
+	return modbus_slave_ctx_process_frame(&modbus_default_ctx, buffer, len);
+}
+
+int8_t modbus_slave_set_pending_pool(modbus_pending_t *pool, uint8_t size, uint8_t flags)
+{
+	return modbus_slave_ctx_set_pending_pool(&modbus_default_ctx, pool, size, flags);
+}
+
+int8_t modbus_slave_complete(modbus_transaction_t *transaction, int8_t result)
+{
+	return modbus_slave_ctx_complete(&modbus_default_ctx, transaction, result);
+}
+
+int8_t modbus_slave_init_device_id(modbus_device_id_t *device_id)
+{
+	return modbus_slave_ctx_init_device_id(&modbus_default_ctx, device_id);
+}
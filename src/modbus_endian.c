@@ -0,0 +1,174 @@
+/*
+ * modbus_endian.c
+ *
+ *  Register byte order conversions, see modbus_endian.h
+ */
+
+#include "modbus_endian.h"
+
+/* define as 0 to use the portable kernel on any CPU */
+#ifndef MODBUS_ENDIAN_SIMD
+#define MODBUS_ENDIAN_SIMD 1
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MODBUS_ENDIAN_KERNEL "copy"
+#elif MODBUS_ENDIAN_SIMD && defined(__AVX2__)
+#define MODBUS_ENDIAN_KERNEL "avx2"
+#define MODBUS_ENDIAN_HAVE_AVX2 1
+#define MODBUS_ENDIAN_HAVE_SSE2 1
+#include <immintrin.h>
+#elif MODBUS_ENDIAN_SIMD && defined(__SSE2__)
+#define MODBUS_ENDIAN_KERNEL "sse2"
+#define MODBUS_ENDIAN_HAVE_SSE2 1
+#include <emmintrin.h>
+#elif MODBUS_ENDIAN_SIMD && defined(__ARM_NEON)
+#define MODBUS_ENDIAN_KERNEL "neon"
+#define MODBUS_ENDIAN_HAVE_NEON 1
+#include <arm_neon.h>
+#else
+#define MODBUS_ENDIAN_KERNEL "bswap"
+#endif
+
+/*
+ * Private functions
+ */
+
+/* swaps bytes of count 16-bit words from src to dst; the same operation packs and unpacks.
+ * Buffers may be unaligned, vector loads / stores are unaligned ones */
+static void modbus_swap16(uint8_t *dst, const uint8_t *src, uint16_t count)
+{
+	uint16_t i = 0;
+	uint16_t word;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	/* host order is wire order */
+	(void)i;
+	(void)word;
+	memcpy(dst, src, 2 * count);
+#else
+#ifdef MODBUS_ENDIAN_HAVE_AVX2
+	{
+		const __m256i shuffle = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+				1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+		for (; i + 16 <= count; i += 16) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+			_mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_shuffle_epi8(v, shuffle));
+		}
+	}
+#endif
+#ifdef MODBUS_ENDIAN_HAVE_SSE2
+	/* SSE2 has no byte shuffle: swap halves of 16-bit lanes with shifts */
+	for (; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+	}
+#endif
+#ifdef MODBUS_ENDIAN_HAVE_NEON
+	for (; i + 8 <= count; i += 8) {
+		vst1q_u8(dst + 2 * i, vrev16q_u8(vld1q_u8(src + 2 * i)));
+	}
+#endif
+	for (; i < count; i++) {
+		memcpy(&word, src + 2 * i, 2);
+		word = __builtin_bswap16(word);
+		memcpy(dst + 2 * i, &word, 2);
+	}
+#endif
+}
+
+static uint64_t modbus_registers_get(const uint16_t *registers, uint8_t words, uint8_t order)
+{
+	uint64_t value = 0;
+	uint16_t word;
+
+	for (uint8_t i = 0; i < words; i++) {
+		word = registers[(order & MODBUS_ORDER_CDAB) ? words - 1 - i : i];
+		if (order & MODBUS_ORDER_BADC) {
+			word = __builtin_bswap16(word);
+		}
+		value = (value << 16) | word;
+	}
+	return value;
+}
+
+static void modbus_registers_set(uint16_t *registers, uint64_t value, uint8_t words, uint8_t order)
+{
+	uint16_t word;
+
+	for (uint8_t i = words; i-- > 0;) {
+		word = value & 0xffff;
+		value >>= 16;
+		if (order & MODBUS_ORDER_BADC) {
+			word = __builtin_bswap16(word);
+		}
+		registers[(order & MODBUS_ORDER_CDAB) ? words - 1 - i : i] = word;
+	}
+}
+
+/*
+ * Public function definitions
+ */
+
+void modbus_registers_pack(uint8_t *dst, const uint16_t *src, uint16_t count)
+{
+	modbus_swap16(dst, (const uint8_t *)src, count);
+}
+
+void modbus_registers_unpack(uint16_t *dst, const uint8_t *src, uint16_t count)
+{
+	modbus_swap16((uint8_t *)dst, src, count);
+}
+
+const char *modbus_registers_kernel(void)
+{
+	return MODBUS_ENDIAN_KERNEL;
+}
+
+uint32_t modbus_get_uint32(const uint16_t *registers, uint8_t order)
+{
+	return (uint32_t)modbus_registers_get(registers, 2, order);
+}
+
+void modbus_set_uint32(uint16_t *registers, uint32_t value, uint8_t order)
+{
+	modbus_registers_set(registers, value, 2, order);
+}
+
+int32_t modbus_get_int32(const uint16_t *registers, uint8_t order)
+{
+	return (int32_t)modbus_get_uint32(registers, order);
+}
+
+void modbus_set_int32(uint16_t *registers, int32_t value, uint8_t order)
+{
+	modbus_set_uint32(registers, (uint32_t)value, order);
+}
+
+float modbus_get_float(const uint16_t *registers, uint8_t order)
+{
+	uint32_t bits = modbus_get_uint32(registers, order);
+	float value;
+
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+void modbus_set_float(uint16_t *registers, float value, uint8_t order)
+{
+	uint32_t bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	modbus_set_uint32(registers, bits, order);
+}
+
+uint64_t modbus_get_uint64(const uint16_t *registers, uint8_t order)
+{
+	return modbus_registers_get(registers, 4, order);
+}
+
+void modbus_set_uint64(uint16_t *registers, uint64_t value, uint8_t order)
+{
+	modbus_registers_set(registers, value, 4, order);
+}
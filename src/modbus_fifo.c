@@ -0,0 +1,104 @@
+/*
+ * modbus_fifo.c
+ *
+ *  FIFO queues for Read FIFO Queue (24), see modbus_fifo.h
+ */
+
+#include "modbus_fifo.h"
+
+/*
+ * Private functions
+ */
+
+static void modbus_fifo_update_high_water(modbus_fifo_t *fifo, uint32_t head)
+{
+	uint32_t used = head - __atomic_load_n(&fifo->tail, __ATOMIC_RELAXED);
+
+	if (used > fifo->high_water) {
+		fifo->high_water = used;
+	}
+}
+
+/*
+ * Public function definitions
+ */
+
+int8_t modbus_fifo_init(modbus_fifo_t *fifo, uint16_t address, uint16_t *registers, uint32_t size,
+		uint8_t sample_size)
+{
+	if (fifo == NULL || registers == NULL || size == 0 || (size & (size - 1)) != 0 ||
+			sample_size == 0 || sample_size > MODBUS_FIFO_MAX_REPLY_COUNT || sample_size > size) {
+		return MODBUS_ERROR;
+	}
+	fifo->registers = registers;
+	fifo->mask = size - 1;
+	fifo->next = NULL;
+	fifo->address = address;
+	fifo->sample_size = sample_size;
+	fifo->flags = 0;
+	fifo->head = 0;
+	fifo->overruns = 0;
+	fifo->high_water = 0;
+	fifo->tail = 0;
+	return MODBUS_OK;
+}
+
+uint32_t modbus_fifo_write(modbus_fifo_t *fifo, const uint16_t *samples, uint32_t count)
+{
+	uint32_t head = fifo->head; /* own index, no ordering needed */
+	/* acquire: consumer is done with the registers before we overwrite them */
+	uint32_t tail = __atomic_load_n(&fifo->tail, __ATOMIC_ACQUIRE);
+	uint32_t free_samples = (fifo->mask + 1 - (head - tail)) / fifo->sample_size;
+	uint32_t len;
+
+	if (count > free_samples) {
+		fifo->overruns += count - free_samples;
+		count = free_samples;
+	}
+	len = count * fifo->sample_size;
+	for (uint32_t i = 0; i < len; i++) {
+		fifo->registers[(head + i) & fifo->mask] = samples[i];
+	}
+	if (len > 0) {
+		/* release: registers are visible before the new head */
+		__atomic_store_n(&fifo->head, head + len, __ATOMIC_RELEASE);
+		modbus_fifo_update_high_water(fifo, head + len);
+	}
+	return count;
+}
+
+int8_t modbus_fifo_push(modbus_fifo_t *fifo, const uint16_t *sample)
+{
+	return modbus_fifo_write(fifo, sample, 1) == 1 ? MODBUS_OK : MODBUS_ERROR_OUT_OF_BOUNDS;
+}
+
+uint32_t modbus_fifo_count(const modbus_fifo_t *fifo)
+{
+	return __atomic_load_n(&fifo->head, __ATOMIC_ACQUIRE) - fifo->tail;
+}
+
+uint16_t modbus_fifo_read(modbus_fifo_t *fifo, uint16_t *values, uint16_t max_count)
+{
+	uint32_t tail = fifo->tail; /* own index */
+	/* acquire: registers of all published samples are visible */
+	uint32_t len = __atomic_load_n(&fifo->head, __ATOMIC_ACQUIRE) - tail;
+
+	if (len > max_count) {
+		/* whole samples only */
+		len = max_count - max_count % fifo->sample_size;
+	}
+	for (uint32_t i = 0; i < len; i++) {
+		values[i] = fifo->registers[(tail + i) & fifo->mask];
+	}
+	/* release: we're done reading the registers before producer may reuse them */
+	__atomic_store_n(&fifo->tail, tail + len, __ATOMIC_RELEASE);
+	return len;
+}
+
+modbus_fifo_t *modbus_fifo_find(modbus_fifo_t *first, uint16_t address)
+{
+	while (first != NULL && first->address != address) {
+		first = first->next;
+	}
+	return first;
+}
@@ -0,0 +1,238 @@
+/*
+ * modbus_file_record.c
+ *
+ *  File records backed by memory / memory-mapped files, see modbus_file_record.h
+ */
+
+#include "modbus_file_record.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MODBUS_FILE_HAVE_MMAP 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#define MODBUS_FILE_HAVE_MMAP 0
+#endif
+
+/*
+ * Private functions
+ */
+
+/* inserts file keeping files sorted; duplicates are rejected */
+static int8_t modbus_file_map_insert(modbus_file_map_t *map, const modbus_file_t *file)
+{
+	uint16_t pos = map->file_count;
+
+	if (map->file_count >= map->capacity) {
+		return MODBUS_ERROR_OUT_OF_BOUNDS;
+	}
+	while (pos > 0 && map->files[pos - 1].file_number > file->file_number) {
+		pos--;
+	}
+	if (pos > 0 && map->files[pos - 1].file_number == file->file_number) {
+		return MODBUS_ERROR;
+	}
+	memmove(&map->files[pos + 1], &map->files[pos], (map->file_count - pos) * sizeof(modbus_file_t));
+	map->files[pos] = *file;
+	map->file_count++;
+	return MODBUS_OK;
+}
+
+#if MODBUS_FILE_HAVE_MMAP
+static int8_t modbus_file_sync(modbus_file_t *file, uint8_t policy)
+{
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t start;
+	uintptr_t end;
+
+	if (file->map_base == NULL || file->dirty_start >= file->dirty_end) {
+		return MODBUS_OK;
+	}
+	/* msync() wants page-aligned address */
+	start = (uintptr_t)(file->data + 2 * file->dirty_start) & ~(page - 1);
+	end = (uintptr_t)(file->data + 2 * file->dirty_end);
+	file->dirty_start = file->dirty_end = 0;
+	if (msync((void *)start, end - start, policy == MODBUS_FILE_SYNC_SYNC ? MS_SYNC : MS_ASYNC) != 0) {
+		return MODBUS_ERROR;
+	}
+	return MODBUS_OK;
+}
+#endif
+
+/*
+ * Public function definitions
+ */
+
+int8_t modbus_file_map_init(modbus_file_map_t *map, modbus_file_t *files, uint16_t capacity)
+{
+	if (map == NULL || (files == NULL && capacity > 0)) {
+		return MODBUS_ERROR;
+	}
+	memset(map, 0, sizeof(*map));
+	map->files = files;
+	map->capacity = capacity;
+	return MODBUS_OK;
+}
+
+int8_t modbus_file_map_add(modbus_file_map_t *map, uint16_t file_number, void *data, uint16_t record_count,
+		uint8_t access)
+{
+	modbus_file_t file = {
+		.file_number = file_number, .access = access, .record_count = record_count, .data = data,
+	};
+
+	/* file number 0 is not valid, section 6.14 */
+	if (file_number == 0 || data == NULL || record_count == 0 || record_count > MODBUS_FILE_MAX_RECORDS) {
+		return MODBUS_ERROR;
+	}
+	return modbus_file_map_insert(map, &file);
+}
+
+int8_t modbus_file_map_add_file(modbus_file_map_t *map, uint16_t file_number, const char *path, uint8_t access)
+{
+#if MODBUS_FILE_HAVE_MMAP
+	int writable = (access & MODBUS_ACCESS_WRITE) != 0;
+	uint32_t records;
+	uint16_t files;
+	struct stat st;
+	uint8_t *base;
+	int fd;
+
+	fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	if (fd < 0) {
+		return MODBUS_ERROR;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < 2) {
+		close(fd);
+		return MODBUS_ERROR;
+	}
+	records = st.st_size / 2;
+	files = (records + MODBUS_FILE_MAX_RECORDS - 1) / MODBUS_FILE_MAX_RECORDS;
+	if (file_number == 0 || (uint32_t)file_number + files > 0x10000 ||
+			map->file_count + files > map->capacity) {
+		close(fd);
+		return MODBUS_ERROR_OUT_OF_BOUNDS;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+	/* mapping stays valid after close */
+	close(fd);
+	if (base == MAP_FAILED) {
+		return MODBUS_ERROR;
+	}
+	for (uint16_t i = 0; i < files; i++) {
+		uint32_t count = records - (uint32_t)i * MODBUS_FILE_MAX_RECORDS;
+		modbus_file_t file = {
+			.file_number = file_number + i, .access = access, .owner = (i == 0),
+			.record_count = count < MODBUS_FILE_MAX_RECORDS ? count : MODBUS_FILE_MAX_RECORDS,
+			.data = base + 2 * (uint32_t)i * MODBUS_FILE_MAX_RECORDS,
+			.map_base = base, .map_size = st.st_size,
+		};
+		if (modbus_file_map_insert(map, &file) != MODBUS_OK) {
+			/* file number already used: undo */
+			for (uint16_t j = 0; j < i; j++) {
+				modbus_file_t *added = modbus_file_map_find(map, file_number + j, 0, 1);
+				memmove(added, added + 1, (map->files + map->file_count - added - 1) * sizeof(modbus_file_t));
+				map->file_count--;
+			}
+			munmap(base, st.st_size);
+			return MODBUS_ERROR;
+		}
+	}
+	return MODBUS_OK;
+#else
+	(void)map;
+	(void)file_number;
+	(void)path;
+	(void)access;
+	return MODBUS_ERROR;
+#endif
+}
+
+void modbus_file_map_set_sync(modbus_file_map_t *map, uint8_t policy, uint16_t every)
+{
+	map->sync_policy = policy;
+	map->sync_every = every > 0 ? every : 1;
+	map->writes_since_sync = 0;
+}
+
+int8_t modbus_file_map_sync(modbus_file_map_t *map, uint8_t policy)
+{
+	int8_t result = MODBUS_OK;
+
+#if MODBUS_FILE_HAVE_MMAP
+	for (uint16_t i = 0; i < map->file_count; i++) {
+		if (map->files[i].dirty_start < map->files[i].dirty_end) {
+			map->syncs++;
+			if (modbus_file_sync(&map->files[i], policy) != MODBUS_OK) {
+				result = MODBUS_ERROR;
+			}
+		}
+	}
+#else
+	(void)policy;
+#endif
+	map->writes_since_sync = 0;
+	return result;
+}
+
+void modbus_file_map_close(modbus_file_map_t *map)
+{
+	modbus_file_map_sync(map, MODBUS_FILE_SYNC_SYNC);
+#if MODBUS_FILE_HAVE_MMAP
+	for (uint16_t i = 0; i < map->file_count; i++) {
+		if (map->files[i].owner) {
+			munmap(map->files[i].map_base, map->files[i].map_size);
+		}
+	}
+#endif
+	map->file_count = 0;
+}
+
+modbus_file_t *modbus_file_map_find(const modbus_file_map_t *map, uint16_t file_number, uint16_t record_number,
+		uint16_t count)
+{
+	uint16_t low = 0;
+	uint16_t high = map->file_count;
+
+	while (low < high) {
+		uint16_t mid = (low + high) / 2;
+		if (map->files[mid].file_number < file_number) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low == map->file_count || map->files[low].file_number != file_number ||
+			(uint32_t)record_number + count > map->files[low].record_count) {
+		return NULL;
+	}
+	return &map->files[low];
+}
+
+void modbus_file_map_written(modbus_file_t *file, uint16_t record_number, uint16_t count)
+{
+	if (file->map_base == NULL) {
+		return;
+	}
+	if (file->dirty_start >= file->dirty_end) {
+		file->dirty_start = record_number;
+		file->dirty_end = record_number + count;
+		return;
+	}
+	if (record_number < file->dirty_start) {
+		file->dirty_start = record_number;
+	}
+	if (record_number + count > file->dirty_end) {
+		file->dirty_end = record_number + count;
+	}
+}
+
+int8_t modbus_file_map_write_done(modbus_file_map_t *map)
+{
+	if (map->sync_policy == MODBUS_FILE_SYNC_NONE || ++map->writes_since_sync < map->sync_every) {
+		return MODBUS_OK;
+	}
+	return modbus_file_map_sync(map, map->sync_policy);
+}
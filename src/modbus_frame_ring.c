@@ -0,0 +1,100 @@
+/*
+ * modbus_frame_ring.c
+ *
+ *  SPSC lock-free frame ring, see modbus_frame_ring.h
+ */
+
+#include "modbus_frame_ring.h"
+
+_Static_assert((MODBUS_FRAME_RING_SIZE & (MODBUS_FRAME_RING_SIZE - 1)) == 0 && MODBUS_FRAME_RING_SIZE > 0,
+		"MODBUS_FRAME_RING_SIZE must be power of 2");
+
+#define MODBUS_FRAME_RING_MASK (MODBUS_FRAME_RING_SIZE - 1)
+
+/*
+ * Public function definitions
+ */
+
+void modbus_frame_ring_init(modbus_frame_ring_t *ring)
+{
+	ring->head = 0;
+	ring->tail = 0;
+	ring->overruns = 0;
+	ring->high_water = 0;
+}
+
+uint8_t *modbus_frame_ring_reserve(modbus_frame_ring_t *ring)
+{
+	uint32_t head = ring->head; /* own index, no ordering needed */
+	/* acquire: consumer is done with the slot before we overwrite it */
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail >= MODBUS_FRAME_RING_SIZE) {
+		ring->overruns++;
+		return NULL;
+	}
+	return ring->slots[head & MODBUS_FRAME_RING_MASK].data;
+}
+
+void modbus_frame_ring_commit(modbus_frame_ring_t *ring, int len)
+{
+	uint32_t head = ring->head;
+	uint32_t used;
+
+	ring->slots[head & MODBUS_FRAME_RING_MASK].len = len;
+	/* release: frame data are visible before the new head */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	used = head + 1 - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	if (used > ring->high_water) {
+		ring->high_water = used;
+	}
+}
+
+int8_t modbus_frame_ring_push(modbus_frame_ring_t *ring, const uint8_t *frame, int len)
+{
+	uint8_t *slot;
+
+	if (len <= 0 || len > MODBUS_MAX_RTU_FRAME_SIZE) {
+		return MODBUS_ERROR_FRAME_INVALID;
+	}
+	slot = modbus_frame_ring_reserve(ring);
+	if (slot == NULL) {
+		return MODBUS_ERROR_OUT_OF_BOUNDS;
+	}
+	memcpy(slot, frame, len);
+	modbus_frame_ring_commit(ring, len);
+	return MODBUS_OK;
+}
+
+int8_t modbus_frame_ring_frame_handler(const uint8_t *frame, int len, void *user_data)
+{
+	return modbus_frame_ring_push((modbus_frame_ring_t *)user_data, frame, len);
+}
+
+uint32_t modbus_frame_ring_count(const modbus_frame_ring_t *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+}
+
+int modbus_frame_ring_drain(modbus_frame_ring_t *ring, modbus_frame_handler_t handler, void *user_data,
+		int max_frames)
+{
+	uint32_t tail = ring->tail; /* own index */
+	/* acquire: frame data of all published slots are visible */
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	int count = 0;
+
+	while (tail != head && (max_frames <= 0 || count < max_frames)) {
+		const modbus_frame_slot_t *slot = &ring->slots[tail & MODBUS_FRAME_RING_MASK];
+		if (handler == NULL) {
+			modbus_slave_process_frame(slot->data, slot->len);
+		} else {
+			handler(slot->data, slot->len, user_data);
+		}
+		tail++;
+		count++;
+		/* release: we're done reading the slot before producer may reuse it */
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+	return count;
+}
@@ -0,0 +1,796 @@
+/*
+ * modbus_gateway.c
+ *
+ *  Modbus TCP to RTU gateway (Linux, epoll, timerfd), see modbus_gateway.h
+ */
+
+#define _GNU_SOURCE
+#include "modbus_gateway.h"
+#include "modbus_master.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+/* epoll event data: connection index, bus index * 2 + event kind above MODBUS_GATEWAY_EVENT_BUS,
+ * listening socket and eventfd of modbus_gateway_stop() are special */
+#define MODBUS_GATEWAY_EVENT_BUS (1ULL << 32)
+#define MODBUS_GATEWAY_EVENT_RX 0
+#define MODBUS_GATEWAY_EVENT_TIMER 1
+#define MODBUS_GATEWAY_EVENT_LISTEN (UINT64_MAX - 1)
+#define MODBUS_GATEWAY_EVENT_WAKE UINT64_MAX
+
+/* bus states */
+#define MODBUS_GATEWAY_BUS_IDLE 0
+#define MODBUS_GATEWAY_BUS_WAIT_REPLY 1 /* request at queue head is on the wire */
+#define MODBUS_GATEWAY_BUS_TURNAROUND 2 /* quiet after broadcast */
+
+/* connection slot closed during current poll, free after it */
+#define MODBUS_GATEWAY_FD_CLOSED (-2)
+
+static int8_t modbus_gateway_serve(modbus_gateway_t *gateway, modbus_gateway_connection_t *conn);
+
+/*
+ * Private functions
+ */
+
+static uint64_t modbus_gateway_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+static int8_t modbus_gateway_epoll_set(modbus_gateway_t *gateway, int op, int fd, uint32_t events, uint64_t data)
+{
+	struct epoll_event event = { .events = events, .data.u64 = data };
+
+	return epoll_ctl(gateway->epoll_fd, op, fd, &event) == 0 ? MODBUS_OK : MODBUS_ERROR;
+}
+
+/*
+ * TCP side
+ */
+
+static void modbus_gateway_connection_close(modbus_gateway_t *gateway, modbus_gateway_connection_t *conn)
+{
+	/* closing the descriptor removes it from epoll set; the slot is reused only after current
+	 * batch of events is handled. Requests of the connection stay queued, their replies are
+	 * dropped (generation changes on accept) */
+	close(conn->fd);
+	conn->fd = MODBUS_GATEWAY_FD_CLOSED;
+	gateway->active_connections--;
+	gateway->stats.connections_closed++;
+}
+
+/* connection still open since waiter was queued */
+static modbus_gateway_connection_t *modbus_gateway_waiter_connection(modbus_gateway_t *gateway,
+		const modbus_gateway_waiter_t *waiter)
+{
+	modbus_gateway_connection_t *conn = &gateway->connections[waiter->connection];
+
+	return (conn->fd >= 0 && conn->generation == waiter->generation) ? conn : NULL;
+}
+
+/* one more request can be taken: TX buffer has room for replies to all pending requests */
+static uint8_t modbus_gateway_can_accept(const modbus_gateway_connection_t *conn)
+{
+	return conn->tx_len + (conn->pending + 1) * MODBUS_TCP_MAX_ADU_SIZE <= MODBUS_GATEWAY_TX_BUFFER_SIZE;
+}
+
+/* appends reply ADU to TX buffer (room is reserved by modbus_gateway_can_accept()) */
+static void modbus_gateway_reply(modbus_gateway_t *gateway, modbus_gateway_connection_t *conn,
+		const uint8_t *transaction_id, uint8_t unit, const uint8_t *pdu, uint16_t pdu_len)
+{
+	uint8_t *reply = conn->tx_buffer + conn->tx_len;
+
+	reply[0] = transaction_id[0];
+	reply[1] = transaction_id[1];
+	reply[2] = MODBUS_TCP_PROTOCOL_ID >> 8;
+	reply[3] = MODBUS_TCP_PROTOCOL_ID & 0xff;
+	reply[4] = (pdu_len + 1) >> 8;
+	reply[5] = (pdu_len + 1) & 0xff;
+	reply[6] = unit;
+	memcpy(reply + MODBUS_TCP_MBAP_HEADER_LEN, pdu, pdu_len);
+	conn->tx_len += MODBUS_TCP_MBAP_HEADER_LEN + pdu_len;
+	gateway->stats.replies++;
+}
+
+static void modbus_gateway_exception(modbus_gateway_t *gateway, modbus_gateway_connection_t *conn,
+		const uint8_t *adu, uint8_t exception)
+{
+	const uint8_t pdu[2] = { adu[MODBUS_TCP_MBAP_HEADER_LEN] | MODBUS_ERROR_FLAG, exception };
+
+	modbus_gateway_reply(gateway, conn, adu, adu[MODBUS_TCP_MBAP_LENGTH_OFFSET], pdu, sizeof(pdu));
+}
+
+/* epoll events follow connection state: read while requests can be taken, write while
+ * replies are waiting */
+static int8_t modbus_gateway_connection_update(modbus_gateway_t *gateway, modbus_gateway_connection_t *conn)
+{
+	uint32_t events = EPOLLRDHUP;
+
+	if (modbus_gateway_can_accept(conn)) {
+		events |= EPOLLIN;
+	}
+	if (conn->tx_pos < conn->tx_len) {
+		events |= EPOLLOUT;
+	}
+	if (events == conn->events) {
+		return MODBUS_OK;
+	}
+	conn->events = events;
+	return modbus_gateway_epoll_set(gateway, EPOLL_CTL_MOD, conn->fd, events, conn - gateway->connections);
+}
+
+/* sends pending replies; returns MODBUS_ERROR if connection has to be closed */
+static int8_t modbus_gateway_flush(modbus_gateway_connection_t *conn)
+{
+	ssize_t sent;
+
+	while (conn->tx_pos < conn->tx_len) {
+		/* MSG_NOSIGNAL: peer may have gone away, don't raise SIGPIPE */
+		sent = send(conn->fd, conn->tx_buffer + conn->tx_pos, conn->tx_len - conn->tx_pos, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return MODBUS_OK;
+			}
+			return MODBUS_ERROR;
+		}
+		conn->tx_pos += sent;
+	}
+	conn->tx_pos = 0;
+	conn->tx_len = 0;
+	return MODBUS_OK;
+}
+
+static void modbus_gateway_accept(modbus_gateway_t *gateway)
+{
+	modbus_gateway_connection_t *conn;
+	uint32_t index;
+	int one = 1;
+	int fd;
+
+	/* accept everything that is pending */
+	for (;;) {
+		fd = accept4(gateway->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			/* EAGAIN: nothing left; other errors (e.g. EMFILE) are retried on next event */
+			return;
+		}
+		for (index = 0; index < gateway->max_connections && gateway->connections[index].fd != -1; index++) {
+		}
+		if (index == gateway->max_connections) {
+			/* connection limit reached */
+			gateway->stats.connections_rejected++;
+			close(fd);
+			continue;
+		}
+		conn = &gateway->connections[index];
+		conn->fd = fd;
+		conn->generation++;
+		conn->events = EPOLLIN | EPOLLRDHUP;
+		conn->rx_len = 0;
+		conn->tx_len = 0;
+		conn->tx_pos = 0;
+		conn->pending = 0;
+		/* replies are small and latency matters */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		gateway->active_connections++;
+		if (modbus_gateway_epoll_set(gateway, EPOLL_CTL_ADD, fd, conn->events, index) != MODBUS_OK) {
+			modbus_gateway_connection_close(gateway, conn);
+			continue;
+		}
+		gateway->stats.connections_accepted++;
+	}
+}
+
+/*
+ * RTU side
+ */
+
+/* one-shot timer at the earliest of: end of reply frame, reply / turnaround deadline, end of
+ * silence before next request (disarmed when there is nothing to wait for) */
+static void modbus_gateway_bus_arm_timer(modbus_gateway_bus_t *bus, uint64_t now_us)
+{
+	struct itimerspec its;
+	uint64_t deadline_us = 0;
+
+	if (bus->framer.state != MODBUS_RTU_STATE_IDLE) {
+		/* framer works with 32-bit timestamps; deadline relative to now (can be in the past) */
+		deadline_us = now_us + (int32_t)(modbus_rtu_framer_deadline(&bus->framer) - (uint32_t)now_us);
+	} else if (bus->state != MODBUS_GATEWAY_BUS_IDLE) {
+		/* reply timeout is not checked while a frame is being received */
+		deadline_us = bus->deadline_us;
+	} else if (bus->count > 0 && bus->quiet_us > now_us) {
+		deadline_us = bus->quiet_us;
+	}
+	memset(&its, 0, sizeof(its));
+	if (deadline_us != 0) {
+		its.it_value.tv_sec = deadline_us / 1000000u;
+		its.it_value.tv_nsec = (deadline_us % 1000000u) * 1000;
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+			/* zero would disarm the timer */
+			its.it_value.tv_nsec = 1;
+		}
+	}
+	timerfd_settime(bus->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static uint8_t modbus_gateway_request_waited(modbus_gateway_t *gateway, const modbus_gateway_request_t *request)
+{
+	for (uint8_t i = 0; i < request->waiter_count; i++) {
+		if (modbus_gateway_waiter_connection(gateway, &request->waiters[i]) != NULL) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* removes request at queue head and sends reply PDU to its clients */
+static void modbus_gateway_bus_complete(modbus_gateway_bus_t *bus, const uint8_t *pdu, uint16_t pdu_len)
+{
+	modbus_gateway_t *gateway = bus->gateway;
+	modbus_gateway_request_t *request = &bus->queue[bus->head];
+	modbus_gateway_waiter_t waiters[MODBUS_GATEWAY_MAX_WAITERS];
+	modbus_gateway_connection_t *conn;
+	uint8_t waiter_count = request->waiter_count;
+	uint8_t unit = request->frame[0];
+
+	/* slot may be reused by requests of the clients served below */
+	memcpy(waiters, request->waiters, waiter_count * sizeof(modbus_gateway_waiter_t));
+	bus->head = (bus->head + 1) % MODBUS_GATEWAY_QUEUE_SIZE;
+	bus->count--;
+	bus->state = MODBUS_GATEWAY_BUS_IDLE;
+	for (uint8_t i = 0; i < waiter_count; i++) {
+		conn = modbus_gateway_waiter_connection(gateway, &waiters[i]);
+		if (conn != NULL) {
+			modbus_gateway_reply(gateway, conn, waiters[i].transaction_id, unit, pdu, pdu_len);
+			conn->pending--;
+		}
+	}
+	/* send replies, continue with requests that were waiting for a free pending slot */
+	for (uint8_t i = 0; i < waiter_count; i++) {
+		conn = modbus_gateway_waiter_connection(gateway, &waiters[i]);
+		if (conn != NULL && modbus_gateway_serve(gateway, conn) != MODBUS_OK) {
+			modbus_gateway_connection_close(gateway, conn);
+		}
+	}
+}
+
+/* sends request at queue head once bus has been quiet long enough */
+static void modbus_gateway_bus_start(modbus_gateway_bus_t *bus, uint64_t now_us)
+{
+	modbus_gateway_request_t *request;
+	uint32_t wait_us;
+	ssize_t written;
+
+	if (bus->framing) {
+		/* reply completed from the frame handler: the rest of the chunk being fed must not go
+		 * into the framer reset for the next reply; caller of feed / poll starts it */
+		return;
+	}
+	while (bus->state == MODBUS_GATEWAY_BUS_IDLE && bus->count > 0 && now_us >= bus->quiet_us) {
+		request = &bus->queue[bus->head];
+		if (request->frame[0] != MODBUS_BROADCAST_ADDR && !modbus_gateway_request_waited(bus->gateway, request)) {
+			/* all clients are gone */
+			bus->stats.dropped++;
+			bus->head = (bus->head + 1) % MODBUS_GATEWAY_QUEUE_SIZE;
+			bus->count--;
+			continue;
+		}
+		/* leftovers of a late reply must not be taken for the reply to this request */
+		tcflush(bus->fd, TCIFLUSH);
+		modbus_rtu_framer_reset(&bus->framer);
+		do {
+			written = write(bus->fd, request->frame, request->len);
+		} while (written < 0 && errno == EINTR);
+		wait_us = now_us - request->enqueued_us;
+		bus->stats.transactions++;
+		bus->stats.wait_total_us += wait_us;
+		if (wait_us > bus->stats.wait_max_us) {
+			bus->stats.wait_max_us = wait_us;
+		}
+		/* request is on the wire for len characters */
+		bus->sent_us = now_us + (uint64_t)request->len * bus->framer.char_us;
+		if (written != request->len) {
+			/* driver didn't take the frame (it is much smaller than any TX buffer): fails
+			 * as timeout right away, clients can't be served from here (see bus_complete) */
+			bus->stats.tx_errors++;
+			bus->state = MODBUS_GATEWAY_BUS_WAIT_REPLY;
+			bus->deadline_us = now_us;
+		} else if (request->frame[0] == MODBUS_BROADCAST_ADDR) {
+			/* no reply; slaves need time to execute it */
+			bus->head = (bus->head + 1) % MODBUS_GATEWAY_QUEUE_SIZE;
+			bus->count--;
+			bus->state = MODBUS_GATEWAY_BUS_TURNAROUND;
+			bus->deadline_us = bus->sent_us + (uint64_t)bus->config.turnaround_ms * 1000u;
+		} else {
+			bus->state = MODBUS_GATEWAY_BUS_WAIT_REPLY;
+			bus->deadline_us = bus->sent_us + (uint64_t)bus->config.response_timeout_ms * 1000u;
+		}
+	}
+	modbus_gateway_bus_arm_timer(bus, now_us);
+}
+
+/* modbus_frame_handler_t: frame with valid CRC from framer */
+static int8_t modbus_gateway_frame_handler(const uint8_t *frame, int len, void *user_data)
+{
+	modbus_gateway_bus_t *bus = user_data;
+	modbus_reply_t view;
+	uint64_t now_us;
+	uint32_t response_us;
+	int8_t result;
+
+	if (bus->state != MODBUS_GATEWAY_BUS_WAIT_REPLY) {
+		/* late reply to a request that timed out, or noise */
+		bus->stats.invalid_replies++;
+		return MODBUS_OK;
+	}
+	result = modbus_reply_decode(MODBUS_MASTER_RTU, bus->queue[bus->head].frame, bus->queue[bus->head].len,
+			frame, len, &view);
+	if (result != MODBUS_OK && result != MODBUS_ERROR_EXCEPTION) {
+		/* keep waiting for the right one until timeout */
+		bus->stats.invalid_replies++;
+		return result;
+	}
+	now_us = modbus_gateway_now_us();
+	response_us = now_us - bus->sent_us;
+	bus->stats.replies++;
+	bus->stats.exceptions += result == MODBUS_ERROR_EXCEPTION;
+	bus->stats.response_total_us += response_us;
+	if (response_us > bus->stats.response_max_us) {
+		bus->stats.response_max_us = response_us;
+	}
+	/* frame has been closed by t3.5 silence: next request may follow right away */
+	bus->quiet_us = now_us;
+	modbus_gateway_bus_complete(bus, frame + 1, len - 3);
+	return MODBUS_OK;
+}
+
+static void modbus_gateway_bus_read(modbus_gateway_bus_t *bus)
+{
+	uint8_t data[MODBUS_SERIAL_READ_SIZE];
+	uint64_t now_us = modbus_gateway_now_us();
+	ssize_t received;
+
+	for (;;) {
+		received = read(bus->fd, data, sizeof(data));
+		if (received < 0 && errno == EINTR) {
+			continue;
+		}
+		if (received <= 0) {
+			break;
+		}
+		now_us = modbus_gateway_now_us();
+		bus->framing = 1;
+		modbus_rtu_framer_feed(&bus->framer, data, received, (uint32_t)now_us);
+		bus->framing = 0;
+	}
+	modbus_gateway_bus_start(bus, now_us);
+}
+
+static void modbus_gateway_bus_timer(modbus_gateway_bus_t *bus)
+{
+	uint64_t expirations;
+	uint64_t now_us;
+
+	if (read(bus->timer_fd, &expirations, sizeof(expirations)) < 0) {
+		/* spurious wake-up, timer was re-armed meanwhile */
+		return;
+	}
+	now_us = modbus_gateway_now_us();
+	bus->framing = 1;
+	modbus_rtu_framer_poll(&bus->framer, (uint32_t)now_us);
+	bus->framing = 0;
+	if (bus->state == MODBUS_GATEWAY_BUS_WAIT_REPLY && bus->framer.state == MODBUS_RTU_STATE_IDLE &&
+			now_us >= bus->deadline_us) {
+		const uint8_t pdu[2] = { bus->queue[bus->head].frame[1] | MODBUS_ERROR_FLAG,
+				MODBUS_EXCEPTION_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND };
+
+		bus->stats.timeouts++;
+		bus->quiet_us = now_us + bus->framer.t35_us;
+		modbus_gateway_bus_complete(bus, pdu, sizeof(pdu));
+	} else if (bus->state == MODBUS_GATEWAY_BUS_TURNAROUND && now_us >= bus->deadline_us) {
+		bus->state = MODBUS_GATEWAY_BUS_IDLE;
+		bus->quiet_us = now_us;
+	}
+	modbus_gateway_bus_start(bus, now_us);
+}
+
+/* identical read request in queue (or on the wire) that can take one more client; searched from
+ * the tail back to the last write (any non-read request) to the unit, a read queued before it
+ * would return values from before the write */
+static modbus_gateway_request_t *modbus_gateway_bus_find(modbus_gateway_bus_t *bus, const uint8_t *frame,
+		uint16_t len)
+{
+	for (uint16_t i = bus->count; i > 0; i--) {
+		modbus_gateway_request_t *request = &bus->queue[(bus->head + i - 1) % MODBUS_GATEWAY_QUEUE_SIZE];
+
+		if (request->len == len && request->waiter_count < MODBUS_GATEWAY_MAX_WAITERS &&
+				memcmp(request->frame, frame, len) == 0) {
+			return request;
+		}
+		if ((request->frame[0] == frame[0] || request->frame[0] == MODBUS_BROADCAST_ADDR) &&
+				(request->frame[1] < MODBUS_READ_COILS || request->frame[1] > MODBUS_READ_INPUT_REGISTERS)) {
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+/* routes request ADU (length: MBAP length field) to its bus */
+static void modbus_gateway_request(modbus_gateway_t *gateway, modbus_gateway_connection_t *conn,
+		const uint8_t *adu, uint16_t length)
+{
+	const uint8_t *frame = adu + MODBUS_TCP_MBAP_LENGTH_OFFSET; /* unit id + PDU */
+	uint16_t frame_len = length + 2;
+	modbus_gateway_request_t *request = NULL;
+	modbus_gateway_waiter_t *waiter;
+	modbus_gateway_bus_t *bus;
+	uint8_t unit = frame[0];
+	uint16_t crc16;
+
+	gateway->stats.requests++;
+	if (frame_len > MODBUS_MAX_RTU_FRAME_SIZE) {
+		/* MBAP allows longer PDUs than frames of smaller builds hold */
+		gateway->stats.too_long++;
+		modbus_gateway_exception(gateway, conn, adu, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+		return;
+	}
+	if (gateway->routes[unit] == 0) {
+		gateway->stats.no_route++;
+		modbus_gateway_exception(gateway, conn, adu, MODBUS_EXCEPTION_GATEWAY_PATH_UNAVAILABLE);
+		return;
+	}
+	bus = gateway->buses[gateway->routes[unit] - 1];
+	crc16 = modbus_CRC16(frame, length);
+	if (bus->config.merge_reads && unit != MODBUS_BROADCAST_ADDR && frame[1] >= MODBUS_READ_COILS &&
+			frame[1] <= MODBUS_READ_INPUT_REGISTERS) {
+		uint8_t rtu_frame[MODBUS_MAX_RTU_FRAME_SIZE];
+
+		memcpy(rtu_frame, frame, length);
+		rtu_frame[length] = crc16 & 0xff;
+		rtu_frame[length + 1] = crc16 >> 8;
+		request = modbus_gateway_bus_find(bus, rtu_frame, frame_len);
+		if (request != NULL) {
+			bus->stats.merged++;
+		}
+	}
+	if (request == NULL) {
+		if (bus->count == MODBUS_GATEWAY_QUEUE_SIZE) {
+			bus->stats.queue_full++;
+			modbus_gateway_exception(gateway, conn, adu, MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY);
+			return;
+		}
+		request = &bus->queue[(bus->head + bus->count) % MODBUS_GATEWAY_QUEUE_SIZE];
+		bus->count++;
+		if (bus->count > bus->stats.queue_depth_max) {
+			bus->stats.queue_depth_max = bus->count;
+		}
+		request->enqueued_us = modbus_gateway_now_us();
+		request->len = frame_len;
+		request->waiter_count = 0;
+		memcpy(request->frame, frame, length);
+		request->frame[length] = crc16 & 0xff;
+		request->frame[length + 1] = crc16 >> 8;
+	}
+	if (unit != MODBUS_BROADCAST_ADDR) {
+		waiter = &request->waiters[request->waiter_count++];
+		waiter->connection = conn - gateway->connections;
+		waiter->generation = conn->generation;
+		waiter->transaction_id[0] = adu[0];
+		waiter->transaction_id[1] = adu[1];
+		conn->pending++;
+	}
+	if (bus->state == MODBUS_GATEWAY_BUS_IDLE) {
+		modbus_gateway_bus_start(bus, modbus_gateway_now_us());
+	}
+}
+
+/* takes complete requests from RX buffer while replies to them fit into TX buffer, sends
+ * replies; returns MODBUS_ERROR if connection has to be closed */
+static int8_t modbus_gateway_serve(modbus_gateway_t *gateway, modbus_gateway_connection_t *conn)
+{
+	uint16_t pos = 0;
+	uint16_t length;
+	uint8_t *adu;
+
+	while (conn->rx_len - pos >= MODBUS_TCP_MBAP_HEADER_LEN && modbus_gateway_can_accept(conn)) {
+		adu = conn->rx_buffer + pos;
+		length = (adu[4] << 8) | adu[5];
+		if (((adu[2] << 8) | adu[3]) != MODBUS_TCP_PROTOCOL_ID ||
+				length < 2 || length > MODBUS_TCP_MAX_PDU_SIZE + 1) {
+			/* not Modbus; there is no way to resynchronize the stream */
+			gateway->stats.protocol_errors++;
+			return MODBUS_ERROR;
+		}
+		if (conn->rx_len - pos < MODBUS_TCP_MBAP_LENGTH_OFFSET + length) {
+			/* incomplete request */
+			break;
+		}
+		modbus_gateway_request(gateway, conn, adu, length);
+		pos += MODBUS_TCP_MBAP_LENGTH_OFFSET + length;
+	}
+	if (pos > 0) {
+		conn->rx_len -= pos;
+		memmove(conn->rx_buffer, conn->rx_buffer + pos, conn->rx_len);
+	}
+	if (modbus_gateway_flush(conn) != MODBUS_OK) {
+		return MODBUS_ERROR;
+	}
+	return modbus_gateway_connection_update(gateway, conn);
+}
+
+static int8_t modbus_gateway_read(modbus_gateway_t *gateway, modbus_gateway_connection_t *conn)
+{
+	ssize_t received;
+
+	received = recv(conn->fd, conn->rx_buffer + conn->rx_len, MODBUS_GATEWAY_RX_BUFFER_SIZE - conn->rx_len, 0);
+	if (received == 0) {
+		/* peer closed connection */
+		return MODBUS_ERROR;
+	}
+	if (received < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? MODBUS_OK : MODBUS_ERROR;
+	}
+	conn->rx_len += received;
+	return modbus_gateway_serve(gateway, conn);
+}
+
+static void modbus_gateway_connection_event(modbus_gateway_t *gateway, modbus_gateway_connection_t *conn,
+		uint32_t events)
+{
+	int8_t result = MODBUS_OK;
+
+	if (events & EPOLLERR) {
+		result = MODBUS_ERROR;
+	} else if (events & EPOLLIN) {
+		result = modbus_gateway_read(gateway, conn);
+	} else if (events & EPOLLOUT) {
+		result = modbus_gateway_serve(gateway, conn);
+	} else if (events & (EPOLLHUP | EPOLLRDHUP)) {
+		result = MODBUS_ERROR;
+	}
+	if (result != MODBUS_OK) {
+		modbus_gateway_connection_close(gateway, conn);
+	}
+}
+
+/*
+ * Public function definitions
+ */
+
+int8_t modbus_gateway_init(modbus_gateway_t *gateway, const char *bind_address, uint16_t port,
+		uint32_t max_connections)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+
+	if (gateway == NULL || max_connections == 0) {
+		return MODBUS_ERROR;
+	}
+	memset(gateway, 0, sizeof(*gateway));
+	gateway->listen_fd = -1;
+	gateway->epoll_fd = -1;
+	gateway->wake_fd = -1;
+	gateway->max_connections = max_connections;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind_address != NULL && inet_pton(AF_INET, bind_address, &addr.sin_addr) != 1) {
+		return MODBUS_ERROR;
+	}
+
+	gateway->connections = calloc(max_connections, sizeof(modbus_gateway_connection_t));
+	if (gateway->connections == NULL) {
+		return MODBUS_ERROR;
+	}
+	for (uint32_t i = 0; i < max_connections; i++) {
+		gateway->connections[i].fd = -1;
+	}
+
+	gateway->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	gateway->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	gateway->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (gateway->listen_fd < 0 || gateway->epoll_fd < 0 || gateway->wake_fd < 0) {
+		modbus_gateway_close(gateway);
+		return MODBUS_ERROR;
+	}
+	setsockopt(gateway->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(gateway->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			listen(gateway->listen_fd, SOMAXCONN) != 0 ||
+			modbus_gateway_epoll_set(gateway, EPOLL_CTL_ADD, gateway->listen_fd, EPOLLIN,
+				MODBUS_GATEWAY_EVENT_LISTEN) != MODBUS_OK ||
+			modbus_gateway_epoll_set(gateway, EPOLL_CTL_ADD, gateway->wake_fd, EPOLLIN,
+				MODBUS_GATEWAY_EVENT_WAKE) != MODBUS_OK) {
+		modbus_gateway_close(gateway);
+		return MODBUS_ERROR;
+	}
+	gateway->running = 1;
+	return MODBUS_OK;
+}
+
+uint16_t modbus_gateway_port(const modbus_gateway_t *gateway)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+
+	if (getsockname(gateway->listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+		return 0;
+	}
+	return ntohs(addr.sin_port);
+}
+
+int8_t modbus_gateway_bus_open(modbus_gateway_t *gateway, modbus_gateway_bus_t *bus, const char *path,
+		const modbus_gateway_bus_config_t *config)
+{
+	uint64_t event;
+
+	if (gateway == NULL || bus == NULL || path == NULL || config == NULL ||
+			gateway->bus_count >= MODBUS_GATEWAY_MAX_BUSES) {
+		return MODBUS_ERROR;
+	}
+	memset(bus, 0, sizeof(*bus));
+	bus->gateway = gateway;
+	bus->config = *config;
+	bus->index = gateway->bus_count;
+	bus->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	bus->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (bus->fd < 0 || bus->timer_fd < 0 || modbus_serial_configure(bus->fd, &config->serial) != MODBUS_OK ||
+			modbus_rtu_framer_init(&bus->framer, config->serial.baudrate, modbus_gateway_frame_handler,
+				bus) != MODBUS_OK) {
+		goto error;
+	}
+	/* gaps inside frame can't be measured from user space: only t3.5 (or configured silence) counts */
+	if (config->serial.silence_us != 0) {
+		bus->framer.t35_us = config->serial.silence_us;
+	}
+	bus->framer.t15_us = bus->framer.t35_us;
+	event = MODBUS_GATEWAY_EVENT_BUS + bus->index * 2;
+	if (modbus_gateway_epoll_set(gateway, EPOLL_CTL_ADD, bus->fd, EPOLLIN,
+				event + MODBUS_GATEWAY_EVENT_RX) != MODBUS_OK ||
+			modbus_gateway_epoll_set(gateway, EPOLL_CTL_ADD, bus->timer_fd, EPOLLIN,
+				event + MODBUS_GATEWAY_EVENT_TIMER) != MODBUS_OK) {
+		goto error;
+	}
+	gateway->buses[gateway->bus_count++] = bus;
+	return MODBUS_OK;
+
+error:
+	if (bus->fd >= 0) {
+		close(bus->fd);
+	}
+	if (bus->timer_fd >= 0) {
+		close(bus->timer_fd);
+	}
+	bus->fd = -1;
+	bus->timer_fd = -1;
+	return MODBUS_ERROR;
+}
+
+int8_t modbus_gateway_route(modbus_gateway_t *gateway, modbus_gateway_bus_t *bus, uint8_t first, uint8_t last)
+{
+	if (gateway == NULL || bus == NULL || bus->gateway != gateway || first > last) {
+		return MODBUS_ERROR;
+	}
+	for (uint16_t unit = first; unit <= last; unit++) {
+		gateway->routes[unit] = bus->index + 1;
+	}
+	return MODBUS_OK;
+}
+
+int8_t modbus_gateway_poll(modbus_gateway_t *gateway, int timeout_ms)
+{
+	struct epoll_event events[MODBUS_GATEWAY_MAX_EVENTS];
+	uint64_t closed = gateway->stats.connections_closed;
+	modbus_gateway_bus_t *bus;
+	uint64_t data;
+	int count;
+
+	count = epoll_wait(gateway->epoll_fd, events, MODBUS_GATEWAY_MAX_EVENTS, timeout_ms);
+	if (count < 0) {
+		return errno == EINTR ? MODBUS_OK : MODBUS_ERROR;
+	}
+	for (int i = 0; i < count; i++) {
+		data = events[i].data.u64;
+		if (data == MODBUS_GATEWAY_EVENT_WAKE) {
+			uint64_t value;
+			if (read(gateway->wake_fd, &value, sizeof(value)) < 0) {
+				/* already drained */
+			}
+		} else if (data == MODBUS_GATEWAY_EVENT_LISTEN) {
+			modbus_gateway_accept(gateway);
+		} else if (data >= MODBUS_GATEWAY_EVENT_BUS) {
+			bus = gateway->buses[(data - MODBUS_GATEWAY_EVENT_BUS) / 2];
+			if ((data - MODBUS_GATEWAY_EVENT_BUS) % 2 == MODBUS_GATEWAY_EVENT_TIMER) {
+				modbus_gateway_bus_timer(bus);
+			} else {
+				modbus_gateway_bus_read(bus);
+			}
+		} else if (gateway->connections[data].fd >= 0) {
+			modbus_gateway_connection_event(gateway, &gateway->connections[data], events[i].events);
+		}
+	}
+	/* slots of connections closed during this batch can be reused now */
+	if (gateway->stats.connections_closed != closed) {
+		for (uint32_t i = 0; i < gateway->max_connections; i++) {
+			if (gateway->connections[i].fd == MODBUS_GATEWAY_FD_CLOSED) {
+				gateway->connections[i].fd = -1;
+			}
+		}
+	}
+	return MODBUS_OK;
+}
+
+int8_t modbus_gateway_run(modbus_gateway_t *gateway)
+{
+	while (__atomic_load_n(&gateway->running, __ATOMIC_ACQUIRE)) {
+		if (modbus_gateway_poll(gateway, -1) != MODBUS_OK) {
+			return MODBUS_ERROR;
+		}
+	}
+	return MODBUS_OK;
+}
+
+void modbus_gateway_stop(modbus_gateway_t *gateway)
+{
+	uint64_t value = 1;
+
+	__atomic_store_n(&gateway->running, 0, __ATOMIC_RELEASE);
+	if (write(gateway->wake_fd, &value, sizeof(value)) < 0) {
+		/* counter overflow is impossible here; nothing to do */
+	}
+}
+
+void modbus_gateway_close(modbus_gateway_t *gateway)
+{
+	if (gateway->connections != NULL) {
+		for (uint32_t i = 0; i < gateway->max_connections; i++) {
+			if (gateway->connections[i].fd >= 0) {
+				close(gateway->connections[i].fd);
+			}
+		}
+		free(gateway->connections);
+		gateway->connections = NULL;
+	}
+	for (uint8_t i = 0; i < gateway->bus_count; i++) {
+		close(gateway->buses[i]->fd);
+		close(gateway->buses[i]->timer_fd);
+		gateway->buses[i]->fd = -1;
+		gateway->buses[i]->timer_fd = -1;
+	}
+	gateway->bus_count = 0;
+	if (gateway->listen_fd >= 0) {
+		close(gateway->listen_fd);
+	}
+	if (gateway->epoll_fd >= 0) {
+		close(gateway->epoll_fd);
+	}
+	if (gateway->wake_fd >= 0) {
+		close(gateway->wake_fd);
+	}
+	gateway->listen_fd = -1;
+	gateway->epoll_fd = -1;
+	gateway->wake_fd = -1;
+	gateway->active_connections = 0;
+}
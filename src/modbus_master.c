@@ -0,0 +1,546 @@
+/*
+ * modbus_master.c
+ *
+ *  Modbus master and poll scheduler, see modbus_master.h
+ */
+
+#include "modbus_master.h"
+
+/*
+ * Private functions
+ */
+
+static void modbus_master_put16(uint8_t *buffer, uint16_t value)
+{
+	buffer[0] = value >> 8;
+	buffer[1] = value & 0xff;
+}
+
+static uint16_t modbus_master_get16(const uint8_t *buffer)
+{
+	return (buffer[0] << 8) | buffer[1];
+}
+
+/* request ADU around PDU already in place (after header); returns ADU length */
+static uint16_t modbus_master_frame(modbus_master_t *master, uint8_t slave, uint16_t pdu_len)
+{
+	uint16_t crc;
+
+	if (master->mode == MODBUS_MASTER_TCP) {
+		master->transaction_id++;
+		modbus_master_put16(master->request, master->transaction_id);
+		modbus_master_put16(master->request + 2, 0);
+		modbus_master_put16(master->request + 4, pdu_len + 1);
+		master->request[6] = slave;
+		return MODBUS_MASTER_MBAP_HEADER_LEN + pdu_len;
+	}
+	master->request[0] = slave;
+	crc = modbus_CRC16(master->request, pdu_len + 1);
+	master->request[pdu_len + 1] = crc & 0xff;
+	master->request[pdu_len + 2] = crc >> 8;
+	return pdu_len + 3;
+}
+
+/* PDU of request being built */
+static uint8_t *modbus_master_pdu(modbus_master_t *master)
+{
+	return master->request + (master->mode == MODBUS_MASTER_TCP ? MODBUS_MASTER_MBAP_HEADER_LEN : 1);
+}
+
+/* sends request PDU built in place by modbus_master_pdu() and decodes the reply */
+static int8_t modbus_master_send(modbus_master_t *master, uint8_t slave, uint16_t pdu_len, modbus_reply_t *reply)
+{
+	uint16_t request_len = modbus_master_frame(master, slave, pdu_len);
+	uint16_t reply_len = 0;
+	int8_t result;
+
+	/* transport failures leave the reply empty rather than indeterminate */
+	memset(reply, 0, sizeof(*reply));
+	master->stats.requests++;
+	result = master->transfer(master, master->request, request_len, master->reply, &reply_len);
+	if (slave == MODBUS_BROADCAST_ADDR && master->mode == MODBUS_MASTER_RTU) {
+		/* nobody replies to broadcast */
+		return result == MODBUS_ERROR_TIMEOUT ? MODBUS_OK : result;
+	}
+	if (result == MODBUS_OK) {
+		result = modbus_reply_decode(master->mode, master->request, request_len, master->reply, reply_len, reply);
+	}
+	switch (result) {
+	case MODBUS_OK:
+		master->stats.replies++;
+		break;
+	case MODBUS_ERROR_EXCEPTION:
+		master->stats.replies++;
+		master->stats.exceptions++;
+		master->exception = reply->exception;
+		break;
+	case MODBUS_ERROR_TIMEOUT:
+		master->stats.timeouts++;
+		break;
+	default:
+		master->stats.errors++;
+		break;
+	}
+	return result;
+}
+
+static uint8_t modbus_poll_function_code(uint8_t table)
+{
+	switch (table) {
+	case MODBUS_TABLE_COILS:
+		return MODBUS_READ_COILS;
+	case MODBUS_TABLE_DISCRETE_INPUTS:
+		return MODBUS_READ_DISCRETE_INPUTS;
+	case MODBUS_TABLE_INPUT_REGISTERS:
+		return MODBUS_READ_INPUT_REGISTERS;
+	default:
+		return MODBUS_READ_HOLDING_REGISTERS;
+	}
+}
+
+static uint16_t modbus_poll_max_count(uint8_t table)
+{
+	return table <= MODBUS_TABLE_DISCRETE_INPUTS ? MODBUS_MAX_READ_BITS : MODBUS_MAX_REGISTERS;
+}
+
+/* tags are ordered by slave, table, period and address, so mergeable tags are adjacent */
+static int modbus_poll_tag_compare(const modbus_poll_tag_t *a, const modbus_poll_tag_t *b)
+{
+	if (a->slave != b->slave) {
+		return a->slave < b->slave ? -1 : 1;
+	}
+	if (a->table != b->table) {
+		return a->table < b->table ? -1 : 1;
+	}
+	if (a->period_ms != b->period_ms) {
+		return a->period_ms < b->period_ms ? -1 : 1;
+	}
+	if (a->address != b->address) {
+		return a->address < b->address ? -1 : 1;
+	}
+	return 0;
+}
+
+/* insertion sort: stable, no library calls, tag lists are short and planned rarely */
+static void modbus_poll_sort_tags(modbus_poll_tag_t *tags, uint16_t count)
+{
+	modbus_poll_tag_t tag;
+	uint16_t j;
+
+	for (uint16_t i = 1; i < count; i++) {
+		tag = tags[i];
+		for (j = i; j > 0 && modbus_poll_tag_compare(&tags[j - 1], &tag) > 0; j--) {
+			tags[j] = tags[j - 1];
+		}
+		tags[j] = tag;
+	}
+}
+
+/* wrap-around safe "a is before b" */
+static int modbus_poll_before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+/*
+ * Public function definitions
+ */
+
+int8_t modbus_reply_decode(uint8_t mode, const uint8_t *request, uint16_t request_len, const uint8_t *reply,
+		uint16_t reply_len, modbus_reply_t *view)
+{
+	const uint8_t *request_pdu;
+	const uint8_t *pdu;
+	uint16_t pdu_len;
+	uint16_t data_len;
+
+	memset(view, 0, sizeof(*view));
+	if (mode == MODBUS_MASTER_TCP) {
+		if (request_len < MODBUS_MASTER_MBAP_HEADER_LEN + 1) {
+			return MODBUS_ERROR;
+		}
+		if (reply_len < MODBUS_MASTER_MBAP_HEADER_LEN + 2 || reply_len > MODBUS_MASTER_ADU_SIZE ||
+				modbus_master_get16(reply + 4) != reply_len - 6) {
+			return MODBUS_ERROR_FRAME_INVALID;
+		}
+		/* transaction and protocol id */
+		if (memcmp(reply, request, 4) != 0) {
+			return MODBUS_ERROR_TRANSACTION_MISMATCH;
+		}
+		if (reply[6] != request[6]) {
+			return MODBUS_ERROR_ADDRESS_MISMATCH;
+		}
+		request_pdu = request + MODBUS_MASTER_MBAP_HEADER_LEN;
+		pdu = reply + MODBUS_MASTER_MBAP_HEADER_LEN;
+		pdu_len = reply_len - MODBUS_MASTER_MBAP_HEADER_LEN;
+	} else {
+		if (request_len < MODBUS_MINIMAL_FRAME_LEN) {
+			return MODBUS_ERROR;
+		}
+		if (reply_len < MODBUS_MINIMAL_FRAME_LEN + 1 || reply_len > MODBUS_MAX_RTU_FRAME_SIZE) {
+			return MODBUS_ERROR_FRAME_INVALID;
+		}
+		/* CRC over a complete frame including its CRC is 0 */
+		if (modbus_crc16_update(MODBUS_CRC16_INIT, reply, reply_len) != 0) {
+			return MODBUS_ERROR_CRC;
+		}
+		if (reply[0] != request[0]) {
+			return MODBUS_ERROR_ADDRESS_MISMATCH;
+		}
+		request_pdu = request + 1;
+		pdu = reply + 1;
+		pdu_len = reply_len - 3;
+	}
+	view->slave = pdu[-1];
+	view->function_code = request_pdu[0];
+	view->pdu = pdu;
+	view->pdu_len = pdu_len;
+
+	if (pdu[0] == (request_pdu[0] | MODBUS_ERROR_FLAG)) {
+		if (pdu_len != 2) {
+			return MODBUS_ERROR_FRAME_INVALID;
+		}
+		view->exception = pdu[1];
+		return MODBUS_ERROR_EXCEPTION;
+	}
+	if (pdu[0] != request_pdu[0]) {
+		return MODBUS_ERROR_FUNCTION_MISMATCH;
+	}
+
+	switch (request_pdu[0]) {
+	case MODBUS_READ_COILS:
+	case MODBUS_READ_DISCRETE_INPUTS:
+	case MODBUS_READ_HOLDING_REGISTERS:
+	case MODBUS_READ_INPUT_REGISTERS:
+	case MODBUS_READ_WRITE_MULTIPLE_REGISTERS:
+		view->address = modbus_master_get16(request_pdu + 1);
+		view->count = modbus_master_get16(request_pdu + 3);
+		data_len = request_pdu[0] <= MODBUS_READ_DISCRETE_INPUTS ? MODBUS_BITS_TO_BYTES(view->count) :
+				2 * view->count;
+		if (pdu_len < 2 || pdu[1] != data_len || pdu_len != 2 + data_len) {
+			return MODBUS_ERROR_LENGTH_MISMATCH;
+		}
+		view->data = pdu + 2;
+		return MODBUS_OK;
+	case MODBUS_WRITE_SINGLE_COIL:
+	case MODBUS_WRITE_SINGLE_REGISTER:
+	case MODBUS_WRITE_MULTIPLE_COILS:
+	case MODBUS_WRITE_MULTIPLE_REGISTERS:
+	case MODBUS_MASK_WRITE_REGISTER:
+		/* echo of address and value / quantity (and masks) */
+		data_len = request_pdu[0] == MODBUS_MASK_WRITE_REGISTER ? 7 : 5;
+		if (pdu_len != data_len) {
+			return MODBUS_ERROR_LENGTH_MISMATCH;
+		}
+		if (memcmp(pdu, request_pdu, data_len) != 0) {
+			return MODBUS_ERROR_ECHO_MISMATCH;
+		}
+		view->address = modbus_master_get16(request_pdu + 1);
+		view->count = request_pdu[0] == MODBUS_WRITE_MULTIPLE_COILS ||
+				request_pdu[0] == MODBUS_WRITE_MULTIPLE_REGISTERS ? modbus_master_get16(request_pdu + 3) : 1;
+		view->data = request_pdu[0] == MODBUS_WRITE_SINGLE_REGISTER ? pdu + 3 : NULL;
+		return MODBUS_OK;
+	default:
+		/* other functions: data after function code, not interpreted */
+		view->data = pdu + 1;
+		view->count = pdu_len - 1;
+		return MODBUS_OK;
+	}
+}
+
+uint8_t modbus_reply_bit(const modbus_reply_t *reply, uint16_t index)
+{
+	return modbus_bit_get(reply->data, index);
+}
+
+uint16_t modbus_reply_register(const modbus_reply_t *reply, uint16_t index)
+{
+	return modbus_master_get16(reply->data + 2 * index);
+}
+
+void modbus_reply_registers(const modbus_reply_t *reply, uint16_t index, uint16_t count, uint16_t *dst)
+{
+	modbus_registers_unpack(dst, reply->data + 2 * index, count);
+}
+
+uint32_t modbus_reply_uint32(const modbus_reply_t *reply, uint16_t index, uint8_t order)
+{
+	uint16_t registers[2];
+
+	registers[0] = modbus_master_get16(reply->data + 2 * index);
+	registers[1] = modbus_master_get16(reply->data + 2 * index + 2);
+	return modbus_get_uint32(registers, order);
+}
+
+int32_t modbus_reply_int32(const modbus_reply_t *reply, uint16_t index, uint8_t order)
+{
+	return (int32_t)modbus_reply_uint32(reply, index, order);
+}
+
+float modbus_reply_float(const modbus_reply_t *reply, uint16_t index, uint8_t order)
+{
+	uint32_t bits = modbus_reply_uint32(reply, index, order);
+	float value;
+
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+int8_t modbus_master_init(modbus_master_t *master, uint8_t mode, modbus_master_transfer_t transfer, void *user_data)
+{
+	if (master == NULL || transfer == NULL || mode > MODBUS_MASTER_TCP) {
+		return MODBUS_ERROR;
+	}
+	memset(master, 0, sizeof(*master));
+	master->transfer = transfer;
+	master->user_data = user_data;
+	master->mode = mode;
+	return MODBUS_OK;
+}
+
+int8_t modbus_master_transaction(modbus_master_t *master, uint8_t slave, const uint8_t *pdu, uint16_t pdu_len,
+		const uint8_t **reply_pdu, uint16_t *reply_pdu_len)
+{
+	uint16_t max_pdu_len = master->mode == MODBUS_MASTER_TCP ? MODBUS_MASTER_ADU_SIZE - MODBUS_MASTER_MBAP_HEADER_LEN :
+			MODBUS_MAX_RTU_FRAME_SIZE - 3;
+	modbus_reply_t reply;
+	int8_t result;
+
+	if (pdu == NULL || pdu_len == 0 || pdu_len > max_pdu_len) {
+		return MODBUS_ERROR;
+	}
+	memcpy(modbus_master_pdu(master), pdu, pdu_len);
+	result = modbus_master_send(master, slave, pdu_len, &reply);
+	*reply_pdu = reply.pdu;
+	*reply_pdu_len = reply.pdu_len;
+	return result;
+}
+
+int8_t modbus_master_read_reply(modbus_master_t *master, uint8_t slave, uint8_t function_code, uint16_t address,
+		uint16_t count, modbus_reply_t *reply)
+{
+	uint8_t *pdu = modbus_master_pdu(master);
+	uint8_t registers = function_code == MODBUS_READ_HOLDING_REGISTERS || function_code == MODBUS_READ_INPUT_REGISTERS;
+
+	if (slave == MODBUS_BROADCAST_ADDR || count == 0 || reply == NULL ||
+			(!registers && function_code != MODBUS_READ_COILS && function_code != MODBUS_READ_DISCRETE_INPUTS) ||
+			count > (registers ? MODBUS_MAX_REGISTERS : MODBUS_MAX_READ_BITS)) {
+		return MODBUS_ERROR;
+	}
+	pdu[0] = function_code;
+	modbus_master_put16(pdu + 1, address);
+	modbus_master_put16(pdu + 3, count);
+	return modbus_master_send(master, slave, 5, reply);
+}
+
+int8_t modbus_master_read(modbus_master_t *master, uint8_t slave, uint8_t function_code, uint16_t address,
+		uint16_t count, void *dst)
+{
+	modbus_reply_t reply;
+	int8_t result;
+
+	if (dst == NULL) {
+		return MODBUS_ERROR;
+	}
+	result = modbus_master_read_reply(master, slave, function_code, address, count, &reply);
+	if (result != MODBUS_OK) {
+		return result;
+	}
+	if (function_code == MODBUS_READ_HOLDING_REGISTERS || function_code == MODBUS_READ_INPUT_REGISTERS) {
+		modbus_reply_registers(&reply, 0, count, dst);
+	} else {
+		memcpy(dst, reply.data, MODBUS_BITS_TO_BYTES(count));
+	}
+	return MODBUS_OK;
+}
+
+int8_t modbus_master_write_register(modbus_master_t *master, uint8_t slave, uint16_t address, uint16_t value)
+{
+	uint8_t *pdu = modbus_master_pdu(master);
+	modbus_reply_t reply;
+
+	pdu[0] = MODBUS_WRITE_SINGLE_REGISTER;
+	modbus_master_put16(pdu + 1, address);
+	modbus_master_put16(pdu + 3, value);
+	return modbus_master_send(master, slave, 5, &reply);
+}
+
+int8_t modbus_master_write_registers(modbus_master_t *master, uint8_t slave, uint16_t address, uint16_t count,
+		const uint16_t *values)
+{
+	uint8_t *pdu = modbus_master_pdu(master);
+	modbus_reply_t reply;
+
+	if (count == 0 || count > MODBUS_MASTER_MAX_WRITE_REGISTERS || values == NULL) {
+		return MODBUS_ERROR;
+	}
+	pdu[0] = MODBUS_WRITE_MULTIPLE_REGISTERS;
+	modbus_master_put16(pdu + 1, address);
+	modbus_master_put16(pdu + 3, count);
+	pdu[5] = 2 * count;
+	modbus_registers_pack(pdu + 6, values, count);
+	return modbus_master_send(master, slave, 6 + 2 * count, &reply);
+}
+
+int8_t modbus_master_write_coil(modbus_master_t *master, uint8_t slave, uint16_t address, uint8_t value)
+{
+	uint8_t *pdu = modbus_master_pdu(master);
+	modbus_reply_t reply;
+
+	pdu[0] = MODBUS_WRITE_SINGLE_COIL;
+	modbus_master_put16(pdu + 1, address);
+	modbus_master_put16(pdu + 3, value ? MODBUS_COIL_ON : MODBUS_COIL_OFF);
+	return modbus_master_send(master, slave, 5, &reply);
+}
+
+int8_t modbus_poll_init(modbus_poll_t *poll, modbus_poll_tag_t *tags, uint16_t tag_count,
+		modbus_poll_request_t *requests, uint16_t capacity, uint16_t gap)
+{
+	if (poll == NULL || (tags == NULL && tag_count > 0) || (requests == NULL && capacity > 0)) {
+		return MODBUS_ERROR;
+	}
+	poll->tags = tags;
+	poll->requests = requests;
+	poll->tag_count = tag_count;
+	poll->request_capacity = capacity;
+	poll->request_count = 0;
+	poll->gap = gap;
+	return MODBUS_OK;
+}
+
+int8_t modbus_poll_plan(modbus_poll_t *poll, uint32_t now_ms)
+{
+	modbus_poll_request_t *request = NULL;
+	modbus_poll_tag_t *tag;
+	uint32_t end;
+
+	poll->request_count = 0;
+	for (uint16_t i = 0; i < poll->tag_count; i++) {
+		tag = &poll->tags[i];
+		if (tag->table >= MODBUS_TABLE_COUNT || tag->width == 0 || tag->width > modbus_poll_max_count(tag->table) ||
+				tag->period_ms == 0 ||
+				(uint32_t)tag->address + tag->width > 0x10000 || tag->value == NULL) {
+			return MODBUS_ERROR;
+		}
+	}
+	modbus_poll_sort_tags(poll->tags, poll->tag_count);
+
+	for (uint16_t i = 0; i < poll->tag_count; i++) {
+		tag = &poll->tags[i];
+		end = (uint32_t)tag->address + tag->width;
+		/* extend current request if tag is close enough and the result fits one read */
+		if (request != NULL && request->slave == tag->slave && request->function_code ==
+				modbus_poll_function_code(tag->table) && request->period_ms == tag->period_ms &&
+				tag->address <= (uint32_t)request->address + request->count + poll->gap &&
+				end - request->address <= modbus_poll_max_count(tag->table)) {
+			if (end > (uint32_t)request->address + request->count) {
+				request->count = end - request->address;
+			}
+			request->tag_count++;
+			continue;
+		}
+		if (poll->request_count == poll->request_capacity) {
+			poll->request_count = 0;
+			return MODBUS_ERROR;
+		}
+		request = &poll->requests[poll->request_count++];
+		request->slave = tag->slave;
+		request->function_code = modbus_poll_function_code(tag->table);
+		request->address = tag->address;
+		request->count = tag->width;
+		request->first_tag = i;
+		request->tag_count = 1;
+		request->period_ms = tag->period_ms;
+	}
+
+	/* spread requests of each period evenly over it */
+	for (uint16_t i = 0; i < poll->request_count; i++) {
+		uint16_t same = 0;
+		uint16_t index = 0;
+
+		for (uint16_t j = 0; j < poll->request_count; j++) {
+			if (poll->requests[j].period_ms == poll->requests[i].period_ms) {
+				index += j < i;
+				same++;
+			}
+		}
+		poll->requests[i].due_ms = now_ms + (uint32_t)((uint64_t)poll->requests[i].period_ms * index / same);
+	}
+	return MODBUS_OK;
+}
+
+modbus_poll_request_t *modbus_poll_next(modbus_poll_t *poll, uint32_t now_ms, uint32_t *wait_ms)
+{
+	modbus_poll_request_t *next = NULL;
+
+	/* earliest deadline; requests with equal deadlines keep plan order (slave, table, address) */
+	for (uint16_t i = 0; i < poll->request_count; i++) {
+		if (next == NULL || modbus_poll_before(poll->requests[i].due_ms, next->due_ms)) {
+			next = &poll->requests[i];
+		}
+	}
+	if (next == NULL) {
+		if (wait_ms != NULL) {
+			*wait_ms = UINT32_MAX;
+		}
+		return NULL;
+	}
+	if (modbus_poll_before(now_ms, next->due_ms)) {
+		if (wait_ms != NULL) {
+			*wait_ms = next->due_ms - now_ms;
+		}
+		return NULL;
+	}
+	if (wait_ms != NULL) {
+		*wait_ms = 0;
+	}
+	return next;
+}
+
+int8_t modbus_poll_execute(modbus_poll_t *poll, modbus_master_t *master, modbus_poll_request_t *request,
+		uint32_t now_ms)
+{
+	modbus_reply_t reply;
+	modbus_poll_tag_t *tag;
+	uint16_t offset;
+	int8_t result;
+
+	result = modbus_master_read_reply(master, request->slave, request->function_code, request->address,
+			request->count, &reply);
+	for (uint16_t i = request->first_tag; i < request->first_tag + request->tag_count; i++) {
+		tag = &poll->tags[i];
+		tag->result = result;
+		tag->exception = result == MODBUS_ERROR_EXCEPTION ? reply.exception : 0;
+		if (result != MODBUS_OK) {
+			continue;
+		}
+		/* straight from the reply frame into the tag */
+		offset = tag->address - request->address;
+		if (request->function_code == MODBUS_READ_HOLDING_REGISTERS ||
+				request->function_code == MODBUS_READ_INPUT_REGISTERS) {
+			modbus_reply_registers(&reply, offset, tag->width, tag->value);
+		} else {
+			memset(tag->value, 0, MODBUS_BITS_TO_BYTES(tag->width));
+			modbus_bits_copy(tag->value, 0, reply.data, offset, tag->width);
+		}
+		tag->updated_ms = now_ms;
+	}
+	/* next period; missed periods are skipped rather than caught up with a burst */
+	request->due_ms += request->period_ms;
+	if (!modbus_poll_before(now_ms, request->due_ms)) {
+		request->due_ms = now_ms + request->period_ms;
+	}
+	return result;
+}
+
+uint32_t modbus_poll_run(modbus_poll_t *poll, modbus_master_t *master, uint32_t now_ms)
+{
+	modbus_poll_request_t *request;
+	uint32_t wait_ms;
+
+	/* due requests back to back, so the bus is not idle while anything is due */
+	while ((request = modbus_poll_next(poll, now_ms, &wait_ms)) != NULL) {
+		modbus_poll_execute(poll, master, request, now_ms);
+	}
+	return wait_ms;
+}
@@ -0,0 +1,259 @@
+/*
+ * modbus_register_map.c
+ *
+ *  Declarative register map, see modbus_register_map.h
+ */
+
+#include "modbus_register_map.h"
+#include "modbus_endian.h"
+
+/*
+ * Private functions
+ */
+
+static void modbus_register_map_reindex(modbus_register_map_t *map)
+{
+	uint16_t i = 0;
+
+	for (uint8_t table = 0; table < MODBUS_TABLE_COUNT; table++) {
+		map->table_first[table] = i;
+		while (i < map->range_count && map->ranges[i].table == table) {
+			i++;
+		}
+		map->table_count[table] = i - map->table_first[table];
+	}
+}
+
+static int8_t modbus_register_map_read_registers(modbus_slave_ctx_t *ctx, const modbus_register_range_t *range,
+		modbus_transaction_t *transaction)
+{
+	const uint16_t *src;
+	int8_t result;
+
+	if (!(range->access & MODBUS_ACCESS_READ)) {
+		return MODBUS_ERROR_ACCESS_DENIED;
+	}
+	if (range->read_hook != NULL) {
+		result = range->read_hook(ctx, transaction, range);
+		if (result != MODBUS_OK) {
+			return result;
+		}
+	}
+	if (range->shadow != NULL) {
+		/* consistent snapshot, even while the bank is being updated */
+		if (transaction->payload != NULL) {
+			modbus_shadow_read_be(range->shadow, transaction->register_address - range->start, transaction->payload,
+					transaction->register_count);
+			transaction->payload_ready = 1;
+		} else {
+			modbus_shadow_read(range->shadow, transaction->register_address - range->start, transaction->buffer16b,
+					transaction->register_count);
+		}
+		return MODBUS_OK;
+	}
+	src = (const uint16_t *)range->data + (transaction->register_address - range->start);
+	if (transaction->payload != NULL) {
+		/* straight to the final position in reply, big-endian */
+		modbus_registers_pack(transaction->payload, src, transaction->register_count);
+		transaction->payload_ready = 1;
+	} else {
+		memcpy(transaction->buffer16b, src, transaction->register_count * sizeof(uint16_t));
+	}
+	return MODBUS_OK;
+}
+
+static int8_t modbus_register_map_write_registers(modbus_slave_ctx_t *ctx, const modbus_register_range_t *range,
+		modbus_transaction_t *transaction)
+{
+	if (!(range->access & MODBUS_ACCESS_WRITE) || range->table != MODBUS_TABLE_HOLDING_REGISTERS) {
+		return MODBUS_ERROR_ACCESS_DENIED;
+	}
+	if (range->shadow != NULL) {
+		modbus_shadow_write(range->shadow, transaction->register_address - range->start, transaction->holding_registers,
+				transaction->register_count);
+	} else {
+		memcpy((uint16_t *)range->data + (transaction->register_address - range->start), transaction->holding_registers,
+				transaction->register_count * sizeof(uint16_t));
+	}
+	if (range->write_hook != NULL) {
+		return range->write_hook(ctx, transaction, range);
+	}
+	return MODBUS_OK;
+}
+
+static int8_t modbus_register_map_read_bits(modbus_slave_ctx_t *ctx, const modbus_register_range_t *range,
+		modbus_transaction_t *transaction)
+{
+	int8_t result;
+
+	if (!(range->access & MODBUS_ACCESS_READ)) {
+		return MODBUS_ERROR_ACCESS_DENIED;
+	}
+	if (range->read_hook != NULL) {
+		result = range->read_hook(ctx, transaction, range);
+		if (result != MODBUS_OK) {
+			return result;
+		}
+	}
+	if (transaction->payload != NULL) {
+		/* straight to the final position in reply */
+		modbus_bits_copy(transaction->payload, 0, range->data, transaction->register_address - range->start,
+				transaction->register_count);
+		transaction->payload_ready = 1;
+	} else {
+		modbus_bits_copy(transaction->coils, 0, range->data, transaction->register_address - range->start,
+				transaction->register_count);
+	}
+	return MODBUS_OK;
+}
+
+static int8_t modbus_register_map_write_bits(modbus_slave_ctx_t *ctx, const modbus_register_range_t *range,
+		modbus_transaction_t *transaction)
+{
+	if (!(range->access & MODBUS_ACCESS_WRITE) || range->table != MODBUS_TABLE_COILS) {
+		return MODBUS_ERROR_ACCESS_DENIED;
+	}
+	modbus_bits_copy(range->data, transaction->register_address - range->start, transaction->coils, 0,
+			transaction->register_count);
+	if (range->write_hook != NULL) {
+		return range->write_hook(ctx, transaction, range);
+	}
+	return MODBUS_OK;
+}
+
+/*
+ * Public function definitions
+ */
+
+int8_t modbus_register_map_init(modbus_register_map_t *map, modbus_register_range_t *ranges, uint16_t capacity)
+{
+	if (map == NULL || (ranges == NULL && capacity > 0)) {
+		return MODBUS_ERROR;
+	}
+	memset(map, 0, sizeof(*map));
+	map->ranges = ranges;
+	map->capacity = capacity;
+	return MODBUS_OK;
+}
+
+int8_t modbus_register_map_add(modbus_register_map_t *map, const modbus_register_range_t *range)
+{
+	uint16_t pos;
+
+	if (range->table >= MODBUS_TABLE_COUNT || range->count == 0 || (uint32_t)range->start + range->count > 0x10000) {
+		return MODBUS_ERROR;
+	}
+	if (range->shadow != NULL) {
+		/* registers only, all of the range in the bank */
+		if (range->table == MODBUS_TABLE_COILS || range->table == MODBUS_TABLE_DISCRETE_INPUTS ||
+				range->count > range->shadow->count) {
+			return MODBUS_ERROR;
+		}
+	} else if (range->data == NULL) {
+		return MODBUS_ERROR;
+	}
+	if (map->range_count >= map->capacity) {
+		return MODBUS_ERROR_OUT_OF_BOUNDS;
+	}
+	/* keep ranges sorted (insertion happens at init time, so simple shifting is fine) */
+	pos = map->range_count;
+	while (pos > 0 && (map->ranges[pos - 1].table > range->table ||
+			(map->ranges[pos - 1].table == range->table && map->ranges[pos - 1].start > range->start))) {
+		pos--;
+	}
+	/* reject overlap with neighbours */
+	if (pos > 0 && map->ranges[pos - 1].table == range->table &&
+			(uint32_t)map->ranges[pos - 1].start + map->ranges[pos - 1].count > range->start) {
+		return MODBUS_ERROR;
+	}
+	if (pos < map->range_count && map->ranges[pos].table == range->table &&
+			(uint32_t)range->start + range->count > map->ranges[pos].start) {
+		return MODBUS_ERROR;
+	}
+	memmove(&map->ranges[pos + 1], &map->ranges[pos], (map->range_count - pos) * sizeof(modbus_register_range_t));
+	map->ranges[pos] = *range;
+	if (range->table == MODBUS_TABLE_INPUT_REGISTERS || range->table == MODBUS_TABLE_DISCRETE_INPUTS) {
+		map->ranges[pos].access &= ~MODBUS_ACCESS_WRITE;
+	}
+	map->range_count++;
+	modbus_register_map_reindex(map);
+	return MODBUS_OK;
+}
+
+const modbus_register_range_t *modbus_register_map_find(const modbus_register_map_t *map, uint8_t table,
+		uint16_t address, uint16_t count)
+{
+	const modbus_register_range_t *ranges;
+	uint16_t low = 0;
+	uint16_t high;
+
+	if (table >= MODBUS_TABLE_COUNT || map->table_count[table] == 0) {
+		return NULL;
+	}
+	ranges = &map->ranges[map->table_first[table]];
+	high = map->table_count[table];
+	/* find last range starting at or before address */
+	while (high - low > 1) {
+		uint16_t mid = (low + high) / 2;
+		if (ranges[mid].start <= address) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+	if (ranges[low].start > address ||
+			(uint32_t)address + count > (uint32_t)ranges[low].start + ranges[low].count) {
+		return NULL;
+	}
+	return &ranges[low];
+}
+
+uint8_t modbus_register_map_table(uint8_t function_code)
+{
+	switch (function_code) {
+	case MODBUS_READ_COILS:
+	case MODBUS_WRITE_SINGLE_COIL:
+	case MODBUS_WRITE_MULTIPLE_COILS:
+		return MODBUS_TABLE_COILS;
+	case MODBUS_READ_DISCRETE_INPUTS:
+		return MODBUS_TABLE_DISCRETE_INPUTS;
+	case MODBUS_READ_INPUT_REGISTERS:
+		return MODBUS_TABLE_INPUT_REGISTERS;
+	case MODBUS_READ_HOLDING_REGISTERS:
+	case MODBUS_WRITE_SINGLE_REGISTER:
+	case MODBUS_WRITE_MULTIPLE_REGISTERS:
+	case MODBUS_MASK_WRITE_REGISTER:
+	case MODBUS_READ_WRITE_MULTIPLE_REGISTERS:
+		return MODBUS_TABLE_HOLDING_REGISTERS;
+	default:
+		return MODBUS_TABLE_COUNT;
+	}
+}
+
+int8_t modbus_register_map_serve(modbus_slave_ctx_t *ctx, const modbus_register_map_t *map,
+		modbus_transaction_t *transaction)
+{
+	const modbus_register_range_t *range;
+	uint8_t table = modbus_register_map_table(transaction->function_code);
+
+	range = modbus_register_map_find(map, table, transaction->register_address, transaction->register_count);
+	if (range == NULL) {
+		return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+	}
+	switch (transaction->function_code) {
+	case MODBUS_READ_HOLDING_REGISTERS:
+	case MODBUS_READ_INPUT_REGISTERS:
+		return modbus_register_map_read_registers(ctx, range, transaction);
+	case MODBUS_WRITE_SINGLE_REGISTER:
+	case MODBUS_WRITE_MULTIPLE_REGISTERS:
+		return modbus_register_map_write_registers(ctx, range, transaction);
+	case MODBUS_READ_COILS:
+	case MODBUS_READ_DISCRETE_INPUTS:
+		return modbus_register_map_read_bits(ctx, range, transaction);
+	case MODBUS_WRITE_SINGLE_COIL:
+	case MODBUS_WRITE_MULTIPLE_COILS:
+		return modbus_register_map_write_bits(ctx, range, transaction);
+	default:
+		return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+	}
+}
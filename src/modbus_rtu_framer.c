@@ -0,0 +1,136 @@
+/*
+ * modbus_rtu_framer.c
+ *
+ *  Byte-stream RTU framer, see modbus_rtu_framer.h
+ */
+
+#include "modbus_rtu_framer.h"
+
+/*
+ * Private functions
+ */
+
+/* silence between end of byte received at 'from_us' and byte received at 'to_us'
+ * (timestamps are taken at the end of the character); negative values are clamped */
+static uint32_t modbus_rtu_silence(uint32_t from_us, uint32_t to_us)
+{
+	int32_t silence = (int32_t)(to_us - from_us);
+	return silence > 0 ? (uint32_t)silence : 0;
+}
+
+/* frame ended (t3.5 silence): validate and pass it on */
+static int8_t modbus_rtu_framer_close(modbus_rtu_framer_t *framer)
+{
+	framer->state = MODBUS_RTU_STATE_IDLE;
+	if (framer->frame_nok || framer->len < MODBUS_MINIMAL_FRAME_LEN) {
+		framer->frames_invalid++;
+		return MODBUS_ERROR_FRAME_INVALID;
+	}
+	/* CRC computed over whole frame including received CRC is zero for valid frame */
+	if (framer->crc != 0) {
+		framer->frames_crc_error++;
+		return MODBUS_ERROR_CRC;
+	}
+	framer->frames_ok++;
+	if (framer->handler == NULL) {
+		return modbus_slave_process_frame(framer->buffer, framer->len);
+	}
+	return framer->handler(framer->buffer, framer->len, framer->user_data);
+}
+
+/*
+ * Public function definitions
+ */
+
+int8_t modbus_rtu_framer_init(modbus_rtu_framer_t *framer, uint32_t baudrate,
+		modbus_frame_handler_t handler, void *user_data)
+{
+	if (framer == NULL || baudrate == 0) {
+		return MODBUS_ERROR;
+	}
+	memset(framer, 0, sizeof(*framer));
+	/* round up, shorter timeouts would split frames */
+	framer->char_us = (MODBUS_RTU_BITS_PER_CHAR * 1000000UL + baudrate - 1) / baudrate;
+	if (baudrate > MODBUS_RTU_FIXED_TIMING_BAUDRATE) {
+		framer->t15_us = MODBUS_RTU_FIXED_T15_US;
+		framer->t35_us = MODBUS_RTU_FIXED_T35_US;
+	} else {
+		framer->t15_us = (uint32_t)((15ULL * MODBUS_RTU_BITS_PER_CHAR * 1000000ULL + 10ULL * baudrate - 1) / (10ULL * baudrate));
+		framer->t35_us = (uint32_t)((35ULL * MODBUS_RTU_BITS_PER_CHAR * 1000000ULL + 10ULL * baudrate - 1) / (10ULL * baudrate));
+	}
+	framer->handler = handler;
+	framer->user_data = user_data;
+	framer->state = MODBUS_RTU_STATE_IDLE;
+	return MODBUS_OK;
+}
+
+void modbus_rtu_framer_reset(modbus_rtu_framer_t *framer)
+{
+	framer->state = MODBUS_RTU_STATE_IDLE;
+	framer->len = 0;
+	framer->frame_nok = 0;
+}
+
+int8_t modbus_rtu_framer_feed(modbus_rtu_framer_t *framer, const uint8_t *data, int len, uint32_t timestamp_us)
+{
+	int8_t result = MODBUS_FRAME_INCOMPLETE;
+
+	if (len <= 0) {
+		return result;
+	}
+	if (framer->state != MODBUS_RTU_STATE_IDLE) {
+		/* bytes in chunk are assumed to be back-to-back, estimate arrival of the first one */
+		uint32_t first_byte_us = timestamp_us - (uint32_t)(len - 1) * framer->char_us;
+		uint32_t silence = modbus_rtu_silence(framer->last_byte_us + framer->char_us, first_byte_us);
+		if (silence >= framer->t35_us) {
+			/* previous frame has ended, this is the start of the next one */
+			result = modbus_rtu_framer_close(framer);
+		} else if (silence > framer->t15_us || framer->state == MODBUS_RTU_STATE_CONTROL_AND_WAITING) {
+			/* character received after t1.5: frame is not OK */
+			framer->frame_nok = 1;
+		}
+	}
+	if (framer->state == MODBUS_RTU_STATE_IDLE) {
+		/* start of frame */
+		framer->len = 0;
+		framer->crc = MODBUS_CRC16_INIT;
+		framer->frame_nok = 0;
+	}
+	framer->state = MODBUS_RTU_STATE_RECEPTION;
+	framer->last_byte_us = timestamp_us;
+	if (framer->frame_nok) {
+		/* frame is going to be discarded anyway */
+		return result;
+	}
+	if (framer->len + len > MODBUS_MAX_RTU_FRAME_SIZE) {
+		framer->frame_nok = 1;
+		return result;
+	}
+	memcpy(framer->buffer + framer->len, data, len);
+	framer->len += len;
+	/* CRC is updated as bytes arrive, so it is ready when the frame ends */
+	framer->crc = modbus_crc16_update(framer->crc, data, len);
+	return result;
+}
+
+int8_t modbus_rtu_framer_poll(modbus_rtu_framer_t *framer, uint32_t now_us)
+{
+	uint32_t silence;
+
+	if (framer->state == MODBUS_RTU_STATE_IDLE) {
+		return MODBUS_FRAME_INCOMPLETE;
+	}
+	silence = modbus_rtu_silence(framer->last_byte_us, now_us);
+	if (silence >= framer->t35_us) {
+		return modbus_rtu_framer_close(framer);
+	}
+	if (silence > framer->t15_us) {
+		framer->state = MODBUS_RTU_STATE_CONTROL_AND_WAITING;
+	}
+	return MODBUS_FRAME_INCOMPLETE;
+}
+
+uint32_t modbus_rtu_framer_deadline(const modbus_rtu_framer_t *framer)
+{
+	return framer->last_byte_us + framer->t35_us;
+}
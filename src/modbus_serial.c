@@ -0,0 +1,410 @@
+/*
+ * modbus_serial.c
+ *
+ *  Modbus RTU over Linux serial ports (termios, epoll, timerfd), see modbus_serial.h
+ */
+
+#define _GNU_SOURCE
+#include "modbus_serial.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <linux/serial.h>
+
+/* epoll event data: port index * 2 + event kind; eventfd of modbus_serial_stop() is special */
+#define MODBUS_SERIAL_EVENT_RX 0
+#define MODBUS_SERIAL_EVENT_TIMER 1
+#define MODBUS_SERIAL_EVENT_WAKE UINT64_MAX
+
+/*
+ * Private functions
+ */
+
+static uint64_t modbus_serial_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+static speed_t modbus_serial_speed(uint32_t baudrate)
+{
+	static const struct {
+		uint32_t baudrate;
+		speed_t speed;
+	} speeds[] = {
+		{ 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+		{ 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+		{ 230400, B230400 }, { 460800, B460800 }, { 500000, B500000 }, { 576000, B576000 },
+		{ 921600, B921600 }, { 1000000, B1000000 }, { 1152000, B1152000 }, { 1500000, B1500000 },
+		{ 2000000, B2000000 }, { 2500000, B2500000 }, { 3000000, B3000000 }, { 3500000, B3500000 },
+		{ 4000000, B4000000 },
+	};
+
+	for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+		if (speeds[i].baudrate == baudrate) {
+			return speeds[i].speed;
+		}
+	}
+	return B0;
+}
+
+static int8_t modbus_serial_epoll_set(modbus_serial_t *serial, int op, int fd, uint32_t events, uint64_t data)
+{
+	struct epoll_event event = { .events = events, .data.u64 = data };
+
+	return epoll_ctl(serial->epoll_fd, op, fd, &event) == 0 ? MODBUS_OK : MODBUS_ERROR;
+}
+
+/* one-shot timer at end-of-frame deadline (disarmed when framer is idle) */
+static void modbus_serial_arm_timer(modbus_serial_port_t *port, uint64_t now_us)
+{
+	struct itimerspec its;
+	uint64_t deadline_us;
+
+	memset(&its, 0, sizeof(its));
+	if (port->framer.state != MODBUS_RTU_STATE_IDLE) {
+		/* framer works with 32-bit timestamps; deadline relative to now (can be in the past) */
+		deadline_us = now_us + (int32_t)(modbus_rtu_framer_deadline(&port->framer) - (uint32_t)now_us);
+		its.it_value.tv_sec = deadline_us / 1000000u;
+		its.it_value.tv_nsec = (deadline_us % 1000000u) * 1000;
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+			/* zero would disarm the timer */
+			its.it_value.tv_nsec = 1;
+		}
+	}
+	timerfd_settime(port->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* writes pending reply; waits for EPOLLOUT if the driver can't take all of it now */
+static void modbus_serial_flush(modbus_serial_port_t *port)
+{
+	ssize_t written;
+
+	while (port->tx_pos < port->tx_len) {
+		written = write(port->fd, port->tx_buffer + port->tx_pos, port->tx_len - port->tx_pos);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				modbus_serial_epoll_set(port->serial, EPOLL_CTL_MOD, port->fd, EPOLLIN | EPOLLOUT,
+						port->index * 2 + MODBUS_SERIAL_EVENT_RX);
+				return;
+			}
+			port->stats.tx_errors++;
+			break;
+		}
+		port->tx_pos += written;
+		port->stats.tx_bytes += written;
+	}
+	if (port->tx_len > 0 && port->tx_pos == port->tx_len) {
+		port->stats.replies++;
+	}
+	port->tx_len = 0;
+	port->tx_pos = 0;
+	modbus_serial_epoll_set(port->serial, EPOLL_CTL_MOD, port->fd, EPOLLIN, port->index * 2 + MODBUS_SERIAL_EVENT_RX);
+}
+
+/* appends CRC to reply (address + PDU) built in tx_buffer and writes it */
+static void modbus_serial_send(modbus_serial_port_t *port, uint16_t reply_len)
+{
+	uint16_t crc16 = modbus_CRC16(port->tx_buffer, reply_len);
+
+	port->tx_buffer[reply_len++] = crc16 & 0xff;
+	port->tx_buffer[reply_len++] = crc16 >> 8;
+	port->tx_len = reply_len;
+	modbus_serial_flush(port);
+}
+
+/* modbus_frame_handler_t: frame with valid CRC from framer */
+static int8_t modbus_serial_frame_handler(const uint8_t *frame, int len, void *user_data)
+{
+	modbus_serial_port_t *port = user_data;
+	uint16_t reply_len;
+	uint32_t turnaround;
+
+	if (port->tx_len != 0) {
+		/* master didn't wait for previous reply */
+		port->stats.tx_errors++;
+		port->tx_len = 0;
+		port->tx_pos = 0;
+	}
+	/* CRC is not part of the request */
+	modbus_slave_ctx_process_request(port->ctx, frame, len - 2, port->tx_buffer, &reply_len, MODBUS_REQUEST_FLAG_NONE);
+	if (reply_len == 0) {
+		/* no reply, or request parked until modbus_serial_port_complete() */
+		return MODBUS_OK;
+	}
+	turnaround = (uint32_t)modbus_serial_now_us() - port->framer.last_byte_us;
+	modbus_serial_send(port, reply_len);
+	port->stats.turnaround_last_us = turnaround;
+	if (port->stats.turnaround_total_us == 0 || turnaround < port->stats.turnaround_min_us) {
+		port->stats.turnaround_min_us = turnaround;
+	}
+	if (turnaround > port->stats.turnaround_max_us) {
+		port->stats.turnaround_max_us = turnaround;
+	}
+	port->stats.turnaround_total_us += turnaround;
+	return MODBUS_OK;
+}
+
+/* frames dropped by framer never reach the context, count them in its bus diagnostics */
+static void modbus_serial_count_error(modbus_serial_port_t *port, int8_t result)
+{
+	if (result == MODBUS_ERROR_CRC || result == MODBUS_ERROR_FRAME_INVALID) {
+		modbus_slave_ctx_count_error(port->ctx, result);
+	}
+}
+
+static void modbus_serial_read(modbus_serial_port_t *port)
+{
+	uint8_t data[MODBUS_SERIAL_READ_SIZE];
+	uint64_t now_us = 0;
+	ssize_t received;
+
+	for (;;) {
+		received = read(port->fd, data, sizeof(data));
+		if (received < 0 && errno == EINTR) {
+			continue;
+		}
+		if (received <= 0) {
+			break;
+		}
+		now_us = modbus_serial_now_us();
+		port->stats.rx_bytes += received;
+		modbus_serial_count_error(port, modbus_rtu_framer_feed(&port->framer, data, received, (uint32_t)now_us));
+	}
+	if (now_us != 0) {
+		modbus_serial_arm_timer(port, now_us);
+	}
+}
+
+static void modbus_serial_timer(modbus_serial_port_t *port)
+{
+	uint64_t expirations;
+	uint64_t now_us;
+
+	if (read(port->timer_fd, &expirations, sizeof(expirations)) < 0) {
+		/* spurious wake-up, timer was re-armed meanwhile */
+		return;
+	}
+	now_us = modbus_serial_now_us();
+	modbus_serial_count_error(port, modbus_rtu_framer_poll(&port->framer, (uint32_t)now_us));
+	/* still receiving (bytes came after the timer was armed): wait for new deadline */
+	modbus_serial_arm_timer(port, now_us);
+}
+
+/*
+ * Public function definitions
+ */
+
+int8_t modbus_serial_configure(int fd, const modbus_serial_config_t *config)
+{
+	speed_t speed = modbus_serial_speed(config->baudrate);
+	struct termios tio;
+
+	if (speed == B0 || tcgetattr(fd, &tio) != 0) {
+		return MODBUS_ERROR;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag &= ~(CSTOPB | PARENB | PARODD | CRTSCTS);
+	tio.c_cflag |= CS8 | CLOCAL | CREAD;
+	switch (config->parity) {
+	case 'N':
+		break;
+	case 'E':
+		tio.c_cflag |= PARENB;
+		break;
+	case 'O':
+		tio.c_cflag |= PARENB | PARODD;
+		break;
+	default:
+		return MODBUS_ERROR;
+	}
+	if (config->stop_bits == 2) {
+		tio.c_cflag |= CSTOPB;
+	} else if (config->stop_bits != 1) {
+		return MODBUS_ERROR;
+	}
+	tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	if (cfsetispeed(&tio, speed) != 0 || cfsetospeed(&tio, speed) != 0 ||
+			tcsetattr(fd, TCSANOW, &tio) != 0) {
+		return MODBUS_ERROR;
+	}
+	tcflush(fd, TCIOFLUSH);
+	if (config->rs485) {
+		struct serial_rs485 rs485;
+		memset(&rs485, 0, sizeof(rs485));
+		rs485.flags = SER_RS485_ENABLED;
+		/* RTS level while sending / after sending */
+		rs485.flags |= config->rs485_rts_active_low ? SER_RS485_RTS_AFTER_SEND : SER_RS485_RTS_ON_SEND;
+		rs485.delay_rts_before_send = config->rs485_delay_before_ms;
+		rs485.delay_rts_after_send = config->rs485_delay_after_ms;
+		if (ioctl(fd, TIOCSRS485, &rs485) != 0) {
+			/* not supported by driver (or not a RS-485 capable port) */
+			return MODBUS_ERROR;
+		}
+	}
+	return MODBUS_OK;
+}
+
+int8_t modbus_serial_init(modbus_serial_t *serial)
+{
+	if (serial == NULL) {
+		return MODBUS_ERROR;
+	}
+	memset(serial, 0, sizeof(*serial));
+	serial->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	serial->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (serial->epoll_fd < 0 || serial->wake_fd < 0 ||
+			modbus_serial_epoll_set(serial, EPOLL_CTL_ADD, serial->wake_fd, EPOLLIN, MODBUS_SERIAL_EVENT_WAKE) != MODBUS_OK) {
+		modbus_serial_close(serial);
+		return MODBUS_ERROR;
+	}
+	serial->running = 1;
+	return MODBUS_OK;
+}
+
+int8_t modbus_serial_port_open(modbus_serial_t *serial, modbus_serial_port_t *port, modbus_slave_ctx_t *ctx,
+		const char *path, const modbus_serial_config_t *config)
+{
+	if (serial == NULL || port == NULL || ctx == NULL || path == NULL || config == NULL ||
+			serial->port_count >= MODBUS_SERIAL_MAX_PORTS) {
+		return MODBUS_ERROR;
+	}
+	memset(port, 0, sizeof(*port));
+	port->serial = serial;
+	port->ctx = ctx;
+	port->index = serial->port_count;
+	port->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	port->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (port->fd < 0 || port->timer_fd < 0 || modbus_serial_configure(port->fd, config) != MODBUS_OK ||
+			modbus_rtu_framer_init(&port->framer, config->baudrate, modbus_serial_frame_handler, port) != MODBUS_OK) {
+		goto error;
+	}
+	/* gaps inside frame can't be measured from user space: only t3.5 (or configured silence) counts */
+	if (config->silence_us != 0) {
+		port->framer.t35_us = config->silence_us;
+	}
+	port->framer.t15_us = port->framer.t35_us;
+	if (modbus_serial_epoll_set(serial, EPOLL_CTL_ADD, port->fd, EPOLLIN,
+				port->index * 2 + MODBUS_SERIAL_EVENT_RX) != MODBUS_OK ||
+			modbus_serial_epoll_set(serial, EPOLL_CTL_ADD, port->timer_fd, EPOLLIN,
+				port->index * 2 + MODBUS_SERIAL_EVENT_TIMER) != MODBUS_OK) {
+		goto error;
+	}
+	serial->ports[serial->port_count++] = port;
+	return MODBUS_OK;
+
+error:
+	if (port->fd >= 0) {
+		close(port->fd);
+	}
+	if (port->timer_fd >= 0) {
+		close(port->timer_fd);
+	}
+	port->fd = -1;
+	port->timer_fd = -1;
+	return MODBUS_ERROR;
+}
+
+int8_t modbus_serial_port_complete(modbus_serial_port_t *port, modbus_slave_ctx_t *ctx,
+		modbus_transaction_t *transaction, int8_t result)
+{
+	uint16_t reply_len;
+
+	if (port->tx_len != 0) {
+		/* previous reply is still being written, transaction stays pending */
+		return MODBUS_ERROR;
+	}
+	if (modbus_slave_ctx_complete_request(ctx, transaction, result, port->tx_buffer, &reply_len) != MODBUS_OK) {
+		return MODBUS_ERROR;
+	}
+	if (reply_len != 0) {
+		modbus_serial_send(port, reply_len);
+	}
+	return MODBUS_OK;
+}
+
+int8_t modbus_serial_poll(modbus_serial_t *serial, int timeout_ms)
+{
+	struct epoll_event events[MODBUS_SERIAL_MAX_EVENTS];
+	modbus_serial_port_t *port;
+	int count;
+
+	count = epoll_wait(serial->epoll_fd, events, MODBUS_SERIAL_MAX_EVENTS, timeout_ms);
+	if (count < 0) {
+		return errno == EINTR ? MODBUS_OK : MODBUS_ERROR;
+	}
+	for (int i = 0; i < count; i++) {
+		if (events[i].data.u64 == MODBUS_SERIAL_EVENT_WAKE) {
+			uint64_t value;
+			if (read(serial->wake_fd, &value, sizeof(value)) < 0) {
+				/* already drained */
+			}
+			continue;
+		}
+		port = serial->ports[events[i].data.u64 / 2];
+		if (events[i].data.u64 % 2 == MODBUS_SERIAL_EVENT_TIMER) {
+			modbus_serial_timer(port);
+			continue;
+		}
+		if (events[i].events & EPOLLOUT) {
+			modbus_serial_flush(port);
+		}
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+			modbus_serial_read(port);
+		}
+	}
+	return MODBUS_OK;
+}
+
+int8_t modbus_serial_run(modbus_serial_t *serial)
+{
+	while (__atomic_load_n(&serial->running, __ATOMIC_ACQUIRE)) {
+		if (modbus_serial_poll(serial, -1) != MODBUS_OK) {
+			return MODBUS_ERROR;
+		}
+	}
+	return MODBUS_OK;
+}
+
+void modbus_serial_stop(modbus_serial_t *serial)
+{
+	uint64_t value = 1;
+
+	__atomic_store_n(&serial->running, 0, __ATOMIC_RELEASE);
+	if (write(serial->wake_fd, &value, sizeof(value)) < 0) {
+		/* counter overflow is impossible here; nothing to do */
+	}
+}
+
+void modbus_serial_close(modbus_serial_t *serial)
+{
+	for (uint8_t i = 0; i < serial->port_count; i++) {
+		close(serial->ports[i]->fd);
+		close(serial->ports[i]->timer_fd);
+		serial->ports[i]->fd = -1;
+		serial->ports[i]->timer_fd = -1;
+	}
+	serial->port_count = 0;
+	if (serial->epoll_fd >= 0) {
+		close(serial->epoll_fd);
+	}
+	if (serial->wake_fd >= 0) {
+		close(serial->wake_fd);
+	}
+	serial->epoll_fd = -1;
+	serial->wake_fd = -1;
+}
@@ -0,0 +1,138 @@
+/*
+ * modbus_shadow.c
+ *
+ *  Seqlock-protected shadow register bank, see modbus_shadow.h
+ *
+ *  Registers are accessed with relaxed atomic loads/stores, so concurrent access is
+ *  well defined; ordering comes from the fences around the sequence counter.
+ */
+
+#include "modbus_shadow.h"
+
+/*
+ * Private functions
+ */
+
+static int8_t modbus_shadow_check(const modbus_shadow_bank_t *bank, uint16_t index, uint16_t count)
+{
+	if (bank == NULL || count == 0 || (uint32_t)index + count > bank->count) {
+		return MODBUS_ERROR_OUT_OF_BOUNDS;
+	}
+	return MODBUS_OK;
+}
+
+/* sequence of a snapshot that is not being written */
+static uint32_t modbus_shadow_read_begin(modbus_shadow_bank_t *bank)
+{
+	uint32_t sequence;
+
+	while ((sequence = __atomic_load_n(&bank->sequence, __ATOMIC_ACQUIRE)) & 1) {
+		/* writer inside, it only copies a few registers */
+	}
+	return sequence;
+}
+
+/* nonzero if registers were written since modbus_shadow_read_begin() returned sequence */
+static int modbus_shadow_read_retry(modbus_shadow_bank_t *bank, uint32_t sequence)
+{
+	/* register loads must not be moved after the sequence check */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&bank->sequence, __ATOMIC_RELAXED) == sequence) {
+		return 0;
+	}
+	__atomic_fetch_add(&bank->read_retries, 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/*
+ * Public function definitions
+ */
+
+int8_t modbus_shadow_init(modbus_shadow_bank_t *bank, uint16_t *registers, uint16_t count)
+{
+	if (bank == NULL || registers == NULL || count == 0) {
+		return MODBUS_ERROR;
+	}
+	bank->sequence = 0;
+	bank->count = count;
+	bank->registers = registers;
+	bank->read_retries = 0;
+	return MODBUS_OK;
+}
+
+void modbus_shadow_write_begin(modbus_shadow_bank_t *bank)
+{
+	uint32_t sequence = __atomic_load_n(&bank->sequence, __ATOMIC_RELAXED);
+
+	/* even -> odd claims the bank; fails while another writer is inside */
+	while ((sequence & 1) || !__atomic_compare_exchange_n(&bank->sequence, &sequence, sequence + 1, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		sequence = __atomic_load_n(&bank->sequence, __ATOMIC_RELAXED);
+	}
+	/* readers that see any of the new registers see the odd sequence afterwards */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void modbus_shadow_write_end(modbus_shadow_bank_t *bank)
+{
+	/* publishes registers together with the new even sequence */
+	__atomic_store_n(&bank->sequence, __atomic_load_n(&bank->sequence, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+void modbus_shadow_set(modbus_shadow_bank_t *bank, uint16_t index, uint16_t value)
+{
+	__atomic_store_n(&bank->registers[index], value, __ATOMIC_RELAXED);
+}
+
+uint16_t modbus_shadow_get(modbus_shadow_bank_t *bank, uint16_t index)
+{
+	return __atomic_load_n(&bank->registers[index], __ATOMIC_RELAXED);
+}
+
+int8_t modbus_shadow_write(modbus_shadow_bank_t *bank, uint16_t index, const uint16_t *values, uint16_t count)
+{
+	if (modbus_shadow_check(bank, index, count) != MODBUS_OK) {
+		return MODBUS_ERROR_OUT_OF_BOUNDS;
+	}
+	modbus_shadow_write_begin(bank);
+	for (uint16_t i = 0; i < count; i++) {
+		modbus_shadow_set(bank, index + i, values[i]);
+	}
+	modbus_shadow_write_end(bank);
+	return MODBUS_OK;
+}
+
+int8_t modbus_shadow_read(modbus_shadow_bank_t *bank, uint16_t index, uint16_t *values, uint16_t count)
+{
+	uint32_t sequence;
+
+	if (modbus_shadow_check(bank, index, count) != MODBUS_OK) {
+		return MODBUS_ERROR_OUT_OF_BOUNDS;
+	}
+	do {
+		sequence = modbus_shadow_read_begin(bank);
+		for (uint16_t i = 0; i < count; i++) {
+			values[i] = __atomic_load_n(&bank->registers[index + i], __ATOMIC_RELAXED);
+		}
+	} while (modbus_shadow_read_retry(bank, sequence));
+	return MODBUS_OK;
+}
+
+int8_t modbus_shadow_read_be(modbus_shadow_bank_t *bank, uint16_t index, uint8_t *data, uint16_t count)
+{
+	uint32_t sequence;
+	uint16_t value;
+
+	if (modbus_shadow_check(bank, index, count) != MODBUS_OK) {
+		return MODBUS_ERROR_OUT_OF_BOUNDS;
+	}
+	do {
+		sequence = modbus_shadow_read_begin(bank);
+		for (uint16_t i = 0; i < count; i++) {
+			value = __atomic_load_n(&bank->registers[index + i], __ATOMIC_RELAXED);
+			data[2 * i] = value >> 8;
+			data[2 * i + 1] = value & 0xff;
+		}
+	} while (modbus_shadow_read_retry(bank, sequence));
+	return MODBUS_OK;
+}
@@ -0,0 +1,373 @@
+/*
+ * modbus_tcp.c
+ *
+ *  Modbus TCP server (Linux, epoll), see modbus_tcp.h
+ */
+
+#define _GNU_SOURCE
+#include "modbus_tcp.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/*
+ * Private functions
+ */
+
+static int8_t modbus_tcp_epoll_set(modbus_tcp_server_t *server, int op, int fd, uint32_t events, void *ptr)
+{
+	struct epoll_event event = { .events = events, .data.ptr = ptr };
+
+	return epoll_ctl(server->epoll_fd, op, fd, &event) == 0 ? MODBUS_OK : MODBUS_ERROR;
+}
+
+static void modbus_tcp_connection_close(modbus_tcp_server_t *server, modbus_tcp_connection_t *conn)
+{
+	/* closing the descriptor removes it from epoll set; the slot is reused only after
+	 * current batch of events is handled, so that stale events can't hit a new connection */
+	close(conn->fd);
+	conn->fd = -1;
+	conn->next_free = server->closed_connections;
+	server->closed_connections = conn;
+	server->active_connections--;
+	server->stats.connections_closed++;
+}
+
+static void modbus_tcp_accept(modbus_tcp_server_t *server)
+{
+	modbus_tcp_connection_t *conn;
+	int one = 1;
+	int fd;
+
+	/* accept everything that is pending */
+	for (;;) {
+		fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			/* EAGAIN: nothing left; other errors (e.g. EMFILE) are retried on next event */
+			return;
+		}
+		conn = server->free_connections;
+		if (conn == NULL) {
+			/* connection limit reached */
+			server->stats.connections_rejected++;
+			close(fd);
+			continue;
+		}
+		server->free_connections = conn->next_free;
+		conn->fd = fd;
+		conn->rx_len = 0;
+		conn->tx_len = 0;
+		conn->tx_pos = 0;
+		conn->tx_blocked = 0;
+		/* replies are small and latency matters */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		server->active_connections++;
+		if (modbus_tcp_epoll_set(server, EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLRDHUP, conn) != MODBUS_OK) {
+			modbus_tcp_connection_close(server, conn);
+			continue;
+		}
+		server->stats.connections_accepted++;
+	}
+}
+
+/* sends pending replies; returns MODBUS_ERROR if connection has to be closed */
+static int8_t modbus_tcp_flush(modbus_tcp_server_t *server, modbus_tcp_connection_t *conn)
+{
+	ssize_t sent;
+
+	while (conn->tx_pos < conn->tx_len) {
+		/* MSG_NOSIGNAL: peer may have gone away, don't raise SIGPIPE */
+		sent = send(conn->fd, conn->tx_buffer + conn->tx_pos, conn->tx_len - conn->tx_pos, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			return MODBUS_ERROR;
+		}
+		conn->tx_pos += sent;
+	}
+	if (conn->tx_pos == conn->tx_len) {
+		conn->tx_pos = 0;
+		conn->tx_len = 0;
+		if (conn->tx_blocked) {
+			/* resume reading */
+			conn->tx_blocked = 0;
+			return modbus_tcp_epoll_set(server, EPOLL_CTL_MOD, conn->fd, EPOLLIN | EPOLLRDHUP, conn);
+		}
+	} else if (!conn->tx_blocked) {
+		/* socket buffer is full: stop reading until peer catches up */
+		conn->tx_blocked = 1;
+		return modbus_tcp_epoll_set(server, EPOLL_CTL_MOD, conn->fd, EPOLLOUT | EPOLLRDHUP, conn);
+	}
+	return MODBUS_OK;
+}
+
+/* processes all complete requests in RX buffer for which there is space in TX buffer;
+ * tx_full is set if some requests were left for later; returns MODBUS_ERROR if connection
+ * has to be closed */
+static int8_t modbus_tcp_process_rx(modbus_tcp_server_t *server, modbus_tcp_connection_t *conn, uint8_t *tx_full)
+{
+	uint16_t pos = 0;
+	uint16_t length;
+	uint16_t reply_len;
+	uint8_t *request;
+	uint8_t *reply;
+
+	*tx_full = 0;
+	while (conn->rx_len - pos >= MODBUS_TCP_MBAP_HEADER_LEN) {
+		request = conn->rx_buffer + pos;
+		length = (request[4] << 8) | request[5];
+		if (((request[2] << 8) | request[3]) != MODBUS_TCP_PROTOCOL_ID ||
+				length < 2 || length > MODBUS_TCP_MAX_PDU_SIZE + 1) {
+			/* not Modbus; there is no way to resynchronize the stream */
+			server->stats.protocol_errors++;
+			return MODBUS_ERROR;
+		}
+		if (conn->rx_len - pos < MODBUS_TCP_MBAP_LENGTH_OFFSET + length) {
+			/* incomplete request */
+			break;
+		}
+		if (MODBUS_TCP_TX_BUFFER_SIZE - conn->tx_len < MODBUS_TCP_MBAP_LENGTH_OFFSET + MODBUS_MAX_RTU_FRAME_SIZE) {
+			/* no space for reply; continue when pending replies are sent */
+			*tx_full = 1;
+			break;
+		}
+		server->stats.requests++;
+		/* unit id + PDU has the same layout as RTU frame without CRC */
+		reply = conn->tx_buffer + conn->tx_len;
+		modbus_slave_ctx_process_request(server->ctx, request + MODBUS_TCP_MBAP_LENGTH_OFFSET, length,
+				reply + MODBUS_TCP_MBAP_LENGTH_OFFSET, &reply_len,
+				MODBUS_REQUEST_FLAG_ANY_ADDRESS | MODBUS_REQUEST_FLAG_NO_DEFER);
+		pos += MODBUS_TCP_MBAP_LENGTH_OFFSET + length;
+		if (reply_len == 0) {
+			continue;
+		}
+		/* transaction id and protocol id are copied from request */
+		memcpy(reply, request, 4);
+		reply[4] = reply_len >> 8;
+		reply[5] = reply_len & 0xff;
+		conn->tx_len += MODBUS_TCP_MBAP_LENGTH_OFFSET + reply_len;
+		server->stats.replies++;
+	}
+	if (pos > 0) {
+		conn->rx_len -= pos;
+		memmove(conn->rx_buffer, conn->rx_buffer + pos, conn->rx_len);
+	}
+	return MODBUS_OK;
+}
+
+/* processes received requests and sends replies; all replies to one batch of
+ * requests go out in one call */
+static int8_t modbus_tcp_serve(modbus_tcp_server_t *server, modbus_tcp_connection_t *conn)
+{
+	uint8_t tx_full;
+
+	do {
+		if (modbus_tcp_process_rx(server, conn, &tx_full) != MODBUS_OK ||
+				modbus_tcp_flush(server, conn) != MODBUS_OK) {
+			return MODBUS_ERROR;
+		}
+	} while (tx_full && !conn->tx_blocked);
+	return MODBUS_OK;
+}
+
+static int8_t modbus_tcp_read(modbus_tcp_server_t *server, modbus_tcp_connection_t *conn)
+{
+	ssize_t received;
+
+	if (conn->rx_len == MODBUS_TCP_RX_BUFFER_SIZE) {
+		/* can't happen: RX buffer holds several ADUs and complete ones are always consumed */
+		return MODBUS_ERROR;
+	}
+	received = recv(conn->fd, conn->rx_buffer + conn->rx_len, MODBUS_TCP_RX_BUFFER_SIZE - conn->rx_len, 0);
+	if (received == 0) {
+		/* peer closed connection */
+		return MODBUS_ERROR;
+	}
+	if (received < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? MODBUS_OK : MODBUS_ERROR;
+	}
+	conn->rx_len += received;
+	return modbus_tcp_serve(server, conn);
+}
+
+static void modbus_tcp_connection_event(modbus_tcp_server_t *server, modbus_tcp_connection_t *conn, uint32_t events)
+{
+	int8_t result = MODBUS_OK;
+
+	if (events & EPOLLERR) {
+		result = MODBUS_ERROR;
+	} else if (events & EPOLLOUT) {
+		result = modbus_tcp_flush(server, conn);
+		if (result == MODBUS_OK && !conn->tx_blocked) {
+			/* requests that were waiting for TX space */
+			result = modbus_tcp_serve(server, conn);
+		}
+	} else if (events & EPOLLIN) {
+		result = modbus_tcp_read(server, conn);
+	} else if (events & (EPOLLHUP | EPOLLRDHUP)) {
+		result = MODBUS_ERROR;
+	}
+	if (result != MODBUS_OK) {
+		modbus_tcp_connection_close(server, conn);
+	}
+}
+
+/*
+ * Public function definitions
+ */
+
+int8_t modbus_tcp_server_init(modbus_tcp_server_t *server, modbus_slave_ctx_t *ctx,
+		const char *bind_address, uint16_t port, uint32_t max_connections)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+
+	if (server == NULL || ctx == NULL || max_connections == 0) {
+		return MODBUS_ERROR;
+	}
+	memset(server, 0, sizeof(*server));
+	server->ctx = ctx;
+	server->listen_fd = -1;
+	server->epoll_fd = -1;
+	server->wake_fd = -1;
+	server->max_connections = max_connections;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind_address != NULL && inet_pton(AF_INET, bind_address, &addr.sin_addr) != 1) {
+		return MODBUS_ERROR;
+	}
+
+	server->connections = calloc(max_connections, sizeof(modbus_tcp_connection_t));
+	if (server->connections == NULL) {
+		return MODBUS_ERROR;
+	}
+	for (uint32_t i = 0; i < max_connections; i++) {
+		server->connections[i].fd = -1;
+		server->connections[i].next_free = (i + 1 < max_connections) ? &server->connections[i + 1] : NULL;
+	}
+	server->free_connections = &server->connections[0];
+
+	server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (server->listen_fd < 0 || server->epoll_fd < 0 || server->wake_fd < 0) {
+		modbus_tcp_server_close(server);
+		return MODBUS_ERROR;
+	}
+	setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			listen(server->listen_fd, SOMAXCONN) != 0 ||
+			/* listening socket is identified by NULL, wake-up eventfd by pointer to wake_fd */
+			modbus_tcp_epoll_set(server, EPOLL_CTL_ADD, server->listen_fd, EPOLLIN, NULL) != MODBUS_OK ||
+			modbus_tcp_epoll_set(server, EPOLL_CTL_ADD, server->wake_fd, EPOLLIN, &server->wake_fd) != MODBUS_OK) {
+		modbus_tcp_server_close(server);
+		return MODBUS_ERROR;
+	}
+	server->running = 1;
+	return MODBUS_OK;
+}
+
+uint16_t modbus_tcp_server_port(const modbus_tcp_server_t *server)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+
+	if (getsockname(server->listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+		return 0;
+	}
+	return ntohs(addr.sin_port);
+}
+
+int8_t modbus_tcp_server_poll(modbus_tcp_server_t *server, int timeout_ms)
+{
+	struct epoll_event events[MODBUS_TCP_MAX_EVENTS];
+	int count;
+
+	count = epoll_wait(server->epoll_fd, events, MODBUS_TCP_MAX_EVENTS, timeout_ms);
+	if (count < 0) {
+		return errno == EINTR ? MODBUS_OK : MODBUS_ERROR;
+	}
+	for (int i = 0; i < count; i++) {
+		if (events[i].data.ptr == NULL) {
+			modbus_tcp_accept(server);
+		} else if (events[i].data.ptr == &server->wake_fd) {
+			uint64_t value;
+			if (read(server->wake_fd, &value, sizeof(value)) < 0) {
+				/* already drained */
+			}
+		} else if (((modbus_tcp_connection_t *)events[i].data.ptr)->fd >= 0) {
+			modbus_tcp_connection_event(server, events[i].data.ptr, events[i].events);
+		}
+	}
+	/* slots of connections closed during this batch can be reused now */
+	while (server->closed_connections != NULL) {
+		modbus_tcp_connection_t *conn = server->closed_connections;
+		server->closed_connections = conn->next_free;
+		conn->next_free = server->free_connections;
+		server->free_connections = conn;
+	}
+	return MODBUS_OK;
+}
+
+int8_t modbus_tcp_server_run(modbus_tcp_server_t *server)
+{
+	while (__atomic_load_n(&server->running, __ATOMIC_ACQUIRE)) {
+		if (modbus_tcp_server_poll(server, -1) != MODBUS_OK) {
+			return MODBUS_ERROR;
+		}
+	}
+	return MODBUS_OK;
+}
+
+void modbus_tcp_server_stop(modbus_tcp_server_t *server)
+{
+	uint64_t value = 1;
+
+	__atomic_store_n(&server->running, 0, __ATOMIC_RELEASE);
+	if (write(server->wake_fd, &value, sizeof(value)) < 0) {
+		/* counter overflow is impossible here; nothing to do */
+	}
+}
+
+void modbus_tcp_server_close(modbus_tcp_server_t *server)
+{
+	if (server->connections != NULL) {
+		for (uint32_t i = 0; i < server->max_connections; i++) {
+			if (server->connections[i].fd >= 0) {
+				close(server->connections[i].fd);
+			}
+		}
+		free(server->connections);
+		server->connections = NULL;
+	}
+	if (server->listen_fd >= 0) {
+		close(server->listen_fd);
+	}
+	if (server->epoll_fd >= 0) {
+		close(server->epoll_fd);
+	}
+	if (server->wake_fd >= 0) {
+		close(server->wake_fd);
+	}
+	server->listen_fd = -1;
+	server->epoll_fd = -1;
+	server->wake_fd = -1;
+	server->active_connections = 0;
+}
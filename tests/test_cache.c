@@ -0,0 +1,342 @@
+/*
+ * Response cache: hits skip the callback and return the stored frame, TTL, ranges,
+ * exceptions, invalidation by writes and by the application, request API, busy replies,
+ * registered read handlers, vectored transmit
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus.h"
+#include "modbus_cache.h"
+#include "test_util.h"
+
+#define INPUTS 32
+#define HOLDINGS 32
+#define TTL_MS 100
+
+static modbus_slave_ctx_t ctx;
+static modbus_cache_t cache;
+static modbus_cache_entry_t entries[8];
+static const modbus_cache_range_t cache_ranges[] = {
+	/* registers 32..63 are cacheable, but don't exist */
+	{ .table = MODBUS_TABLE_INPUT_REGISTERS, .start = 0, .count = 64, .ttl_ms = TTL_MS },
+	{ .table = MODBUS_TABLE_HOLDING_REGISTERS, .start = 0, .count = 16, .ttl_ms = 1000 },
+};
+
+static uint16_t inputs[INPUTS];
+static uint16_t holdings[HOLDINGS];
+static int callbacks;
+static uint32_t now_ms = 0xfffffff0; /* wraps during test */
+
+/* what was sent */
+static uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static int reply_len;
+static int transmits;
+static bool defer;
+static modbus_pending_t pool[1];
+
+static uint32_t test_clock(void *clock_data)
+{
+	(void)clock_data;
+	return now_ms;
+}
+
+static int8_t cache_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	uint16_t address = transaction->register_address;
+	uint16_t count = transaction->register_count;
+
+	(void)ctx;
+	callbacks++;
+	if (defer) {
+		return MODBUS_PENDING;
+	}
+	switch (transaction->function_code) {
+	case MODBUS_READ_INPUT_REGISTERS:
+		if (address + count > INPUTS) {
+			return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+		}
+		memcpy(transaction->input_registers, &inputs[address], 2 * count);
+		return MODBUS_OK;
+	case MODBUS_READ_HOLDING_REGISTERS:
+		if (address + count > HOLDINGS) {
+			return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+		}
+		memcpy(transaction->holding_registers, &holdings[address], 2 * count);
+		return MODBUS_OK;
+	case MODBUS_WRITE_SINGLE_REGISTER:
+	case MODBUS_WRITE_MULTIPLE_REGISTERS:
+		if (address + count > HOLDINGS) {
+			return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+		}
+		memcpy(&holdings[address], transaction->holding_registers, 2 * count);
+		return MODBUS_OK;
+	default:
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+}
+
+static int8_t cache_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	memcpy(reply, buffer, data_len);
+	reply_len = data_len;
+	transmits++;
+	return MODBUS_OK;
+}
+
+static int8_t cache_transmitv(modbus_slave_ctx_t *ctx, const modbus_iovec_t *iov, uint8_t iov_count)
+{
+	(void)ctx;
+	reply_len = 0;
+	for (int i = 0; i < iov_count; i++) {
+		memcpy(reply + reply_len, iov[i].data, iov[i].len);
+		reply_len += iov[i].len;
+	}
+	transmits++;
+	return MODBUS_OK;
+}
+
+/* registered read holding registers handler: one register, 0xbeef */
+static int8_t fixed_execute(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	(void)transaction;
+	return MODBUS_OK;
+}
+
+static uint8_t fixed_serialize(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	(void)transaction;
+	buffer[0] = 2;
+	buffer[1] = 0xbe;
+	buffer[2] = 0xef;
+	return 3;
+}
+
+static const modbus_function_handler_t fixed_handler = { 4, 0, NULL, fixed_execute, fixed_serialize };
+
+/* global API is not used here */
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+static void request(const uint8_t *pdu, int pdu_len)
+{
+	reply_len = 0;
+	test_request(&ctx, ctx.address, pdu, pdu_len, false);
+}
+
+static void read_registers(uint8_t function_code, uint16_t address, uint16_t count)
+{
+	const uint8_t pdu[] = { function_code, address >> 8, address & 0xff, count >> 8, count & 0xff };
+
+	request(pdu, sizeof(pdu));
+}
+
+static bool reply_crc_ok(void)
+{
+	uint16_t crc;
+
+	if (reply_len < 4) {
+		return false;
+	}
+	crc = modbus_CRC16(reply, reply_len - 2);
+	return reply[reply_len - 2] == (crc & 0xff) && reply[reply_len - 1] == (crc >> 8);
+}
+
+/* valid read reply, first register value */
+static bool reply_value(uint16_t value)
+{
+	return reply_crc_ok() && !(reply[1] & MODBUS_ERROR_FLAG) && reply[3] == (value >> 8) &&
+			reply[4] == (value & 0xff);
+}
+
+int main(void)
+{
+	uint8_t first[MODBUS_MAX_RTU_FRAME_SIZE];
+	int first_len;
+	bool ok;
+
+	printf("Response cache test\n");
+	for (int i = 0; i < INPUTS; i++) {
+		inputs[i] = 0x1000 + i;
+	}
+	for (int i = 0; i < HOLDINGS; i++) {
+		holdings[i] = 0x2000 + i;
+	}
+	modbus_slave_ctx_init(&ctx, 1, cache_callback, cache_transmit, NULL);
+
+	ok = modbus_cache_init(&cache, entries, 6, cache_ranges, 2, test_clock, NULL) == MODBUS_ERROR &&
+			modbus_cache_init(&cache, entries, 8, cache_ranges, 2, NULL, NULL) == MODBUS_ERROR &&
+			modbus_cache_init(&cache, entries, 8, cache_ranges, 2, test_clock, NULL) == MODBUS_OK &&
+			modbus_slave_ctx_set_cache(&ctx, &cache) == MODBUS_OK;
+	check("init", ok);
+
+	/* miss: served by callback, stored */
+	callbacks = 0;
+	read_registers(MODBUS_READ_INPUT_REGISTERS, 0, 10);
+	memcpy(first, reply, reply_len);
+	first_len = reply_len;
+	ok = callbacks == 1 && reply_len == 5 + 20 && reply_value(0x1000) && cache.stats.misses == 1 &&
+			cache.stats.hits == 0;
+	check("miss is served and stored", ok);
+
+	/* hit: same frame, no callback */
+	transmits = 0;
+	read_registers(MODBUS_READ_INPUT_REGISTERS, 0, 10);
+	ok = callbacks == 1 && transmits == 1 && reply_len == first_len && memcmp(reply, first, first_len) == 0 &&
+			cache.stats.hits == 1;
+	check("hit returns stored frame without callback", ok);
+
+	/* other function code / count: other key */
+	read_registers(MODBUS_READ_HOLDING_REGISTERS, 0, 10);
+	ok = callbacks == 2 && reply_value(0x2000);
+	read_registers(MODBUS_READ_INPUT_REGISTERS, 0, 9);
+	ok = ok && callbacks == 3 && reply_len == 5 + 18 && reply_value(0x1000);
+	check("key covers function code and count", ok);
+
+	/* value changed by application: stale until invalidated */
+	inputs[0] = 0x5555;
+	read_registers(MODBUS_READ_INPUT_REGISTERS, 0, 10);
+	ok = callbacks == 3 && reply_value(0x1000);
+	modbus_cache_invalidate(&cache, MODBUS_TABLE_INPUT_REGISTERS, 5, 1);
+	read_registers(MODBUS_READ_INPUT_REGISTERS, 0, 10);
+	ok = ok && callbacks == 4 && reply_value(0x5555);
+	/* holding entry has not been dropped */
+	read_registers(MODBUS_READ_HOLDING_REGISTERS, 0, 10);
+	ok = ok && callbacks == 4 && reply_value(0x2000);
+	check("application invalidates range", ok);
+
+	/* TTL, clock wraps */
+	inputs[0] = 0x6666;
+	now_ms += TTL_MS - 1;
+	read_registers(MODBUS_READ_INPUT_REGISTERS, 0, 10);
+	ok = callbacks == 4 && reply_value(0x5555);
+	now_ms += 1;
+	read_registers(MODBUS_READ_INPUT_REGISTERS, 0, 10);
+	ok = ok && callbacks == 5 && reply_value(0x6666) && cache.stats.expired == 1 && now_ms < TTL_MS;
+	check("entry expires after TTL", ok);
+
+	/* outside of ranges: never cached */
+	read_registers(MODBUS_READ_HOLDING_REGISTERS, 10, 10);
+	read_registers(MODBUS_READ_HOLDING_REGISTERS, 10, 10);
+	ok = callbacks == 7 && reply_value(0x200a);
+	check("requests outside ranges are not cached", ok);
+
+	/* exception reply is not stored */
+	read_registers(MODBUS_READ_INPUT_REGISTERS, 40, 2);
+	ok = reply_crc_ok() && reply[1] == (MODBUS_ERROR_FLAG | MODBUS_READ_INPUT_REGISTERS);
+	read_registers(MODBUS_READ_INPUT_REGISTERS, 40, 2);
+	ok = ok && callbacks == 9 && reply[1] == (MODBUS_ERROR_FLAG | MODBUS_READ_INPUT_REGISTERS);
+	check("exceptions are not cached", ok);
+
+	/* writes received by the context drop overlapping holding register entries */
+	read_registers(MODBUS_READ_HOLDING_REGISTERS, 0, 4);
+	read_registers(MODBUS_READ_HOLDING_REGISTERS, 8, 4);
+	callbacks = 0;
+	{
+		const uint8_t write_single[] = { MODBUS_WRITE_SINGLE_REGISTER, 0x00, 0x02, 0x12, 0x34 };
+		const uint8_t write_multiple[] = { MODBUS_WRITE_MULTIPLE_REGISTERS, 0x00, 0x0b, 0x00, 0x01, 0x02, 0xab, 0xcd };
+
+		request(write_single, sizeof(write_single));
+		/* 0..3 re-read (value at 0 unchanged), 8..11 still cached */
+		read_registers(MODBUS_READ_HOLDING_REGISTERS, 0, 4);
+		ok = callbacks == 2 && reply_value(0x2000) && reply[7] == 0x12 && reply[8] == 0x34;
+		read_registers(MODBUS_READ_HOLDING_REGISTERS, 8, 4);
+		ok = ok && callbacks == 2;
+		request(write_multiple, sizeof(write_multiple));
+		read_registers(MODBUS_READ_HOLDING_REGISTERS, 8, 4);
+		ok = ok && callbacks == 4 && reply_crc_ok() && reply[9] == 0xab && reply[10] == 0xcd;
+	}
+	check("register writes invalidate cached reads", ok);
+
+	/* write through request API (TCP, serial port) drops cached entry of RTU reads too */
+	read_registers(MODBUS_READ_HOLDING_REGISTERS, 0, 4);
+	callbacks = 0;
+	{
+		const uint8_t write_single[] = { 1, MODBUS_WRITE_SINGLE_REGISTER, 0x00, 0x00, 0x56, 0x78 };
+		uint8_t tcp_reply[MODBUS_MAX_RTU_FRAME_SIZE];
+		uint16_t tcp_reply_len;
+
+		ok = modbus_slave_ctx_process_request(&ctx, write_single, sizeof(write_single), tcp_reply, &tcp_reply_len,
+				MODBUS_REQUEST_FLAG_NONE) == MODBUS_OK && tcp_reply_len == sizeof(write_single);
+		read_registers(MODBUS_READ_HOLDING_REGISTERS, 0, 4);
+		ok = ok && callbacks == 2 && reply_value(0x5678);
+	}
+	check("request API writes invalidate cached reads", ok);
+
+	/* request API is answered from entries stored by RTU frames and stores its own replies */
+	callbacks = 0;
+	{
+		const uint8_t read_holding[] = { 1, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x04 };
+		const uint8_t read_input[] = { 1, MODBUS_READ_INPUT_REGISTERS, 0x00, 0x01, 0x00, 0x02 };
+		uint8_t tcp_reply[MODBUS_MAX_RTU_FRAME_SIZE];
+		uint16_t tcp_reply_len;
+		uint64_t hits = cache.stats.hits;
+
+		ok = modbus_slave_ctx_process_request(&ctx, read_holding, sizeof(read_holding), tcp_reply, &tcp_reply_len,
+				MODBUS_REQUEST_FLAG_NONE) == MODBUS_OK && tcp_reply_len == reply_len - 2 &&
+				memcmp(tcp_reply, reply, tcp_reply_len) == 0 && callbacks == 0 && cache.stats.hits == hits + 1;
+		ok = ok && modbus_slave_ctx_process_request(&ctx, read_input, sizeof(read_input), tcp_reply, &tcp_reply_len,
+				MODBUS_REQUEST_FLAG_NONE) == MODBUS_OK && tcp_reply_len == 3 + 4 && callbacks == 1;
+		read_registers(MODBUS_READ_INPUT_REGISTERS, 1, 2);
+		ok = ok && callbacks == 1 && reply_len == tcp_reply_len + 2 && memcmp(reply, tcp_reply, tcp_reply_len) == 0 &&
+				reply_value(0x1001) && cache.stats.hits == hits + 2;
+	}
+	check("request API shares cache with RTU frames", ok);
+
+	/* busy slave doesn't answer from cache either */
+	read_registers(MODBUS_READ_HOLDING_REGISTERS, 0, 4);
+	modbus_slave_ctx_set_pending_pool(&ctx, pool, 1, MODBUS_PENDING_FLAG_BUSY);
+	defer = true;
+	request((const uint8_t[]){ MODBUS_WRITE_SINGLE_REGISTER, 0x00, 0x1f, 0x12, 0x34 }, 5);
+	defer = false;
+	ok = reply_len == 0 && ctx.pending_count == 1;
+	read_registers(MODBUS_READ_HOLDING_REGISTERS, 0, 4);
+	ok = ok && reply_crc_ok() && reply[1] == (MODBUS_ERROR_FLAG | MODBUS_READ_HOLDING_REGISTERS) &&
+			reply[2] == MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY;
+	modbus_slave_ctx_complete(&ctx, &pool[0].transaction, MODBUS_OK);
+	modbus_slave_ctx_set_pending_pool(&ctx, NULL, 0, MODBUS_PENDING_FLAG_NONE);
+	callbacks = 0;
+	read_registers(MODBUS_READ_HOLDING_REGISTERS, 0, 4);
+	ok = ok && callbacks == 0 && reply_value(0x5678);
+	check("busy reply comes before cached reply", ok);
+
+	/* registered handler replaces built-in read, cached entry included */
+	modbus_slave_ctx_register_function(&ctx, MODBUS_READ_HOLDING_REGISTERS, &fixed_handler);
+	read_registers(MODBUS_READ_HOLDING_REGISTERS, 0, 4);
+	ok = reply_len == 7 && reply_crc_ok() && reply[2] == 2 && reply[3] == 0xbe && reply[4] == 0xef;
+	check("registered read handler bypasses cache", ok);
+
+	/* vectored transmit: stores and returns the same frame */
+	modbus_slave_ctx_set_transmitv(&ctx, cache_transmitv);
+	modbus_cache_clear(&cache);
+	callbacks = 0;
+	read_registers(MODBUS_READ_INPUT_REGISTERS, 20, 12);
+	memcpy(first, reply, reply_len);
+	first_len = reply_len;
+	read_registers(MODBUS_READ_INPUT_REGISTERS, 20, 12);
+	ok = callbacks == 1 && first_len == 5 + 24 && reply_len == first_len && memcmp(reply, first, first_len) == 0 &&
+			reply_value(0x1014);
+	check("vectored transmit", ok);
+
+	/* disabled cache: served by callback again */
+	modbus_slave_ctx_set_cache(&ctx, NULL);
+	read_registers(MODBUS_READ_INPUT_REGISTERS, 20, 12);
+	ok = callbacks == 2 && reply_len == first_len && memcmp(reply, first, first_len) == 0;
+	check("cache can be disabled", ok);
+
+	return test_summary();
+}
@@ -0,0 +1,271 @@
+/*
+ * Wire capture and replay: log and pcap files, directions, vectored replies, dropped
+ * frames, replay comparison, recorded timing, truncated logs
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "modbus.h"
+#include "modbus_capture.h"
+#include "test_util.h"
+
+static modbus_slave_ctx_t ctx;
+static modbus_capture_t capture;
+static uint8_t ring[4096];
+static uint16_t registers[16];
+static char log_path[] = "/tmp/test_capture_XXXXXX";
+static char pcap_path[] = "/tmp/test_capture_pcap_XXXXXX";
+
+static int8_t capture_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	if (transaction->register_address + transaction->register_count > 16) {
+		return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+	}
+	switch (transaction->function_code) {
+	case MODBUS_READ_HOLDING_REGISTERS:
+		memcpy(transaction->holding_registers, &registers[transaction->register_address],
+				2 * transaction->register_count);
+		return MODBUS_OK;
+	case MODBUS_WRITE_SINGLE_REGISTER:
+	case MODBUS_WRITE_MULTIPLE_REGISTERS:
+		memcpy(&registers[transaction->register_address], transaction->holding_registers,
+				2 * transaction->register_count);
+		return MODBUS_OK;
+	default:
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+}
+
+static int8_t capture_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+static uint8_t vectored_reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static uint16_t vectored_len;
+
+static int8_t capture_transmitv(modbus_slave_ctx_t *ctx, const modbus_iovec_t *iov, uint8_t iov_count)
+{
+	(void)ctx;
+	vectored_len = 0;
+	for (uint8_t i = 0; i < iov_count; i++) {
+		memcpy(vectored_reply + vectored_len, iov[i].data, iov[i].len);
+		vectored_len += iov[i].len;
+	}
+	return MODBUS_OK;
+}
+
+/* global API is not used here */
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+/* sends request with CRC (corrupted if bad_crc) to ctx */
+static void request(uint8_t address, const uint8_t *pdu, int pdu_len, bool bad_crc)
+{
+	test_request(&ctx, address, pdu, pdu_len, bad_crc);
+}
+
+/* traffic: 6 requests, 4 replies; returns number of frames */
+static int traffic(void)
+{
+	const uint8_t read[] = { MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x02, 0x00, 0x04 };
+	const uint8_t write[] = { MODBUS_WRITE_SINGLE_REGISTER, 0x00, 0x03, 0x12, 0x34 };
+	const uint8_t out_of_range[] = { MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x0f, 0x00, 0x02 };
+
+	/* replay starts from the same register contents */
+	memset(registers, 0, sizeof(registers));
+	request(5, read, sizeof(read), false);
+	request(5, write, sizeof(write), false);
+	request(5, read, sizeof(read), false);
+	request(5, read, sizeof(read), true); /* no reply */
+	request(6, read, sizeof(read), false); /* other slave, no reply */
+	request(5, out_of_range, sizeof(out_of_range), false); /* exception reply */
+	return 10;
+}
+
+static long file_size(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+int main(void)
+{
+	modbus_replay_t replay;
+	modbus_replay_stats_t stats;
+	modbus_capture_record_t record;
+	uint8_t directions[16];
+	int frames = 0;
+	bool ok;
+	bool fast;
+
+	printf("Capture test\n");
+	close(mkstemp(log_path));
+	close(mkstemp(pcap_path));
+	modbus_slave_ctx_init(&ctx, 5, capture_callback, capture_transmit, NULL);
+
+	check("open rejects bad ring size", modbus_capture_open(&capture, log_path, MODBUS_CAPTURE_FORMAT_LOG,
+			ring, 3000) == MODBUS_ERROR && modbus_capture_open(&capture, log_path, MODBUS_CAPTURE_FORMAT_LOG, ring,
+			128) == MODBUS_ERROR);
+
+	/* log */
+	check("open log", modbus_capture_open(&capture, log_path, MODBUS_CAPTURE_FORMAT_LOG, ring, sizeof(ring)) == MODBUS_OK);
+	modbus_slave_ctx_set_capture(&ctx, modbus_capture_hook, &capture);
+	frames = traffic();
+	modbus_slave_ctx_set_capture(&ctx, NULL, NULL);
+	check("close log", modbus_capture_close(&capture) == MODBUS_OK && capture.records == (uint32_t)frames &&
+			capture.dropped == 0);
+	/* requests 8 bytes, replies 13, 8, 13, 5 bytes */
+	check("log size", file_size(log_path) == MODBUS_CAPTURE_LOG_HEADER_LEN + frames * MODBUS_CAPTURE_LOG_RECORD_LEN +
+			6 * 8 + 13 + 8 + 13 + 5);
+
+	ok = modbus_replay_open(&replay, log_path) == MODBUS_OK && replay.format == MODBUS_CAPTURE_FORMAT_LOG;
+	for (int i = 0; ok && i < frames; i++) {
+		ok = modbus_replay_next(&replay, &record) == MODBUS_OK;
+		directions[i] = record.direction;
+	}
+	check("log records", ok && modbus_replay_next(&replay, &record) == MODBUS_ERROR &&
+			memcmp(directions, (uint8_t[]){ 0, 1, 0, 1, 0, 1, 0, 0, 0, 1 }, frames) == 0);
+	modbus_replay_rewind(&replay);
+	memset(registers, 0, sizeof(registers));
+	check("log replay matches", modbus_replay_run(&replay, &ctx, MODBUS_REPLAY_FLAG_NONE, &stats) == MODBUS_OK &&
+			stats.requests == 5 && stats.matched == 5 && stats.skipped == 1);
+	/* different register contents than recorded */
+	memset(registers, 0, sizeof(registers));
+	registers[2] = 0xbeef;
+	modbus_replay_rewind(&replay);
+	modbus_replay_run(&replay, &ctx, MODBUS_REPLAY_FLAG_NONE, &stats);
+	check("replay reports mismatch", stats.matched == 3 && stats.mismatched == 2);
+	modbus_replay_close(&replay);
+
+	/* truncated log */
+	truncate(log_path, file_size(log_path) - 3);
+	modbus_replay_open(&replay, log_path);
+	memset(registers, 0, sizeof(registers));
+	check("truncated log", modbus_replay_run(&replay, &ctx, MODBUS_REPLAY_FLAG_NONE, &stats) ==
+			MODBUS_ERROR_FRAME_INVALID && stats.requests == 5);
+	modbus_replay_close(&replay);
+
+	/* pcap: directions are inferred */
+	modbus_capture_open(&capture, pcap_path, MODBUS_CAPTURE_FORMAT_PCAP, ring, sizeof(ring));
+	modbus_slave_ctx_set_capture(&ctx, modbus_capture_hook, &capture);
+	traffic();
+	modbus_slave_ctx_set_capture(&ctx, NULL, NULL);
+	modbus_capture_close(&capture);
+	check("pcap size", file_size(pcap_path) == MODBUS_CAPTURE_PCAP_HEADER_LEN +
+			frames * MODBUS_CAPTURE_PCAP_RECORD_LEN + 6 * 8 + 13 + 8 + 13 + 5);
+	ok = modbus_replay_open(&replay, pcap_path) == MODBUS_OK && replay.format == MODBUS_CAPTURE_FORMAT_PCAP;
+	for (int i = 0; ok && i < frames; i++) {
+		ok = modbus_replay_next(&replay, &record) == MODBUS_OK;
+		directions[i] = record.direction;
+	}
+	check("pcap directions", ok && memcmp(directions, (uint8_t[]){ 0, 1, 0, 1, 0, 1, 0, 0, 0, 1 }, frames) == 0);
+	modbus_replay_rewind(&replay);
+	memset(registers, 0, sizeof(registers));
+	check("pcap replay matches", modbus_replay_run(&replay, &ctx, MODBUS_REPLAY_FLAG_NONE, &stats) == MODBUS_OK &&
+			stats.requests == 5 && stats.matched == 5);
+	modbus_replay_close(&replay);
+
+	/* vectored replies are captured joined */
+	modbus_capture_open(&capture, log_path, MODBUS_CAPTURE_FORMAT_LOG, ring, sizeof(ring));
+	modbus_slave_ctx_set_capture(&ctx, modbus_capture_hook, &capture);
+	modbus_slave_ctx_set_transmitv(&ctx, capture_transmitv);
+	traffic();
+	modbus_slave_ctx_set_transmitv(&ctx, NULL);
+	modbus_slave_ctx_set_capture(&ctx, NULL, NULL);
+	modbus_capture_close(&capture);
+	modbus_replay_open(&replay, log_path);
+	ok = false;
+	while (modbus_replay_next(&replay, &record) == MODBUS_OK) {
+		/* last reply is the exception */
+		ok = record.direction == MODBUS_CAPTURE_REPLY && record.len == vectored_len &&
+				memcmp(record.data, vectored_reply, vectored_len) == 0;
+	}
+	check("vectored reply captured", ok);
+	modbus_replay_close(&replay);
+
+	/* requests of transports without RTU framing (TCP, serial backend) are captured with CRC */
+	{
+		const uint8_t read[] = { 5, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x02, 0x00, 0x04 };
+		uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+		uint16_t reply_len;
+
+		modbus_capture_open(&capture, log_path, MODBUS_CAPTURE_FORMAT_LOG, ring, sizeof(ring));
+		modbus_slave_ctx_set_capture(&ctx, modbus_capture_hook, &capture);
+		modbus_slave_ctx_process_request(&ctx, read, sizeof(read), reply, &reply_len, MODBUS_REQUEST_FLAG_NONE);
+		modbus_slave_ctx_set_capture(&ctx, NULL, NULL);
+		modbus_capture_close(&capture);
+		modbus_replay_open(&replay, log_path);
+		ok = modbus_replay_next(&replay, &record) == MODBUS_OK && record.direction == MODBUS_CAPTURE_REQUEST &&
+				record.len == sizeof(read) + 2 && memcmp(record.data, read, sizeof(read)) == 0 &&
+				modbus_CRC16(record.data, record.len) == 0;
+		ok = ok && modbus_replay_next(&replay, &record) == MODBUS_OK && record.direction == MODBUS_CAPTURE_REPLY &&
+				record.len == reply_len + 2 && memcmp(record.data, reply, reply_len) == 0 &&
+				modbus_CRC16(record.data, record.len) == 0;
+		modbus_replay_rewind(&replay);
+		check("process_request captured", ok && modbus_replay_run(&replay, &ctx, MODBUS_REPLAY_FLAG_NONE, &stats) ==
+				MODBUS_OK && stats.matched == 1 && stats.mismatched == 0);
+		modbus_replay_close(&replay);
+	}
+
+	/* ring smaller than a burst: frames are dropped, never torn */
+	modbus_capture_open(&capture, log_path, MODBUS_CAPTURE_FORMAT_LOG, ring, 512);
+	modbus_slave_ctx_set_capture(&ctx, modbus_capture_hook, &capture);
+	for (int i = 0; i < 50; i++) {
+		traffic();
+	}
+	modbus_slave_ctx_set_capture(&ctx, NULL, NULL);
+	modbus_capture_close(&capture);
+	modbus_replay_open(&replay, log_path);
+	frames = 0;
+	while (modbus_replay_next(&replay, &record) == MODBUS_OK) {
+		frames++;
+	}
+	check("dropped frames counted", capture.records + capture.dropped == 500 && frames == (int)capture.records &&
+			replay.pos == replay.size);
+	printf("    %u frames captured, %u dropped\n", capture.records, capture.dropped);
+	modbus_replay_close(&replay);
+
+	/* recorded timing */
+	{
+		const uint8_t read[] = { MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x01 };
+
+		modbus_capture_open(&capture, log_path, MODBUS_CAPTURE_FORMAT_LOG, ring, sizeof(ring));
+		modbus_slave_ctx_set_capture(&ctx, modbus_capture_hook, &capture);
+		request(5, read, sizeof(read), false);
+		usleep(30000);
+		request(5, read, sizeof(read), false);
+		modbus_slave_ctx_set_capture(&ctx, NULL, NULL);
+		modbus_capture_close(&capture);
+		modbus_replay_open(&replay, log_path);
+		modbus_replay_run(&replay, &ctx, MODBUS_REPLAY_FLAG_NONE, &stats);
+		fast = stats.elapsed_us < 20000;
+		modbus_replay_rewind(&replay);
+		modbus_replay_run(&replay, &ctx, MODBUS_REPLAY_FLAG_REALTIME, &stats);
+		check("realtime replay keeps timing", fast && stats.matched == 2 && stats.elapsed_us >= 29000);
+		modbus_replay_close(&replay);
+	}
+
+	unlink(log_path);
+	unlink(pcap_path);
+	return test_summary();
+}
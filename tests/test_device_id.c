@@ -0,0 +1,186 @@
+/*
+ * Read Device Identification (FC43 / MEI 0x0E): stream and individual access,
+ * extended objects, "more follows" continuation
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus.h"
+#include "test_util.h"
+
+static modbus_slave_ctx_t ctx;
+
+static uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static int reply_len;
+
+static uint8_t long_value[4][140];
+static const modbus_device_id_object_t extended_objects[] = {
+	{ .id = 0x80, .len = 4, .value = (const uint8_t *)"\x01\x02\x03\x04" },
+	{ .id = 0x81, .len = 140, .value = long_value[0] },
+	{ .id = 0x90, .len = 140, .value = long_value[1] },
+	{ .id = 0xF0, .len = 140, .value = long_value[2] },
+	/* does not fit into MODBUS_DEVICE_ID_BUFFER_SIZE together with the rest */
+	{ .id = 0xFF, .len = 140, .value = long_value[3] },
+};
+
+static modbus_device_id_t device_id = {
+	.object_name = {
+		.VendorName = "Company",
+		.ProductCode = "PC-1",
+		.MajorMinorRevision = "V2.11",
+		.VendorUrl = "http://x.org",
+		.ProductName = "Product",
+		.ModelName = "M1",
+		.UserApplicationName = "App",
+	},
+};
+
+static int8_t device_id_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+static int8_t device_id_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	memcpy(reply, buffer, data_len);
+	reply_len = data_len;
+	return MODBUS_OK;
+}
+
+static void request(uint8_t read_device_id_code, uint8_t object_id)
+{
+	uint8_t frame[] = { 0x01, MODBUS_READ_DEVICE_IDENTIFICATION, MODBUS_MEI, read_device_id_code, object_id, 0, 0 };
+	uint16_t crc = modbus_CRC16(frame, 5);
+
+	frame[5] = crc & 0xff;
+	frame[6] = crc >> 8;
+	reply_len = 0;
+	modbus_slave_ctx_process_msg(&ctx, frame, sizeof(frame));
+}
+
+static bool reply_ok(uint8_t read_device_id_code, uint8_t more_follows, uint8_t next_object_id, uint8_t object_count)
+{
+	return reply_len > 10 && modbus_crc16_update(MODBUS_CRC16_INIT, reply, reply_len) == 0 &&
+			reply[1] == MODBUS_READ_DEVICE_IDENTIFICATION && reply[2] == MODBUS_MEI &&
+			reply[3] == read_device_id_code && reply[4] == device_id.conformity_level &&
+			reply[5] == more_follows && reply[6] == next_object_id && reply[7] == object_count;
+}
+
+/* object ids in reply, in order */
+static int reply_object_ids(uint8_t *ids)
+{
+	int pos = 8;
+	int n = 0;
+
+	while (pos < reply_len - 2) {
+		ids[n++] = reply[pos];
+		pos += 2 + reply[pos + 1];
+	}
+	return pos == reply_len - 2 ? n : -1;
+}
+
+int main(void)
+{
+	static const uint8_t basic[] = {
+		0x01, 0x2B, 0x0E, 0x01, 0x81, 0x00, 0x00, 0x03,
+		0x00, 0x07, 'C', 'o', 'm', 'p', 'a', 'n', 'y',
+		0x01, 0x04, 'P', 'C', '-', '1',
+		0x02, 0x05, 'V', '2', '.', '1', '1',
+	};
+	uint8_t ids[MODBUS_DEVICE_ID_MAX_OBJECTS];
+	uint8_t seen[MODBUS_DEVICE_ID_MAX_OBJECTS];
+	int seen_count;
+	uint8_t next;
+	bool ok;
+
+	printf("Read device identification test\n");
+	modbus_slave_ctx_init(&ctx, 1, device_id_callback, device_id_transmit, NULL);
+	check("init", modbus_slave_ctx_init_device_id(&ctx, &device_id) == MODBUS_OK &&
+			device_id.conformity_level == (MODBUS_CONFORMITY_REGULAR | MODBUS_DEVICE_ID_INDIVIDUAL_ACCESS_FLAG));
+
+	/* basic stream: exact bytes */
+	device_id.conformity_level = 0x81;
+	request(MODBUS_CONFORMITY_BASIC, 0);
+	check("basic stream", reply_len == sizeof(basic) + 2 && memcmp(reply, basic, sizeof(basic)) == 0 &&
+			modbus_crc16_update(MODBUS_CRC16_INIT, reply, reply_len) == 0);
+	modbus_slave_ctx_init_device_id(&ctx, &device_id);
+
+	request(MODBUS_CONFORMITY_REGULAR, 0);
+	check("regular stream", reply_ok(MODBUS_CONFORMITY_REGULAR, MODBUS_NO_MORE_FOLLOWS, 0, 7) &&
+			reply_object_ids(ids) == 7 && ids[6] == 6);
+
+	request(MODBUS_CONFORMITY_REGULAR, 4);
+	check("regular stream from object 4", reply_ok(MODBUS_CONFORMITY_REGULAR, MODBUS_NO_MORE_FOLLOWS, 0, 3) &&
+			reply_object_ids(ids) == 3 && ids[0] == 4);
+
+	request(MODBUS_CONFORMITY_BASIC, 0x05);
+	check("unknown object restarts stream", reply_ok(MODBUS_CONFORMITY_BASIC, MODBUS_NO_MORE_FOLLOWS, 0, 3) &&
+			reply_object_ids(ids) == 3 && ids[0] == 0);
+
+	request(MODBUS_INDIVIDUAL_ACCESS, 5);
+	check("individual access", reply_ok(MODBUS_INDIVIDUAL_ACCESS, MODBUS_NO_MORE_FOLLOWS, 0, 1) &&
+			reply_len == 8 + 2 + 2 + 2 && reply[8] == 5 && reply[9] == 2 && reply[10] == 'M');
+
+	request(MODBUS_INDIVIDUAL_ACCESS, 0x80);
+	check("individual access to missing object", reply_len == 5 && reply[1] == (MODBUS_ERROR_FLAG | 43) &&
+			reply[2] == MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+	request(5, 0);
+	check("invalid read device id code", reply_len == 5 && reply[2] == MODBUS_EXCEPTION_ILLEGAL_DEVICE_ID_CODE);
+
+	/* extended objects: too long for one reply, continuation via next object id */
+	for (int i = 0; i < 4; i++) {
+		memset(long_value[i], 'a' + i, sizeof(long_value[i]));
+	}
+	device_id.extended_objects = extended_objects;
+	device_id.extended_count = 5;
+	check("objects exceeding buffer rejected", modbus_slave_ctx_init_device_id(&ctx, &device_id) == MODBUS_ERROR_OUT_OF_BOUNDS);
+	device_id.extended_count = 4;
+	check("init extended", modbus_slave_ctx_init_device_id(&ctx, &device_id) == MODBUS_OK &&
+			device_id.conformity_level == (MODBUS_CONFORMITY_EXTENDED | MODBUS_DEVICE_ID_INDIVIDUAL_ACCESS_FLAG));
+
+	ok = true;
+	seen_count = 0;
+	next = 0;
+	for (int page = 0; ok && page < 10; page++) {
+		int n;
+		request(MODBUS_CONFORMITY_EXTENDED, next);
+		n = reply_object_ids(ids);
+		ok = n > 0 && reply_len <= MODBUS_MAX_RTU_FRAME_SIZE && reply[7] == n && reply[1] == 43;
+		for (int i = 0; ok && i < n; i++) {
+			seen[seen_count++] = ids[i];
+		}
+		if (reply[5] == MODBUS_NO_MORE_FOLLOWS) {
+			break;
+		}
+		next = reply[6];
+	}
+	ok = ok && seen_count == 11 && seen[0] == 0 && seen[6] == 6 && seen[7] == 0x80 && seen[10] == 0xF0;
+	for (int i = 1; ok && i < seen_count; i++) {
+		ok = seen[i] > seen[i - 1];
+	}
+	check("extended stream with more follows", ok);
+
+	request(MODBUS_INDIVIDUAL_ACCESS, 0x90);
+	check("individual extended object", reply_ok(MODBUS_INDIVIDUAL_ACCESS, MODBUS_NO_MORE_FOLLOWS, 0, 1) &&
+			reply[8] == 0x90 && reply[9] == 140 && reply[10] == 'b' && reply_len == 8 + 142 + 2);
+
+	request(MODBUS_CONFORMITY_REGULAR, 0x90);
+	check("extended object restarts regular stream", reply_ok(MODBUS_CONFORMITY_REGULAR, MODBUS_NO_MORE_FOLLOWS, 0, 7));
+
+	/* unsorted ids are rejected */
+	modbus_device_id_t bad = device_id;
+	const modbus_device_id_object_t unsorted[] = {
+		{ .id = 0x85, .len = 1, .value = (const uint8_t *)"x" },
+		{ .id = 0x82, .len = 1, .value = (const uint8_t *)"y" },
+	};
+	bad.extended_objects = unsorted;
+	bad.extended_count = 2;
+	check("unsorted extended objects rejected", modbus_slave_ctx_init_device_id(&ctx, &bad) != MODBUS_OK);
+
+	return test_summary();
+}
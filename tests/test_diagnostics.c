@@ -0,0 +1,328 @@
+/*
+ * Bus diagnostics: counters kept for dropped frames, exceptions and unanswered requests,
+ * diagnostics (08) sub-functions, listen only mode, get comm event counter / log (11 / 12)
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus.h"
+#include "test_util.h"
+
+#define INPUTS 16
+
+static modbus_slave_ctx_t ctx;
+static uint16_t inputs[INPUTS];
+static uint8_t pend; /* callback returns MODBUS_PENDING */
+
+/* what was sent */
+static uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static int reply_len;
+
+static int8_t diag_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	uint16_t address = transaction->register_address;
+	uint16_t count = transaction->register_count;
+
+	(void)ctx;
+	if (pend) {
+		return MODBUS_PENDING;
+	}
+	if (transaction->function_code != MODBUS_READ_INPUT_REGISTERS) {
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+	if (address + count > INPUTS) {
+		return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+	}
+	memcpy(transaction->input_registers, &inputs[address], 2 * count);
+	return MODBUS_OK;
+}
+
+static int8_t diag_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	memcpy(reply, buffer, data_len);
+	reply_len = data_len;
+	return MODBUS_OK;
+}
+
+/* global API is not used here */
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+/* sends PDU to address, CRC is broken on request */
+static void send_to(uint8_t address, const uint8_t *pdu, int pdu_len, bool bad_crc)
+{
+	reply_len = 0;
+	test_request(&ctx, address, pdu, pdu_len, bad_crc);
+}
+
+static void request(const uint8_t *pdu, int pdu_len)
+{
+	send_to(ctx.address, pdu, pdu_len, false);
+}
+
+static void read_inputs(uint16_t address, uint16_t count)
+{
+	const uint8_t pdu[] = { MODBUS_READ_INPUT_REGISTERS, address >> 8, address & 0xff, count >> 8, count & 0xff };
+
+	request(pdu, sizeof(pdu));
+}
+
+static void diagnostic(uint16_t sub_function, uint16_t data)
+{
+	const uint8_t pdu[] = { MODBUS_DIAGNOSTIC, sub_function >> 8, sub_function & 0xff, data >> 8, data & 0xff };
+
+	request(pdu, sizeof(pdu));
+}
+
+/* counter returned by diagnostics sub-function, -1 if reply is not valid */
+static int32_t counter(uint16_t sub_function)
+{
+	diagnostic(sub_function, 0);
+	if (reply_len != 8 || reply[1] != MODBUS_DIAGNOSTIC || reply[2] != (sub_function >> 8) ||
+			reply[3] != (sub_function & 0xff)) {
+		return -1;
+	}
+	return (reply[4] << 8) | reply[5];
+}
+
+static bool exception_reply(uint8_t function_code, uint8_t exception)
+{
+	return reply_len == 5 && reply[1] == (function_code | MODBUS_ERROR_FLAG) && reply[2] == exception;
+}
+
+static uint16_t reply_u16(int offset)
+{
+	return (reply[offset] << 8) | reply[offset + 1];
+}
+
+int main(void)
+{
+	const modbus_diagnostics_t *diag;
+	uint8_t events[MODBUS_EVENT_LOG_SIZE];
+	bool ok;
+
+	printf("Diagnostics test\n");
+	for (int i = 0; i < INPUTS; i++) {
+		inputs[i] = 0x1000 + i;
+	}
+	modbus_slave_ctx_init(&ctx, 1, diag_callback, diag_transmit, NULL);
+	diag = modbus_slave_ctx_diagnostics(&ctx);
+
+	/* return query data: any data is echoed */
+	{
+		const uint8_t pdu[] = { MODBUS_DIAGNOSTIC, 0x00, MODBUS_DIAG_RETURN_QUERY_DATA, 0xa5, 0x37, 0x12, 0x34 };
+
+		request(pdu, sizeof(pdu));
+		ok = reply_len == 1 + sizeof(pdu) + 2 && memcmp(reply + 1, pdu, sizeof(pdu)) == 0;
+	}
+	check("return query data echoes request", ok);
+
+	/* largest loopback echoed whole; larger one (request API takes any length) refused */
+	{
+		uint8_t pdu[MODBUS_MAX_RTU_FRAME_SIZE - 3] = { MODBUS_DIAGNOSTIC, 0x00, MODBUS_DIAG_RETURN_QUERY_DATA };
+		uint8_t big[300] = { 1, MODBUS_DIAGNOSTIC, 0x00, MODBUS_DIAG_RETURN_QUERY_DATA };
+		uint8_t big_reply[MODBUS_MAX_RTU_FRAME_SIZE];
+		uint16_t big_reply_len;
+
+		memset(pdu + 3, 0x5a, sizeof(pdu) - 3);
+		request(pdu, sizeof(pdu));
+		ok = reply_len == MODBUS_MAX_RTU_FRAME_SIZE && memcmp(reply + 1, pdu, sizeof(pdu)) == 0;
+		ok = ok && modbus_slave_ctx_process_request(&ctx, big, sizeof(big), big_reply, &big_reply_len,
+				MODBUS_REQUEST_FLAG_NONE) == MODBUS_OK && big_reply_len == 3 &&
+				big_reply[1] == (MODBUS_DIAGNOSTIC | MODBUS_ERROR_FLAG) && big_reply[2] == MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	}
+	check("oversized loopback refused", ok);
+
+	/* frames dropped before processing are counted, not answered */
+	modbus_slave_ctx_clear_diagnostics(&ctx);
+	read_inputs(0, 2);
+	{
+		const uint8_t pdu[] = { MODBUS_READ_INPUT_REGISTERS, 0x00, 0x00, 0x00, 0x02 };
+		const uint8_t short_frame[] = { 0x01, 0x04, 0x00 };
+
+		send_to(ctx.address, pdu, sizeof(pdu), true);
+		ok = reply_len == 0;
+		send_to(2, pdu, sizeof(pdu), false);
+		ok = ok && reply_len == 0;
+		modbus_slave_ctx_process_msg(&ctx, short_frame, sizeof(short_frame));
+		ok = ok && reply_len == 0;
+		/* CRC of a frame for other address is not checked by default */
+		send_to(2, pdu, sizeof(pdu), true);
+		ok = ok && reply_len == 0;
+	}
+	/* this request is counted too */
+	ok = ok && counter(MODBUS_DIAG_BUS_MESSAGE_COUNT) == 6 && counter(MODBUS_DIAG_BUS_COMM_ERROR_COUNT) == 2 &&
+			counter(MODBUS_DIAG_SLAVE_MESSAGE_COUNT) == 4;
+	ok = ok && diag != NULL && diag->bus_messages == 8 && diag->bus_comm_errors == 2 && diag->slave_messages == 4;
+	check("CRC errors, short frames and other addresses", ok);
+
+	/* on request, CRC errors of other addresses are comm errors too; setting survives clear */
+	ctx.diagnostics.check_other_crc = 1;
+	modbus_slave_ctx_clear_diagnostics(&ctx);
+	{
+		const uint8_t pdu[] = { MODBUS_READ_INPUT_REGISTERS, 0x00, 0x00, 0x00, 0x02 };
+
+		send_to(2, pdu, sizeof(pdu), true);
+		send_to(2, pdu, sizeof(pdu), false);
+		ok = reply_len == 0;
+	}
+	ok = ok && diag->bus_messages == 2 && diag->bus_comm_errors == 1 && diag->check_other_crc == 1;
+	ctx.diagnostics.check_other_crc = 0;
+	check("CRC of other addresses checked on request", ok);
+
+	/* exceptions; busy ones have their own counter */
+	modbus_slave_ctx_clear_diagnostics(&ctx);
+	read_inputs(INPUTS, 1);
+	ok = exception_reply(MODBUS_READ_INPUT_REGISTERS, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+	{
+		const uint8_t pdu[] = { 0x41 };
+
+		request(pdu, sizeof(pdu));
+		ok = ok && exception_reply(0x41, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+	}
+	/* no pending pool: deferred request is answered with exception 06 */
+	pend = 1;
+	read_inputs(0, 1);
+	pend = 0;
+	ok = ok && exception_reply(MODBUS_READ_INPUT_REGISTERS, MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY);
+	ok = ok && counter(MODBUS_DIAG_BUS_EXCEPTION_COUNT) == 3 && counter(MODBUS_DIAG_SLAVE_BUSY_COUNT) == 1 &&
+			counter(MODBUS_DIAG_SLAVE_NAK_COUNT) == 0;
+	check("exceptions are counted", ok);
+
+	/* broadcasts and malformed requests are not answered */
+	modbus_slave_ctx_clear_diagnostics(&ctx);
+	{
+		const uint8_t pdu[] = { MODBUS_READ_INPUT_REGISTERS, 0x00, 0x00, 0x00, 0x01 };
+		const uint8_t truncated[] = { MODBUS_READ_INPUT_REGISTERS, 0x00 };
+
+		send_to(MODBUS_BROADCAST_ADDR, pdu, sizeof(pdu), false);
+		ok = reply_len == 0;
+		request(truncated, sizeof(truncated));
+		ok = ok && reply_len == 0;
+	}
+	ok = ok && counter(MODBUS_DIAG_SLAVE_NO_RESPONSE_COUNT) == 2 && counter(MODBUS_DIAG_SLAVE_MESSAGE_COUNT) == 4;
+	check("requests without reply", ok);
+
+	/* get comm event counter: successful requests only, not itself */
+	modbus_slave_ctx_clear_diagnostics(&ctx);
+	{
+		const uint8_t pdu[] = { MODBUS_GET_COM_EVENT_COUNTER };
+
+		read_inputs(0, 1);
+		read_inputs(0, 2);
+		read_inputs(INPUTS, 1);
+		request(pdu, sizeof(pdu));
+		request(pdu, sizeof(pdu));
+		ok = reply_len == 8 && reply[1] == MODBUS_GET_COM_EVENT_COUNTER && reply_u16(2) == 0x0000 &&
+				reply_u16(4) == 2;
+	}
+	check("get comm event counter", ok);
+
+	/* get comm event log: newest first, its own receive event included */
+	modbus_slave_ctx_clear_diagnostics(&ctx);
+	{
+		const uint8_t pdu[] = { MODBUS_GET_COM_EVENT_LOG };
+		const uint8_t expected[] = {
+			MODBUS_EVENT_RECEIVE,
+			MODBUS_EVENT_SEND | MODBUS_EVENT_SEND_READ_EXCEPTION,
+			MODBUS_EVENT_RECEIVE,
+			MODBUS_EVENT_SEND,
+			MODBUS_EVENT_RECEIVE,
+			/* broadcast is completed without reply */
+			MODBUS_EVENT_SEND,
+			MODBUS_EVENT_RECEIVE | MODBUS_EVENT_RECEIVE_BROADCAST,
+			MODBUS_EVENT_RECEIVE | MODBUS_EVENT_RECEIVE_COMM_ERROR,
+		};
+		const uint8_t bad[] = { MODBUS_READ_INPUT_REGISTERS, 0x00, 0x00, 0x00, 0x01 };
+
+		send_to(ctx.address, bad, sizeof(bad), true);
+		send_to(MODBUS_BROADCAST_ADDR, bad, sizeof(bad), false);
+		read_inputs(0, 1);
+		read_inputs(INPUTS, 1);
+		request(pdu, sizeof(pdu));
+		ok = reply_len == 3 + 6 + sizeof(expected) + 2 && reply[1] == MODBUS_GET_COM_EVENT_LOG &&
+				reply[2] == 6 + sizeof(expected) && reply_u16(3) == 0x0000 && reply_u16(5) == 2 &&
+				reply_u16(7) == 5 && memcmp(reply + 9, expected, sizeof(expected)) == 0;
+	}
+	check("get comm event log", ok);
+
+	/* event log is a ring of MODBUS_EVENT_LOG_SIZE */
+	modbus_slave_ctx_clear_diagnostics(&ctx);
+	for (int i = 0; i < MODBUS_EVENT_LOG_SIZE; i++) {
+		read_inputs(INPUTS, 1);
+	}
+	read_inputs(0, 1);
+	ok = modbus_slave_ctx_event_log(&ctx, events, sizeof(events)) == MODBUS_EVENT_LOG_SIZE &&
+			events[0] == MODBUS_EVENT_SEND && events[1] == MODBUS_EVENT_RECEIVE &&
+			events[2] == (MODBUS_EVENT_SEND | MODBUS_EVENT_SEND_READ_EXCEPTION) &&
+			events[MODBUS_EVENT_LOG_SIZE - 1] == MODBUS_EVENT_RECEIVE;
+	ok = ok && modbus_slave_ctx_event_log(&ctx, events, 3) == 3 && events[2] == (MODBUS_EVENT_SEND | MODBUS_EVENT_SEND_READ_EXCEPTION);
+	check("event log wraps", ok);
+
+	/* listen only mode: requests are counted, not served, until restart */
+	modbus_slave_ctx_clear_diagnostics(&ctx);
+	diagnostic(MODBUS_DIAG_FORCE_LISTEN_ONLY, 0);
+	ok = reply_len == 0 && diag->listen_only;
+	read_inputs(0, 1);
+	ok = ok && reply_len == 0;
+	diagnostic(MODBUS_DIAG_SLAVE_MESSAGE_COUNT, 0);
+	ok = ok && reply_len == 0 && diag->slave_messages == 3 && diag->slave_no_response == 3;
+	ok = ok && modbus_slave_ctx_event_log(&ctx, events, 2) == 2 &&
+			events[0] == (MODBUS_EVENT_SEND | MODBUS_EVENT_SEND_LISTEN_ONLY) &&
+			events[1] == (MODBUS_EVENT_RECEIVE | MODBUS_EVENT_RECEIVE_LISTEN_ONLY);
+	/* restart is not answered either, but ends listen only mode and clears the log */
+	diagnostic(MODBUS_DIAG_RESTART_COMMUNICATIONS, 0xFF00);
+	ok = ok && reply_len == 0 && !diag->listen_only && diag->slave_messages == 0;
+	ok = ok && modbus_slave_ctx_event_log(&ctx, events, sizeof(events)) == 1 && events[0] == MODBUS_EVENT_RESTART;
+	read_inputs(0, 1);
+	ok = ok && reply_len == 7 && reply_u16(3) == 0x1000;
+	check("listen only mode and restart", ok);
+
+	/* restart outside listen only mode is answered, event log is kept with 0000 */
+	read_inputs(0, 1);
+	diagnostic(MODBUS_DIAG_RESTART_COMMUNICATIONS, 0x0000);
+	ok = reply_len == 8 && reply[1] == MODBUS_DIAGNOSTIC && reply_u16(2) == MODBUS_DIAG_RESTART_COMMUNICATIONS &&
+			reply_u16(4) == 0x0000 && diag->slave_messages == 0 && diag->event_count > 4;
+	check("restart communications option", ok);
+
+	/* diagnostic register is set by application; clear counters (0A) clears it too */
+	ctx.diagnostics.diagnostic_register = 0xbeef;
+	ok = counter(MODBUS_DIAG_RETURN_DIAGNOSTIC_REGISTER) == 0xbeef;
+	diagnostic(MODBUS_DIAG_CLEAR_COUNTERS, 0);
+	ok = ok && reply_len == 8 && reply_u16(2) == MODBUS_DIAG_CLEAR_COUNTERS && diag->diagnostic_register == 0 &&
+			diag->bus_messages == 0;
+	check("diagnostic register and clear counters", ok);
+
+	/* overruns are reported by the transport */
+	ok = modbus_slave_ctx_count_error(&ctx, MODBUS_ERROR_OUT_OF_BOUNDS) == MODBUS_OK &&
+			modbus_slave_ctx_count_error(&ctx, MODBUS_ERROR_CRC) == MODBUS_OK &&
+			modbus_slave_ctx_count_error(&ctx, MODBUS_ERROR_TIMEOUT) == MODBUS_ERROR;
+	ok = ok && counter(MODBUS_DIAG_BUS_OVERRUN_COUNT) == 1 && counter(MODBUS_DIAG_BUS_COMM_ERROR_COUNT) == 1;
+	diagnostic(MODBUS_DIAG_CLEAR_OVERRUN, 0);
+	ok = ok && reply_len == 8 && counter(MODBUS_DIAG_BUS_OVERRUN_COUNT) == 0 &&
+			counter(MODBUS_DIAG_BUS_COMM_ERROR_COUNT) == 1;
+	check("overrun counter", ok);
+
+	/* unsupported sub-function, data other than 0000 */
+	diagnostic(0x03, 0x0a00);
+	ok = exception_reply(MODBUS_DIAGNOSTIC, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+	diagnostic(MODBUS_DIAG_BUS_MESSAGE_COUNT, 0x0001);
+	ok = ok && exception_reply(MODBUS_DIAGNOSTIC, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+	diagnostic(MODBUS_DIAG_RESTART_COMMUNICATIONS, 0x1234);
+	ok = ok && exception_reply(MODBUS_DIAGNOSTIC, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+	check("invalid sub-function and data", ok);
+
+	return test_summary();
+}
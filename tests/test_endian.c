@@ -0,0 +1,140 @@
+/*
+ * Register byte order: pack / unpack kernels against a reference at every length and
+ * alignment of a frame, typed values in all word orders
+ *
+ * Built twice: with the kernel selected for the host and with MODBUS_ENDIAN_SIMD=0
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus_endian.h"
+#include "test_util.h"
+
+#define MAX_REGISTERS 125
+
+static bool registers_equal(const uint16_t *registers, uint16_t r0, uint16_t r1)
+{
+	return registers[0] == r0 && registers[1] == r1;
+}
+
+/* every count up to a full frame, at every offset within 32 bytes, guard bytes untouched */
+static bool test_pack(void)
+{
+	uint16_t src[MAX_REGISTERS];
+	uint8_t dst[2 * MAX_REGISTERS + 40];
+
+	for (int i = 0; i < MAX_REGISTERS; i++) {
+		src[i] = (uint16_t)(i * 0x0301 + 0x1234);
+	}
+	for (int offset = 0; offset < 32; offset++) {
+		for (int count = 0; count <= MAX_REGISTERS; count++) {
+			memset(dst, 0xee, sizeof(dst));
+			modbus_registers_pack(dst + offset, src, count);
+			for (int i = 0; i < count; i++) {
+				if (dst[offset + 2 * i] != src[i] >> 8 || dst[offset + 2 * i + 1] != (src[i] & 0xff)) {
+					return false;
+				}
+			}
+			if ((offset > 0 && dst[offset - 1] != 0xee) || dst[offset + 2 * count] != 0xee) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool test_unpack(void)
+{
+	uint8_t src[2 * MAX_REGISTERS + 32];
+	uint16_t dst[MAX_REGISTERS + 1];
+
+	for (unsigned i = 0; i < sizeof(src); i++) {
+		src[i] = (uint8_t)(i * 7 + 1);
+	}
+	for (int offset = 0; offset < 32; offset++) {
+		for (int count = 0; count <= MAX_REGISTERS; count++) {
+			memset(dst, 0xee, sizeof(dst));
+			modbus_registers_unpack(dst, src + offset, count);
+			for (int i = 0; i < count; i++) {
+				if (dst[i] != ((src[offset + 2 * i] << 8) | src[offset + 2 * i + 1])) {
+					return false;
+				}
+			}
+			if (dst[count] != 0xeeee) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static bool test_round_trip(void)
+{
+	uint16_t registers[MAX_REGISTERS];
+	uint16_t result[MAX_REGISTERS];
+	uint8_t wire[2 * MAX_REGISTERS + 1];
+
+	for (int i = 0; i < MAX_REGISTERS; i++) {
+		registers[i] = (uint16_t)(0xffff - i * 0x0123);
+	}
+	/* odd address as in a reply, after the byte count */
+	modbus_registers_pack(wire + 1, registers, MAX_REGISTERS);
+	modbus_registers_unpack(result, wire + 1, MAX_REGISTERS);
+	return memcmp(registers, result, sizeof(registers)) == 0;
+}
+
+int main(void)
+{
+	uint16_t registers[4];
+	bool ok;
+
+	printf("Register byte order test (%s kernel)\n", modbus_registers_kernel());
+
+	check("pack all counts and offsets", test_pack());
+	check("unpack all counts and offsets", test_unpack());
+	check("pack / unpack round trip", test_round_trip());
+
+	/* 123.456f = 0x42f6e979 */
+	modbus_set_float(registers, 123.456f, MODBUS_ORDER_ABCD);
+	ok = registers_equal(registers, 0x42f6, 0xe979);
+	modbus_set_float(registers, 123.456f, MODBUS_ORDER_CDAB);
+	ok = ok && registers_equal(registers, 0xe979, 0x42f6);
+	modbus_set_float(registers, 123.456f, MODBUS_ORDER_BADC);
+	ok = ok && registers_equal(registers, 0xf642, 0x79e9);
+	modbus_set_float(registers, 123.456f, MODBUS_ORDER_DCBA);
+	ok = ok && registers_equal(registers, 0x79e9, 0xf642);
+	check("set float in all word orders", ok);
+
+	ok = true;
+	for (uint8_t order = MODBUS_ORDER_ABCD; order <= MODBUS_ORDER_DCBA; order++) {
+		modbus_set_float(registers, 123.456f, order);
+		ok = ok && modbus_get_float(registers, order) == 123.456f;
+	}
+	registers[0] = 0x42f6;
+	registers[1] = 0xe979;
+	check("get float in all word orders", ok && modbus_get_float(registers, MODBUS_ORDER_ABCD) == 123.456f);
+
+	modbus_set_uint32(registers, 0x12345678, MODBUS_ORDER_ABCD);
+	ok = registers_equal(registers, 0x1234, 0x5678) && modbus_get_uint32(registers, MODBUS_ORDER_CDAB) == 0x56781234 &&
+			modbus_get_uint32(registers, MODBUS_ORDER_BADC) == 0x34127856 &&
+			modbus_get_uint32(registers, MODBUS_ORDER_DCBA) == 0x78563412;
+	check("uint32 word orders", ok);
+
+	modbus_set_int32(registers, -2, MODBUS_ORDER_CDAB);
+	ok = registers_equal(registers, 0xfffe, 0xffff) && modbus_get_int32(registers, MODBUS_ORDER_CDAB) == -2;
+	modbus_set_int32(registers, INT32_MIN, MODBUS_ORDER_DCBA);
+	check("negative int32", ok && registers_equal(registers, 0x0000, 0x0080) &&
+			modbus_get_int32(registers, MODBUS_ORDER_DCBA) == INT32_MIN);
+
+	modbus_set_uint64(registers, 0x0102030405060708ULL, MODBUS_ORDER_ABCD);
+	ok = registers[0] == 0x0102 && registers[1] == 0x0304 && registers[2] == 0x0506 && registers[3] == 0x0708;
+	modbus_set_uint64(registers, 0x0102030405060708ULL, MODBUS_ORDER_DCBA);
+	ok = ok && registers[0] == 0x0807 && registers[1] == 0x0605 && registers[2] == 0x0403 && registers[3] == 0x0201;
+	modbus_set_uint64(registers, 0x0102030405060708ULL, MODBUS_ORDER_CDAB);
+	ok = ok && registers[0] == 0x0708 && registers[3] == 0x0102 &&
+			modbus_get_uint64(registers, MODBUS_ORDER_CDAB) == 0x0102030405060708ULL;
+	check("uint64 word orders", ok);
+
+	return test_summary();
+}
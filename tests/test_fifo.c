@@ -0,0 +1,206 @@
+/*
+ * Read FIFO Queue (24): sample ring ordering and overruns, reply format, FIFO count limits,
+ * strict mode, unknown addresses, producer thread streaming through requests
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include "modbus.h"
+#include "modbus_fifo.h"
+#include "test_util.h"
+
+#define STRESS_SAMPLES 100000
+
+static modbus_slave_ctx_t ctx;
+static modbus_fifo_t fifo;
+static modbus_fifo_t stream;
+static uint16_t fifo_registers[64];
+static uint16_t stream_registers[256];
+
+static uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static int reply_len;
+
+static int8_t fifo_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+static int8_t fifo_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	memcpy(reply, buffer, data_len);
+	reply_len = data_len;
+	return MODBUS_OK;
+}
+
+/* global API is not used here */
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+/* sends read FIFO queue request for address; returns FIFO count of reply, -1 if reply is not valid */
+static int read_fifo(uint16_t address)
+{
+	uint8_t frame[6] = { ctx.address, MODBUS_READ_FIFO_QUEUE, address >> 8, address & 0xff };
+	uint16_t crc = modbus_CRC16(frame, 4);
+	int count;
+
+	frame[4] = crc & 0xff;
+	frame[5] = crc >> 8;
+	reply_len = 0;
+	modbus_slave_ctx_process_msg(&ctx, frame, sizeof(frame));
+	if (reply_len < 8 || reply[1] != MODBUS_READ_FIFO_QUEUE) {
+		return -1;
+	}
+	count = (reply[4] << 8) | reply[5];
+	if (((reply[2] << 8) | reply[3]) != 2 + 2 * count || reply_len != 8 + 2 * count) {
+		return -1;
+	}
+	return count;
+}
+
+static uint16_t reply_register(int index)
+{
+	return (reply[6 + 2 * index] << 8) | reply[7 + 2 * index];
+}
+
+static bool exception_reply(uint8_t exception)
+{
+	return reply_len == 5 && reply[1] == (MODBUS_READ_FIFO_QUEUE | MODBUS_ERROR_FLAG) && reply[2] == exception;
+}
+
+static int producer_done;
+
+/* two-register samples: sequence number high and low word; retries when queue is full */
+static void *producer(void *arg)
+{
+	uint16_t sample[2];
+
+	(void)arg;
+	for (uint32_t seq = 0; seq < STRESS_SAMPLES; seq++) {
+		sample[0] = seq >> 16;
+		sample[1] = seq & 0xffff;
+		while (modbus_fifo_push(&stream, sample) != MODBUS_OK) {
+			sched_yield();
+		}
+	}
+	__atomic_store_n(&producer_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+int main(void)
+{
+	uint16_t values[64];
+	uint16_t sample[10] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+	pthread_t thread;
+	bool ok;
+	int count;
+
+	printf("FIFO queue test\n");
+	modbus_slave_ctx_init(&ctx, 7, fifo_callback, fifo_transmit, NULL);
+
+	/* ring */
+	check("init rejects bad size", modbus_fifo_init(&fifo, 0, fifo_registers, 48, 1) == MODBUS_ERROR &&
+			modbus_fifo_init(&fifo, 0, fifo_registers, 64, 0) == MODBUS_ERROR &&
+			modbus_fifo_init(&fifo, 0, fifo_registers, 64, MODBUS_FIFO_MAX_COUNT + 1) == MODBUS_ERROR);
+	modbus_fifo_init(&fifo, 0x100, fifo_registers, 64, 1);
+	ok = true;
+	for (uint16_t i = 0; i < 64; i++) {
+		ok = ok && modbus_fifo_push(&fifo, &i) == MODBUS_OK;
+	}
+	check("fill queue", ok && modbus_fifo_count(&fifo) == 64 && fifo.high_water == 64);
+	check("overrun when full", modbus_fifo_push(&fifo, sample) == MODBUS_ERROR_OUT_OF_BOUNDS &&
+			modbus_fifo_write(&fifo, sample, 4) == 0 && fifo.overruns == 5);
+	ok = modbus_fifo_read(&fifo, values, 10) == 10;
+	for (uint16_t i = 0; i < 10; i++) {
+		ok = ok && values[i] == i;
+	}
+	check("read in order", ok && modbus_fifo_count(&fifo) == 54);
+	check("write stops when full", modbus_fifo_write(&fifo, sample, 4) == 4 &&
+			modbus_fifo_write(&fifo, sample, 10) == 6 && fifo.overruns == 9);
+
+	/* samples are not split */
+	modbus_fifo_init(&fifo, 0x100, fifo_registers, 64, 2);
+	modbus_fifo_write(&fifo, sample, 2);
+	check("whole samples only", modbus_fifo_read(&fifo, values, 3) == 2 && values[0] == 1 && values[1] == 2 &&
+			modbus_fifo_count(&fifo) == 2);
+	check("sample pushed whole", modbus_fifo_write(&fifo, fifo_registers, 31) == 31 &&
+			modbus_fifo_push(&fifo, sample) == MODBUS_ERROR_OUT_OF_BOUNDS && modbus_fifo_count(&fifo) == 64);
+
+	/* requests */
+	read_fifo(0x100);
+	check("no queues: exception 01", exception_reply(MODBUS_EXCEPTION_ILLEGAL_FUNCTION));
+	modbus_fifo_init(&fifo, 0x100, fifo_registers, 64, 1);
+	check("add queue", modbus_slave_ctx_add_fifo(&ctx, &fifo) == MODBUS_OK &&
+			modbus_slave_ctx_add_fifo(&ctx, &fifo) == MODBUS_ERROR);
+	read_fifo(0x101);
+	check("unknown address: exception 02", exception_reply(MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS));
+	check("empty queue", read_fifo(0x100) == 0);
+	for (uint16_t i = 0; i < 3; i++) {
+		modbus_fifo_push(&fifo, &sample[i]);
+	}
+	check("reply format", read_fifo(0x100) == 3 && reply_register(0) == 1 && reply_register(2) == 3 &&
+			modbus_fifo_count(&fifo) == 0);
+	for (uint16_t i = 0; i < 40; i++) {
+		modbus_fifo_push(&fifo, &i);
+	}
+	count = read_fifo(0x100);
+	check("drained 31 at most", count == MODBUS_FIFO_MAX_REPLY_COUNT && reply_register(count - 1) == count - 1);
+	check("rest in next reply", read_fifo(0x100) == 40 - count && reply_register(0) == count &&
+			read_fifo(0x100) == 0);
+
+	/* strict: exception 03 instead of draining, nothing removed */
+	fifo.flags |= MODBUS_FIFO_FLAG_STRICT;
+	for (uint16_t i = 0; i < MODBUS_FIFO_MAX_REPLY_COUNT + 1; i++) {
+		modbus_fifo_push(&fifo, &i);
+	}
+	read_fifo(0x100);
+	check("strict: exception 03 above 31", exception_reply(MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE) &&
+			modbus_fifo_count(&fifo) == MODBUS_FIFO_MAX_REPLY_COUNT + 1);
+	modbus_fifo_read(&fifo, values, 1);
+	check("strict: full reply at 31", read_fifo(0x100) == MODBUS_FIFO_MAX_REPLY_COUNT);
+
+	/* producer thread streaming two-register samples through requests */
+	modbus_fifo_init(&stream, 0x200, stream_registers, 256, 2);
+	modbus_slave_ctx_add_fifo(&ctx, &stream);
+	pthread_create(&thread, NULL, producer, NULL);
+	{
+		uint32_t expected = 0;
+		uint32_t requests = 0;
+		bool done;
+
+		ok = true;
+		do {
+			done = __atomic_load_n(&producer_done, __ATOMIC_ACQUIRE);
+			count = read_fifo(0x200);
+			requests++;
+			ok = ok && count >= 0 && count % 2 == 0;
+			for (int i = 0; ok && i < count; i += 2) {
+				uint32_t seq = ((uint32_t)reply_register(i) << 16) | reply_register(i + 1);
+				ok = seq == expected++;
+			}
+			if (count == 0) {
+				sched_yield();
+			}
+		} while (ok && !(done && count == 0));
+		pthread_join(thread, NULL);
+		check("producer thread streaming", ok && expected == STRESS_SAMPLES);
+		printf("    %u samples in %u requests, high water %u\n", expected, requests, stream.high_water);
+	}
+
+	return test_summary();
+}
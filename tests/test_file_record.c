@@ -0,0 +1,242 @@
+/*
+ * Read / write file record (20, 21): memory and memory-mapped files, multiple sub-requests,
+ * bounds and access checks, msync policy
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "modbus.h"
+#include "modbus_file_record.h"
+#include "test_util.h"
+
+#define MAPPED_RECORDS 25000 /* file numbers 10, 11, 12 */
+
+static modbus_slave_ctx_t ctx;
+static modbus_file_t files[8];
+static modbus_file_map_t file_map;
+
+static uint8_t log_records[2 * 100]; /* file 1, read-only */
+static uint8_t setup_records[2 * 10]; /* file 2 */
+
+static uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static int reply_len;
+
+static int8_t file_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+static int8_t file_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	memcpy(reply, buffer, data_len);
+	reply_len = data_len;
+	return MODBUS_OK;
+}
+
+/* global API is not used here */
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+static void request(const uint8_t *pdu, int pdu_len)
+{
+	reply_len = 0;
+	test_request(&ctx, ctx.address, pdu, pdu_len, false);
+}
+
+/* appends sub-request header to pdu */
+static int sub_request(uint8_t *pdu, int len, uint16_t file_number, uint16_t record_number, uint16_t record_length)
+{
+	uint8_t header[MODBUS_FILE_SUB_REQUEST_LEN] = {
+		MODBUS_FILE_REFERENCE_TYPE, file_number >> 8, file_number & 0xff,
+		record_number >> 8, record_number & 0xff, record_length >> 8, record_length & 0xff
+	};
+	memcpy(pdu + len, header, sizeof(header));
+	return len + sizeof(header);
+}
+
+static bool reply_exception(uint8_t function_code, uint8_t exception)
+{
+	return reply_len == 5 && reply[1] == (MODBUS_ERROR_FLAG | function_code) && reply[2] == exception;
+}
+
+static uint16_t word(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+int main(void)
+{
+	char path[] = "/tmp/modbus_file_record_XXXXXX";
+	uint8_t pdu[MODBUS_MAX_RTU_FRAME_SIZE];
+	uint8_t stored[4];
+	int fd;
+	int len;
+	bool ok;
+
+	printf("File record test\n");
+	/* record i of the mapped file holds i */
+	fd = mkstemp(path);
+	for (uint32_t i = 0; i < MAPPED_RECORDS; i++) {
+		uint8_t record[2] = { i >> 8, i & 0xff };
+		ok = write(fd, record, 2) == 2;
+	}
+	for (int i = 0; i < 100; i++) {
+		log_records[2 * i + 1] = i;
+	}
+
+	modbus_slave_ctx_init(&ctx, 4, file_callback, file_transmit, NULL);
+	request((const uint8_t[]){ 0x14, 0x07, 0x06, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01 }, 9);
+	check("no file map", reply_exception(0x14, MODBUS_EXCEPTION_ILLEGAL_FUNCTION));
+
+	modbus_file_map_init(&file_map, files, 8);
+	ok = modbus_file_map_add(&file_map, 2, setup_records, 10, MODBUS_ACCESS_READ_WRITE) == MODBUS_OK &&
+			modbus_file_map_add(&file_map, 1, log_records, 100, MODBUS_ACCESS_READ) == MODBUS_OK &&
+			modbus_file_map_add(&file_map, 1, log_records, 100, MODBUS_ACCESS_READ) == MODBUS_ERROR &&
+			modbus_file_map_add(&file_map, 0, log_records, 100, MODBUS_ACCESS_READ) == MODBUS_ERROR;
+	check("add memory files", ok && file_map.file_count == 2);
+	ok = fd >= 0 && modbus_file_map_add_file(&file_map, 10, path, MODBUS_ACCESS_READ_WRITE) == MODBUS_OK;
+	check("map file to consecutive file numbers", ok && file_map.file_count == 5 &&
+			modbus_file_map_find(&file_map, 11, 0, MODBUS_FILE_MAX_RECORDS) != NULL &&
+			modbus_file_map_find(&file_map, 12, 0, 5000) != NULL && modbus_file_map_find(&file_map, 12, 0, 5001) == NULL);
+	check("overlapping file numbers rejected",
+			modbus_file_map_add_file(&file_map, 12, path, MODBUS_ACCESS_READ) == MODBUS_ERROR && file_map.file_count == 5);
+	modbus_slave_ctx_set_file_map(&ctx, &file_map);
+
+	/* three sub-requests in one frame, from memory and from the mapping */
+	pdu[0] = 0x14;
+	len = 2;
+	len = sub_request(pdu, len, 1, 7, 2);
+	len = sub_request(pdu, len, 11, 9999, 1);
+	len = sub_request(pdu, len, 12, 4998, 2);
+	pdu[1] = len - 2;
+	request(pdu, len);
+	ok = reply_len == 5 + 3 * 2 + 2 * 5 && reply[1] == 0x14 && reply[2] == 3 * 2 + 2 * 5 &&
+			reply[3] == 5 && reply[4] == 6 && word(reply + 5) == 7 && word(reply + 7) == 8 &&
+			reply[9] == 3 && reply[10] == 6 && word(reply + 11) == (uint16_t)19999 &&
+			reply[13] == 5 && reply[14] == 6 && word(reply + 15) == (uint16_t)24998 && word(reply + 17) == (uint16_t)24999;
+	check("read file record sub-requests", ok);
+
+	/* largest reply */
+	len = sub_request(pdu, 2, 10, 100, (MODBUS_MAX_READ_DATA - 2) / 2);
+	pdu[1] = len - 2;
+	request(pdu, len);
+	check("read file record filling the frame", reply_len == MODBUS_MAX_RTU_FRAME_SIZE - 1 &&
+			word(reply + 5) == 100 && word(reply + reply_len - 4) == 100 + (MODBUS_MAX_READ_DATA - 2) / 2 - 1);
+	len = sub_request(pdu, 2, 10, 100, 100);
+	len = sub_request(pdu, len, 10, 200, 100);
+	pdu[1] = len - 2;
+	request(pdu, len);
+	check("reply too long refused", reply_exception(0x14, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE));
+
+	len = sub_request(pdu, 2, 12, 4999, 2);
+	pdu[1] = len - 2;
+	request(pdu, len);
+	ok = reply_exception(0x14, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+	len = sub_request(pdu, 2, 3, 0, 1);
+	request(pdu, len);
+	ok = ok && reply_exception(0x14, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+	pdu[2] = 5;
+	request(pdu, len);
+	ok = ok && reply_exception(0x14, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+	check("unknown file, records or reference type", ok);
+	pdu[1] = 8;
+	request(pdu, len + 1);
+	check("read byte count not multiple of 7", reply_exception(0x14, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE));
+	/* record length whose reply size wraps 16 bits */
+	len = sub_request(pdu, 2, 10, 0, 0x7fff);
+	pdu[1] = len - 2;
+	request(pdu, len);
+	check("read reply size wrap refused", reply_exception(0x14, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE));
+
+	/* write into the mapping (flushed synchronously) and into memory */
+	modbus_file_map_set_sync(&file_map, MODBUS_FILE_SYNC_SYNC, 1);
+	pdu[0] = 0x15;
+	len = sub_request(pdu, 2, 11, 5, 2);
+	memcpy(pdu + len, "\xAB\xCD\x12\x34", 4);
+	len += 4;
+	len = sub_request(pdu, len, 2, 9, 1);
+	memcpy(pdu + len, "\x55\xAA", 2);
+	len += 2;
+	pdu[1] = len - 2;
+	request(pdu, len);
+	ok = reply_len == len + 3 && memcmp(reply + 1, pdu, len) == 0 && word(setup_records + 18) == 0x55AA &&
+			word(files[3].data + 10) == 0xABCD && file_map.syncs == 1 && files[3].dirty_end == 0;
+	ok = ok && pread(fd, stored, 4, 2 * (MODBUS_FILE_MAX_RECORDS + 5)) == 4 && memcmp(stored, "\xAB\xCD\x12\x34", 4) == 0;
+	check("write file record sub-requests", ok);
+
+	/* one bad sub-request: nothing is written */
+	len = sub_request(pdu, 2, 2, 0, 1);
+	memcpy(pdu + len, "\x11\x11", 2);
+	len += 2;
+	len = sub_request(pdu, len, 1, 0, 1);
+	memcpy(pdu + len, "\x22\x22", 2);
+	len += 2;
+	pdu[1] = len - 2;
+	request(pdu, len);
+	check("write to read-only file refused whole",
+			reply_exception(0x15, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS) && word(setup_records) == 0 && word(log_records) == 0);
+	pdu[1] = len - 3;
+	request(pdu, len - 1);
+	check("write byte count mismatch", reply_exception(0x15, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE));
+	/* first record length wraps the position back onto the second sub-request */
+	pdu[0] = 0x15;
+	len = sub_request(pdu, 2, 2, 0, 0x8000);
+	len = sub_request(pdu, len, 2, 0, 1);
+	memcpy(pdu + len, "\x33\x33", 2);
+	len += 2;
+	pdu[1] = len - 2;
+	request(pdu, len);
+	check("write sub-request length wrap refused",
+			reply_exception(0x15, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE) && word(setup_records) == 0);
+	/* largest byte count through request API (TCP): 03 if the echo wouldn't fit the frame,
+	 * otherwise 02 (10 records in the file) */
+	{
+		uint8_t big[3 + MODBUS_FILE_WRITE_MAX_BYTE_COUNT] = { 0, 0x15, MODBUS_FILE_WRITE_MAX_BYTE_COUNT };
+		uint8_t big_reply[MODBUS_MAX_RTU_FRAME_SIZE];
+		uint16_t big_reply_len;
+
+		big[0] = ctx.address;
+		sub_request(big, 3, 2, 0, (MODBUS_FILE_WRITE_MAX_BYTE_COUNT - MODBUS_FILE_SUB_REQUEST_LEN) / 2);
+		modbus_slave_ctx_process_request(&ctx, big, sizeof(big), big_reply, &big_reply_len, MODBUS_REQUEST_FLAG_NONE);
+		ok = big_reply_len == 3 && big_reply[1] == (MODBUS_ERROR_FLAG | 0x15) &&
+				big_reply[2] == (5 + MODBUS_FILE_WRITE_MAX_BYTE_COUNT > MODBUS_MAX_RTU_FRAME_SIZE ?
+				MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE : MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+	}
+	check("write byte count beyond frame size refused", ok && word(setup_records) == 0);
+
+	/* sync every 2nd write request */
+	modbus_file_map_set_sync(&file_map, MODBUS_FILE_SYNC_ASYNC, 2);
+	len = sub_request(pdu, 2, 10, 0, 1);
+	memcpy(pdu + len, "\x77\x77", 2);
+	len += 2;
+	pdu[1] = len - 2;
+	request(pdu, len);
+	ok = reply_len == len + 3 && file_map.syncs == 1;
+	request(pdu, len);
+	check("sync policy interval", ok && reply_len == len + 3 && file_map.syncs == 2);
+
+	modbus_file_map_close(&file_map);
+	ok = pread(fd, stored, 2, 0) == 2 && memcmp(stored, "\x77\x77", 2) == 0;
+	check("close", ok && file_map.file_count == 0);
+	close(fd);
+	unlink(path);
+
+	return test_summary();
+}
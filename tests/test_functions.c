@@ -0,0 +1,164 @@
+/*
+ * Function code dispatch: mask write register (22), read/write multiple registers (23),
+ * handlers registered at runtime
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus.h"
+#include "modbus_register_map.h"
+#include "test_util.h"
+
+#define VENDOR_FUNCTION 0x41
+
+static modbus_slave_ctx_t ctx;
+static modbus_register_map_t map;
+static modbus_register_range_t ranges[1];
+
+static uint16_t registers[20]; /* holding 0..19 */
+static uint16_t callback_register = 0x00F0; /* holding 1000, served by callback */
+static int callback_calls;
+
+static uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static int reply_len;
+
+static int8_t functions_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	callback_calls++;
+	if (transaction->register_address == 2000) {
+		/* something went wrong on our side */
+		return MODBUS_ERROR;
+	}
+	if (transaction->register_address != 1000 || transaction->register_count != 1) {
+		return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+	}
+	switch (transaction->function_code) {
+	case MODBUS_READ_HOLDING_REGISTERS:
+		transaction->holding_registers[0] = callback_register;
+		return MODBUS_OK;
+	case MODBUS_WRITE_SINGLE_REGISTER:
+		callback_register = transaction->holding_registers[0];
+		return MODBUS_OK;
+	default:
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+}
+
+static int8_t functions_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	memcpy(reply, buffer, data_len);
+	reply_len = data_len;
+	return MODBUS_OK;
+}
+
+/* vendor function: returns sum of request bytes */
+static int8_t vendor_parse(modbus_slave_ctx_t *ctx, const uint8_t *data, int len, modbus_transaction_t *transaction)
+{
+	uint16_t sum = 0;
+
+	(void)ctx;
+	for (int i = 0; i < len; i++) {
+		sum += data[i];
+	}
+	transaction->holding_registers[0] = sum;
+	return MODBUS_OK;
+}
+
+static uint8_t vendor_serialize(modbus_slave_ctx_t *ctx, uint8_t *buffer, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	buffer[0] = transaction->holding_registers[0] >> 8;
+	buffer[1] = transaction->holding_registers[0] & 0xff;
+	return 2;
+}
+
+static const modbus_function_handler_t vendor_handler = {
+	.min_len = 1,
+	.parse = vendor_parse,
+	.serialize = vendor_serialize,
+};
+
+static void request(const uint8_t *pdu, int pdu_len)
+{
+	reply_len = 0;
+	test_request(&ctx, ctx.address, pdu, pdu_len, false);
+}
+
+static uint16_t reply_register(int i)
+{
+	return (reply[3 + 2 * i] << 8) | reply[4 + 2 * i];
+}
+
+static bool reply_exception(uint8_t function_code, uint8_t exception)
+{
+	return reply_len == 5 && reply[1] == (MODBUS_ERROR_FLAG | function_code) && reply[2] == exception;
+}
+
+int main(void)
+{
+	printf("Function code dispatch test\n");
+	for (int i = 0; i < 20; i++) {
+		registers[i] = 100 + i;
+	}
+	modbus_slave_ctx_init(&ctx, 3, functions_callback, functions_transmit, NULL);
+	modbus_register_map_init(&map, ranges, 1);
+	modbus_register_range_t r_registers = {
+		.table = MODBUS_TABLE_HOLDING_REGISTERS, .start = 0, .count = 20,
+		.data = registers, .access = MODBUS_ACCESS_READ_WRITE,
+	};
+	modbus_register_map_add(&map, &r_registers);
+	modbus_slave_ctx_set_register_map(&ctx, &map);
+
+	/* example from Modbus_Application_Protocol_V1_1b, section 6.16: 0x12 & 0xF2 | 0x25 & ~0xF2 = 0x17 */
+	registers[4] = 0x0012;
+	request((const uint8_t[]){ 0x16, 0x00, 0x04, 0x00, 0xF2, 0x00, 0x25 }, 7);
+	check("mask write register (map)", reply_len == 10 && memcmp(reply + 1, "\x16\x00\x04\x00\xF2\x00\x25", 7) == 0 &&
+			registers[4] == 0x0017 && callback_calls == 0);
+
+	request((const uint8_t[]){ 0x16, 0x03, 0xE8, 0xFF, 0x0F, 0x00, 0x3C }, 7);
+	check("mask write register (callback)", reply_len == 10 && callback_register == 0x0030 && callback_calls == 2);
+
+	request((const uint8_t[]){ 0x16, 0x00, 0x64, 0xFF, 0xFF, 0x00, 0x00 }, 7);
+	check("mask write register to unknown address", reply_exception(0x16, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS));
+
+	/* write 10..11 first, then read 9..12 */
+	request((const uint8_t[]){ 0x17, 0x00, 0x09, 0x00, 0x04, 0x00, 0x0A, 0x00, 0x02, 0x04, 0xAA, 0xBB, 0xCC, 0xDD }, 14);
+	check("read/write multiple registers", reply_len == 5 + 8 && reply[1] == 0x17 && reply[2] == 8 &&
+			reply_register(0) == 109 && reply_register(1) == 0xAABB && reply_register(2) == 0xCCDD &&
+			reply_register(3) == 112 && registers[10] == 0xAABB);
+
+	request((const uint8_t[]){ 0x17, 0x00, 0x09, 0x00, 0x04, 0x00, 0x0A, 0x00, 0x02, 0x03, 0xAA, 0xBB, 0xCC }, 13);
+	check("read/write multiple with wrong byte count", reply_exception(0x17, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE));
+
+	request((const uint8_t[]){ 0x17, 0x00, 0x09, 0x00, 0x04, 0x00, 0x0A, 0x00, 0x02, 0x04, 0xAA, 0xBB }, 12);
+	check("truncated read/write multiple ignored", reply_len == 0);
+
+	request((const uint8_t[]){ 0x16, 0x00, 0x04, 0x00, 0xF2 }, 5);
+	check("short mask write ignored", reply_len == 0);
+
+	/* callback failing for other reasons than unknown register */
+	request((const uint8_t[]){ 0x03, 0x07, 0xD0, 0x00, 0x01 }, 5);
+	check("callback error is slave device failure", reply_exception(0x03, MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE));
+
+	/* function registered at runtime */
+	request((const uint8_t[]){ VENDOR_FUNCTION, 0x01, 0x02, 0x03 }, 4);
+	check("unknown function before registration", reply_exception(VENDOR_FUNCTION, MODBUS_EXCEPTION_ILLEGAL_FUNCTION));
+	check("register function", modbus_slave_ctx_register_function(&ctx, VENDOR_FUNCTION, &vendor_handler) == MODBUS_OK);
+	request((const uint8_t[]){ VENDOR_FUNCTION, 0x01, 0x02, 0x03 }, 4);
+	check("registered function", reply_len == 6 && reply[1] == VENDOR_FUNCTION && reply[2] == 0x00 && reply[3] == 0x06);
+
+	/* built-in function replaced by NULL handler is disabled */
+	modbus_slave_ctx_register_function(&ctx, MODBUS_WRITE_SINGLE_REGISTER, NULL);
+	request((const uint8_t[]){ 0x06, 0x00, 0x01, 0x12, 0x34 }, 5);
+	check("disabled built-in function", reply_exception(0x06, MODBUS_EXCEPTION_ILLEGAL_FUNCTION) && registers[1] == 101);
+
+	modbus_slave_ctx_register_function(&ctx, 0x42, &vendor_handler);
+	modbus_slave_ctx_register_function(&ctx, 0x43, &vendor_handler);
+	check("registration table full", modbus_slave_ctx_register_function(&ctx, 0x44, &vendor_handler) == MODBUS_ERROR_OUT_OF_BOUNDS &&
+			modbus_slave_ctx_register_function(&ctx, 0x43, NULL) == MODBUS_OK);
+
+	return test_summary();
+}
@@ -0,0 +1,368 @@
+/*
+ * TCP to RTU gateway test: simulated slave on a pseudo terminal, TCP clients; routing,
+ * exceptions, timeout, merged reads, queueing, broadcast turnaround, metrics
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <termios.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "modbus.h"
+#include "modbus_gateway.h"
+#include "test_util.h"
+
+#define SLAVE_ADDRESS 5
+#define SILENT_ADDRESS 6 /* routed, but nobody answers */
+#define CLIENTS 4
+#define WRITTEN_REGISTER 0x40 /* reads back last written value */
+
+static modbus_gateway_t gateway;
+static modbus_gateway_bus_t bus;
+
+/* simulated slave on the master side of the pty */
+static modbus_slave_ctx_t slave;
+static int pty;
+static int slave_stop;
+static int slave_frames; /* frames seen on the bus */
+static int slave_delay_us; /* before reply */
+static int slave_writes;
+static uint16_t slave_written;
+
+/* holding register value is its address, except for WRITTEN_REGISTER */
+static int8_t slave_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	switch (transaction->function_code) {
+	case MODBUS_READ_HOLDING_REGISTERS:
+		for (int i = 0; i < transaction->register_count; i++) {
+			transaction->holding_registers[i] = transaction->register_address + i == WRITTEN_REGISTER ?
+					slave_written : transaction->register_address + i;
+		}
+		return MODBUS_OK;
+	case MODBUS_WRITE_SINGLE_REGISTER:
+		__atomic_add_fetch(&slave_writes, 1, __ATOMIC_SEQ_CST);
+		slave_written = transaction->holding_registers[0];
+		return MODBUS_OK;
+	default:
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+}
+
+static int8_t slave_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	usleep(slave_delay_us);
+	return write(pty, buffer, data_len) == data_len ? MODBUS_OK : MODBUS_ERROR;
+}
+
+/* global API is not used here */
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+/* frames requests by 2 ms of silence */
+static void *slave_thread(void *arg)
+{
+	struct pollfd pfd = { .fd = pty, .events = POLLIN };
+	uint8_t frame[MODBUS_MAX_RTU_FRAME_SIZE];
+	int len = 0;
+	int n;
+
+	(void)arg;
+	while (!__atomic_load_n(&slave_stop, __ATOMIC_ACQUIRE)) {
+		if (poll(&pfd, 1, len > 0 ? 2 : 20) > 0) {
+			n = read(pty, frame + len, sizeof(frame) - len);
+			len += n > 0 ? n : 0;
+			continue;
+		}
+		if (len > 0) {
+			__atomic_add_fetch(&slave_frames, 1, __ATOMIC_SEQ_CST);
+			modbus_slave_ctx_process_msg(&slave, frame, len);
+			len = 0;
+		}
+	}
+	return NULL;
+}
+
+static void *gateway_thread(void *arg)
+{
+	(void)arg;
+	modbus_gateway_run(&gateway);
+	return NULL;
+}
+
+/* master side of new pty, slave path in name */
+static int open_pty(char *name, size_t size)
+{
+	struct termios tio;
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0 || ptsname_r(fd, name, size) != 0) {
+		return -1;
+	}
+	tcgetattr(fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(fd, TCSANOW, &tio);
+	return fd;
+}
+
+/*
+ * TCP clients
+ */
+
+static int client_connect(void)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	struct timeval timeout = { .tv_sec = 2 };
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	addr.sin_port = htons(modbus_gateway_port(&gateway));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	return fd;
+}
+
+static bool client_send(int fd, uint16_t transaction_id, uint8_t unit, const uint8_t *pdu, int pdu_len)
+{
+	uint8_t adu[MODBUS_TCP_MAX_ADU_SIZE] = { transaction_id >> 8, transaction_id & 0xff, 0, 0,
+			(pdu_len + 1) >> 8, (pdu_len + 1) & 0xff, unit };
+
+	memcpy(adu + MODBUS_TCP_MBAP_HEADER_LEN, pdu, pdu_len);
+	return send(fd, adu, MODBUS_TCP_MBAP_HEADER_LEN + pdu_len, 0) == MODBUS_TCP_MBAP_HEADER_LEN + pdu_len;
+}
+
+static bool client_read(int fd, uint16_t transaction_id, uint8_t unit, uint16_t address, uint16_t count)
+{
+	const uint8_t pdu[] = { MODBUS_READ_HOLDING_REGISTERS, address >> 8, address & 0xff, count >> 8, count & 0xff };
+
+	return client_send(fd, transaction_id, unit, pdu, sizeof(pdu));
+}
+
+/* reply ADU, or -1 */
+static int client_receive(int fd, uint8_t *adu)
+{
+	int length;
+
+	if (recv(fd, adu, MODBUS_TCP_MBAP_HEADER_LEN, MSG_WAITALL) != MODBUS_TCP_MBAP_HEADER_LEN) {
+		return -1;
+	}
+	length = (adu[4] << 8) | adu[5];
+	if (length < 2 || recv(fd, adu + MODBUS_TCP_MBAP_HEADER_LEN, length - 1, MSG_WAITALL) != length - 1) {
+		return -1;
+	}
+	return MODBUS_TCP_MBAP_LENGTH_OFFSET + length;
+}
+
+/* reply to client_read() */
+static bool check_read_reply(int fd, uint16_t transaction_id, uint8_t unit, uint16_t address, uint16_t count)
+{
+	uint8_t adu[MODBUS_TCP_MAX_ADU_SIZE];
+	int len = client_receive(fd, adu);
+
+	if (len != MODBUS_TCP_MBAP_HEADER_LEN + 2 + 2 * count || ((adu[0] << 8) | adu[1]) != transaction_id ||
+			adu[6] != unit || adu[7] != MODBUS_READ_HOLDING_REGISTERS || adu[8] != 2 * count) {
+		return false;
+	}
+	for (int i = 0; i < count; i++) {
+		if (((adu[9 + 2 * i] << 8) | adu[10 + 2 * i]) != address + i) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* single register read reply with value */
+static bool check_value_reply(int fd, uint16_t transaction_id, uint16_t value)
+{
+	uint8_t adu[MODBUS_TCP_MAX_ADU_SIZE];
+
+	return client_receive(fd, adu) == MODBUS_TCP_MBAP_HEADER_LEN + 4 && ((adu[0] << 8) | adu[1]) == transaction_id &&
+			adu[7] == MODBUS_READ_HOLDING_REGISTERS && ((adu[9] << 8) | adu[10]) == value;
+}
+
+static bool check_exception(int fd, uint16_t transaction_id, uint8_t function_code, uint8_t exception)
+{
+	uint8_t adu[MODBUS_TCP_MAX_ADU_SIZE];
+
+	return client_receive(fd, adu) == MODBUS_TCP_MBAP_HEADER_LEN + 2 && ((adu[0] << 8) | adu[1]) == transaction_id &&
+			adu[7] == (function_code | MODBUS_ERROR_FLAG) && adu[8] == exception;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int main(void)
+{
+	modbus_gateway_bus_config_t config = MODBUS_GATEWAY_BUS_CONFIG_DEFAULT;
+	const uint8_t write_pdu[] = { MODBUS_WRITE_SINGLE_REGISTER, 0x00, 0x07, 0x12, 0x34 };
+	const uint8_t written_pdu[] = { MODBUS_WRITE_SINGLE_REGISTER, 0x00, WRITTEN_REGISTER, 0x43, 0x21 };
+	const uint8_t coil_pdu[] = { MODBUS_WRITE_SINGLE_COIL, 0x00, 0x01, 0xff, 0x00 };
+	pthread_t slave_tid, gateway_tid;
+	int clients[CLIENTS];
+	char name[64];
+	int frames;
+	uint64_t merged;
+	uint64_t start;
+	bool ok;
+
+	printf("Gateway test\n");
+	pty = open_pty(name, sizeof(name));
+	modbus_slave_ctx_init(&slave, SLAVE_ADDRESS, slave_callback, slave_transmit, NULL);
+	config.serial.baudrate = 115200;
+	config.response_timeout_ms = 100;
+	config.turnaround_ms = 50;
+	ok = pty >= 0 && modbus_gateway_init(&gateway, "127.0.0.1", 0, 8) == MODBUS_OK &&
+			modbus_gateway_bus_open(&gateway, &bus, name, &config) == MODBUS_OK &&
+			modbus_gateway_route(&gateway, &bus, 0, SILENT_ADDRESS) == MODBUS_OK &&
+			modbus_gateway_port(&gateway) != 0;
+	check("init", ok);
+	pthread_create(&slave_tid, NULL, slave_thread, NULL);
+	pthread_create(&gateway_tid, NULL, gateway_thread, NULL);
+	for (int i = 0; i < CLIENTS; i++) {
+		clients[i] = client_connect();
+	}
+
+	ok = client_read(clients[0], 0x1234, SLAVE_ADDRESS, 0x10, 3) && check_read_reply(clients[0], 0x1234, SLAVE_ADDRESS, 0x10, 3);
+	check("read through gateway", ok);
+
+	ok = client_send(clients[0], 2, SLAVE_ADDRESS, coil_pdu, sizeof(coil_pdu)) &&
+			check_exception(clients[0], 2, MODBUS_WRITE_SINGLE_COIL, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+	check("slave exception forwarded", ok);
+
+	ok = client_read(clients[0], 3, 100, 0, 1) &&
+			check_exception(clients[0], 3, MODBUS_READ_HOLDING_REGISTERS, MODBUS_EXCEPTION_GATEWAY_PATH_UNAVAILABLE);
+	check("unrouted unit id: exception 0A", ok && gateway.stats.no_route == 1);
+
+	start = now_ms();
+	ok = client_read(clients[0], 4, SILENT_ADDRESS, 0, 1) && check_exception(clients[0], 4,
+			MODBUS_READ_HOLDING_REGISTERS, MODBUS_EXCEPTION_GATEWAY_TARGET_DEVICE_FAILED_TO_RESPOND);
+	check("no reply: exception 0B after timeout", ok && now_ms() - start >= 100 && bus.stats.timeouts == 1);
+
+	/* slow slave: requests from all clients arrive while the first one is on the wire */
+	slave_delay_us = 50000;
+	frames = __atomic_load_n(&slave_frames, __ATOMIC_SEQ_CST);
+	ok = true;
+	for (int i = 0; i < CLIENTS; i++) {
+		ok = ok && client_read(clients[i], 100 + i, SLAVE_ADDRESS, 0x20, 8);
+	}
+	for (int i = 0; i < CLIENTS; i++) {
+		ok = ok && check_read_reply(clients[i], 100 + i, SLAVE_ADDRESS, 0x20, 8);
+	}
+	check("identical reads share one transaction", ok && slave_frames - frames == 1 &&
+			bus.stats.merged == CLIENTS - 1);
+
+	/* writes are never merged */
+	frames = __atomic_load_n(&slave_frames, __ATOMIC_SEQ_CST);
+	ok = client_send(clients[0], 200, SLAVE_ADDRESS, write_pdu, sizeof(write_pdu)) &&
+			client_send(clients[1], 201, SLAVE_ADDRESS, write_pdu, sizeof(write_pdu));
+	ok = ok && client_receive(clients[0], (uint8_t[MODBUS_TCP_MAX_ADU_SIZE]){ 0 }) == 12 &&
+			client_receive(clients[1], (uint8_t[MODBUS_TCP_MAX_ADU_SIZE]){ 0 }) == 12;
+	check("writes are not merged", ok && slave_frames - frames == 2 && slave_writes == 2 && slave_written == 0x1234);
+
+	/* read queued after a write doesn't join identical read queued before it */
+	frames = __atomic_load_n(&slave_frames, __ATOMIC_SEQ_CST);
+	merged = bus.stats.merged;
+	ok = client_read(clients[0], 250, SLAVE_ADDRESS, WRITTEN_REGISTER, 1);
+	/* first read reaches the gateway before the others */
+	usleep(10000);
+	ok = ok && client_send(clients[1], 251, SLAVE_ADDRESS, written_pdu, sizeof(written_pdu)) &&
+			client_read(clients[1], 252, SLAVE_ADDRESS, WRITTEN_REGISTER, 1);
+	ok = ok && check_value_reply(clients[0], 250, 0x1234) &&
+			client_receive(clients[1], (uint8_t[MODBUS_TCP_MAX_ADU_SIZE]){ 0 }) == 12 &&
+			check_value_reply(clients[1], 252, 0x4321);
+	check("read after write not merged with earlier read", ok && slave_frames - frames == 3 &&
+			bus.stats.merged == merged && slave_writes == 3);
+
+	/* pipelined requests of one client wait in the bus queue, replies come in order */
+	slave_delay_us = 5000;
+	ok = true;
+	for (int i = 0; i < 6; i++) {
+		ok = ok && client_read(clients[2], 300 + i, SLAVE_ADDRESS, 10 * i, 2);
+	}
+	for (int i = 0; i < 6; i++) {
+		ok = ok && check_read_reply(clients[2], 300 + i, SLAVE_ADDRESS, 10 * i, 2);
+	}
+	check("pipelined requests queued", ok && bus.stats.queue_depth_max >= 5 && bus.count == 0);
+
+	/* broadcast: executed, not answered, bus stays quiet for turnaround delay */
+	slave_delay_us = 0;
+	start = now_ms();
+	ok = client_send(clients[3], 400, MODBUS_BROADCAST_ADDR, write_pdu, sizeof(write_pdu)) &&
+			client_read(clients[3], 401, SLAVE_ADDRESS, 1, 1) && check_read_reply(clients[3], 401, SLAVE_ADDRESS, 1, 1);
+	check("broadcast turnaround", ok && now_ms() - start >= 50 && slave_writes == 4);
+
+	/* client gone before its reply: reply is dropped, others still served */
+	slave_delay_us = 20000;
+	ok = client_read(clients[3], 500, SLAVE_ADDRESS, 0x30, 1);
+	close(clients[3]);
+	ok = ok && client_read(clients[0], 501, SLAVE_ADDRESS, 0x31, 1) && check_read_reply(clients[0], 501, SLAVE_ADDRESS, 0x31, 1);
+	check("disconnected client", ok);
+
+	/* metrics */
+	/* every transaction but the broadcast ended with reply or timeout */
+	ok = bus.stats.replies + bus.stats.timeouts + 1 == bus.stats.transactions && bus.stats.exceptions == 1 &&
+			bus.stats.wait_max_us >= 5000 && bus.stats.wait_total_us >= bus.stats.wait_max_us &&
+			bus.stats.response_max_us >= 50000 && bus.stats.invalid_replies == 0 && bus.framer.frames_crc_error == 0 &&
+			gateway.stats.protocol_errors == 0 && gateway.stats.connections_accepted == CLIENTS;
+	check("metrics", ok);
+	printf("    %llu transactions, %llu merged, queue depth max %u, wait mean %llu us max %u us\n",
+			(unsigned long long)bus.stats.transactions, (unsigned long long)bus.stats.merged, bus.stats.queue_depth_max,
+			(unsigned long long)(bus.stats.wait_total_us / bus.stats.transactions), bus.stats.wait_max_us);
+
+	/* longest PDU: 03 if it doesn't fit an RTU frame, otherwise the slave refuses the function */
+	{
+		uint8_t pdu[MODBUS_TCP_MAX_PDU_SIZE] = { MODBUS_WRITE_MULTIPLE_REGISTERS, 0x00, 0x00, 0x00, 0x7b, 0xf6 };
+		bool too_long = 1 + sizeof(pdu) + 2 > MODBUS_MAX_RTU_FRAME_SIZE;
+
+		ok = client_send(clients[0], 5, SLAVE_ADDRESS, pdu, sizeof(pdu)) &&
+				check_exception(clients[0], 5, MODBUS_WRITE_MULTIPLE_REGISTERS,
+				too_long ? MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE : MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+		ok = ok && gateway.stats.too_long == (too_long ? 1 : 0);
+	}
+	check("request longer than RTU frame", ok);
+
+	/* invalid MBAP header closes connection */
+	ok = send(clients[1], "\x00\x01\x00\x07\x00\x02\x05\x03", 8, 0) == 8 &&
+			client_receive(clients[1], (uint8_t[MODBUS_TCP_MAX_ADU_SIZE]){ 0 }) < 0;
+	check("protocol error closes connection", ok && gateway.stats.protocol_errors == 1);
+
+	modbus_gateway_stop(&gateway);
+	pthread_join(gateway_tid, NULL);
+	__atomic_store_n(&slave_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(slave_tid, NULL);
+	modbus_gateway_close(&gateway);
+	check("close", gateway.bus_count == 0 && bus.fd == -1 && gateway.epoll_fd == -1);
+	for (int i = 0; i < 3; i++) {
+		close(clients[i]);
+	}
+	close(pty);
+
+	return test_summary();
+}
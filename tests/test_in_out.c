@@ -21,7 +21,18 @@ uint8_t in_frame[][MODBUS_MAX_RTU_FRAME_SIZE] = {
 	{0x03, 0x04, 0x00, 0xC0, 0x00, 0x01, 0x30, 0x14},
 	/* non-implemented function */
 	{0x03, 66, 0x00, 0xC0, 0x00, 0x01, 0xB9, 0xDB},
-
+	/* read coils 20-38 (Modbus_Application_Protocol_V1_1b example) */
+	{0x11, 0x01, 0x00, 0x13, 0x00, 0x13, 0x8E, 0x92},
+	/* read discrete inputs 10197-10218 */
+	{0x11, 0x02, 0x00, 0xC4, 0x00, 0x16, 0xBA, 0xA9},
+	/* write single coil 173 ON */
+	{0x11, 0x05, 0x00, 0xAC, 0xFF, 0x00, 0x4E, 0x8B},
+	/* write multiple coils 20-29 */
+	{0x11, 0x0F, 0x00, 0x13, 0x00, 0x0A, 0x02, 0xCD, 0x01, 0xBF, 0x0B},
+	/* write single coil with invalid value - exception 3 */
+	{0x11, 0x05, 0x00, 0xAC, 0x12, 0x34, 0x02, 0x0C},
+	/* read 2001 coils - exception 3 */
+	{0x11, 0x01, 0x00, 0x13, 0x07, 0xD1, 0x0D, 0x33},
 };
 
 uint8_t out_frame[][MODBUS_MAX_RTU_FRAME_SIZE] = {
@@ -31,13 +42,19 @@ uint8_t out_frame[][MODBUS_MAX_RTU_FRAME_SIZE] = {
 	{0x01, 0x04, 0x04, 0x27, 0x10, 0xC3, 0x50, 0xA0, 0x39},
 	{0x03, 0x04, 0x02, 0xCA, 0xFE, 0x17, 0xD0},
 	{0x03, 0x80 | 66, 0x01, 0x11, 0x60}, /* reply with exception code 1: function not supported */
+	{0x11, 0x01, 0x03, 0xCD, 0x6B, 0x05, 0x40, 0x12},
+	{0x11, 0x02, 0x03, 0xAC, 0xDB, 0x35, 0x20, 0x18},
+	{0x11, 0x05, 0x00, 0xAC, 0xFF, 0x00, 0x4E, 0x8B},
+	{0x11, 0x0F, 0x00, 0x13, 0x00, 0x0A, 0x26, 0x99},
+	{0x11, 0x85, 0x03, 0x03, 0x54},
+	{0x11, 0x81, 0x03, 0x01, 0x94},
 };
 
-int in_frame_len[] = { 8, 8, 8, 8, 8, 8};
-int out_frame_len[] = { 11, 5, 9, 9, 7, 5 };
+int in_frame_len[] = { 8, 8, 8, 8, 8, 8, 8, 8, 8, 11, 8, 8 };
+int out_frame_len[] = { 11, 5, 9, 9, 7, 5, 8, 8, 8, 8, 5, 5 };
 
 /* slave address for given test */
-uint8_t current_device_address[] = { 0x11, 0x12, 0x01, 0x01, 0x03, 0x03 };
+uint8_t current_device_address[] = { 0x11, 0x12, 0x01, 0x01, 0x03, 0x03, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11 };
 
 #define N 32
 uint8_t actual_out_frame[N][MODBUS_MAX_RTU_FRAME_SIZE];
@@ -76,10 +93,29 @@ int8_t modbus_slave_callback(modbus_transaction_t *transaction)
 			transaction->input_registers[0] = (0xCA << 8) | 0xFE;
 			return MODBUS_OK;
 		}
+	} else if (transaction->function_code == MODBUS_READ_COILS && transaction->register_number == 20) {
+		/* coils 20-38: CD 6B 05 */
+		uint32_t coils = 0x056BCD;
+		for (int i = 0; i < transaction->register_count; i++) {
+			modbus_bit_set(transaction->coils, i, (coils >> i) & 1);
+		}
+		return MODBUS_OK;
+	} else if (transaction->function_code == MODBUS_READ_DISCRETE_INPUTS && transaction->register_number == 10197) {
+		/* discrete inputs 10197-10218: AC DB 35 */
+		transaction->discrete_inputs[0] = 0xAC;
+		transaction->discrete_inputs[1] = 0xDB;
+		transaction->discrete_inputs[2] = 0x35;
+		return MODBUS_OK;
+	} else if (transaction->function_code == MODBUS_WRITE_SINGLE_COIL && transaction->register_number == 173) {
+		return modbus_bit_get(transaction->coils, 0) ? MODBUS_OK : MODBUS_ERROR;
+	} else if (transaction->function_code == MODBUS_WRITE_MULTIPLE_COILS && transaction->register_number == 20) {
+		/* coils 20-29: CD 01 */
+		return (transaction->register_count == 10 && transaction->coils[0] == 0xCD &&
+				modbus_bit_get(transaction->coils, 8) == 1 && modbus_bit_get(transaction->coils, 9) == 0) ? MODBUS_OK : MODBUS_ERROR;
 	} else {
 		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
 	}
-
+	return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
 }
 
 int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
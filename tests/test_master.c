@@ -0,0 +1,535 @@
+/*
+ * Modbus master against the in-tree slave: RTU over a socketpair, TCP over loopback,
+ * invalid replies, poll scheduler (merging, limits, spreading, deadlines)
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "modbus.h"
+#include "modbus_master.h"
+#include "modbus_register_map.h"
+#include "modbus_tcp.h"
+#include "test_util.h"
+
+#define SLAVE_ADDRESS 17
+#define REPLY_TIMEOUT_MS 100
+
+static modbus_slave_ctx_t ctx;
+static modbus_register_map_t map;
+static modbus_register_range_t ranges[4];
+static uint16_t holding[200];
+static uint16_t inputs[200];
+static uint8_t coils[32];
+static int slave_fd;
+static volatile int slave_requests;
+
+/* holding register N is 3 * N, input register N is 1000 + N; everything else unmapped */
+static int8_t slave_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	(void)transaction;
+	return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+}
+
+static int8_t slave_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	return send(slave_fd, buffer, data_len, 0) == data_len ? MODBUS_OK : MODBUS_ERROR;
+}
+
+/* RTU slave: one frame per datagram */
+static void *slave_thread(void *arg)
+{
+	uint8_t frame[MODBUS_MAX_RTU_FRAME_SIZE];
+	int len;
+
+	(void)arg;
+	while ((len = recv(slave_fd, frame, sizeof(frame), 0)) > 0) {
+		slave_requests++;
+		modbus_slave_ctx_process_msg(&ctx, frame, len);
+	}
+	return NULL;
+}
+
+/* transport side of the master; fd in user_data */
+static int8_t rtu_transfer(modbus_master_t *master, const uint8_t *request, uint16_t len, uint8_t *reply,
+		uint16_t *reply_len)
+{
+	int fd = (int)(intptr_t)master->user_data;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int n;
+
+	if (send(fd, request, len, 0) != len) {
+		return MODBUS_ERROR;
+	}
+	if (poll(&pfd, 1, REPLY_TIMEOUT_MS) <= 0) {
+		return MODBUS_ERROR_TIMEOUT;
+	}
+	n = recv(fd, reply, MODBUS_MASTER_ADU_SIZE, 0);
+	if (n <= 0) {
+		return MODBUS_ERROR;
+	}
+	*reply_len = n;
+	return MODBUS_OK;
+}
+
+static bool read_all(int fd, uint8_t *buffer, int len)
+{
+	int received = 0;
+
+	while (received < len) {
+		int n = recv(fd, buffer + received, len - received, 0);
+		if (n <= 0) {
+			return false;
+		}
+		received += n;
+	}
+	return true;
+}
+
+/* TCP: MBAP header tells the length of the rest */
+static int8_t tcp_transfer(modbus_master_t *master, const uint8_t *request, uint16_t len, uint8_t *reply,
+		uint16_t *reply_len)
+{
+	int fd = (int)(intptr_t)master->user_data;
+	uint16_t rest;
+
+	if (send(fd, request, len, 0) != len || !read_all(fd, reply, 6)) {
+		return MODBUS_ERROR;
+	}
+	rest = (reply[4] << 8) | reply[5];
+	if (rest == 0 || rest > MODBUS_MASTER_ADU_SIZE - 6 || !read_all(fd, reply + 6, rest)) {
+		return MODBUS_ERROR;
+	}
+	*reply_len = 6 + rest;
+	return MODBUS_OK;
+}
+
+/* canned reply for invalid reply tests */
+static uint8_t canned[MODBUS_MASTER_ADU_SIZE];
+static uint16_t canned_len;
+
+static int8_t canned_transfer(modbus_master_t *master, const uint8_t *request, uint16_t len, uint8_t *reply,
+		uint16_t *reply_len)
+{
+	(void)master;
+	(void)request;
+	(void)len;
+	memcpy(reply, canned, canned_len);
+	*reply_len = canned_len;
+	return MODBUS_OK;
+}
+
+static int8_t timeout_transfer(modbus_master_t *master, const uint8_t *request, uint16_t len, uint8_t *reply,
+		uint16_t *reply_len)
+{
+	(void)master;
+	(void)request;
+	(void)len;
+	(void)reply;
+	(void)reply_len;
+	return MODBUS_ERROR_TIMEOUT;
+}
+
+static void canned_reply(const uint8_t *frame, uint16_t len, bool bad_crc)
+{
+	uint16_t crc;
+
+	memcpy(canned, frame, len);
+	crc = modbus_CRC16(canned, len) ^ (bad_crc ? 0x0001 : 0);
+	canned[len] = crc & 0xff;
+	canned[len + 1] = crc >> 8;
+	canned_len = len + 2;
+}
+
+static void *server_thread(void *arg)
+{
+	modbus_tcp_server_run(arg);
+	return NULL;
+}
+
+static bool test_invalid_replies(void)
+{
+	modbus_master_t master;
+	uint16_t registers[2];
+	const uint8_t good[] = { SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 4, 0x00, 0x01, 0x00, 0x02 };
+	const uint8_t other_address[] = { SLAVE_ADDRESS + 1, MODBUS_READ_HOLDING_REGISTERS, 4, 0x00, 0x01, 0x00, 0x02 };
+	const uint8_t short_data[] = { SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 2, 0x00, 0x01 };
+	const uint8_t other_function[] = { SLAVE_ADDRESS, MODBUS_READ_INPUT_REGISTERS, 4, 0x00, 0x01, 0x00, 0x02 };
+	const uint8_t exception[] = { SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS | MODBUS_ERROR_FLAG, 0x06 };
+	bool ok;
+
+	modbus_master_init(&master, MODBUS_MASTER_RTU, canned_transfer, NULL);
+	canned_reply(good, sizeof(good), false);
+	ok = modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 0, 2, registers) == MODBUS_OK &&
+			registers[0] == 1 && registers[1] == 2;
+	canned_reply(good, sizeof(good), true);
+	ok = ok && modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 0, 2, registers) ==
+			MODBUS_ERROR_CRC;
+	canned_reply(other_address, sizeof(other_address), false);
+	ok = ok && modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 0, 2, registers) ==
+			MODBUS_ERROR_ADDRESS_MISMATCH;
+	canned_reply(short_data, sizeof(short_data), false);
+	ok = ok && modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 0, 2, registers) ==
+			MODBUS_ERROR_LENGTH_MISMATCH;
+	canned_reply(other_function, sizeof(other_function), false);
+	ok = ok && modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 0, 2, registers) ==
+			MODBUS_ERROR_FUNCTION_MISMATCH;
+	canned_reply(exception, sizeof(exception), false);
+	ok = ok && modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 0, 2, registers) ==
+			MODBUS_ERROR_EXCEPTION && master.exception == MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY;
+	return ok && master.stats.requests == 6 && master.stats.replies == 2 && master.stats.exceptions == 1 &&
+			master.stats.errors == 4;
+}
+
+/* failed transport must not hand out a stale or indeterminate reply PDU */
+static bool test_transaction_timeout(void)
+{
+	modbus_master_t master;
+	const uint8_t pdu[] = { MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x00, 0x00, 0x01 };
+	const uint8_t *reply_pdu = pdu;
+	uint16_t reply_pdu_len = 0xffff;
+
+	modbus_master_init(&master, MODBUS_MASTER_RTU, timeout_transfer, NULL);
+	return modbus_master_transaction(&master, SLAVE_ADDRESS, pdu, sizeof(pdu), &reply_pdu, &reply_pdu_len) ==
+			MODBUS_ERROR_TIMEOUT && reply_pdu == NULL && reply_pdu_len == 0 && master.stats.timeouts == 1;
+}
+
+/* decoder on its own: RTU and TCP frames built here */
+static void test_decode(void)
+{
+	/* read input registers 0x0010, 5 registers */
+	const uint8_t request[] = { 0x05, 0x04, 0x00, 0x10, 0x00, 0x05, 0x00, 0x00 };
+	const uint8_t values[] = { 0x05, 0x04, 10, 0x42, 0xf6, 0xe9, 0x79, 0xff, 0xff, 0xff, 0xfe, 0x12, 0x34 };
+	uint8_t rtu_request[sizeof(request)];
+	uint8_t reply[MODBUS_MASTER_ADU_SIZE];
+	modbus_reply_t view;
+	uint16_t crc;
+	bool ok;
+
+	memcpy(rtu_request, request, sizeof(request));
+	crc = modbus_CRC16(rtu_request, 6);
+	rtu_request[6] = crc & 0xff;
+	rtu_request[7] = crc >> 8;
+	canned_reply(values, sizeof(values), false);
+	memcpy(reply, canned, canned_len);
+	ok = modbus_reply_decode(MODBUS_MASTER_RTU, rtu_request, 8, reply, canned_len, &view) == MODBUS_OK;
+	/* view points into the frame, nothing copied */
+	ok = ok && view.data == reply + 3 && view.address == 0x10 && view.count == 5 && view.slave == 5 &&
+			view.function_code == MODBUS_READ_INPUT_REGISTERS;
+	ok = ok && modbus_reply_float(&view, 0, MODBUS_ORDER_ABCD) == 123.456f &&
+			modbus_reply_int32(&view, 2, MODBUS_ORDER_ABCD) == -2 && modbus_reply_register(&view, 4) == 0x1234 &&
+			modbus_reply_uint32(&view, 1, MODBUS_ORDER_CDAB) == 0xffffe979;
+	check("decode RTU read reply", ok);
+
+	/* TCP: same PDU behind MBAP header */
+	{
+		uint8_t tcp_request[12] = { 0x12, 0x34, 0x00, 0x00, 0x00, 0x06 };
+		uint8_t tcp_reply[7 + sizeof(values) - 1] = { 0x12, 0x34, 0x00, 0x00, 0x00, sizeof(values) };
+
+		memcpy(tcp_request + 6, request, 6);
+		memcpy(tcp_reply + 6, values, sizeof(values));
+		ok = modbus_reply_decode(MODBUS_MASTER_TCP, tcp_request, 12, tcp_reply, sizeof(tcp_reply), &view) ==
+				MODBUS_OK && view.data == tcp_reply + 9 && modbus_reply_register(&view, 4) == 0x1234;
+		tcp_reply[1] = 0x35;
+		ok = ok && modbus_reply_decode(MODBUS_MASTER_TCP, tcp_request, 12, tcp_reply, sizeof(tcp_reply), &view) ==
+				MODBUS_ERROR_TRANSACTION_MISMATCH;
+		tcp_reply[1] = 0x34;
+		tcp_reply[5]++;
+		ok = ok && modbus_reply_decode(MODBUS_MASTER_TCP, tcp_request, 12, tcp_reply, sizeof(tcp_reply), &view) ==
+				MODBUS_ERROR_FRAME_INVALID;
+		tcp_reply[5]--;
+		tcp_reply[6] = 6;
+		ok = ok && modbus_reply_decode(MODBUS_MASTER_TCP, tcp_request, 12, tcp_reply, sizeof(tcp_reply), &view) ==
+				MODBUS_ERROR_ADDRESS_MISMATCH;
+		check("decode TCP read reply", ok);
+	}
+
+	/* bits, write echo */
+	{
+		const uint8_t coils_request[] = { 0x05, 0x01, 0x00, 0x03, 0x00, 0x0a };
+		const uint8_t coils_reply[] = { 0x05, 0x01, 2, 0x81, 0x02 };
+		const uint8_t write_request[] = { 0x05, 0x06, 0x00, 0x07, 0xab, 0xcd };
+		const uint8_t bad_echo[] = { 0x05, 0x06, 0x00, 0x07, 0xab, 0xce };
+		uint8_t frame[16];
+
+		memcpy(frame, coils_request, 6);
+		crc = modbus_CRC16(frame, 6);
+		frame[6] = crc & 0xff;
+		frame[7] = crc >> 8;
+		canned_reply(coils_reply, sizeof(coils_reply), false);
+		ok = modbus_reply_decode(MODBUS_MASTER_RTU, frame, 8, canned, canned_len, &view) == MODBUS_OK &&
+				view.count == 10 && modbus_reply_bit(&view, 0) && !modbus_reply_bit(&view, 1) &&
+				modbus_reply_bit(&view, 7) && modbus_reply_bit(&view, 9);
+
+		memcpy(frame, write_request, 6);
+		crc = modbus_CRC16(frame, 6);
+		frame[6] = crc & 0xff;
+		frame[7] = crc >> 8;
+		canned_reply(write_request, sizeof(write_request), false);
+		ok = ok && modbus_reply_decode(MODBUS_MASTER_RTU, frame, 8, canned, canned_len, &view) == MODBUS_OK &&
+				view.address == 7 && modbus_reply_register(&view, 0) == 0xabcd;
+		canned_reply(bad_echo, sizeof(bad_echo), false);
+		ok = ok && modbus_reply_decode(MODBUS_MASTER_RTU, frame, 8, canned, canned_len, &view) ==
+				MODBUS_ERROR_ECHO_MISMATCH;
+		canned_reply(write_request, 4, false);
+		ok = ok && modbus_reply_decode(MODBUS_MASTER_RTU, frame, 8, canned, canned_len, &view) ==
+				MODBUS_ERROR_LENGTH_MISMATCH;
+		check("decode bits and write echo", ok);
+	}
+}
+
+static bool test_plan(void)
+{
+	static uint16_t values[8][130];
+	modbus_poll_tag_t tags[] = {
+		/* merged: 0-1 and 6-7 (gap 4), 20-23 too far */
+		{ .slave = 1, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 6, .width = 2, .period_ms = 100 },
+		{ .slave = 1, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 0, .width = 2, .period_ms = 100 },
+		{ .slave = 1, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 20, .width = 4, .period_ms = 100 },
+		/* same addresses, other slave / table / period */
+		{ .slave = 2, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 0, .width = 2, .period_ms = 100 },
+		{ .slave = 1, .table = MODBUS_TABLE_INPUT_REGISTERS, .address = 0, .width = 2, .period_ms = 100 },
+		{ .slave = 1, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 2, .width = 2, .period_ms = 1000 },
+		/* 125 register limit: 100 + 30 don't fit one request */
+		{ .slave = 3, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 0, .width = 100, .period_ms = 100 },
+		{ .slave = 3, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 100, .width = 30, .period_ms = 100 },
+	};
+	modbus_poll_tag_t adjacent[] = {
+		{ .slave = 1, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 0, .width = 2, .period_ms = 100 },
+		{ .slave = 1, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 3, .width = 4, .period_ms = 100 },
+		{ .slave = 1, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 2, .width = 1, .period_ms = 100 },
+		{ .slave = 1, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 8, .width = 1, .period_ms = 100 },
+	};
+	modbus_poll_request_t requests[16];
+	modbus_poll_t poll;
+	bool ok;
+
+	for (int i = 0; i < 4; i++) {
+		adjacent[i].value = values[i];
+	}
+	for (int i = 0; i < 8; i++) {
+		tags[i].value = values[i];
+	}
+	modbus_poll_init(&poll, tags, 8, requests, 16, 4);
+	ok = modbus_poll_plan(&poll, 0) == MODBUS_OK && poll.request_count == 7;
+	/* plan order: slave, table, period, address */
+	ok = ok && requests[0].slave == 1 && requests[0].function_code == MODBUS_READ_INPUT_REGISTERS;
+	ok = ok && requests[1].slave == 1 && requests[1].function_code == MODBUS_READ_HOLDING_REGISTERS &&
+			requests[1].address == 0 && requests[1].count == 8 && requests[1].tag_count == 2;
+	ok = ok && requests[2].address == 20 && requests[2].count == 4 && requests[3].period_ms == 1000;
+	ok = ok && requests[5].slave == 3 && requests[5].count == 100 && requests[6].address == 100;
+
+	/* gap 0: adjacent tags are still merged */
+	modbus_poll_init(&poll, adjacent, 4, requests, 16, 0);
+	ok = ok && modbus_poll_plan(&poll, 0) == MODBUS_OK && poll.request_count == 2 && requests[0].count == 7 &&
+			requests[0].tag_count == 3 && requests[1].address == 8 && adjacent[1].address == 2;
+
+	/* capacity, invalid tags */
+	modbus_poll_init(&poll, tags, 8, requests, 3, 4);
+	ok = ok && modbus_poll_plan(&poll, 0) == MODBUS_ERROR && poll.request_count == 0;
+	modbus_poll_init(&poll, tags, 8, requests, 16, 4);
+	tags[4].width = 126;
+	ok = ok && modbus_poll_plan(&poll, 0) == MODBUS_ERROR;
+	tags[4].width = 2;
+	tags[4].period_ms = 0;
+	return ok && modbus_poll_plan(&poll, 0) == MODBUS_ERROR;
+}
+
+static bool test_bit_limits(void)
+{
+	static uint8_t bits[4][256];
+	modbus_poll_tag_t tags[] = {
+		{ .slave = 1, .table = MODBUS_TABLE_COILS, .address = 0, .width = 1500, .period_ms = 10, .value = bits[0] },
+		{ .slave = 1, .table = MODBUS_TABLE_COILS, .address = 1510, .width = 490, .period_ms = 10, .value = bits[1] },
+		{ .slave = 1, .table = MODBUS_TABLE_COILS, .address = 2000, .width = 1, .period_ms = 10, .value = bits[2] },
+		{ .slave = 1, .table = MODBUS_TABLE_DISCRETE_INPUTS, .address = 0, .width = 2000, .period_ms = 10,
+				.value = bits[3] },
+	};
+	modbus_poll_request_t requests[4];
+	modbus_poll_t poll;
+
+	modbus_poll_init(&poll, tags, 4, requests, 4, 16);
+	return modbus_poll_plan(&poll, 0) == MODBUS_OK && poll.request_count == 3 && requests[0].count == 2000 &&
+			requests[0].tag_count == 2 && requests[1].address == 2000 && requests[2].count == 2000;
+}
+
+static bool test_schedule(void)
+{
+	static uint16_t values[4][2];
+	modbus_poll_tag_t tags[] = {
+		{ .slave = 1, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 0, .width = 2, .period_ms = 100 },
+		{ .slave = 2, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 0, .width = 2, .period_ms = 100 },
+		{ .slave = 3, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 0, .width = 2, .period_ms = 100 },
+		{ .slave = 4, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 0, .width = 2, .period_ms = 1000 },
+	};
+	modbus_poll_request_t requests[4];
+	modbus_poll_t poll;
+	modbus_master_t master;
+	modbus_poll_request_t *request;
+	uint32_t wait_ms;
+	uint32_t start = UINT32_MAX - 150; /* clock wraps around during the test */
+	bool ok;
+
+	for (int i = 0; i < 4; i++) {
+		tags[i].value = values[i];
+	}
+	/* every read fails: scheduling does not depend on results */
+	canned_len = 0;
+	modbus_master_init(&master, MODBUS_MASTER_RTU, canned_transfer, NULL);
+	modbus_poll_init(&poll, tags, 4, requests, 4, 0);
+	modbus_poll_plan(&poll, start);
+	/* 100 ms period spread: 0, 33, 66 */
+	ok = requests[0].due_ms == start && requests[1].due_ms == start + 33 && requests[2].due_ms == start + 66 &&
+			requests[3].due_ms == start;
+
+	/* both due at start: plan order */
+	request = modbus_poll_next(&poll, start, &wait_ms);
+	ok = ok && request == &requests[0] && wait_ms == 0;
+	ok = ok && modbus_poll_run(&poll, &master, start) == 33 && requests[0].due_ms == start + 100 &&
+			requests[3].due_ms == start + 1000 && tags[0].result == MODBUS_ERROR_FRAME_INVALID;
+	ok = ok && modbus_poll_next(&poll, start + 32, &wait_ms) == NULL && wait_ms == 1;
+
+	/* late: earliest deadline first, missed periods are skipped */
+	request = modbus_poll_next(&poll, start + 250, NULL);
+	ok = ok && request == &requests[1];
+	modbus_poll_execute(&poll, &master, request, start + 250);
+	ok = ok && requests[1].due_ms == start + 350 && modbus_poll_next(&poll, start + 250, NULL) == &requests[2];
+	return ok && modbus_poll_run(&poll, &master, start + 250) == 100;
+}
+
+int main(void)
+{
+	modbus_master_t master;
+	modbus_tcp_server_t server;
+	modbus_register_range_t range;
+	pthread_t thread;
+	uint16_t registers[MODBUS_MAX_REGISTERS];
+	uint16_t values[3] = { 0x1111, 0x2222, 0x3333 };
+	uint8_t bits[4];
+	int fds[2];
+	bool ok;
+
+	printf("Modbus master test\n");
+	for (int i = 0; i < 200; i++) {
+		holding[i] = 3 * i;
+		inputs[i] = 1000 + i;
+	}
+	coils[0] = 0xa5;
+	modbus_slave_ctx_init(&ctx, SLAVE_ADDRESS, slave_callback, slave_transmit, NULL);
+	modbus_register_map_init(&map, ranges, 4);
+	range = (modbus_register_range_t){ .table = MODBUS_TABLE_HOLDING_REGISTERS, .start = 0, .count = 200,
+			.data = holding, .access = MODBUS_ACCESS_READ_WRITE };
+	modbus_register_map_add(&map, &range);
+	range = (modbus_register_range_t){ .table = MODBUS_TABLE_INPUT_REGISTERS, .start = 0, .count = 200,
+			.data = inputs, .access = MODBUS_ACCESS_READ };
+	modbus_register_map_add(&map, &range);
+	range = (modbus_register_range_t){ .table = MODBUS_TABLE_COILS, .start = 0, .count = 256,
+			.data = coils, .access = MODBUS_ACCESS_READ_WRITE };
+	modbus_register_map_add(&map, &range);
+	modbus_slave_ctx_set_register_map(&ctx, &map);
+
+	/* RTU: datagram socketpair keeps frame boundaries, like t3.5 framing */
+	socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+	slave_fd = fds[1];
+	pthread_create(&thread, NULL, slave_thread, NULL);
+	modbus_master_init(&master, MODBUS_MASTER_RTU, rtu_transfer, (void *)(intptr_t)fds[0]);
+
+	ok = modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 5, MODBUS_MAX_REGISTERS,
+			registers) == MODBUS_OK;
+	for (int i = 0; i < MODBUS_MAX_REGISTERS; i++) {
+		ok = ok && registers[i] == 3 * (5 + i);
+	}
+	ok = ok && modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_READ_INPUT_REGISTERS, 7, 1, registers) == MODBUS_OK &&
+			registers[0] == 1007;
+	check("RTU read registers", ok);
+	check("RTU read coils", modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_READ_COILS, 1, 7, bits) == MODBUS_OK &&
+			bits[0] == 0x52);
+
+	ok = modbus_master_write_register(&master, SLAVE_ADDRESS, 10, 0xbeef) == MODBUS_OK && holding[10] == 0xbeef;
+	ok = ok && modbus_master_write_registers(&master, SLAVE_ADDRESS, 20, 3, values) == MODBUS_OK &&
+			holding[20] == 0x1111 && holding[22] == 0x3333;
+	ok = ok && modbus_master_write_coil(&master, SLAVE_ADDRESS, 1, 1) == MODBUS_OK && coils[0] == 0xa7;
+	check("RTU writes", ok);
+
+	check("RTU exception", modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 199, 2,
+			registers) == MODBUS_ERROR_EXCEPTION && master.exception == MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+	check("RTU timeout", modbus_master_read(&master, SLAVE_ADDRESS + 1, MODBUS_READ_HOLDING_REGISTERS, 0, 1,
+			registers) == MODBUS_ERROR_TIMEOUT && master.stats.timeouts == 1);
+	check("RTU broadcast", modbus_master_write_register(&master, MODBUS_BROADCAST_ADDR, 11, 0x1234) == MODBUS_OK &&
+			holding[11] == 0x1234);
+	check("invalid requests", modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 0,
+			MODBUS_MAX_REGISTERS + 1, registers) == MODBUS_ERROR &&
+			modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_WRITE_SINGLE_COIL, 0, 1, registers) == MODBUS_ERROR &&
+			modbus_master_read(&master, MODBUS_BROADCAST_ADDR, MODBUS_READ_COILS, 0, 1, bits) == MODBUS_ERROR);
+	check("invalid replies", test_invalid_replies());
+	check("transaction timeout", test_transaction_timeout());
+	test_decode();
+
+	check("plan merges tags", test_plan());
+	check("plan bit limits", test_bit_limits());
+	check("schedule", test_schedule());
+
+	/* scheduler through the slave: one frame per planned request */
+	{
+		static uint16_t a[2], b[3], c[1], d[2];
+		static uint8_t e[1];
+		modbus_poll_tag_t tags[] = {
+			{ .slave = SLAVE_ADDRESS, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 100, .width = 2,
+					.period_ms = 100, .value = a },
+			{ .slave = SLAVE_ADDRESS, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 105, .width = 3,
+					.period_ms = 100, .value = b },
+			{ .slave = SLAVE_ADDRESS, .table = MODBUS_TABLE_HOLDING_REGISTERS, .address = 103, .width = 1,
+					.period_ms = 100, .value = c },
+			{ .slave = SLAVE_ADDRESS, .table = MODBUS_TABLE_INPUT_REGISTERS, .address = 50, .width = 2,
+					.period_ms = 100, .value = d },
+			{ .slave = SLAVE_ADDRESS, .table = MODBUS_TABLE_COILS, .address = 2, .width = 5,
+					.period_ms = 100, .value = e },
+		};
+		modbus_poll_request_t requests[4];
+		modbus_poll_t poll;
+		int before = slave_requests;
+
+		modbus_poll_init(&poll, tags, 5, requests, 4, 8);
+		ok = modbus_poll_plan(&poll, 0) == MODBUS_OK && poll.request_count == 3;
+		modbus_poll_run(&poll, &master, 100);
+		ok = ok && slave_requests - before == 3 && a[0] == 300 && a[1] == 303 && c[0] == 309 && b[0] == 315 &&
+				b[2] == 321 && d[1] == 1051 && e[0] == 0x09;
+		ok = ok && tags[0].result == MODBUS_OK && tags[0].updated_ms == 100;
+		check("poll through slave", ok);
+	}
+	shutdown(fds[0], SHUT_RDWR);
+	pthread_join(thread, NULL);
+	close(fds[0]);
+	close(fds[1]);
+
+	/* TCP: same slave behind the TCP server */
+	if (modbus_tcp_server_init(&server, &ctx, "127.0.0.1", 0, 4) == MODBUS_OK) {
+		struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(modbus_tcp_server_port(&server)) };
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+		pthread_create(&thread, NULL, server_thread, &server);
+		inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+		ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+		modbus_master_init(&master, MODBUS_MASTER_TCP, tcp_transfer, (void *)(intptr_t)fd);
+		ok = ok && modbus_master_read(&master, SLAVE_ADDRESS, MODBUS_READ_HOLDING_REGISTERS, 1, 2, registers) ==
+				MODBUS_OK && registers[0] == 3 && registers[1] == 6;
+		ok = ok && modbus_master_write_registers(&master, SLAVE_ADDRESS, 30, 2, values) == MODBUS_OK &&
+				holding[31] == 0x2222 && master.transaction_id == 2;
+		check("TCP read / write", ok);
+		modbus_tcp_server_stop(&server);
+		pthread_join(thread, NULL);
+		close(fd);
+		modbus_tcp_server_close(&server);
+	} else {
+		check("TCP read / write", false);
+	}
+
+	return test_summary();
+}
@@ -0,0 +1,146 @@
+/*
+ * Deferred completion: callback returns MODBUS_PENDING, reply is sent by
+ * modbus_slave_ctx_complete(); acknowledge and busy modes
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus.h"
+#include "test_util.h"
+
+#define SLOW_ADDRESS 100 /* input registers 100.. are "slow sensors" */
+
+static modbus_slave_ctx_t ctx;
+static modbus_pending_t pool[2];
+
+/* parked transactions, in order */
+static modbus_transaction_t *parked[16];
+static int parked_count;
+static uint16_t written;
+
+static uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static int reply_len;
+
+static int8_t pending_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	if (transaction->register_address >= SLOW_ADDRESS) {
+		parked[parked_count++] = transaction;
+		return MODBUS_PENDING;
+	}
+	switch (transaction->function_code) {
+	case MODBUS_READ_INPUT_REGISTERS:
+		for (int i = 0; i < transaction->register_count; i++) {
+			transaction->input_registers[i] = i;
+		}
+		return MODBUS_OK;
+	case MODBUS_READ_HOLDING_REGISTERS:
+	case MODBUS_WRITE_SINGLE_REGISTER:
+		return MODBUS_OK;
+	default:
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+}
+
+static int8_t pending_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	memcpy(reply, buffer, data_len);
+	reply_len = data_len;
+	return MODBUS_OK;
+}
+
+static void request(const uint8_t *pdu, int pdu_len)
+{
+	reply_len = 0;
+	test_request(&ctx, ctx.address, pdu, pdu_len, false);
+}
+
+static bool reply_exception(uint8_t function_code, uint8_t exception)
+{
+	return reply_len == 5 && reply[1] == (MODBUS_ERROR_FLAG | function_code) && reply[2] == exception &&
+			modbus_crc16_update(MODBUS_CRC16_INIT, reply, reply_len) == 0;
+}
+
+int main(void)
+{
+	modbus_transaction_t *t;
+	uint8_t tcp_reply[MODBUS_MAX_RTU_FRAME_SIZE];
+	uint16_t tcp_reply_len;
+
+	printf("Deferred completion test\n");
+	modbus_slave_ctx_init(&ctx, 7, pending_callback, pending_transmit, NULL);
+
+	/* without pool, pending requests can't be parked */
+	request((const uint8_t[]){ 0x04, 0x00, SLOW_ADDRESS, 0x00, 0x02 }, 5);
+	check("pending without pool is busy", reply_exception(0x04, MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY));
+
+	modbus_slave_ctx_set_pending_pool(&ctx, pool, 2, MODBUS_PENDING_FLAG_NONE);
+	parked_count = 0;
+	request((const uint8_t[]){ 0x04, 0x00, SLOW_ADDRESS, 0x00, 0x02 }, 5);
+	check("pending request not answered", reply_len == 0 && parked_count == 1 && ctx.pending_count == 1);
+
+	/* bus keeps being served meanwhile */
+	request((const uint8_t[]){ 0x04, 0x00, 0x00, 0x00, 0x03 }, 5);
+	check("other requests served while pending", reply_len == 11 && reply[2] == 6 && reply[8] == 0x02);
+
+	request((const uint8_t[]){ 0x06, 0x00, SLOW_ADDRESS + 1, 0xAB, 0xCD }, 5);
+	check("second pending request", reply_len == 0 && parked_count == 2 && ctx.pending_count == 2);
+
+	request((const uint8_t[]){ 0x04, 0x00, SLOW_ADDRESS + 2, 0x00, 0x01 }, 5);
+	check("pool full", reply_exception(0x04, MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY) && ctx.pending_count == 2);
+
+	/* completed out of order */
+	t = parked[1];
+	written = t->holding_registers[0];
+	check("complete write", modbus_slave_ctx_complete(&ctx, t, MODBUS_OK) == MODBUS_OK && reply_len == 8 &&
+			reply[1] == 0x06 && reply[3] == SLOW_ADDRESS + 1 && reply[4] == 0xAB && written == 0xABCD &&
+			modbus_crc16_update(MODBUS_CRC16_INIT, reply, reply_len) == 0);
+	check("completing twice fails", modbus_slave_ctx_complete(&ctx, t, MODBUS_OK) == MODBUS_ERROR);
+
+	t = parked[0];
+	t->input_registers[0] = 0x1234;
+	t->input_registers[1] = 0x5678;
+	reply_len = 0;
+	check("complete read", modbus_slave_ctx_complete(&ctx, t, MODBUS_OK) == MODBUS_OK && reply_len == 9 &&
+			reply[1] == 0x04 && reply[2] == 4 && reply[3] == 0x12 && reply[6] == 0x78 && ctx.pending_count == 0 &&
+			modbus_crc16_update(MODBUS_CRC16_INIT, reply, reply_len) == 0);
+
+	request((const uint8_t[]){ 0x04, 0x00, SLOW_ADDRESS, 0x00, 0x01 }, 5);
+	modbus_slave_ctx_complete(&ctx, parked[parked_count - 1], MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED);
+	check("complete with error", reply_exception(0x04, MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS));
+
+	/* only single-step functions can be deferred */
+	request((const uint8_t[]){ 0x16, 0x00, SLOW_ADDRESS, 0xFF, 0x00, 0x00, 0x01 }, 7);
+	check("mask write can't be deferred", reply_exception(0x16, MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY) &&
+			ctx.pending_count == 0);
+
+	/* transport-independent completion */
+	request((const uint8_t[]){ 0x04, 0x00, SLOW_ADDRESS, 0x00, 0x01 }, 5);
+	t = parked[parked_count - 1];
+	t->input_registers[0] = 0x0042;
+	check("complete request", modbus_slave_ctx_complete_request(&ctx, t, MODBUS_OK, tcp_reply, &tcp_reply_len) == MODBUS_OK &&
+			tcp_reply_len == 5 && tcp_reply[0] == 7 && tcp_reply[4] == 0x42);
+
+	/* acknowledge mode: exception 05 right away, no reply on completion */
+	modbus_slave_ctx_set_pending_pool(&ctx, pool, 2, MODBUS_PENDING_FLAG_ACKNOWLEDGE);
+	request((const uint8_t[]){ 0x06, 0x00, SLOW_ADDRESS, 0x00, 0x01 }, 5);
+	check("acknowledge", reply_exception(0x06, MODBUS_EXCEPTION_ACKNOWLEDGE) && ctx.pending_count == 1);
+	reply_len = 0;
+	check("acknowledged request completed silently",
+			modbus_slave_ctx_complete(&ctx, parked[parked_count - 1], MODBUS_OK) == MODBUS_OK && reply_len == 0 &&
+			ctx.pending_count == 0);
+
+	/* busy mode: nothing else is served while a request is pending */
+	modbus_slave_ctx_set_pending_pool(&ctx, pool, 2, MODBUS_PENDING_FLAG_BUSY);
+	request((const uint8_t[]){ 0x04, 0x00, SLOW_ADDRESS, 0x00, 0x01 }, 5);
+	t = parked[parked_count - 1];
+	request((const uint8_t[]){ 0x03, 0x00, 0x00, 0x00, 0x01 }, 5);
+	check("busy while pending", reply_exception(0x03, MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY));
+	modbus_slave_ctx_complete(&ctx, t, MODBUS_OK);
+	request((const uint8_t[]){ 0x03, 0x00, 0x00, 0x00, 0x01 }, 5);
+	check("served after completion", reply_len == 7 && reply[1] == 0x03);
+
+	return test_summary();
+}
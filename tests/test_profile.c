@@ -0,0 +1,129 @@
+/*
+ * Footprint profile build (MODBUS_PROFILE_TINY): request limits follow the frame size,
+ * left-out function codes are answered with exception 01
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus.h"
+#include "test_util.h"
+
+#if MODBUS_PROFILE != MODBUS_PROFILE_TINY
+#error "build with -DMODBUS_PROFILE=MODBUS_PROFILE_TINY"
+#endif
+
+static modbus_slave_ctx_t ctx;
+static uint16_t registers[64];
+
+static uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static int reply_len;
+
+static int8_t profile_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	if (transaction->register_address + transaction->register_count > 64) {
+		return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+	}
+	switch (transaction->function_code) {
+	case MODBUS_READ_HOLDING_REGISTERS:
+		memcpy(transaction->holding_registers, registers + transaction->register_address,
+				transaction->register_count * sizeof(uint16_t));
+		return MODBUS_OK;
+	case MODBUS_WRITE_SINGLE_REGISTER:
+	case MODBUS_WRITE_MULTIPLE_REGISTERS:
+		memcpy(registers + transaction->register_address, transaction->holding_registers,
+				transaction->register_count * sizeof(uint16_t));
+		return MODBUS_OK;
+	default:
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+}
+
+static int8_t profile_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	memcpy(reply, buffer, data_len);
+	reply_len = data_len;
+	return MODBUS_OK;
+}
+
+/* global API is not used here */
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+static void request(const uint8_t *pdu, int pdu_len)
+{
+	reply_len = 0;
+	test_request(&ctx, ctx.address, pdu, pdu_len, false);
+}
+
+static bool reply_exception(uint8_t function_code, uint8_t exception)
+{
+	return reply_len == 5 && reply[1] == (MODBUS_ERROR_FLAG | function_code) && reply[2] == exception;
+}
+
+int main(void)
+{
+	bool ok;
+
+	printf("Tiny profile test\n");
+	for (int i = 0; i < 64; i++) {
+		registers[i] = 0x100 + i;
+	}
+	modbus_slave_ctx_init(&ctx, 9, profile_callback, profile_transmit, NULL);
+
+	check("limits follow frame size", MODBUS_MAX_RTU_FRAME_SIZE == 64 && MODBUS_MAX_REGISTERS == 29 &&
+			sizeof(modbus_transaction_t) < 128 && sizeof(ctx.buffer) == 64);
+	check("CRC engine", modbus_crc16_selftest() == MODBUS_OK);
+
+	/* largest read (fills all but one byte of the frame) */
+	request((const uint8_t[]){ 0x03, 0x00, 0x01, 0x00, MODBUS_MAX_REGISTERS }, 5);
+	ok = reply_len == 5 + 2 * MODBUS_MAX_REGISTERS && reply[2] == 2 * MODBUS_MAX_REGISTERS;
+	for (int i = 0; ok && i < MODBUS_MAX_REGISTERS; i++) {
+		ok = ((reply[3 + 2 * i] << 8) | reply[4 + 2 * i]) == 0x101 + i;
+	}
+	check("read of MODBUS_MAX_REGISTERS", ok);
+	request((const uint8_t[]){ 0x03, 0x00, 0x01, 0x00, MODBUS_MAX_REGISTERS + 1 }, 5);
+	check("larger read refused", reply_exception(0x03, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE));
+
+	request((const uint8_t[]){ 0x10, 0x00, 0x02, 0x00, 0x02, 0x04, 0xAA, 0xBB, 0xCC, 0xDD }, 10);
+	check("write multiple registers", reply_len == 8 && registers[2] == 0xAABB && registers[3] == 0xCCDD);
+	/* 100 registers: refused by request API (TCP), too long a frame for RTU */
+	{
+		uint8_t pdu[6 + 200] = { 0x10, 0x00, 0x00, 0x00, 100, 200 };
+		uint8_t frame[1 + sizeof(pdu) + 2];
+		uint16_t frame_reply_len;
+
+		test_frame(frame, ctx.address, pdu, sizeof(pdu), false);
+		ok = modbus_slave_ctx_process_request(&ctx, frame, 1 + sizeof(pdu), reply, &frame_reply_len,
+				MODBUS_REQUEST_FLAG_NONE) == MODBUS_OK && frame_reply_len == 3 &&
+				reply[1] == (MODBUS_ERROR_FLAG | 0x10) && registers[0] == 0x100;
+		reply_len = 0;
+		ok = ok && modbus_slave_ctx_process_msg(&ctx, frame, sizeof(frame)) == MODBUS_ERROR_FRAME_INVALID &&
+				reply_len == 0 && registers[0] == 0x100;
+	}
+	check("write over transaction size refused", ok && MODBUS_MAX_WRITE_REGISTERS == 30);
+
+	/* function codes left out by the profile */
+	request((const uint8_t[]){ 0x01, 0x00, 0x00, 0x00, 0x08 }, 5);
+	ok = reply_exception(0x01, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+	request((const uint8_t[]){ 0x16, 0x00, 0x04, 0x00, 0xF2, 0x00, 0x25 }, 7);
+	ok = ok && reply_exception(0x16, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+	request((const uint8_t[]){ 0x2B, 0x0E, 0x01, 0x00 }, 4);
+	ok = ok && reply_exception(0x2B, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+	check("left-out functions", ok);
+	check("no runtime handlers", modbus_slave_ctx_register_function(&ctx, 0x41, NULL) == MODBUS_ERROR_OUT_OF_BOUNDS);
+
+	return test_summary();
+}
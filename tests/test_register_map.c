@@ -0,0 +1,229 @@
+/*
+ * Register map test: requests served from memory-backed ranges,
+ * unmapped addresses fall back to the callback
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus.h"
+#include "modbus_register_map.h"
+#include "test_util.h"
+
+static modbus_slave_ctx_t ctx;
+static modbus_register_map_t map;
+static modbus_register_range_t ranges[8];
+
+static uint16_t setpoints[100]; /* holding 0..99 */
+static uint16_t limits[10]; /* holding 200..209, read only */
+static uint16_t measurements[50]; /* input 0..49 */
+static uint8_t outputs[MODBUS_BITS_TO_BYTES(3000)]; /* coils 1000..3999 */
+static uint8_t inputs[MODBUS_BITS_TO_BYTES(64)]; /* discrete inputs 5..68 */
+
+static int callback_calls;
+static int read_hook_calls;
+static int write_hook_calls;
+
+static uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static int reply_len;
+
+static int8_t map_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	callback_calls++;
+	if (transaction->function_code == MODBUS_READ_HOLDING_REGISTERS) {
+		for (int i = 0; i < transaction->register_count; i++) {
+			transaction->holding_registers[i] = 0xCA00 + i;
+		}
+		return MODBUS_OK;
+	}
+	return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+}
+
+static int8_t map_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	memcpy(reply, buffer, data_len);
+	reply_len = data_len;
+	return MODBUS_OK;
+}
+
+static int8_t refresh_measurements(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction,
+		const modbus_register_range_t *range)
+{
+	(void)ctx;
+	(void)transaction;
+	read_hook_calls++;
+	((uint16_t *)range->data)[0]++;
+	return MODBUS_OK;
+}
+
+static int8_t setpoints_written(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction,
+		const modbus_register_range_t *range)
+{
+	(void)ctx;
+	(void)transaction;
+	(void)range;
+	write_hook_calls++;
+	return MODBUS_OK;
+}
+
+static void request(const uint8_t *pdu, int pdu_len)
+{
+	reply_len = 0;
+	test_request(&ctx, ctx.address, pdu, pdu_len, false);
+}
+
+static uint16_t reply_register(int i)
+{
+	return (reply[3 + 2 * i] << 8) | reply[4 + 2 * i];
+}
+
+int main(void)
+{
+	bool ok;
+
+	printf("Register map test\n");
+	for (int i = 0; i < 100; i++) {
+		setpoints[i] = 1000 + i;
+	}
+	for (int i = 0; i < 10; i++) {
+		limits[i] = 2000 + i;
+	}
+	modbus_slave_ctx_init(&ctx, 5, map_callback, map_transmit, NULL);
+	modbus_register_map_init(&map, ranges, 8);
+
+	/* added out of order on purpose */
+	modbus_register_range_t r_limits = {
+		.table = MODBUS_TABLE_HOLDING_REGISTERS, .start = 200, .count = 10,
+		.data = limits, .access = MODBUS_ACCESS_READ,
+	};
+	modbus_register_range_t r_setpoints = {
+		.table = MODBUS_TABLE_HOLDING_REGISTERS, .start = 0, .count = 100,
+		.data = setpoints, .access = MODBUS_ACCESS_READ_WRITE, .write_hook = setpoints_written,
+	};
+	modbus_register_range_t r_measurements = {
+		.table = MODBUS_TABLE_INPUT_REGISTERS, .start = 0, .count = 50,
+		.data = measurements, .access = MODBUS_ACCESS_READ_WRITE, .read_hook = refresh_measurements,
+	};
+	modbus_register_range_t r_outputs = {
+		.table = MODBUS_TABLE_COILS, .start = 1000, .count = 3000,
+		.data = outputs, .access = MODBUS_ACCESS_READ_WRITE,
+	};
+	modbus_register_range_t r_inputs = {
+		.table = MODBUS_TABLE_DISCRETE_INPUTS, .start = 5, .count = 64,
+		.data = inputs, .access = MODBUS_ACCESS_READ,
+	};
+	modbus_register_range_t r_overlap = {
+		.table = MODBUS_TABLE_HOLDING_REGISTERS, .start = 95, .count = 10,
+		.data = setpoints, .access = MODBUS_ACCESS_READ,
+	};
+	ok = modbus_register_map_add(&map, &r_limits) == MODBUS_OK &&
+			modbus_register_map_add(&map, &r_measurements) == MODBUS_OK &&
+			modbus_register_map_add(&map, &r_setpoints) == MODBUS_OK &&
+			modbus_register_map_add(&map, &r_outputs) == MODBUS_OK &&
+			modbus_register_map_add(&map, &r_inputs) == MODBUS_OK;
+	check("add ranges", ok);
+	check("overlapping range rejected", modbus_register_map_add(&map, &r_overlap) != MODBUS_OK);
+	modbus_slave_ctx_set_register_map(&ctx, &map);
+
+	/* read holding registers 10..19 */
+	request((const uint8_t[]){ 0x03, 0x00, 0x0A, 0x00, 0x0A }, 5);
+	ok = reply_len == 5 + 20 && callback_calls == 0;
+	for (int i = 0; ok && i < 10; i++) {
+		ok = reply_register(i) == 1010 + i;
+	}
+	check("read mapped holding registers", ok);
+
+	/* read the whole range (last register included) */
+	request((const uint8_t[]){ 0x03, 0x00, 0x00, 0x00, 0x64 }, 5);
+	check("read whole range", reply_len == 5 + 200 && reply_register(99) == 1099 && callback_calls == 0);
+
+	/* read input registers: read hook refreshes data first */
+	request((const uint8_t[]){ 0x04, 0x00, 0x00, 0x00, 0x02 }, 5);
+	check("read hook", reply_len == 9 && reply_register(0) == 1 && read_hook_calls == 1);
+
+	/* write single register */
+	request((const uint8_t[]){ 0x06, 0x00, 0x05, 0xBE, 0xEF }, 5);
+	check("write single register", reply_len == 8 && setpoints[5] == 0xBEEF && write_hook_calls == 1);
+
+	/* write multiple registers */
+	request((const uint8_t[]){ 0x10, 0x00, 0x60, 0x00, 0x02, 0x04, 0x12, 0x34, 0x56, 0x78 }, 10);
+	check("write multiple registers", reply_len == 8 && setpoints[96] == 0x1234 && setpoints[97] == 0x5678 &&
+			write_hook_calls == 2);
+
+	/* write to read-only range */
+	request((const uint8_t[]){ 0x06, 0x00, 0xC8, 0x00, 0x01 }, 5);
+	check("write to read-only range", reply_len == 5 && reply[1] == 0x86 &&
+			reply[2] == MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS && limits[0] == 2000);
+
+	/* unmapped address falls back to callback */
+	request((const uint8_t[]){ 0x03, 0x01, 0x00, 0x00, 0x02 }, 5);
+	check("unmapped address uses callback", reply_len == 9 && reply_register(1) == 0xCA01 && callback_calls == 1);
+
+	/* request crossing end of range falls back to callback */
+	request((const uint8_t[]){ 0x03, 0x00, 0x63, 0x00, 0x02 }, 5);
+	check("request crossing range end uses callback", reply_len == 9 && callback_calls == 2);
+
+	/* bit copy against bit-by-bit reference, all offset combinations */
+	{
+		uint8_t src[40], dst[40], ref[40];
+		ok = true;
+		for (int i = 0; i < 40; i++) {
+			src[i] = i * 37 + 11;
+		}
+		for (int src_off = 0; src_off < 16 && ok; src_off++) {
+			for (int dst_off = 0; dst_off < 16 && ok; dst_off++) {
+				for (int count = 0; count <= 200 && ok; count += 7) {
+					memset(dst, 0x5A, sizeof(dst));
+					memset(ref, 0x5A, sizeof(ref));
+					for (int i = 0; i < count; i++) {
+						modbus_bit_set(ref, dst_off + i, modbus_bit_get(src, src_off + i));
+					}
+					modbus_bits_copy(dst, dst_off, src, src_off, count);
+					ok = memcmp(dst, ref, sizeof(dst)) == 0;
+				}
+			}
+		}
+		check("bit copy", ok);
+	}
+
+	/* write 1968 coils at unaligned offset, then read 2000 back */
+	{
+		uint8_t pdu[6 + MODBUS_BITS_TO_BYTES(MODBUS_MAX_WRITE_COILS)] = { 0x0F, 0x04, 0x03, 0x07, 0xB0, 0xF6 };
+		for (int i = 0; i < MODBUS_BITS_TO_BYTES(MODBUS_MAX_WRITE_COILS); i++) {
+			pdu[6 + i] = i * 13 + 1;
+		}
+		/* coils 1027 .. 2994 */
+		request(pdu, sizeof(pdu));
+		ok = reply_len == 8 && reply[1] == 0x0F;
+		for (int i = 0; ok && i < MODBUS_MAX_WRITE_COILS; i++) {
+			ok = modbus_bit_get(outputs, 27 + i) == modbus_bit_get(pdu + 6, i);
+		}
+		ok = ok && modbus_bit_get(outputs, 26) == 0 && modbus_bit_get(outputs, 27 + MODBUS_MAX_WRITE_COILS) == 0;
+		check("write multiple coils", ok);
+
+		/* coils 1020 .. 3019 */
+		request((const uint8_t[]){ 0x01, 0x03, 0xFC, 0x07, 0xD0 }, 5);
+		ok = reply_len == 5 + 250 && reply[2] == 250;
+		for (int i = 0; ok && i < MODBUS_MAX_READ_BITS; i++) {
+			ok = modbus_bit_get(reply + 3, i) == modbus_bit_get(outputs, 20 + i);
+		}
+		check("read 2000 coils", ok && callback_calls == 2);
+	}
+
+	/* write single coil, read discrete inputs */
+	request((const uint8_t[]){ 0x05, 0x03, 0xE8, 0xFF, 0x00 }, 5);
+	check("write single coil", reply_len == 8 && modbus_bit_get(outputs, 0) == 1);
+	inputs[0] = 0xF0;
+	inputs[1] = 0x0F;
+	request((const uint8_t[]){ 0x02, 0x00, 0x07, 0x00, 0x09 }, 5);
+	check("read discrete inputs", reply_len == 7 && reply[2] == 2 && reply[3] == 0xFC && reply[4] == 0x01);
+
+	/* lookup */
+	check("find", modbus_register_map_find(&map, MODBUS_TABLE_HOLDING_REGISTERS, 209, 1) == &map.ranges[map.table_first[MODBUS_TABLE_HOLDING_REGISTERS] + 1] &&
+			modbus_register_map_find(&map, MODBUS_TABLE_HOLDING_REGISTERS, 150, 1) == NULL &&
+			modbus_register_map_find(&map, MODBUS_TABLE_COILS, 0, 1) == NULL);
+
+	return test_summary();
+}
@@ -0,0 +1,118 @@
+/*
+ * RTU framer test: frames fed byte by byte / in chunks with timestamps
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus.h"
+#include "modbus_rtu_framer.h"
+
+/* read holding registers 40601, 2 registers */
+static const uint8_t request[] = { 0x01, 0x03, 0x02, 0x58, 0x00, 0x02, 0x44, 0x60 };
+static const uint8_t response[] = { 0x01, 0x03, 0x04, 0x03, 0xE8, 0x13, 0x88, 0x77, 0x15 };
+
+static uint8_t tx_frame[MODBUS_MAX_RTU_FRAME_SIZE];
+static int tx_len;
+
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	if (transaction->function_code == MODBUS_READ_HOLDING_REGISTERS && transaction->register_number == 40601) {
+		transaction->holding_registers[0] = 1000;
+		transaction->holding_registers[1] = 5000;
+		return MODBUS_OK;
+	}
+	return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	memcpy(tx_frame, buffer, data_len);
+	tx_len = data_len;
+	return MODBUS_OK;
+}
+
+static bool response_ok(void)
+{
+	bool ok = tx_len == sizeof(response) && memcmp(tx_frame, response, sizeof(response)) == 0;
+	tx_len = 0;
+	return ok;
+}
+
+static int passed_tests = 0;
+static int test_count = 0;
+
+static void check(const char *name, bool result)
+{
+	test_count++;
+	passed_tests += result;
+	printf("Test %-50s %s\n", name, result ? "PASSED" : "FAILED");
+}
+
+int main(void)
+{
+	modbus_rtu_framer_t framer;
+	uint32_t t = 1000000;
+	int8_t result;
+	uint8_t bad_crc[sizeof(request)];
+
+	printf("RTU framer test\n");
+	modbus_slave_set_address(0x01);
+
+	/* timing constants */
+	modbus_rtu_framer_init(&framer, 115200, NULL, NULL);
+	check("fixed t1.5/t3.5 above 19200 Bd", framer.t15_us == 750 && framer.t35_us == 1750);
+	modbus_rtu_framer_init(&framer, 9600, NULL, NULL);
+	check("t1.5/t3.5 at 9600 Bd", framer.t15_us == 1719 && framer.t35_us == 4011);
+
+	/* byte by byte, closed by poll */
+	for (size_t i = 0; i < sizeof(request); i++) {
+		t += framer.char_us;
+		modbus_rtu_framer_feed(&framer, &request[i], 1, t);
+	}
+	result = modbus_rtu_framer_poll(&framer, t + framer.t35_us - 1);
+	check("no frame before t3.5", result == MODBUS_FRAME_INCOMPLETE && tx_len == 0);
+	result = modbus_rtu_framer_poll(&framer, t + framer.t35_us);
+	check("byte by byte, closed after t3.5", result == MODBUS_OK && response_ok());
+
+	/* whole frame as one chunk, closed by start of the next frame */
+	t += 10000;
+	modbus_rtu_framer_feed(&framer, request, sizeof(request), t);
+	t += framer.t35_us + 4 * framer.char_us; /* timestamp of the 4th byte */
+	result = modbus_rtu_framer_feed(&framer, request, 4, t);
+	check("chunk, closed by next frame", result == MODBUS_OK && response_ok());
+	t += 4 * framer.char_us;
+	modbus_rtu_framer_feed(&framer, request + 4, 4, t);
+	result = modbus_rtu_framer_poll(&framer, t + framer.t35_us);
+	check("frame split into two chunks", result == MODBUS_OK && response_ok());
+
+	/* gap longer than t1.5 inside the frame */
+	t += 10000;
+	modbus_rtu_framer_feed(&framer, request, 3, t);
+	t += framer.t15_us + 100 + 5 * framer.char_us; /* silence, then 5 bytes */
+	modbus_rtu_framer_feed(&framer, request + 3, 5, t);
+	result = modbus_rtu_framer_poll(&framer, t + framer.t35_us);
+	check("t1.5 violation discards frame", result == MODBUS_ERROR_FRAME_INVALID && tx_len == 0);
+
+	/* corrupted CRC */
+	memcpy(bad_crc, request, sizeof(request));
+	bad_crc[7] ^= 0x01;
+	t += 10000;
+	modbus_rtu_framer_feed(&framer, bad_crc, sizeof(bad_crc), t);
+	result = modbus_rtu_framer_poll(&framer, t + framer.t35_us);
+	check("CRC mismatch discards frame", result == MODBUS_ERROR_CRC && tx_len == 0);
+
+	/* timestamps wrap around */
+	t = UINT32_MAX - 3 * framer.char_us;
+	for (size_t i = 0; i < sizeof(request); i++) {
+		t += framer.char_us;
+		modbus_rtu_framer_feed(&framer, &request[i], 1, t);
+	}
+	result = modbus_rtu_framer_poll(&framer, modbus_rtu_framer_deadline(&framer));
+	check("timestamp wrap-around", result == MODBUS_OK && response_ok());
+
+	check("statistics", framer.frames_ok == 4 && framer.frames_crc_error == 1 && framer.frames_invalid == 1);
+
+	printf("Passed %d/%d tests\n", passed_tests, test_count);
+	return passed_tests == test_count ? 0 : 1;
+}
@@ -0,0 +1,255 @@
+/*
+ * Serial port backend test over pseudo terminals: framing by silence, split frames,
+ * CRC errors, two ports served from one thread, deferred replies
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <termios.h>
+#include "modbus.h"
+#include "modbus_serial.h"
+#include "test_util.h"
+
+#define PORT_COUNT 2
+
+static modbus_slave_ctx_t ctx[PORT_COUNT];
+static modbus_serial_port_t port[PORT_COUNT];
+static modbus_serial_t serial;
+static modbus_pending_t pending_pool[2];
+static modbus_transaction_t *deferred;
+
+#define DEFERRED_ADDRESS 0x300
+
+/* holding register value is its address plus slave address; DEFERRED_ADDRESS is deferred */
+static int8_t serial_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	if (transaction->function_code != MODBUS_READ_HOLDING_REGISTERS) {
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+	if (transaction->register_address == DEFERRED_ADDRESS && ctx->pending != NULL) {
+		deferred = transaction;
+		return MODBUS_PENDING;
+	}
+	for (int i = 0; i < transaction->register_count; i++) {
+		transaction->holding_registers[i] = transaction->register_address + i + ctx->address;
+	}
+	return MODBUS_OK;
+}
+
+static int8_t serial_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	(void)buffer;
+	(void)data_len;
+	/* not used by serial backend */
+	return MODBUS_ERROR;
+}
+
+/* global API is not used here */
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+static void *serial_thread(void *arg)
+{
+	(void)arg;
+	modbus_serial_run(&serial);
+	return NULL;
+}
+
+/* master side of new pty, slave path in name */
+static int open_pty(char *name, size_t size)
+{
+	struct termios tio;
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0 || ptsname_r(fd, name, size) != 0) {
+		return -1;
+	}
+	tcgetattr(fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(fd, TCSANOW, &tio);
+	return fd;
+}
+
+static int build_request(uint8_t *frame, uint8_t address, uint16_t start, uint16_t count)
+{
+	uint16_t crc;
+
+	frame[0] = address;
+	frame[1] = MODBUS_READ_HOLDING_REGISTERS;
+	frame[2] = start >> 8;
+	frame[3] = start & 0xff;
+	frame[4] = count >> 8;
+	frame[5] = count & 0xff;
+	crc = modbus_CRC16(frame, 6);
+	frame[6] = crc & 0xff;
+	frame[7] = crc >> 8;
+	return 8;
+}
+
+/* reads reply (or nothing, when len is 0) within timeout */
+static int read_reply(int fd, uint8_t *buffer, int len, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int received = 0;
+
+	while (received < len || len == 0) {
+		if (poll(&pfd, 1, timeout_ms) <= 0) {
+			break;
+		}
+		int n = read(fd, buffer + received, MODBUS_MAX_RTU_FRAME_SIZE - received);
+		if (n <= 0) {
+			break;
+		}
+		received += n;
+	}
+	return received;
+}
+
+static bool check_reply(int fd, uint8_t address, uint16_t start, uint16_t count)
+{
+	uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+	int len = 5 + 2 * count;
+	uint16_t crc;
+
+	if (read_reply(fd, reply, len, 1000) != len) {
+		return false;
+	}
+	crc = modbus_CRC16(reply, len - 2);
+	if (reply[0] != address || reply[1] != MODBUS_READ_HOLDING_REGISTERS || reply[2] != 2 * count ||
+			reply[len - 2] != (crc & 0xff) || reply[len - 1] != (crc >> 8)) {
+		return false;
+	}
+	for (int i = 0; i < count; i++) {
+		if (((reply[3 + 2 * i] << 8) | reply[4 + 2 * i]) != start + i + address) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(void)
+{
+	modbus_serial_config_t config = MODBUS_SERIAL_CONFIG_DEFAULT;
+	modbus_serial_port_t rs485_port;
+	uint8_t request[2 * 8];
+	uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+	char name[PORT_COUNT][64];
+	int master[PORT_COUNT];
+	pthread_t thread;
+	bool ok;
+
+	printf("Serial port test\n");
+	check("init", modbus_serial_init(&serial) == MODBUS_OK);
+	config.baudrate = 115200;
+	ok = true;
+	for (int i = 0; i < PORT_COUNT; i++) {
+		master[i] = open_pty(name[i], sizeof(name[i]));
+		modbus_slave_ctx_init(&ctx[i], 10 + i, serial_callback, serial_transmit, NULL);
+		ok = ok && master[i] >= 0 &&
+				modbus_serial_port_open(&serial, &port[i], &ctx[i], name[i], &config) == MODBUS_OK;
+	}
+	check("open ports", ok && serial.port_count == PORT_COUNT);
+	check("t1.5 check disabled", port[0].framer.t15_us == port[0].framer.t35_us);
+
+	/* invalid configuration is refused */
+	config.baudrate = 12345;
+	ok = modbus_serial_port_open(&serial, &rs485_port, &ctx[0], name[0], &config) != MODBUS_OK;
+	config.baudrate = 115200;
+	config.parity = 'X';
+	ok = ok && modbus_serial_port_open(&serial, &rs485_port, &ctx[0], name[0], &config) != MODBUS_OK;
+	config.parity = 'E';
+	/* pseudo terminal has no RS-485 support */
+	config.rs485 = 1;
+	ok = ok && modbus_serial_port_open(&serial, &rs485_port, &ctx[0], name[0], &config) != MODBUS_OK;
+	check("invalid configuration refused", ok && serial.port_count == PORT_COUNT);
+
+	pthread_create(&thread, NULL, serial_thread, NULL);
+
+	if (write(master[0], request, build_request(request, 10, 0x100, 4)) != 8) {
+		/* checked by reply */
+	}
+	check("request answered", check_reply(master[0], 10, 0x100, 4));
+
+	/* frame split into two writes is joined (gap shorter than t3.5) */
+	build_request(request, 10, 0x20, 2);
+	ok = write(master[0], request, 3) == 3;
+	usleep(200);
+	ok = ok && write(master[0], request + 3, 5) == 5;
+	check("split frame joined", ok && check_reply(master[0], 10, 0x20, 2));
+
+	/* bad CRC: no reply, counted by framer */
+	build_request(request, 10, 0, 1);
+	request[7] ^= 0x55;
+	ok = write(master[0], request, 8) == 8;
+	check("bad CRC not answered", ok && read_reply(master[0], reply, 0, 100) == 0 &&
+			port[0].framer.frames_crc_error == 1);
+
+	/* other address: no reply */
+	ok = write(master[0], request, build_request(request, 11, 0, 1)) == 8;
+	check("other address not answered", ok && read_reply(master[0], reply, 0, 100) == 0);
+
+	/* both ports served by one thread */
+	ok = write(master[0], request, build_request(request, 10, 5, 3)) == 8;
+	ok = ok && write(master[1], request + 8, build_request(request + 8, 11, 7, 2)) == 8;
+	check("two ports served", ok && check_reply(master[0], 10, 5, 3) && check_reply(master[1], 11, 7, 2));
+
+	/* two frames separated by t3.5 silence */
+	build_request(request, 11, 1, 1);
+	build_request(request + 8, 11, 2, 1);
+	ok = write(master[1], request, 8) == 8;
+	usleep(20000);
+	ok = ok && write(master[1], request + 8, 8) == 8;
+	check("frames separated by silence", ok && check_reply(master[1], 11, 1, 1) && check_reply(master[1], 11, 2, 1));
+
+	check("statistics", port[0].stats.replies == 3 && port[1].stats.replies == 3 &&
+			port[0].stats.rx_bytes == 5 * 8 && port[0].stats.tx_bytes == 13 + 9 + 11 &&
+			port[0].stats.tx_errors == 0 && port[0].framer.frames_ok == 4);
+	check("turnaround measured", port[0].stats.turnaround_min_us > 0 &&
+			port[0].stats.turnaround_min_us <= port[0].stats.turnaround_max_us &&
+			port[0].stats.turnaround_total_us >= 3 * (uint64_t)port[0].stats.turnaround_min_us);
+	printf("    turnaround min %u us, max %u us, mean %u us\n", port[0].stats.turnaround_min_us,
+			port[0].stats.turnaround_max_us, (uint32_t)(port[0].stats.turnaround_total_us / port[0].stats.replies));
+
+	modbus_serial_stop(&serial);
+	pthread_join(thread, NULL);
+
+	/* deferred request: nothing sent until completion, served from own poll loop */
+	modbus_slave_ctx_set_pending_pool(&ctx[0], pending_pool, 2, MODBUS_PENDING_FLAG_NONE);
+	ok = write(master[0], request, build_request(request, 10, DEFERRED_ADDRESS, 2)) == 8;
+	for (int i = 0; i < 100 && deferred == NULL; i++) {
+		modbus_serial_poll(&serial, 10);
+	}
+	ok = ok && deferred != NULL && read_reply(master[0], reply, 0, 50) == 0;
+	for (int i = 0; ok && i < 2; i++) {
+		deferred->holding_registers[i] = DEFERRED_ADDRESS + i + ctx[0].address;
+	}
+	ok = ok && modbus_serial_port_complete(&port[0], &ctx[0], deferred, MODBUS_OK) == MODBUS_OK;
+	check("deferred reply written on completion", ok && check_reply(master[0], 10, DEFERRED_ADDRESS, 2) &&
+			modbus_serial_port_complete(&port[0], &ctx[0], deferred, MODBUS_OK) == MODBUS_ERROR);
+
+	modbus_serial_close(&serial);
+	check("close", serial.port_count == 0 && port[0].fd == -1 && serial.epoll_fd == -1);
+	for (int i = 0; i < PORT_COUNT; i++) {
+		close(master[i]);
+	}
+
+	return test_summary();
+}
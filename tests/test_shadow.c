@@ -0,0 +1,203 @@
+/*
+ * Shadow register bank: snapshots served while another thread keeps updating the bank,
+ * writers serialized, register map integration
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include "modbus.h"
+#include "modbus_register_map.h"
+#include "modbus_shadow.h"
+#include "test_util.h"
+
+#define BANK_SIZE 200
+#define READS 200000
+#define INCREMENTS 20000
+
+static uint16_t registers[BANK_SIZE];
+static modbus_shadow_bank_t bank;
+
+static modbus_slave_ctx_t ctx;
+static modbus_register_map_t map;
+static modbus_register_range_t ranges[2];
+
+static uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static int reply_len;
+
+static int stop_writer;
+static uint32_t writes;
+
+/* every write sets register i to generation + i */
+static void *writer(void *arg)
+{
+	(void)arg;
+	for (uint16_t generation = 0; !__atomic_load_n(&stop_writer, __ATOMIC_RELAXED); generation++) {
+		modbus_shadow_write_begin(&bank);
+		for (uint16_t i = 0; i < BANK_SIZE; i++) {
+			modbus_shadow_set(&bank, i, generation + i);
+			if (i == BANK_SIZE / 2 && writes % 256 == 0) {
+				/* preempted in the middle of a write */
+				sched_yield();
+			}
+		}
+		modbus_shadow_write_end(&bank);
+		if (++writes % 4 == 0) {
+			/* let the reader run on single-core machines */
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+/* 32-bit counter in registers 0 (high) and 1 (low), read-modify-write under writer lock */
+static void *incrementer(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < INCREMENTS; i++) {
+		modbus_shadow_write_begin(&bank);
+		uint32_t value = ((uint32_t)modbus_shadow_get(&bank, 0) << 16 | modbus_shadow_get(&bank, 1)) + 1;
+		modbus_shadow_set(&bank, 0, value >> 16);
+		modbus_shadow_set(&bank, 1, value & 0xffff);
+		modbus_shadow_write_end(&bank);
+	}
+	return NULL;
+}
+
+static int8_t shadow_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	/* input registers 0.. come from the bank as well */
+	if (transaction->function_code != MODBUS_READ_INPUT_REGISTERS) {
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+	if (modbus_shadow_read(&bank, transaction->register_address, transaction->input_registers,
+				transaction->register_count) != MODBUS_OK) {
+		return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+	}
+	return MODBUS_OK;
+}
+
+static int8_t shadow_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	memcpy(reply, buffer, data_len);
+	reply_len = data_len;
+	return MODBUS_OK;
+}
+
+/* global API is not used here */
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+static void request(const uint8_t *pdu, int pdu_len)
+{
+	reply_len = 0;
+	test_request(&ctx, ctx.address, pdu, pdu_len, false);
+}
+
+static uint16_t reply_register(int i)
+{
+	return (reply[3 + 2 * i] << 8) | reply[4 + 2 * i];
+}
+
+/* reply of count registers, each one more than previous (one generation) */
+static bool reply_consistent(uint8_t function_code, uint16_t count)
+{
+	if (reply_len != 5 + 2 * count || reply[1] != function_code) {
+		return false;
+	}
+	for (int i = 1; i < count; i++) {
+		if (reply_register(i) != (uint16_t)(reply_register(0) + i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(void)
+{
+	uint16_t values[4];
+	pthread_t threads[2];
+	bool ok;
+
+	printf("Shadow register bank test\n");
+	check("init", modbus_shadow_init(&bank, registers, BANK_SIZE) == MODBUS_OK);
+	ok = modbus_shadow_write(&bank, 10, (const uint16_t[]){ 1, 2, 3, 4 }, 4) == MODBUS_OK &&
+			modbus_shadow_read(&bank, 10, values, 4) == MODBUS_OK;
+	check("write and read", ok && values[0] == 1 && values[3] == 4 && bank.sequence == 2);
+	check("out of bounds", modbus_shadow_write(&bank, BANK_SIZE - 1, values, 2) == MODBUS_ERROR_OUT_OF_BOUNDS &&
+			modbus_shadow_read(&bank, BANK_SIZE, values, 1) == MODBUS_ERROR_OUT_OF_BOUNDS);
+
+	modbus_slave_ctx_init(&ctx, 1, shadow_callback, shadow_transmit, NULL);
+	modbus_register_map_init(&map, ranges, 2);
+	modbus_register_range_t holding = {
+		.table = MODBUS_TABLE_HOLDING_REGISTERS, .start = 1000, .count = BANK_SIZE,
+		.access = MODBUS_ACCESS_READ_WRITE, .shadow = &bank,
+	};
+	modbus_register_range_t bits = {
+		.table = MODBUS_TABLE_COILS, .start = 0, .count = 8, .shadow = &bank,
+	};
+	modbus_register_range_t too_long = holding;
+	too_long.start = 0;
+	too_long.count = BANK_SIZE + 1;
+	check("shadow ranges validated", modbus_register_map_add(&map, &bits) == MODBUS_ERROR &&
+			modbus_register_map_add(&map, &too_long) == MODBUS_ERROR &&
+			modbus_register_map_add(&map, &holding) == MODBUS_OK);
+	modbus_slave_ctx_set_register_map(&ctx, &map);
+
+	/* write multiple registers 1010..1011 -> bank 10..11 */
+	request((const uint8_t[]){ 0x10, 0x03, 0xF2, 0x00, 0x02, 0x04, 0x12, 0x34, 0x56, 0x78 }, 10);
+	check("map writes through bank", reply_len == 8 && registers[10] == 0x1234 && registers[11] == 0x5678 &&
+			bank.sequence == 4);
+	request((const uint8_t[]){ 0x03, 0x03, 0xF2, 0x00, 0x02 }, 5);
+	check("map reads from bank", reply_len == 9 && reply_register(0) == 0x1234 && reply_register(1) == 0x5678);
+
+	/* reads through map (zero-copy) and callback while writer keeps updating the whole bank;
+	 * bank holds a consistent generation before the first read, writer may not have run yet */
+	modbus_shadow_write_begin(&bank);
+	for (uint16_t i = 0; i < BANK_SIZE; i++) {
+		modbus_shadow_set(&bank, i, i);
+	}
+	modbus_shadow_write_end(&bank);
+	pthread_create(&threads[0], NULL, writer, NULL);
+	ok = true;
+	for (int i = 0; ok && i < READS; i++) {
+		uint16_t address = i % (BANK_SIZE - MODBUS_MAX_REGISTERS);
+		uint16_t count = 2 + i % (MODBUS_MAX_REGISTERS - 1);
+		if (i % 2) {
+			request((const uint8_t[]){ 0x03, (1000 + address) >> 8, (1000 + address) & 0xff, 0x00, count }, 5);
+			ok = reply_consistent(0x03, count);
+		} else {
+			request((const uint8_t[]){ 0x04, address >> 8, address & 0xff, 0x00, count }, 5);
+			ok = reply_consistent(0x04, count);
+		}
+	}
+	__atomic_store_n(&stop_writer, 1, __ATOMIC_RELAXED);
+	pthread_join(threads[0], NULL);
+	check("snapshots never torn", ok);
+	printf("    %u writes, %u read retries\n", writes, bank.read_retries);
+
+	/* concurrent writers exclude each other */
+	modbus_shadow_write(&bank, 0, (const uint16_t[]){ 0, 0 }, 2);
+	pthread_create(&threads[0], NULL, incrementer, NULL);
+	pthread_create(&threads[1], NULL, incrementer, NULL);
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+	modbus_shadow_read(&bank, 0, values, 2);
+	check("writers serialized", ((uint32_t)values[0] << 16 | values[1]) == 2 * INCREMENTS && !(bank.sequence & 1));
+
+	return test_summary();
+}
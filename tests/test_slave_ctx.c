@@ -0,0 +1,143 @@
+/*
+ * Reentrant slave context test: several contexts served in parallel from
+ * separate threads, each with its own address, registers and transmit function.
+ * Note that this test does not implement modbus_slave_callback() / modbus_transmit_function().
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "modbus.h"
+
+#define PORT_COUNT 4
+#define ITERATIONS 20000
+
+typedef struct {
+	uint16_t registers[MODBUS_MAX_REGISTERS];
+	uint8_t last_reply[MODBUS_MAX_RTU_FRAME_SIZE];
+	uint16_t last_reply_len;
+	int errors;
+} port_t;
+
+static modbus_slave_ctx_t ctx[PORT_COUNT];
+static port_t port[PORT_COUNT];
+
+static int8_t port_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	port_t *p = ctx->user_data;
+
+	if (transaction->function_code != MODBUS_READ_HOLDING_REGISTERS) {
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+	if (transaction->register_address + transaction->register_count > MODBUS_MAX_REGISTERS) {
+		return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+	}
+	for (int i = 0; i < transaction->register_count; i++) {
+		transaction->holding_registers[i] = p->registers[transaction->register_address + i];
+	}
+	return MODBUS_OK;
+}
+
+static int8_t port_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	port_t *p = ctx->user_data;
+
+	memcpy(p->last_reply, buffer, data_len);
+	p->last_reply_len = data_len;
+	return MODBUS_OK;
+}
+
+static int build_request(uint8_t *frame, uint8_t address, uint16_t start, uint16_t count)
+{
+	uint16_t crc;
+
+	frame[0] = address;
+	frame[1] = MODBUS_READ_HOLDING_REGISTERS;
+	frame[2] = start >> 8;
+	frame[3] = start & 0xff;
+	frame[4] = count >> 8;
+	frame[5] = count & 0xff;
+	crc = modbus_CRC16(frame, 6);
+	frame[6] = crc & 0xff;
+	frame[7] = crc >> 8;
+	return 8;
+}
+
+static void *port_thread(void *arg)
+{
+	int n = (int)(intptr_t)arg;
+	uint8_t request[MODBUS_MAX_RTU_FRAME_SIZE];
+	port_t *p = &port[n];
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		uint16_t start = i % 100;
+		uint16_t count = 1 + i % 25;
+		int len = build_request(request, ctx[n].address, start, count);
+		p->last_reply_len = 0;
+		modbus_slave_ctx_process_msg(&ctx[n], request, len);
+		/* reply must come from this port's register bank */
+		if (p->last_reply_len != 5 + 2 * count || p->last_reply[0] != ctx[n].address) {
+			p->errors++;
+			continue;
+		}
+		for (int r = 0; r < count; r++) {
+			uint16_t value = (p->last_reply[3 + 2 * r] << 8) | p->last_reply[4 + 2 * r];
+			if (value != p->registers[start + r]) {
+				p->errors++;
+				break;
+			}
+		}
+		if (modbus_CRC16(p->last_reply, p->last_reply_len) != 0) {
+			p->errors++;
+		}
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t thread[PORT_COUNT];
+	uint8_t request[MODBUS_MAX_RTU_FRAME_SIZE];
+	int passed_tests = 0;
+	int test_count = 0;
+	bool ok;
+	int len;
+
+	printf("Slave context test (%d ports)\n", PORT_COUNT);
+	for (int n = 0; n < PORT_COUNT; n++) {
+		for (int r = 0; r < MODBUS_MAX_REGISTERS; r++) {
+			port[n].registers[r] = (n << 12) | r;
+		}
+		modbus_slave_ctx_init(&ctx[n], 10 + n, port_callback, port_transmit, &port[n]);
+	}
+
+	/* contexts don't share cache lines */
+	ok = ((uintptr_t)&ctx[1] - (uintptr_t)&ctx[0]) % MODBUS_CACHE_LINE_SIZE == 0 &&
+			(uintptr_t)&ctx[0] % MODBUS_CACHE_LINE_SIZE == 0;
+	printf("Test cache line alignment %s\n", ok ? "PASSED" : "FAILED");
+	passed_tests += ok;
+	test_count++;
+
+	/* frame for other context is ignored */
+	len = build_request(request, 11, 0, 1);
+	port[0].last_reply_len = 0;
+	modbus_slave_ctx_process_msg(&ctx[0], request, len);
+	ok = port[0].last_reply_len == 0;
+	printf("Test address filtering per context %s\n", ok ? "PASSED" : "FAILED");
+	passed_tests += ok;
+	test_count++;
+
+	for (int n = 0; n < PORT_COUNT; n++) {
+		pthread_create(&thread[n], NULL, port_thread, (void *)(intptr_t)n);
+	}
+	for (int n = 0; n < PORT_COUNT; n++) {
+		pthread_join(thread[n], NULL);
+		ok = port[n].errors == 0;
+		printf("Test parallel port %d (%d requests) %s\n", n, ITERATIONS, ok ? "PASSED" : "FAILED");
+		passed_tests += ok;
+		test_count++;
+	}
+	printf("Passed %d/%d tests\n", passed_tests, test_count);
+	return passed_tests == test_count ? 0 : 1;
+}
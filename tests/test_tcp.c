@@ -0,0 +1,224 @@
+/*
+ * Modbus TCP server test over loopback: many connections, pipelined requests
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "modbus.h"
+#include "modbus_tcp.h"
+
+#define CLIENT_COUNT 200
+#define PIPELINE_DEPTH 8
+#define BURST_REQUESTS 200
+
+static modbus_slave_ctx_t ctx;
+static modbus_tcp_server_t server;
+static modbus_pending_t pending_pool[2];
+
+#define DEFERRED_ADDRESS 0x300
+
+/* holding register value is its address; DEFERRED_ADDRESS is deferred */
+static int8_t tcp_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	if (transaction->function_code != MODBUS_READ_HOLDING_REGISTERS) {
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+	if (transaction->register_address == DEFERRED_ADDRESS) {
+		return MODBUS_PENDING;
+	}
+	for (int i = 0; i < transaction->register_count; i++) {
+		transaction->holding_registers[i] = transaction->register_address + i;
+	}
+	return MODBUS_OK;
+}
+
+static int8_t tcp_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	(void)buffer;
+	(void)data_len;
+	/* not used by TCP server */
+	return MODBUS_ERROR;
+}
+
+static void *server_thread(void *arg)
+{
+	(void)arg;
+	modbus_tcp_server_run(&server);
+	return NULL;
+}
+
+static int client_connect(uint16_t port)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int build_request(uint8_t *frame, uint16_t tid, uint8_t unit, uint16_t start, uint16_t count)
+{
+	frame[0] = tid >> 8;
+	frame[1] = tid & 0xff;
+	frame[2] = 0;
+	frame[3] = 0;
+	frame[4] = 0;
+	frame[5] = 6;
+	frame[6] = unit;
+	frame[7] = MODBUS_READ_HOLDING_REGISTERS;
+	frame[8] = start >> 8;
+	frame[9] = start & 0xff;
+	frame[10] = count >> 8;
+	frame[11] = count & 0xff;
+	return 12;
+}
+
+static bool read_all(int fd, uint8_t *buffer, int len)
+{
+	int received = 0;
+	while (received < len) {
+		int n = recv(fd, buffer + received, len - received, 0);
+		if (n <= 0) {
+			return false;
+		}
+		received += n;
+	}
+	return true;
+}
+
+static bool check_reply(int fd, uint16_t tid, uint8_t unit, uint16_t start, uint16_t count)
+{
+	uint8_t reply[MODBUS_TCP_MAX_ADU_SIZE];
+	int len = 9 + 2 * count;
+
+	if (!read_all(fd, reply, len)) {
+		return false;
+	}
+	if (((reply[0] << 8) | reply[1]) != tid || reply[2] != 0 || reply[3] != 0 ||
+			((reply[4] << 8) | reply[5]) != 3 + 2 * count || reply[6] != unit ||
+			reply[7] != MODBUS_READ_HOLDING_REGISTERS || reply[8] != 2 * count) {
+		return false;
+	}
+	for (int i = 0; i < count; i++) {
+		if (((reply[9 + 2 * i] << 8) | reply[10 + 2 * i]) != start + i) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int passed_tests = 0;
+static int test_count = 0;
+
+static void check(const char *name, bool result)
+{
+	test_count++;
+	passed_tests += result;
+	printf("Test %-50s %s\n", name, result ? "PASSED" : "FAILED");
+}
+
+int main(void)
+{
+	static int fd[CLIENT_COUNT];
+	static uint8_t request[BURST_REQUESTS * 12];
+	pthread_t thread;
+	uint16_t port;
+	bool ok;
+	int len;
+
+	printf("Modbus TCP server test\n");
+	modbus_slave_ctx_init(&ctx, 1, tcp_callback, tcp_transmit, NULL);
+	modbus_slave_ctx_set_pending_pool(&ctx, pending_pool, 2, MODBUS_PENDING_FLAG_NONE);
+	if (modbus_tcp_server_init(&server, &ctx, "127.0.0.1", 0, CLIENT_COUNT + 1) != MODBUS_OK) {
+		printf("Server init FAILED\n");
+		return 1;
+	}
+	port = modbus_tcp_server_port(&server);
+	pthread_create(&thread, NULL, server_thread, NULL);
+
+	/* many connections, pipelined requests */
+	ok = true;
+	for (int c = 0; c < CLIENT_COUNT; c++) {
+		fd[c] = client_connect(port);
+		ok &= fd[c] >= 0;
+	}
+	check("connect clients", ok);
+	for (int c = 0; c < CLIENT_COUNT; c++) {
+		len = 0;
+		for (int r = 0; r < PIPELINE_DEPTH; r++) {
+			len += build_request(request + len, c * 100 + r, 0xFF, c + r, 1 + (c + r) % MODBUS_MAX_REGISTERS);
+		}
+		send(fd[c], request, len, 0);
+	}
+	ok = true;
+	for (int c = 0; c < CLIENT_COUNT; c++) {
+		for (int r = 0; r < PIPELINE_DEPTH; r++) {
+			ok &= check_reply(fd[c], c * 100 + r, 0xFF, c + r, 1 + (c + r) % MODBUS_MAX_REGISTERS);
+		}
+	}
+	check("pipelined requests on all connections", ok);
+
+	/* burst larger than TX buffer: replies must come in order, none lost */
+	len = 0;
+	for (int r = 0; r < BURST_REQUESTS; r++) {
+		len += build_request(request + len, r, 7, r, MODBUS_MAX_REGISTERS);
+	}
+	send(fd[0], request, len, 0);
+	ok = true;
+	for (int r = 0; r < BURST_REQUESTS; r++) {
+		ok &= check_reply(fd[0], r, 7, r, MODBUS_MAX_REGISTERS);
+	}
+	check("burst with backpressure", ok);
+
+	/* request split across several segments */
+	len = build_request(request, 0x1234, 1, 10, 3);
+	for (int i = 0; i < len; i++) {
+		send(fd[1], request + i, 1, 0);
+		usleep(100);
+	}
+	check("request split into single bytes", check_reply(fd[1], 0x1234, 1, 10, 3));
+
+	/* wrong protocol id closes connection */
+	len = build_request(request, 1, 1, 0, 1);
+	request[3] = 1;
+	send(fd[2], request, len, 0);
+	check("invalid MBAP header closes connection", recv(fd[2], request, 1, 0) == 0);
+
+	/* exception reply */
+	len = build_request(request, 2, 1, 0, 1);
+	request[7] = MODBUS_WRITE_MULTIPLE_COILS + 50;
+	send(fd[3], request, len, 0);
+	ok = read_all(fd[3], request, 9) && request[5] == 3 && request[7] == (MODBUS_ERROR_FLAG | 65) &&
+			request[8] == MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+	check("exception reply", ok);
+
+	/* reply of a parked request could not be routed back: busy instead */
+	len = build_request(request, 3, 1, DEFERRED_ADDRESS, 1);
+	send(fd[3], request, len, 0);
+	ok = read_all(fd[3], request, 9) && request[1] == 3 && request[7] == (MODBUS_ERROR_FLAG |
+			MODBUS_READ_HOLDING_REGISTERS) && request[8] == MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY;
+	check("deferred request answered busy", ok && ctx.pending_count == 0);
+
+	for (int c = 0; c < CLIENT_COUNT; c++) {
+		close(fd[c]);
+	}
+	modbus_tcp_server_stop(&server);
+	pthread_join(thread, NULL);
+	check("statistics", server.stats.connections_accepted == CLIENT_COUNT && server.stats.protocol_errors == 1 &&
+			server.stats.replies == CLIENT_COUNT * PIPELINE_DEPTH + BURST_REQUESTS + 3);
+	modbus_tcp_server_close(&server);
+
+	printf("Passed %d/%d tests\n", passed_tests, test_count);
+	return passed_tests == test_count ? 0 : 1;
+}
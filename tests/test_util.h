@@ -0,0 +1,56 @@
+/*
+ * test_util.h
+ *
+ *  Helpers shared by test programs: result lines / summary and RTU request frames
+ */
+
+#ifndef TESTS_TEST_UTIL_H_
+#define TESTS_TEST_UTIL_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus.h"
+
+static int passed_tests = 0;
+static int test_count = 0;
+
+static void check(const char *name, bool result)
+{
+	test_count++;
+	passed_tests += result;
+	printf("Test %-50s %s\n", name, result ? "PASSED" : "FAILED");
+}
+
+/* prints summary; returns exit code of the test program */
+static int test_summary(void)
+{
+	printf("Passed %d/%d tests\n", passed_tests, test_count);
+	return passed_tests == test_count ? 0 : 1;
+}
+
+/* frame helpers are inline, so tests built without the slave library don't get unused copies
+ * referring to it */
+
+/* RTU frame: address, PDU and CRC (broken if bad_crc is set); returns frame length */
+static inline int test_frame(uint8_t *frame, uint8_t address, const uint8_t *pdu, int pdu_len, bool bad_crc)
+{
+	uint16_t crc;
+
+	frame[0] = address;
+	memcpy(frame + 1, pdu, pdu_len);
+	crc = modbus_CRC16(frame, pdu_len + 1) ^ (bad_crc ? 0x0101 : 0);
+	frame[pdu_len + 1] = crc & 0xff;
+	frame[pdu_len + 2] = crc >> 8;
+	return pdu_len + 3;
+}
+
+/* passes PDU for address to ctx as RTU frame (modbus_slave_ctx_process_msg()) */
+static inline int8_t test_request(modbus_slave_ctx_t *ctx, uint8_t address, const uint8_t *pdu, int pdu_len, bool bad_crc)
+{
+	uint8_t frame[MODBUS_MAX_RTU_FRAME_SIZE];
+
+	return modbus_slave_ctx_process_msg(ctx, frame, test_frame(frame, address, pdu, pdu_len, bad_crc));
+}
+
+#endif /* TESTS_TEST_UTIL_H_ */
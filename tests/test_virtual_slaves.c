@@ -0,0 +1,184 @@
+/*
+ * Virtual slaves: per-address register maps, device ids and callbacks behind one port,
+ * broadcasts, address check before CRC, Modbus TCP style processing, full address range
+ *
+ * Linked with -Wl,--wrap=modbus_CRC16 to count CRC computations of the library.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus.h"
+#include "modbus_register_map.h"
+#include "test_util.h"
+
+#define SLAVES 3
+
+static modbus_slave_ctx_t port;
+static modbus_slave_ctx_t slaves[SLAVES];
+static modbus_slave_ctx_t all_slaves[247];
+static modbus_slave_table_t table;
+static modbus_register_map_t maps[SLAVES];
+static modbus_register_range_t ranges[SLAVES][1];
+static uint16_t registers[SLAVES][4];
+static modbus_device_id_t device_ids[SLAVES];
+static const uint8_t addresses[SLAVES] = { 10, 11, 200 };
+
+static uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static int reply_len;
+static int callbacks[SLAVES];
+
+/* index of the virtual slave in user_data */
+static int8_t slave_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	callbacks[(intptr_t)ctx->user_data]++;
+	return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+}
+
+static int8_t port_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	memcpy(reply, buffer, data_len);
+	reply_len = data_len;
+	return MODBUS_OK;
+}
+
+/* global API is not used here */
+int8_t modbus_slave_callback(modbus_transaction_t *transaction)
+{
+	(void)transaction;
+	return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+}
+
+int8_t modbus_transmit_function(uint8_t *buffer, uint16_t data_len)
+{
+	(void)buffer;
+	(void)data_len;
+	return MODBUS_OK;
+}
+
+static int crc_calls;
+
+uint16_t __real_modbus_CRC16(const uint8_t *buf, int len);
+
+uint16_t __wrap_modbus_CRC16(const uint8_t *buf, int len)
+{
+	crc_calls++;
+	return __real_modbus_CRC16(buf, len);
+}
+
+/* sends request to port; returns processing result, crc_calls counts CRCs computed on the way */
+static int8_t request(uint8_t address, const uint8_t *pdu, int pdu_len, bool bad_crc)
+{
+	uint8_t frame[MODBUS_MAX_RTU_FRAME_SIZE];
+	int len = test_frame(frame, address, pdu, pdu_len, bad_crc);
+
+	reply_len = 0;
+	crc_calls = 0;
+	return modbus_slave_ctx_process_msg(&port, frame, len);
+}
+
+static bool read_reply(uint8_t address, uint16_t value)
+{
+	return reply_len == 7 && reply[0] == address && reply[1] == MODBUS_READ_HOLDING_REGISTERS &&
+			reply[3] == (value >> 8) && reply[4] == (value & 0xff);
+}
+
+int main(void)
+{
+	const uint8_t read[] = { MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x01, 0x00, 0x01 };
+	const uint8_t unmapped[] = { MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x10, 0x00, 0x01 };
+	const uint8_t write[] = { MODBUS_WRITE_SINGLE_REGISTER, 0x00, 0x02, 0xab, 0xcd };
+	const uint8_t device_id[] = { MODBUS_READ_DEVICE_IDENTIFICATION, 0x0e, 0x01, 0x00 };
+	static char vendors[SLAVES][8] = { "Meter A", "Meter B", "Drive" };
+	uint8_t tcp_request[6] = { 11, MODBUS_READ_HOLDING_REGISTERS, 0x00, 0x01, 0x00, 0x01 };
+	uint16_t tcp_reply_len;
+	bool ok;
+
+	printf("Virtual slaves test\n");
+	modbus_slave_ctx_init(&port, 1, slave_callback, port_transmit, NULL);
+	modbus_slave_table_init(&table);
+	for (int i = 0; i < SLAVES; i++) {
+		modbus_register_range_t range = {
+			.table = MODBUS_TABLE_HOLDING_REGISTERS, .start = 0, .count = 4,
+			.data = registers[i], .access = MODBUS_ACCESS_READ_WRITE,
+		};
+		registers[i][1] = 0x100 * (i + 1);
+		modbus_slave_ctx_init(&slaves[i], addresses[i], slave_callback, port_transmit, (void *)(intptr_t)i);
+		modbus_register_map_init(&maps[i], ranges[i], 1);
+		modbus_register_map_add(&maps[i], &range);
+		modbus_slave_ctx_set_register_map(&slaves[i], &maps[i]);
+		device_ids[i].object_name.VendorName = vendors[i];
+		device_ids[i].object_name.ProductCode = (char *)"VS";
+		device_ids[i].object_name.MajorMinorRevision = (char *)"1.0";
+		modbus_slave_ctx_init_device_id(&slaves[i], &device_ids[i]);
+	}
+
+	ok = true;
+	for (int i = 0; i < SLAVES; i++) {
+		ok = ok && modbus_slave_table_add(&table, &slaves[i]) == MODBUS_OK;
+	}
+	check("add slaves", ok && table.count == SLAVES && modbus_slave_table_add(&table, &slaves[0]) == MODBUS_ERROR);
+	modbus_slave_ctx_set_slave_table(&port, &table);
+
+	/* each address served from its own register map */
+	ok = true;
+	for (int i = 0; i < SLAVES; i++) {
+		ok = ok && request(addresses[i], read, sizeof(read), false) == MODBUS_OK && read_reply(addresses[i], 0x100 * (i + 1));
+	}
+	check("own register map per address", ok);
+	request(11, unmapped, sizeof(unmapped), false);
+	check("own callback per address", callbacks[1] == 1 && callbacks[0] == 0 && reply_len == 5 &&
+			reply[1] == (MODBUS_READ_HOLDING_REGISTERS | MODBUS_ERROR_FLAG));
+	request(200, device_id, sizeof(device_id), false);
+	check("own device id per address", reply_len > 20 && reply[0] == 200 &&
+			memmem(reply, reply_len, "Drive", 5) != NULL && memmem(reply, reply_len, "Meter", 5) == NULL);
+
+	/* port address is not served unless the port is in the table */
+	check("port address not served", request(1, read, sizeof(read), false) == MODBUS_OK && reply_len == 0);
+	/* unknown addresses are dropped before the CRC is checked */
+	check("unknown address skips CRC", request(12, read, sizeof(read), true) == MODBUS_OK && reply_len == 0 &&
+			crc_calls == 0);
+	check("known address checks CRC", request(10, read, sizeof(read), true) == MODBUS_ERROR_CRC && reply_len == 0 &&
+			crc_calls == 1);
+
+	/* broadcast reaches every virtual slave, nobody replies */
+	request(MODBUS_BROADCAST_ADDR, write, sizeof(write), false);
+	check("broadcast to all slaves", reply_len == 0 && registers[0][2] == 0xabcd && registers[1][2] == 0xabcd &&
+			registers[2][2] == 0xabcd);
+
+	/* Modbus TCP: unit id selects the slave */
+	modbus_slave_ctx_process_request(&port, tcp_request, sizeof(tcp_request), reply, &tcp_reply_len,
+			MODBUS_REQUEST_FLAG_ANY_ADDRESS);
+	ok = tcp_reply_len == 5 && reply[0] == 11 && reply[3] == 0x02;
+	tcp_request[0] = 99;
+	modbus_slave_ctx_process_request(&port, tcp_request, sizeof(tcp_request), reply, &tcp_reply_len,
+			MODBUS_REQUEST_FLAG_ANY_ADDRESS);
+	check("unit id dispatch", ok && tcp_reply_len == 0);
+
+	check("remove slave", modbus_slave_table_remove(&table, 11) == MODBUS_OK && table.count == SLAVES - 1 &&
+			request(11, read, sizeof(read), false) == MODBUS_OK && reply_len == 0 &&
+			modbus_slave_table_remove(&table, 11) == MODBUS_ERROR);
+
+	/* 247 slaves, each replying with its address */
+	modbus_slave_table_init(&table);
+	ok = true;
+	for (int i = 0; i < 247; i++) {
+		modbus_slave_ctx_init(&all_slaves[i], i + 1, slave_callback, port_transmit, (void *)(intptr_t)0);
+		modbus_slave_ctx_set_register_map(&all_slaves[i], &maps[0]);
+		ok = ok && modbus_slave_table_add(&table, &all_slaves[i]) == MODBUS_OK;
+	}
+	for (int i = 0; i < 247; i++) {
+		ok = ok && request(i + 1, read, sizeof(read), false) == MODBUS_OK && read_reply(i + 1, 0x100);
+	}
+	check("247 virtual slaves", ok && table.count == 247);
+
+	/* without table, single address is checked before CRC as well */
+	modbus_slave_ctx_set_slave_table(&port, NULL);
+	ok = request(2, read, sizeof(read), true) == MODBUS_OK && crc_calls == 0;
+	check("single address skips CRC", ok && request(1, read, sizeof(read), true) == MODBUS_ERROR_CRC && crc_calls == 1);
+
+	return test_summary();
+}
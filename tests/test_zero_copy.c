@@ -0,0 +1,163 @@
+/*
+ * Zero-copy replies: reply built in caller-supplied buffer, payload written in place
+ * or provided by callback, vectored transmit
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "modbus.h"
+#include "modbus_register_map.h"
+#include "test_util.h"
+
+static modbus_slave_ctx_t ctx;
+static modbus_register_map_t map;
+static modbus_register_range_t ranges[2];
+
+static uint16_t registers[MODBUS_MAX_REGISTERS]; /* holding 0..124 */
+static uint8_t coils[2] = { 0xFF, 0xFF }; /* coils 0..15 */
+/* input registers 0..3, already in wire format */
+static const uint8_t wire_inputs[8] = { 0x00, 0x01, 0x00, 0x02, 0x00, 0x03, 0x00, 0x04 };
+
+static uint8_t dma_buffer[MODBUS_MAX_RTU_FRAME_SIZE];
+
+/* what was sent */
+static uint8_t reply[MODBUS_MAX_RTU_FRAME_SIZE];
+static int reply_len;
+static const uint8_t *transmit_buffer;
+static modbus_iovec_t segments[MODBUS_REPLY_IOV_COUNT];
+
+static int8_t zc_callback(modbus_slave_ctx_t *ctx, modbus_transaction_t *transaction)
+{
+	(void)ctx;
+	if (transaction->function_code != MODBUS_READ_INPUT_REGISTERS) {
+		return MODBUS_ERROR_FUNCTION_NOT_IMPLEMENTED;
+	}
+	if (transaction->register_address == 0 && transaction->register_count == 4) {
+		/* hand over memory already in wire format */
+		transaction->payload = (uint8_t *)wire_inputs;
+		transaction->payload_ready = 1;
+		return MODBUS_OK;
+	}
+	if (transaction->register_address == 100) {
+		/* write big-endian values directly to reply */
+		for (int i = 0; i < transaction->register_count; i++) {
+			transaction->payload[2 * i] = 0xAB;
+			transaction->payload[2 * i + 1] = i;
+		}
+		transaction->payload_ready = 1;
+		return MODBUS_OK;
+	}
+	return MODBUS_ERROR_REGISTER_NOT_IMPLEMENTED;
+}
+
+static int8_t zc_transmit(modbus_slave_ctx_t *ctx, uint8_t *buffer, uint16_t data_len)
+{
+	(void)ctx;
+	transmit_buffer = buffer;
+	memcpy(reply, buffer, data_len);
+	reply_len = data_len;
+	return MODBUS_OK;
+}
+
+static int8_t zc_transmitv(modbus_slave_ctx_t *ctx, const modbus_iovec_t *iov, uint8_t iov_count)
+{
+	(void)ctx;
+	reply_len = 0;
+	for (int i = 0; i < iov_count; i++) {
+		segments[i] = iov[i];
+		memcpy(reply + reply_len, iov[i].data, iov[i].len);
+		reply_len += iov[i].len;
+	}
+	return MODBUS_OK;
+}
+
+static void request(const uint8_t *pdu, int pdu_len)
+{
+	reply_len = 0;
+	transmit_buffer = NULL;
+	memset(segments, 0, sizeof(segments));
+	test_request(&ctx, ctx.address, pdu, pdu_len, false);
+}
+
+static bool reply_crc_ok(void)
+{
+	return reply_len > 2 && modbus_crc16_update(MODBUS_CRC16_INIT, reply, reply_len) == 0;
+}
+
+int main(void)
+{
+	uint8_t contiguous[MODBUS_MAX_RTU_FRAME_SIZE];
+	int contiguous_len;
+	bool ok;
+
+	printf("Zero-copy reply test\n");
+	for (int i = 0; i < MODBUS_MAX_REGISTERS; i++) {
+		registers[i] = 0x1000 + i;
+	}
+	modbus_slave_ctx_init(&ctx, 9, zc_callback, zc_transmit, NULL);
+	modbus_register_map_init(&map, ranges, 2);
+	modbus_register_range_t r_registers = {
+		.table = MODBUS_TABLE_HOLDING_REGISTERS, .start = 0, .count = MODBUS_MAX_REGISTERS,
+		.data = registers, .access = MODBUS_ACCESS_READ_WRITE,
+	};
+	modbus_register_range_t r_coils = {
+		.table = MODBUS_TABLE_COILS, .start = 0, .count = 16,
+		.data = coils, .access = MODBUS_ACCESS_READ_WRITE,
+	};
+	modbus_register_map_add(&map, &r_registers);
+	modbus_register_map_add(&map, &r_coils);
+	modbus_slave_ctx_set_register_map(&ctx, &map);
+	modbus_slave_ctx_set_reply_buffer(&ctx, dma_buffer);
+
+	/* 125 registers from the map, built in caller-supplied buffer */
+	ctx.buffer[0] = 0x55;
+	request((const uint8_t[]){ 0x03, 0x00, 0x00, 0x00, MODBUS_MAX_REGISTERS }, 5);
+	ok = transmit_buffer == dma_buffer && reply_len == 5 + 2 * MODBUS_MAX_REGISTERS && reply_crc_ok() &&
+			reply[2] == 2 * MODBUS_MAX_REGISTERS && ctx.buffer[0] == 0x55;
+	for (int i = 0; ok && i < MODBUS_MAX_REGISTERS; i++) {
+		ok = reply[3 + 2 * i] == 0x10 && reply[4 + 2 * i] == i;
+	}
+	check("read registers into reply buffer", ok);
+	memcpy(contiguous, reply, reply_len);
+	contiguous_len = reply_len;
+
+	/* same request, vectored transmit */
+	modbus_slave_ctx_set_transmitv(&ctx, zc_transmitv);
+	request((const uint8_t[]){ 0x03, 0x00, 0x00, 0x00, MODBUS_MAX_REGISTERS }, 5);
+	check("vectored transmit segments", segments[0].data == dma_buffer && segments[0].len == MODBUS_REPLY_PAYLOAD_OFFSET &&
+			segments[1].data == dma_buffer + MODBUS_REPLY_PAYLOAD_OFFSET && segments[1].len == 2 * MODBUS_MAX_REGISTERS &&
+			segments[2].len == 2);
+	check("vectored reply matches joined reply", reply_len == contiguous_len && memcmp(reply, contiguous, reply_len) == 0);
+
+	/* payload handed over by callback is not copied */
+	request((const uint8_t[]){ 0x04, 0x00, 0x00, 0x00, 0x04 }, 5);
+	check("callback payload passed as segment", segments[1].data == wire_inputs && segments[1].len == 8 &&
+			reply_len == 13 && reply_crc_ok() && reply[2] == 8 && reply[10] == 0x04);
+
+	/* payload written in place by callback */
+	request((const uint8_t[]){ 0x04, 0x00, 0x64, 0x00, 0x03 }, 5);
+	check("callback payload written in place", segments[1].data == dma_buffer + MODBUS_REPLY_PAYLOAD_OFFSET &&
+			reply_len == 11 && reply_crc_ok() && reply[3] == 0xAB && reply[8] == 0x02);
+
+	/* replies without payload are sent as header only */
+	request((const uint8_t[]){ 0x06, 0x00, 0x07, 0xBE, 0xEF }, 5);
+	check("write reply without payload", segments[0].len == 6 && segments[1].len == 0 && reply_len == 8 &&
+			reply_crc_ok() && registers[7] == 0xBEEF);
+	request((const uint8_t[]){ 0x04, 0x00, 0x05, 0x00, 0x01 }, 5);
+	check("exception reply without payload", segments[0].len == 3 && segments[1].len == 0 && reply_len == 5 &&
+			reply_crc_ok() && reply[1] == (MODBUS_ERROR_FLAG | MODBUS_READ_INPUT_REGISTERS));
+
+	/* coils from the map: unused bits of the last byte cleared */
+	request((const uint8_t[]){ 0x01, 0x00, 0x02, 0x00, 0x0B }, 5);
+	check("read coils in place", segments[1].len == 2 && reply_len == 7 && reply_crc_ok() &&
+			reply[3] == 0xFF && reply[4] == 0x07);
+
+	/* callback payload joined into reply buffer without vectored transmit */
+	modbus_slave_ctx_set_transmitv(&ctx, NULL);
+	request((const uint8_t[]){ 0x04, 0x00, 0x00, 0x00, 0x04 }, 5);
+	check("callback payload joined", transmit_buffer == dma_buffer && reply_len == 13 && reply_crc_ok() &&
+			memcmp(reply + 3, wire_inputs, 8) == 0);
+
+	return test_summary();
+}